@@ -0,0 +1,232 @@
+//Microbenchmarks of the C side: the dynamic arrays the GUI keeps its text in and utf8_to_utf32. Prints JSON in the format of the Rust
+//benchmarks (decapad-bench), so both can be tracked together.
+//build: cc -O2 -o decapad-bench-c bench.c dynamic_array.c
+//usage: decapad-bench-c [--quick] [filter]
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "main.h"
+#include "dynamic_array.h"
+
+#define BATCH_TIME_NS 20000000.0
+#define QUICK_BATCH_TIME_NS 1000000.0
+#define SAMPLES 5
+#define ARRAY_LENGTH 10000
+#define EDITS 100
+
+typedef void (*Routine) (void *state);
+
+char *filter = NULL;
+double batch_time = BATCH_TIME_NS;
+int number_of_results = 0;
+volatile Uint32 sink; //keeps the compiler from dropping results
+
+double
+now_ns (void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec*1e9 + time.tv_nsec;
+}
+
+//Runs the routine in batches that take at least batch_time and prints the time per iteration of the fastest of SAMPLES batches.
+void
+bench (char *name, long elements, char *unit, Routine routine, void *state)
+{
+    if ( filter && !strstr(name, filter) )
+    {
+        return;
+    }
+
+    long batch = 1;
+    long i;
+    for (;;)
+    {
+        double start = now_ns();
+        for (i=0; i<batch; i++)
+        {
+            routine(state);
+        }
+        if ( now_ns() - start >= batch_time || batch >= (1L<<30) )
+        {
+            break;
+        }
+        batch *= 2;
+    }
+
+    double fastest = -1;
+    int sample;
+    for (sample=0; sample<SAMPLES; sample++)
+    {
+        double start = now_ns();
+        for (i=0; i<batch; i++)
+        {
+            routine(state);
+        }
+        double elapsed = now_ns() - start;
+        if ( fastest < 0 || elapsed < fastest )
+        {
+            fastest = elapsed;
+        }
+    }
+
+    printf("%s\n  {\"name\": \"%s\", \"iterations\": %ld, \"ns_per_iteration\": %.3f, \"elements\": %ld, \"unit\": \"%s\"}",
+           number_of_results ? "," : "", name, batch*SAMPLES, fastest/batch, elements, unit);
+    number_of_results++;
+}
+
+void
+fill ( DynamicArray_uint32 *array, long length )
+{
+    long i;
+    array->length = 0;
+    for (i=0; i<length; i++)
+    {
+        addToDynamicArray_uint32(array, 'a' + i%26);
+    }
+}
+
+void
+bench_append ( void *state )
+{
+    DynamicArray_uint32 array;
+    initDynamicArray_uint32(&array);
+    fill(&array, ARRAY_LENGTH);
+    sink = array.array[ARRAY_LENGTH-1];
+    free(array.array);
+}
+
+//EDITS inserts followed by as many deletes at the same place, so the array has the same length for every iteration
+void
+bench_edit_front ( void *state )
+{
+    DynamicArray_uint32 *array = state;
+    int i;
+    for (i=0; i<EDITS; i++)
+    {
+        insertIntoDynamicArray_uint32(array, 'x', 0);
+    }
+    for (i=0; i<EDITS; i++)
+    {
+        deleteFromDynamicArray_uint32(array, 0);
+    }
+    sink = array->array[0];
+}
+
+void
+bench_edit_middle ( void *state )
+{
+    DynamicArray_uint32 *array = state;
+    long middle = array->length/2;
+    int i;
+    for (i=0; i<EDITS; i++)
+    {
+        insertIntoDynamicArray_uint32(array, 'x', middle);
+    }
+    for (i=0; i<EDITS; i++)
+    {
+        deleteFromDynamicArray_uint32(array, middle);
+    }
+    sink = array->array[middle];
+}
+
+void
+bench_edit_end ( void *state )
+{
+    DynamicArray_uint32 *array = state;
+    int i;
+    for (i=0; i<EDITS; i++)
+    {
+        insertIntoDynamicArray_uint32(array, 'x', array->length);
+    }
+    for (i=0; i<EDITS; i++)
+    {
+        deleteFromDynamicArray_uint32(array, array->length-1);
+    }
+    sink = array->array[0];
+}
+
+//appends the second array to the first one and cuts the first one back, its allocation is kept after the first iteration
+void
+bench_concat ( void *state )
+{
+    DynamicArray_uint32 *arrays = state;
+    concatDynamicArrays_uint32(&arrays[0], &arrays[1]);
+    sink = arrays[0].array[arrays[0].length-1];
+    arrays[0].length = ARRAY_LENGTH;
+}
+
+typedef struct Utf8State
+{
+    char *text;
+    DynamicArray_uint32 out;
+} Utf8State;
+
+void
+bench_utf8_to_utf32 ( void *state )
+{
+    Utf8State *utf8 = state;
+    utf8->out.length = 0;
+    utf8_to_utf32(utf8->text, &utf8->out);
+    sink = utf8->out.array[0];
+}
+
+int
+main ( int argc, char **argv )
+{
+    int i;
+    for (i=1; i<argc; i++)
+    {
+        if ( strcmp(argv[i], "--quick") == 0 )
+        {
+            batch_time = QUICK_BATCH_TIME_NS;
+        }
+        else
+        {
+            filter = argv[i];
+        }
+    }
+
+    printf("{\"suite\": \"dynamic_array\", \"results\": [");
+
+    bench("dynamic_array/append/10000", ARRAY_LENGTH, "items", bench_append, NULL);
+
+    DynamicArray_uint32 array;
+    initDynamicArray_uint32(&array);
+    fill(&array, ARRAY_LENGTH);
+    bench("dynamic_array/insert_delete_front/10000", 2*EDITS, "edits", bench_edit_front, &array);
+    bench("dynamic_array/insert_delete_middle/10000", 2*EDITS, "edits", bench_edit_middle, &array);
+    bench("dynamic_array/insert_delete_end/10000", 2*EDITS, "edits", bench_edit_end, &array);
+
+    DynamicArray_uint32 arrays[2];
+    initDynamicArray_uint32(&arrays[0]);
+    initDynamicArray_uint32(&arrays[1]);
+    fill(&arrays[0], ARRAY_LENGTH);
+    fill(&arrays[1], ARRAY_LENGTH);
+    bench("dynamic_array/concat/10000", ARRAY_LENGTH, "items", bench_concat, arrays);
+
+    //a mix of one to four byte characters, like the text the GUI gets from SDL and the clipboard
+    char *words[] = {"decapad ", "Grüße ", "€uro ", "テキスト ", "𝄞 ", "edit\n"};
+    Utf8State utf8;
+    long length = 0;
+    utf8.text = malloc(4096 + 32);
+    utf8.text[0] = 0;
+    for (i=0; length < 4096; i++)
+    {
+        strcat(utf8.text + length, words[i%6]);
+        length += strlen(words[i%6]);
+    }
+    initDynamicArray_uint32(&utf8.out);
+    bench("utf8_to_utf32/4096", length, "bytes", bench_utf8_to_utf32, &utf8);
+
+    printf("\n]}\n");
+
+    free(array.array);
+    free(arrays[0].array);
+    free(arrays[1].array);
+    free(utf8.text);
+    free(utf8.out.array);
+    return 0;
+}
@@ -144,6 +144,72 @@ concatDynamicArrays_uint32 ( DynamicArray_uint32 *array1, DynamicArray_uint32 *a
     return 0;
 }
 
+void
+utf8_to_utf32 ( char *in, DynamicArray_uint32 *out )
+{
+
+    int i;
+    Uint32 utfchar;
+    for (i=0; in[i]; i++)
+    {
+        if ( (in[i] & 0x80) == 0)
+        {
+            utfchar = in[i];
+        }
+
+        else if ( (in[i] & 0x40) == 0)
+        {
+            printf("Why is there a continuation byte here?\n");
+        }
+
+        else if ( (in[i] & 0x20) == 0)
+        {
+            utfchar = in[i] & 0x1f;
+
+            utfchar <<= 6;
+            i++;
+            utfchar += in[i] & 0x3f;
+        }
+
+        else if ( (in[i] & 0x10) == 0)
+        {
+            utfchar = in[i] & 0x0f;
+
+            utfchar <<= 6;
+            i++;
+            utfchar += in[i] & 0x3f;
+
+            utfchar <<= 6;
+            i++;
+            utfchar += in[i] & 0x3f;
+        }
+
+        else if ( (in[i] & 0x08) == 0)
+        {
+            utfchar = in[i] & 0x07;
+
+            utfchar <<= 6;
+            i++;
+            utfchar += in[i] & 0x3f;
+
+            utfchar <<= 6;
+            i++;
+            utfchar += in[i] & 0x3f;
+
+            utfchar <<= 6;
+            i++;
+            utfchar += in[i] & 0x3f;
+        }
+
+        else
+        {
+            printf("What is that fifth continuation doing here?? (This should never happen)\n");
+        }
+
+        addToDynamicArray_uint32(out, utfchar);
+    }
+}
+
 //char
 
 int
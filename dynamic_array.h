@@ -39,6 +39,9 @@ void deleteFromDynamicArray_uint32 ( DynamicArray_uint32 *array, long int positi
 int
 concatDynamicArrays_uint32 ( DynamicArray_uint32 *array1, DynamicArray_uint32 *array2 );
 
+void
+utf8_to_utf32 ( char *in, DynamicArray_uint32 *out ); //appends the characters of a 0-terminated UTF-8 string
+
 typedef struct DynamicArray_char
 {
     char *array;
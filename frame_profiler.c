@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "main.h"
+#include "frame_profiler.h"
+
+char *phase_names[NUMBER_OF_PHASES+1] = {"events", "sync", "clear", "draw_text", "overlay", "unlock", "present", "delay", "frame"};
+
+Uint64
+now_us (void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (Uint64) time.tv_sec*1000000 + time.tv_nsec/1000;
+}
+
+//Buckets are exact below 2*PROFILER_SUB_BUCKETS microseconds, above that every power of two is split into PROFILER_SUB_BUCKETS, so a bucket
+//is at most 25% wide.
+int
+bucket_of ( Uint32 microseconds )
+{
+    if ( microseconds < 2*PROFILER_SUB_BUCKETS )
+    {
+        return microseconds;
+    }
+    int exponent = 31 - __builtin_clz(microseconds);
+    int sub_bucket = (microseconds >> (exponent-2)) & (PROFILER_SUB_BUCKETS-1);
+    return (exponent-1)*PROFILER_SUB_BUCKETS + sub_bucket;
+}
+
+Uint64
+bucket_start ( int bucket )
+{
+    if ( bucket < 2*PROFILER_SUB_BUCKETS )
+    {
+        return bucket;
+    }
+    int exponent = bucket/PROFILER_SUB_BUCKETS + 1;
+    int sub_bucket = bucket%PROFILER_SUB_BUCKETS;
+    return (Uint64) (PROFILER_SUB_BUCKETS + sub_bucket) << (exponent-2);
+}
+
+void
+init_frame_profiler ( FrameProfiler *profiler )
+{
+    memset(profiler, 0, sizeof(FrameProfiler));
+    profiler->phase = PHASE_EVENTS;
+    profiler->phase_start = now_us();
+}
+
+int
+profiler_begin_phase ( FrameProfiler *profiler, int phase )
+{
+    Uint64 now = now_us();
+    int previous_phase = profiler->phase;
+    profiler->current[previous_phase] += now - profiler->phase_start;
+    profiler->phase = phase;
+    profiler->phase_start = now;
+    return previous_phase;
+}
+
+void
+profiler_end_frame ( FrameProfiler *profiler )
+{
+    profiler_begin_phase(profiler, profiler->phase); //accounts for the time up to now
+    Uint32 *frame = profiler->history[profiler->frames % PROFILER_HISTORY];
+    int phase;
+
+    if ( profiler->frames >= PROFILER_HISTORY ) //the frame that falls out of the window leaves the histogram
+    {
+        for (phase=0; phase<=NUMBER_OF_PHASES; phase++)
+        {
+            profiler->histogram[phase][bucket_of(frame[phase])]--;
+        }
+    }
+
+    Uint32 total = 0;
+    for (phase=0; phase<NUMBER_OF_PHASES; phase++)
+    {
+        frame[phase] = profiler->current[phase];
+        total += profiler->current[phase];
+        profiler->current[phase] = 0;
+    }
+    frame[NUMBER_OF_PHASES] = total;
+
+    for (phase=0; phase<=NUMBER_OF_PHASES; phase++)
+    {
+        profiler->histogram[phase][bucket_of(frame[phase])]++;
+    }
+    profiler->frames++;
+}
+
+Uint32
+profiler_percentile ( FrameProfiler *profiler, int phase, int percent )
+{
+    long frames = profiler->frames < PROFILER_HISTORY ? profiler->frames : PROFILER_HISTORY;
+    long rank = (frames*percent + 99) / 100; //of the frame at the percentile, counting from 1
+    if ( rank < 1 )
+    {
+        rank = 1;
+    }
+    long seen = 0;
+    int bucket;
+    for (bucket=0; bucket<PROFILER_BUCKETS; bucket++)
+    {
+        seen += profiler->histogram[phase][bucket];
+        if ( seen >= rank )
+        {
+            return bucket_start(bucket+1) - 1; //the end of the bucket, to err on the slow side
+        }
+    }
+    return 0;
+}
+
+Uint32
+profiler_frame_time ( FrameProfiler *profiler, int frames_ago, int phase )
+{
+    if ( frames_ago >= PROFILER_HISTORY || frames_ago >= profiler->frames )
+    {
+        return 0;
+    }
+    return profiler->history[(profiler->frames - 1 - frames_ago) % PROFILER_HISTORY][phase];
+}
+
+//One row per non-empty histogram bucket: phase,from_us,to_us,frames
+int
+dump_frame_profile ( FrameProfiler *profiler, char *path )
+{
+    FILE *file = fopen(path, "w");
+    if ( file == NULL )
+    {
+        printf("Error in dump_frame_profile: couldn't open %s.\n", path);
+        return -1;
+    }
+
+    fprintf(file, "phase,from_us,to_us,frames\n");
+    int phase, bucket;
+    for (phase=0; phase<=NUMBER_OF_PHASES; phase++)
+    {
+        for (bucket=0; bucket<PROFILER_BUCKETS; bucket++)
+        {
+            if ( profiler->histogram[phase][bucket] )
+            {
+                fprintf(file, "%s,%llu,%llu,%u\n", phase_names[phase], (unsigned long long) bucket_start(bucket),
+                        (unsigned long long) bucket_start(bucket+1) - 1, profiler->histogram[phase][bucket]);
+            }
+        }
+    }
+
+    fclose(file);
+    return 0;
+}
@@ -0,0 +1,59 @@
+#ifndef FRAME_PROFILER_H
+#define FRAME_PROFILER_H
+#include <stdio.h>
+#include "main.h"
+
+//Times the phases of the GUI's main loop. Every frame is split into the phases below by calling profiler_begin_phase whenever the loop
+//moves on to the next one; profiler_end_frame closes the frame. The per-phase times of the last PROFILER_HISTORY frames are kept, together
+//with a histogram over the same frames, which the overlay (F3) shows and dump_frame_profile writes to a CSV file (F4).
+//Needs to be compiled with main.c: cc main.c dynamic_array.c frame_profiler.c ...
+
+enum FRAME_PHASES
+{
+    PHASE_EVENTS, //SDL event handling, except for waiting on the backend
+    PHASE_SYNC, //rust_blocking_sync_text and rust_try_sync_text
+    PHASE_CLEAR, //locking the texture and clearing the pixel buffer
+    PHASE_DRAW_TEXT,
+    PHASE_OVERLAY, //drawing the profiler overlay itself
+    PHASE_UNLOCK,
+    PHASE_PRESENT,
+    PHASE_DELAY, //sleeping until the next frame
+    NUMBER_OF_PHASES
+};
+
+#define PROFILER_HISTORY 256 //frames, a power of two
+#define PROFILER_SUB_BUCKETS 4 //histogram buckets per power of two microseconds
+#define PROFILER_BUCKETS (32*PROFILER_SUB_BUCKETS)
+
+typedef struct FrameProfiler
+{
+    int phase; //the phase that is being timed
+    Uint64 phase_start; //in microseconds
+    Uint32 current[NUMBER_OF_PHASES]; //microseconds spent in each phase during the current frame
+    Uint32 history[PROFILER_HISTORY][NUMBER_OF_PHASES+1]; //of the last frames, the last column is the whole frame
+    Uint32 histogram[NUMBER_OF_PHASES+1][PROFILER_BUCKETS]; //counts of the frames in history
+    long frames; //closed so far
+    int overlay; //whether the overlay is shown
+} FrameProfiler;
+
+extern char *phase_names[NUMBER_OF_PHASES+1];
+
+void
+init_frame_profiler ( FrameProfiler *profiler );
+
+int
+profiler_begin_phase ( FrameProfiler *profiler, int phase ); //returns the phase that was being timed, so it can be resumed afterwards
+
+void
+profiler_end_frame ( FrameProfiler *profiler );
+
+Uint32
+profiler_percentile ( FrameProfiler *profiler, int phase, int percent ); //microseconds, NUMBER_OF_PHASES for the whole frame
+
+Uint32
+profiler_frame_time ( FrameProfiler *profiler, int frames_ago, int phase ); //microseconds, 0 for frames that haven't happened
+
+int
+dump_frame_profile ( FrameProfiler *profiler, char *path );
+
+#endif
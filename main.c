@@ -12,6 +12,7 @@
 #include <SDL2/SDL.h>
 #include "main.h"
 #include "dynamic_array.h"
+#include "frame_profiler.h"
 
 #define SETPIXEL(x, y, value) ( *(pixels+(x)+(y)*pitch) = (value) )
 
@@ -25,6 +26,9 @@ int pitch;
 
 Uint8 crc_0x97_table[256];
 
+FrameProfiler profiler;
+Uint32 phase_colors[NUMBER_OF_PHASES+1] = {0x4E9A06FF, 0xCC0000FF, 0x3465A4FF, 0xEDD400FF, 0x75507BFF, 0xF57900FF, 0x06989AFF, 0x555753FF, 0xFFFFFFFF};
+
 enum PROGRAM_STATES
 {
     STATE_LOGIN,
@@ -395,69 +399,104 @@ draw_text (TextBuffer *buffer, Uint32 *text, Uint32 *pixels, char show_cursor, F
     }
 }
 
+//draws a line of ascii text with its baseline at y, in the given color
 void
-utf8_to_utf32 ( char *in, DynamicArray_uint32 *out )
+draw_string (char *string, int x, int y, Uint32 color, Uint32 *pixels, FT_Face fontface)
 {
-
-    int i;
-    Uint32 utfchar;
-    for (i=0; in[i]; i++)
+    int i, row, col;
+    for (i=0; string[i]; i++)
     {
-        if ( (in[i] & 0x80) == 0)
+        if ( FT_Load_Char(fontface, string[i], FT_LOAD_RENDER) || fontface->glyph->bitmap.pixel_mode != FT_PIXEL_MODE_GRAY )
         {
-            utfchar = in[i];
+            continue;
         }
 
-        else if ( (in[i] & 0x40) == 0)
+        FT_Bitmap bitmap = fontface->glyph->bitmap;
+        int target_x = x + fontface->glyph->bitmap_left;
+        int target_y = y - fontface->glyph->bitmap_top;
+        unsigned char *glyph_buffer = (unsigned char *) (bitmap.buffer);
+        for ( row = 0; row < bitmap.rows; row++ )
         {
-            printf("Why is there a continuation byte here?\n");
-        }
-
-        else if ( (in[i] & 0x20) == 0)
-        {
-            utfchar = in[i] & 0x1f;
-
-            utfchar <<= 6;
-            i++;
-            utfchar += in[i] & 0x3f;
+            for ( col = 0; col < bitmap.width; col++ )
+            {
+                if ( (target_y+row < window_height) && (target_y+row >= 0) && (target_x+col < window_width) && (target_x+col >= 0) )
+                {
+                    Uint32 coverage = *( glyph_buffer + row * (bitmap.pitch) + col );
+                    if (coverage > 0)
+                    {
+                        Uint32 red = ((color >> 24) & 255) * coverage / 255;
+                        Uint32 green = ((color >> 16) & 255) * coverage / 255;
+                        Uint32 blue = ((color >> 8) & 255) * coverage / 255;
+                        SETPIXEL(target_x+col, target_y+row, (red<<24)+(green<<16)+(blue<<8)+255);
+                    }
+                }
+            }
         }
+        x += fontface->glyph->advance.x >> 6;
+    }
+}
 
-        else if ( (in[i] & 0x10) == 0)
+void
+fill_rectangle (int x, int y, int width, int height, Uint32 color, Uint32 *pixels)
+{
+    int row, col;
+    for ( row = y; row < y+height; row++ )
+    {
+        for ( col = x; col < x+width; col++ )
         {
-            utfchar = in[i] & 0x0f;
-
-            utfchar <<= 6;
-            i++;
-            utfchar += in[i] & 0x3f;
-
-            utfchar <<= 6;
-            i++;
-            utfchar += in[i] & 0x3f;
+            if ( (row < window_height) && (row >= 0) && (col < window_width) && (col >= 0) )
+            {
+                SETPIXEL(col, row, color);
+            }
         }
+    }
+}
 
-        else if ( (in[i] & 0x08) == 0)
-        {
-            utfchar = in[i] & 0x07;
-
-            utfchar <<= 6;
-            i++;
-            utfchar += in[i] & 0x3f;
+#define OVERLAY_GRAPH_HEIGHT 100
+#define OVERLAY_US_PER_PIXEL 500 //the graph shows up to 50ms per frame
 
-            utfchar <<= 6;
-            i++;
-            utfchar += in[i] & 0x3f;
+//The profiler overlay (F3) in the top right corner: the phases of the last frames stacked on top of each other, newest on the right, and
+//the percentiles of every phase over the same frames.
+void
+draw_frame_profile (FrameProfiler *profiler, Uint32 *pixels, FT_Face fontface)
+{
+    int line_height = (int) fontface->size->metrics.height / 64;
+    int padding = 8;
+    int width = PROFILER_HISTORY + 2*padding;
+    int height = OVERLAY_GRAPH_HEIGHT + (NUMBER_OF_PHASES+2)*line_height + 3*padding;
+    int left = window_width - width - 10;
+    int top = 10;
+    int phase, frame;
 
-            utfchar <<= 6;
-            i++;
-            utfchar += in[i] & 0x3f;
-        }
+    fill_rectangle(left, top, width, height, 0x202020FF, pixels);
 
-        else
+    int graph_bottom = top + padding + OVERLAY_GRAPH_HEIGHT;
+    for (frame=0; frame<PROFILER_HISTORY; frame++)
+    {
+        int x = left + padding + PROFILER_HISTORY-1 - frame;
+        int y = graph_bottom;
+        for (phase=0; phase<NUMBER_OF_PHASES; phase++)
         {
-            printf("What is that fifth continuation doing here?? (This should never happen)\n");
+            int bar = profiler_frame_time(profiler, frame, phase) / OVERLAY_US_PER_PIXEL;
+            if ( y - bar < graph_bottom - OVERLAY_GRAPH_HEIGHT )
+            {
+                bar = y - (graph_bottom - OVERLAY_GRAPH_HEIGHT);
+            }
+            fill_rectangle(x, y-bar, 1, bar, phase_colors[phase], pixels);
+            y -= bar;
         }
+    }
 
-        addToDynamicArray_uint32(out, utfchar);
+    char line[64];
+    int y = graph_bottom + padding + line_height;
+    draw_string("ms         p50    p90    p99    max", left + padding, y, 0xAAAAAAFF, pixels, fontface);
+    for (phase=0; phase<=NUMBER_OF_PHASES; phase++)
+    {
+        y += line_height;
+        snprintf(line, sizeof(line), "%-9s %6.2f %6.2f %6.2f %6.2f", phase_names[phase],
+                 profiler_percentile(profiler, phase, 50)/1000.0, profiler_percentile(profiler, phase, 90)/1000.0,
+                 profiler_percentile(profiler, phase, 99)/1000.0, profiler_percentile(profiler, phase, 100)/1000.0);
+        draw_string(line, left + padding, y, phase_colors[phase], pixels, fontface);
     }
 }
 
@@ -476,6 +515,18 @@ rust_blocking_sync_text (void *ffi_box_ptr);
 void
 rust_send_cursor (Uint32 cursor, void *ffi_box_ptr);
 
+void
+rust_flush_log (void);
+
+//waits for the backend like rust_blocking_sync_text, the time is accounted to the sync phase of the frame
+void
+profiled_blocking_sync (void *ffi_box_ptr)
+{
+    int previous_phase = profiler_begin_phase(&profiler, PHASE_SYNC);
+    rust_blocking_sync_text(ffi_box_ptr);
+    profiler_begin_phase(&profiler, previous_phase);
+}
+
 void
 update_login_buffer (TextBuffer *buffer, DynamicArray_uint32 *username, DynamicArray_uint32 *password, DynamicArray_uint32 *pad_with)
 {
@@ -626,6 +677,15 @@ int main (void)
 
     error = FT_Set_Pixel_Sizes(fontface, 0, 24);
 
+    FT_Face overlay_fontface; //smaller, for the profiler overlay
+    error = FT_New_Face( ft_library, "ClearSans-Regular.ttf", 0, &overlay_fontface);
+    if ( error )
+    {
+        printf("Font could not be loaded.\n");
+        return 1;
+    }
+    error = FT_Set_Pixel_Sizes(overlay_fontface, 0, 11);
+
     int line_height = (int) fontface->size->metrics.height / 64;
 
     //SDL setup
@@ -698,8 +758,13 @@ int main (void)
     char unsigned blink_timer = 0;
     int resend_timer = 0;
 
+    //frame profile, F3 shows it, F4 writes it to DECAPAD_FRAME_PROFILE (frame_profile.csv by default), which also gets it on exit if set
+    char *frame_profile_path = getenv("DECAPAD_FRAME_PROFILE");
+    init_frame_profiler(&profiler);
+
     while (!quit)
     {
+        profiler_begin_phase(&profiler, PHASE_EVENTS);
         SDL_Event e;
         while (SDL_PollEvent(&e))
         {
@@ -787,7 +852,7 @@ int main (void)
                         {
                             if (program_state == STATE_PAD)
                             {
-                                rust_blocking_sync_text(ffi_box_ptr);
+                                profiled_blocking_sync(ffi_box_ptr);
                             }
 
                             if (e.key.keysym.mod & KMOD_SHIFT) //seek to next word
@@ -820,7 +885,7 @@ int main (void)
                         {
                             if (program_state == STATE_PAD)
                             {
-                                rust_blocking_sync_text(ffi_box_ptr);
+                                profiled_blocking_sync(ffi_box_ptr);
                             }
 
                             if (e.key.keysym.mod & KMOD_SHIFT) //seek to previous word
@@ -850,7 +915,7 @@ int main (void)
                         {
                             if (program_state == STATE_PAD)
                             {
-                                rust_blocking_sync_text(ffi_box_ptr);
+                                profiled_blocking_sync(ffi_box_ptr);
                             }
 
                             int i;
@@ -882,7 +947,7 @@ int main (void)
                         {
                             if (program_state == STATE_PAD)
                             {
-                                rust_blocking_sync_text(ffi_box_ptr);
+                                profiled_blocking_sync(ffi_box_ptr);
                             }
 
                             int i;
@@ -937,6 +1002,16 @@ int main (void)
                         {
                             quit = 1;
                         } break;
+
+                        case SDLK_F3:
+                        {
+                            profiler.overlay = !profiler.overlay;
+                        } break;
+
+                        case SDLK_F4:
+                        {
+                            dump_frame_profile(&profiler, frame_profile_path ? frame_profile_path : "frame_profile.csv");
+                        } break;
                     }
 
                     blink_timer = 0;
@@ -1025,6 +1100,7 @@ int main (void)
 
         //drawing
 
+        profiler_begin_phase(&profiler, PHASE_CLEAR);
         int byte_pitch;
         SDL_LockTexture(texture, NULL, &pixels, &byte_pitch);
         pitch = byte_pitch/4;
@@ -1041,9 +1117,10 @@ int main (void)
 
         if ( (program_state == STATE_PAD) && ((click_x != -1) || (click_y != -1)) )
         {
-            rust_blocking_sync_text(ffi_box_ptr);
+            profiled_blocking_sync(ffi_box_ptr);
         }
 
+        profiler_begin_phase(&profiler, PHASE_DRAW_TEXT);
         if (blink_timer < 128)
         {
             draw_text(&buffer, buffer.text.array, pixels, 1, fontface, click_x, click_y);
@@ -1061,8 +1138,16 @@ int main (void)
         }
         click_x = click_y = -1;
 
+        if (profiler.overlay)
+        {
+            profiler_begin_phase(&profiler, PHASE_OVERLAY);
+            draw_frame_profile(&profiler, pixels, overlay_fontface);
+        }
+
         //SDL_UpdateTexture(texture, NULL, pixels, window_width*sizeof(Uint32));
+        profiler_begin_phase(&profiler, PHASE_UNLOCK);
         SDL_UnlockTexture(texture);
+        profiler_begin_phase(&profiler, PHASE_PRESENT);
         SDL_RenderClear(renderer);
         SDL_RenderCopy(renderer, texture, NULL, NULL);
         SDL_RenderPresent(renderer);
@@ -1070,10 +1155,18 @@ int main (void)
 
         blink_timer+=9;
         resend_timer += 30;
+        profiler_begin_phase(&profiler, PHASE_DELAY);
         SDL_Delay(30);//TODO: how big should the delay be?
 
+        profiler_begin_phase(&profiler, PHASE_SYNC);
         rust_try_sync_text(ffi_box_ptr);
 
+        profiler_end_frame(&profiler);
+    }
+
+    if (frame_profile_path)
+    {
+        dump_frame_profile(&profiler, frame_profile_path);
     }
 
     SDL_DestroyRenderer(renderer);
@@ -1083,6 +1176,7 @@ int main (void)
     //kill the rust thread
     Uint8 quit_signal[4] = {255, 255, 255, 255};
     rust_text_input(&quit_signal[0], 4, ffi_box_ptr);
+    rust_flush_log();
 
     free(buffer.text.array);
     free(buffer.author_table.array);
@@ -19,9 +19,9 @@ struct TextInsert
     Uint32 selfID;
     Uint32 parentID;
     Uint32 author;
-    Uint8 charPos;
+    Uint16 charPos;
     char lock;
-    Uint8 length;
+    Uint16 length;
     Uint32 *content;
 };
 typedef struct TextInsert TextInsert;
@@ -0,0 +1,426 @@
+//Acknowledgements that are collected while records come in and then sent together in 'K' records, once per iteration of the backend loop.
+//After the tag and the u16 pad ID placeholder, a 'K' record has three sections, each starting with its number of entries as a u8:
+//the state of inserts (u32 ID, u8 length, u8 number of deleted characters), applied deletions (u32 ID, u8 start, u8 end (exclusive))
+//and ranges of cheap message IDs (u32 first, u32 last, both inclusive).
+//Peers with wide positions (wire version 3) get 'K'|0x80 records instead, in which the lengths and positions are u16 (big endian).
+
+use std::cmp::{min, max};
+use std::slice;
+use framing::Batcher;
+use wire::{read_u32, write_u32};
+
+pub const ACK_TAG: u8 = 'K' as u8;
+pub const WIDE_ACK_TAG: u8 = ACK_TAG | 0x80;
+const FRAME_HEADER_LENGTH: usize = 1+2+3;
+const ENTRY_ID_LENGTH: usize = 4; //followed by two positions
+const MESSAGE_ENTRY_LENGTH: usize = 4+4;
+const MAXIMUM_SECTION_ENTRIES: usize = 255;
+
+///A set of character positions within one insert, as sorted, disjoint and non-adjacent (start, end) ranges. Deletions are mostly
+///contiguous (backspace, selections), so there are few ranges even in long inserts.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct PositionSet
+{
+    ranges: Vec<(u16, u16)>
+}
+
+impl PositionSet
+{
+    pub fn new () -> PositionSet
+    {
+        PositionSet { ranges: Vec::new() }
+    }
+
+    pub fn is_empty (&self) -> bool
+    {
+        self.ranges.is_empty()
+    }
+
+    pub fn contains (&self, position: u16) -> bool
+    {
+        self.ranges.iter().any(|&(start, end)| (start <= position) & (position < end))
+    }
+
+    ///Adds the positions from start to end (exclusive).
+    pub fn insert_range (&mut self, start: u16, end: u16)
+    {
+        if start >= end
+        {
+            return;
+        }
+
+        //the ranges that overlap or touch the new one are replaced by their union
+        let first = self.ranges.iter().position(|&(_, range_end)| range_end >= start).unwrap_or(self.ranges.len());
+        let mut last = first;
+        let (mut start, mut end) = (start, end);
+        while (last < self.ranges.len()) && (self.ranges[last].0 <= end)
+        {
+            start = min(start, self.ranges[last].0);
+            end = max(end, self.ranges[last].1);
+            last += 1;
+        }
+        self.ranges.splice(first..last, Some((start, end)));
+    }
+
+    pub fn remove_range (&mut self, start: u16, end: u16)
+    {
+        if start >= end
+        {
+            return;
+        }
+
+        let mut index = 0;
+        while index < self.ranges.len()
+        {
+            let (range_start, range_end) = self.ranges[index];
+            if (range_end <= start) | (range_start >= end)
+            {
+                index += 1;
+            }
+            else if (range_start < start) & (range_end > end) //splits the range
+            {
+                self.ranges[index].1 = start;
+                self.ranges.insert(index+1, (end, range_end));
+                return;
+            }
+            else if range_start < start
+            {
+                self.ranges[index].1 = start;
+                index += 1;
+            }
+            else if range_end > end
+            {
+                self.ranges[index].0 = end;
+                index += 1;
+            }
+            else
+            {
+                self.ranges.remove(index);
+            }
+        }
+    }
+
+    ///The contained positions as maximal (start, end) ranges, in ascending order.
+    pub fn ranges (&self) -> PositionRanges<'_>
+    {
+        PositionRanges { ranges: self.ranges.iter() }
+    }
+}
+
+pub struct PositionRanges<'a>
+{
+    ranges: slice::Iter<'a, (u16, u16)>
+}
+
+impl<'a> Iterator for PositionRanges<'a>
+{
+    type Item = (u16, u16);
+
+    fn next (&mut self) -> Option<(u16, u16)>
+    {
+        self.ranges.next().cloned()
+    }
+}
+
+///A decoded 'K' record of either width.
+#[derive(Debug, Default, PartialEq)]
+pub struct AckFrame
+{
+    pub inserts: Vec<(u32, u16, u16)>,
+    pub deletions: Vec<(u32, u16, u16)>,
+    pub messages: Vec<(u32, u32)>
+}
+
+///Whether the record is a 'K' record of either width.
+pub fn is_ack_record (tag: u8) -> bool
+{
+    (tag == ACK_TAG) | (tag == WIDE_ACK_TAG)
+}
+
+fn position_length (wide: bool) -> usize
+{
+    if wide { 2 } else { 1 }
+}
+
+fn read_position (data: &[u8], wide: bool) -> u16
+{
+    if wide { ((data[0] as u16)<<8) + data[1] as u16 } else { data[0] as u16 }
+}
+
+fn write_position (value: u16, wide: bool, buffer: &mut Vec<u8>)
+{
+    if wide
+    {
+        buffer.push((value>>8) as u8);
+    }
+    buffer.push(value as u8); //narrow records only go to peers whose inserts are never longer than 255 characters
+}
+
+///Reads a section of (u32 ID, position, position) entries from the front of rest and advances it.
+fn read_entries (rest: &mut &[u8], wide: bool, entries: &mut Vec<(u32, u16, u16)>) -> Option<()>
+{
+    let entry_length = ENTRY_ID_LENGTH + 2*position_length(wide);
+    let count = rest[0] as usize;
+    if rest.len() < 1 + count*entry_length + 1
+    {
+        return None;
+    }
+    for entry in rest[1..1+count*entry_length].chunks(entry_length)
+    {
+        let positions = &entry[ENTRY_ID_LENGTH..];
+        entries.push((read_u32(entry), read_position(positions, wide), read_position(&positions[position_length(wide)..], wide)));
+    }
+    *rest = &rest[1+count*entry_length..];
+    return Some(());
+}
+
+impl AckFrame
+{
+    ///Returns None if the record is truncated or has trailing data.
+    pub fn decode (record: &[u8]) -> Option<AckFrame>
+    {
+        if (record.len() < FRAME_HEADER_LENGTH) || !is_ack_record(record[0])
+        {
+            return None;
+        }
+
+        let wide = record[0] == WIDE_ACK_TAG;
+        let mut frame = AckFrame::default();
+        let mut rest = &record[3..];
+
+        read_entries(&mut rest, wide, &mut frame.inserts)?;
+        read_entries(&mut rest, wide, &mut frame.deletions)?;
+
+        let count = rest[0] as usize;
+        if rest.len() != 1 + count*MESSAGE_ENTRY_LENGTH
+        {
+            return None;
+        }
+        for entry in rest[1..].chunks(MESSAGE_ENTRY_LENGTH)
+        {
+            frame.messages.push((read_u32(entry), read_u32(&entry[4..])));
+        }
+
+        return Some(frame);
+    }
+}
+
+///Collects the acknowledgements owed to the peer until they are sent. The entries are only sorted and merged when the records are
+///written, and the vectors keep their capacity, so collecting doesn't allocate in the steady state.
+#[derive(Debug)]
+pub struct AckAggregator
+{
+    inserts: Vec<(u32, u16, u16)>, //ID, length and number of deleted characters
+    deletions: Vec<(u32, u16, u16)>, //ID, start and end
+    messages: Vec<u32>
+}
+
+impl AckAggregator
+{
+    pub fn new () -> AckAggregator
+    {
+        AckAggregator { inserts: Vec::new(), deletions: Vec::new(), messages: Vec::new() }
+    }
+
+    pub fn is_empty (&self) -> bool
+    {
+        self.inserts.is_empty() & self.deletions.is_empty() & self.messages.is_empty()
+    }
+
+    pub fn insert_state (&mut self, ID: u32, length: u16, deleted: u16)
+    {
+        self.inserts.push((ID, length, deleted));
+    }
+
+    pub fn deletion (&mut self, ID: u32, start: u16, end: u16)
+    {
+        if start < end
+        {
+            self.deletions.push((ID, start, end));
+        }
+    }
+
+    pub fn message (&mut self, message_id: u32)
+    {
+        self.messages.push(message_id);
+    }
+
+    ///Inserts only ever grow, so only the largest state of each insert is kept. Overlapping and adjacent deletions are joined.
+    fn merge (&mut self)
+    {
+        self.inserts.sort_unstable();
+        self.inserts.dedup_by(|later, earlier|
+        {
+            if later.0 == earlier.0
+            {
+                earlier.1 = max(earlier.1, later.1);
+                earlier.2 = max(earlier.2, later.2);
+                true
+            }
+            else
+            {
+                false
+            }
+        });
+
+        self.deletions.sort_unstable();
+        self.deletions.dedup_by(|later, earlier|
+        {
+            if (later.0 == earlier.0) & (later.1 <= earlier.2)
+            {
+                earlier.2 = max(earlier.2, later.2);
+                true
+            }
+            else
+            {
+                false
+            }
+        });
+
+        self.messages.sort_unstable();
+        self.messages.dedup();
+    }
+
+    ///Writes everything collected so far as 'K' records (wide ones if the peer has wide positions) of at most max_length bytes into the
+    ///batcher and starts over.
+    pub fn write_frames (&mut self, max_length: usize, wide: bool, batcher: &mut Batcher)
+    {
+        self.merge();
+
+        let entry_length = ENTRY_ID_LENGTH + 2*position_length(wide);
+        let max_length = max(max_length, FRAME_HEADER_LENGTH + MESSAGE_ENTRY_LENGTH);
+        let (mut inserts, mut deletions, mut messages) = (&self.inserts[..], &self.deletions[..], &self.messages[..]);
+
+        while (inserts.len() > 0) | (deletions.len() > 0) | (messages.len() > 0)
+        {
+            batcher.write_record(|frame|
+            {
+                frame.push(if wide { WIDE_ACK_TAG } else { ACK_TAG });
+                frame.push(0);
+                frame.push(0);
+                let mut space = max_length - FRAME_HEADER_LENGTH;
+
+                let count = min(min(inserts.len(), space / entry_length), MAXIMUM_SECTION_ENTRIES);
+                frame.push(count as u8);
+                for &(ID, length, deleted) in &inserts[..count]
+                {
+                    write_u32(ID, frame);
+                    write_position(length, wide, frame);
+                    write_position(deleted, wide, frame);
+                }
+                inserts = &inserts[count..];
+                space -= count*entry_length;
+
+                let count = min(min(deletions.len(), space / entry_length), MAXIMUM_SECTION_ENTRIES);
+                frame.push(count as u8);
+                for &(ID, start, end) in &deletions[..count]
+                {
+                    write_u32(ID, frame);
+                    write_position(start, wide, frame);
+                    write_position(end, wide, frame);
+                }
+                deletions = &deletions[count..];
+                space -= count*entry_length;
+
+                //runs of consecutive message IDs are written as one range
+                let count_position = frame.len();
+                frame.push(0);
+                let mut count = 0;
+                while (messages.len() > 0) & (space >= MESSAGE_ENTRY_LENGTH) & (count < MAXIMUM_SECTION_ENTRIES)
+                {
+                    let mut run = 1;
+                    while (run < messages.len()) && (messages[run] == messages[run-1].wrapping_add(1))
+                    {
+                        run += 1;
+                    }
+                    write_u32(messages[0], frame);
+                    write_u32(messages[run-1], frame);
+                    messages = &messages[run..];
+                    space -= MESSAGE_ENTRY_LENGTH;
+                    count += 1;
+                }
+                frame[count_position] = count as u8;
+            });
+        }
+
+        self.inserts.clear();
+        self.deletions.clear();
+        self.messages.clear();
+    }
+}
+
+#[test]
+fn test_position_set ()
+{
+    let mut set = PositionSet::new();
+    assert!(set.is_empty());
+    set.insert_range(2, 5);
+    set.insert_range(60, 70);
+    set.insert_range(254, 255);
+    set.insert_range(5, 7); //adjacent
+    set.insert_range(1000, 60000);
+    set.insert_range(65, 255); //joins two ranges
+    assert_eq!(set.ranges().collect::<Vec<(u16, u16)>>(), vec![(2, 7), (60, 255), (1000, 60000)]);
+    assert!(set.contains(59999) & !set.contains(60000) & !set.contains(7));
+
+    set.remove_range(3, 4);
+    set.remove_range(0, 66);
+    set.remove_range(2000, 3000);
+    assert_eq!(set.ranges().collect::<Vec<(u16, u16)>>(), vec![(66, 255), (1000, 2000), (3000, 60000)]);
+    set.remove_range(0, 65535);
+    assert!(set.is_empty());
+}
+
+#[cfg(test)]
+fn write_frames (acks: &mut AckAggregator, max_length: usize, wide: bool) -> Vec<Vec<u8>>
+{
+    let mut batcher = Batcher::new(1400);
+    acks.write_frames(max_length, wide, &mut batcher);
+    batcher.finish().iter().map(|datagram| datagram[4..].to_vec()).collect()
+}
+
+#[test]
+fn test_ack_frames ()
+{
+    let mut acks = AckAggregator::new();
+    acks.insert_state(7, 3, 0);
+    acks.insert_state(7, 5, 1);
+    acks.insert_state(7, 4, 0); //reordered, older state
+    acks.deletion(7, 0, 1);
+    acks.deletion(7, 1, 3);
+    acks.deletion(7, 6, 8);
+    for message_id in vec![1, 2, 3, 5, 9, 10]
+    {
+        acks.message(message_id);
+    }
+
+    let frames = write_frames(&mut acks, 1400, false);
+    assert!(acks.is_empty());
+    assert_eq!(frames.len(), 1);
+    assert_eq!(AckFrame::decode(&frames[0][..]), Some(AckFrame { inserts: vec![(7, 5, 1)],
+                                                              deletions: vec![(7, 0, 3), (7, 6, 8)],
+                                                              messages: vec![(1, 3), (5, 5), (9, 10)] }));
+
+    //split into several records if it doesn't fit into one
+    for ID in 0..100
+    {
+        acks.insert_state(ID, 1, 0);
+        acks.message(2*ID);
+    }
+    let frames = write_frames(&mut acks, 100, false);
+    assert!(frames.iter().all(|frame| frame.len() <= 100));
+    let decoded: Vec<AckFrame> = frames.iter().map(|frame| AckFrame::decode(&frame[..]).unwrap()).collect();
+    assert_eq!(decoded.iter().map(|frame| frame.inserts.len()).sum::<usize>(), 100);
+    assert_eq!(decoded.iter().map(|frame| frame.messages.len()).sum::<usize>(), 100);
+
+    assert_eq!(AckFrame::decode(&frames[0][..frames[0].len()-1]), None);
+
+    //wide records for peers with positions beyond 255
+    acks.insert_state(7, 40000, 300);
+    acks.deletion(7, 256, 65535);
+    acks.message(3);
+    let frames = write_frames(&mut acks, 1400, true);
+    assert_eq!(frames[0][0], WIDE_ACK_TAG);
+    assert_eq!(AckFrame::decode(&frames[0][..]), Some(AckFrame { inserts: vec![(7, 40000, 300)], deletions: vec![(7, 256, 65535)], messages: vec![(3, 3)] }));
+    assert_eq!(AckFrame::decode(&frames[0][..frames[0].len()-1]), None);
+}
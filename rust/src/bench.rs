@@ -0,0 +1,332 @@
+//Microbenchmarks of the primitives on the hot paths, run by decapad-bench. Every benchmark is run in batches that take at least
+//BATCH_TIME_MS, the fastest of SAMPLES batches is reported, as the slower ones only measure interference from the rest of the machine.
+//The results are written as JSON, so they can be compared across versions; the C side (dynamic_array.c, utf8_to_utf32) is covered by
+//bench.c in the same format.
+
+use std::thread;
+use std::hint::black_box;
+use std::time::{Duration, Instant};
+
+use crc::Checksum;
+use tnetstring;
+use wire;
+use utf8::Utf8StreamConverter;
+use sync::spsc_255;
+use super::{TextInsert, TextInsertSet, TextBufferInternal, ProtocolBackendState, NetworkState, init_message, render_text, handle_input};
+use framing;
+
+const BATCH_TIME_MS: u64 = 20;
+const QUICK_BATCH_TIME_MS: u64 = 1;
+const SAMPLES: usize = 5;
+const RING_TRANSFER_BYTES: usize = 1<<16;
+
+#[derive(Debug)]
+pub struct BenchResult
+{
+    pub name: String,
+    pub iterations: u64, //in all samples together
+    pub nanoseconds: f64, //per iteration, of the fastest sample
+    pub elements: usize, //processed per iteration, for throughput
+    pub unit: &'static str //what the elements are
+}
+
+struct Bencher<'a>
+{
+    filter: Option<&'a str>,
+    batch_time: Duration,
+    results: Vec<BenchResult>
+}
+
+impl<'a> Bencher<'a>
+{
+    fn run<F: FnMut()> (&mut self, name: &str, elements: usize, unit: &'static str, mut routine: F)
+    {
+        if !self.filter.map_or(true, |filter| name.contains(filter))
+        {
+            return;
+        }
+
+        //find a batch size that takes long enough to be measured reliably
+        let mut batch: u64 = 1;
+        loop
+        {
+            let start = Instant::now();
+            for _ in 0..batch
+            {
+                routine();
+            }
+            if (start.elapsed() >= self.batch_time) || (batch >= 1<<30)
+            {
+                break;
+            }
+            batch *= 2;
+        }
+
+        let mut fastest = Duration::from_secs(u64::max_value());
+        for _ in 0..SAMPLES
+        {
+            let start = Instant::now();
+            for _ in 0..batch
+            {
+                routine();
+            }
+            fastest = fastest.min(start.elapsed());
+        }
+
+        let nanoseconds = (fastest.as_secs() as f64 * 1e9 + fastest.subsec_nanos() as f64) / batch as f64;
+        self.results.push(BenchResult { name: name.to_string(), iterations: batch * SAMPLES as u64, nanoseconds: nanoseconds, elements: elements, unit: unit });
+    }
+}
+
+///A mix of one to four byte characters, like typed text in a few languages.
+fn sample_text (length: usize) -> String
+{
+    let words = ["decapad ", "Grüße ", "€uro ", "テキスト ", "𝄞 ", "edit\n"];
+    let mut text = String::with_capacity(length + 16);
+    let mut index = 0;
+    while text.len() < length
+    {
+        text.push_str(words[index % words.len()]);
+        index += 1;
+    }
+    return text;
+}
+
+///An insert tree in which every insert has `length` characters and every insert above the given depth has `fan_out` children, spread over
+///its characters. Returns the set and the number of characters in it.
+fn synthetic_tree (depth: usize, fan_out: usize, length: usize) -> (TextInsertSet, usize)
+{
+    let mut set = TextInsertSet::new();
+    let content: String = (0..length).map(|offset| (b'a' + (offset % 26) as u8) as char).collect();
+    let mut level = vec![0u32]; //the parents of the next level, 0 is the root
+    let mut next_ID = 1;
+    for _ in 0..depth
+    {
+        let mut next_level = Vec::with_capacity(level.len() * fan_out);
+        for &parent in level.iter()
+        {
+            for child in 0..fan_out
+            {
+                let charPos = if parent == 0 { 0 } else { ((child + 1) * length / fan_out) as u16 };
+                let slot = set.arena.allocate(&content[..], 0);
+                set.push(TextInsert { ID: next_ID, parent: parent, author: next_ID % 7, charPos: charPos, content: slot });
+                next_level.push(next_ID);
+                next_ID += 1;
+            }
+        }
+        level = next_level;
+    }
+
+    let characters = set.inserts.len() * length;
+    (set, characters)
+}
+
+pub fn run_benchmarks (filter: Option<&str>, quick: bool) -> Vec<BenchResult>
+{
+    let mut bencher = Bencher { filter: filter, batch_time: Duration::from_millis(if quick { QUICK_BATCH_TIME_MS } else { BATCH_TIME_MS }), results: Vec::new() };
+
+    //the GUI's byte stream
+    let text = sample_text(4096);
+    bencher.run("utf8_stream_converter/4096", text.len(), "bytes", ||
+    {
+        let mut converter = Utf8StreamConverter::new();
+        let mut count = 0;
+        for &byte in black_box(text.as_bytes()).iter()
+        {
+            count += converter.input(byte).is_some() as usize;
+        }
+        black_box(count);
+    });
+
+    //datagram checksums
+    for &length in [64, 1400, 65536].iter()
+    {
+        let data: Vec<u8> = (0..length).map(|offset| (offset * 31) as u8).collect();
+        for &checksum in [Checksum::Koopman, Checksum::Castagnoli].iter()
+        {
+            bencher.run(&format!("crc/{}/{}", checksum.name(), length), length, "bytes", || { black_box(checksum.compute(black_box(&data[..]))); });
+        }
+    }
+
+    //the Init message, the largest tnetstring that is exchanged; the owned Data tree is kept as the baseline for the borrowed decoder
+    let grant = ProtocolBackendState::founder().grant();
+    let encoded = init_message(grant);
+    let message = tnetstring::decode(&mut &encoded[..]).unwrap();
+    let mut buffer = Vec::new();
+    bencher.run("tnetstring/encode/init", encoded.len(), "bytes", ||
+    {
+        buffer.clear();
+        tnetstring::encode(black_box(&message), &mut buffer);
+        black_box(&buffer);
+    });
+    bencher.run("tnetstring/write/init", encoded.len(), "bytes", || { black_box(init_message(black_box(grant))); });
+    bencher.run("tnetstring/decode/init", encoded.len(), "bytes", ||
+    {
+        let mut rest = black_box(&encoded[..]);
+        black_box(tnetstring::decode(&mut rest).unwrap());
+    });
+    bencher.run("tnetstring/decode_borrowed/init", encoded.len(), "bytes", ||
+    {
+        let mut rest = black_box(&encoded[..]);
+        let data = tnetstring::decode_borrowed(&mut rest).unwrap();
+        black_box((data.field("type"), data.field("end_ID")));
+    });
+
+    //edit records
+    let backend_state = ProtocolBackendState::new(1, 1024);
+    for &length in [1, 16, 255].iter()
+    {
+        let mut set = TextInsertSet::new();
+        let content: String = sample_text(length * 4).chars().take(length).collect();
+        let slot = set.arena.allocate(&content[..], 0);
+        set.push(TextInsert { ID: 5000, parent: 4000, author: 2, charPos: 3, content: slot });
+
+        for &version in [wire::LEGACY_VERSION, wire::CURRENT_VERSION].iter()
+        {
+            let mut record = Vec::new();
+            set.inserts[0].serialize(&set.arena, version, &mut record);
+            bencher.run(&format!("insert/serialize/v{}/{}", version, length), length, "characters", ||
+            {
+                buffer.clear();
+                set.inserts[0].serialize(&set.arena, version, &mut buffer);
+                black_box(&buffer);
+            });
+            bencher.run(&format!("insert/deserialize/v{}/{}", version, length), length, "characters", ||
+            {
+                let mut new_set = TextInsertSet::new();
+                if let Some(wire::Record::Insert(header, content)) = wire::decode(black_box(&record[..]))
+                {
+                    black_box(TextInsert::deserialize(&header, content, &mut new_set, &backend_state));
+                }
+                black_box(&new_set);
+            });
+        }
+    }
+
+    //rendering: wide and flat, balanced, deep
+    for &(depth, fan_out) in [(1, 1000), (3, 10), (10, 2), (200, 1)].iter()
+    {
+        let (set, characters) = synthetic_tree(depth, fan_out, 16);
+        let mut text_buffer = TextBufferInternal::new();
+        bencher.run(&format!("render_text/depth={},fan_out={}", depth, fan_out), characters, "characters", ||
+        {
+            render_text(black_box(&set), &mut text_buffer);
+            black_box(&text_buffer.text);
+        });
+    }
+
+    //a paste arriving from the GUI, into an empty pad, with a legacy peer (inserts of 255 characters) and one with wide positions
+    let paste = sample_text(65536);
+    let characters = paste.chars().count();
+    for &(name, version) in [("paste", wire::LEGACY_VERSION), ("paste_wide", wire::CURRENT_VERSION)].iter()
+    {
+        bencher.run(&format!("handle_input/{}/65536", name), characters, "characters", ||
+        {
+            let mut set = TextInsertSet::new();
+            let mut backend_state = Some(ProtocolBackendState::new(1, 1<<20));
+            let mut text_buffer = TextBufferInternal::new();
+            let mut network = NetworkState::new(0, 2001, framing::DEFAULT_MTU);
+            network.add_peer("127.0.0.1:2002".parse().unwrap());
+            network.peers[0].wire_version = version;
+            let mut converter = Utf8StreamConverter::new();
+            let mut bytes = black_box(&paste).bytes();
+            handle_input(&mut |_| bytes.next(), &mut converter, &mut set, &mut backend_state, &mut text_buffer, &mut network);
+            black_box(&set);
+        });
+    }
+
+    //the GUI to backend ring, with both ends busy; a full or empty ring yields instead of spinning like blocking_push/pop, which would
+    //measure the scheduler's time slice on a machine with a single core
+    bencher.run(&format!("spsc_255/transfer/{}", RING_TRANSFER_BYTES), RING_TRANSFER_BYTES, "bytes", ||
+    {
+        let (producer, consumer) = spsc_255::new();
+        let producer_thread = thread::spawn(move ||
+        {
+            for index in 0..RING_TRANSFER_BYTES
+            {
+                while !producer.push(index as u8)
+                {
+                    thread::yield_now();
+                }
+            }
+        });
+        let mut sum: u64 = 0;
+        let mut received = 0;
+        while received < RING_TRANSFER_BYTES
+        {
+            match consumer.pop()
+            {
+                Some(byte) =>
+                {
+                    sum += byte as u64;
+                    received += 1;
+                },
+                None => thread::yield_now()
+            }
+        }
+        producer_thread.join().unwrap();
+        black_box(sum);
+    });
+
+    return bencher.results;
+}
+
+fn json_string (value: &str) -> String
+{
+    let mut result = String::with_capacity(value.len() + 2);
+    result.push('"');
+    for character in value.chars()
+    {
+        match character
+        {
+            '"' => result.push_str("\\\""),
+            '\\' => result.push_str("\\\\"),
+            character if (character as u32) < 0x20 => result.push_str(&format!("\\u{:04x}", character as u32)),
+            character => result.push(character)
+        }
+    }
+    result.push('"');
+    return result;
+}
+
+///The results as a JSON object, with the suite and crate version, so runs of different versions can be told apart.
+pub fn to_json (results: &[BenchResult]) -> String
+{
+    let mut json = format!("{{\"suite\": \"rust_embed\", \"version\": {}, \"results\": [", json_string(env!("CARGO_PKG_VERSION")));
+    for (index, result) in results.iter().enumerate()
+    {
+        json.push_str(if index == 0 { "\n  " } else { ",\n  " });
+        json.push_str(&format!("{{\"name\": {}, \"iterations\": {}, \"ns_per_iteration\": {:.3}, \"elements\": {}, \"unit\": {}}}",
+                               json_string(&result.name), result.iterations, result.nanoseconds, result.elements, json_string(result.unit)));
+    }
+    json.push_str("\n]}");
+    return json;
+}
+
+
+#[test]
+fn test_synthetic_tree ()
+{
+    for &(depth, fan_out, inserts) in [(1, 5, 5), (3, 2, 14), (4, 1, 4)].iter()
+    {
+        let (set, characters) = synthetic_tree(depth, fan_out, 8);
+        assert_eq!((set.inserts.len(), characters), (inserts, inserts * 8));
+
+        let mut text_buffer = TextBufferInternal::new();
+        render_text(&set, &mut text_buffer);
+        assert_eq!(text_buffer.text.len(), characters);
+    }
+}
+
+#[test]
+fn test_bench_json ()
+{
+    let results = run_benchmarks(Some("crc/crc32c/64"), true);
+    assert_eq!(results.len(), 1);
+    assert!(results[0].iterations > 0 && results[0].nanoseconds > 0.0);
+
+    let json = to_json(&results);
+    assert!(json.starts_with("{\"suite\": \"rust_embed\"") && json.ends_with("]}"));
+    assert!(json.contains("\"name\": \"crc/crc32c/64\"") && json.contains("\"unit\": \"bytes\""));
+    assert_eq!(json_string("a\"b\\\n"), "\"a\\\"b\\\\\\u000a\"");
+}
@@ -0,0 +1,18 @@
+//Runs the microbenchmarks of the backend's primitives and prints the results as JSON, see src/bench.rs.
+//usage: decapad-bench [--quick] [filter]
+//Only benchmarks whose name contains the filter are run; --quick uses short batches, to check that everything still runs.
+
+extern crate rust_embed;
+
+use std::env;
+
+fn main ()
+{
+    let arguments: Vec<String> = env::args().skip(1).collect();
+    let quick = arguments.iter().any(|argument| argument == "--quick");
+    let filter = arguments.iter().find(|argument| !argument.starts_with("--")).map(|filter| &filter[..]);
+
+    let results = rust_embed::run_benchmarks(filter, quick);
+    println!("{}", rust_embed::benchmarks_to_json(&results));
+    rust_embed::flush_log();
+}
@@ -0,0 +1,41 @@
+//Headless hub: keeps pads for any number of clients, without a window. Clients join a pad by starting with DECAPAD_PAD set to it and
+//the hub's port as the other port.
+//Usage: decapad-hub [port] [number of workers] [storage directory]
+
+extern crate rust_embed;
+
+use std::{env, process, thread};
+use std::path::PathBuf;
+use rust_embed::HostOptions;
+
+fn main ()
+{
+    let arguments: Vec<String> = env::args().collect();
+    let port = match arguments.get(1).map(|argument| argument.parse::<u16>())
+    {
+        Some(Ok(port)) => port,
+        Some(Err(_)) =>
+        {
+            eprintln!("Usage: {} [port] [number of workers] [storage directory]", arguments[0]);
+            process::exit(2);
+        },
+        None => 2000
+    };
+
+    let mut options = HostOptions::new(port);
+    options.workers = arguments.get(2).and_then(|argument| argument.parse().ok())
+        .unwrap_or_else(|| thread::available_parallelism().map(|workers| workers.get()).unwrap_or(1));
+    options.storage = arguments.get(3).map(PathBuf::from);
+    if let Some(mtu) = env::var("DECAPAD_MTU").ok().and_then(|mtu| mtu.parse().ok())
+    {
+        options.mtu = mtu;
+    }
+
+    println!("Hosting pads on port {} with {} workers.", options.port, options.workers);
+    if let Err(error) = rust_embed::host_pads(options)
+    {
+        eprintln!("The hub stopped: {}", error);
+        rust_embed::flush_log();
+        process::exit(1);
+    }
+}
@@ -0,0 +1,536 @@
+//Load generator: runs a number of backends in this process, connects them through a proxy that can drop, delay and reorder datagrams and
+//drives them with scripted edits through the entry points the C frontend uses. Reports how long it takes until all peers show the same
+//text after an edit, how much traffic an edit causes and how much CPU time each backend used.
+//Usage: decapad-load [--peers N] [--rounds N] [--concurrency N] [--workload typing|paste|delete|mixed] [--loss P] [--reorder P]
+//                    [--delay MS] [--jitter MS] [--timeout S] [--base-port PORT] [--seed N]
+//The backends log to stdout, so the report goes to stderr.
+//Every pair of backends talks through two proxy sockets: backend i reaches j at port Q(i,j), and the proxy forwards what it receives
+//there from Q(j,i), which is where j expects datagrams from i. The ports are laid out so that they compare like the backends' own ports,
+//which the init exchange depends on.
+
+#![allow(non_snake_case)]
+
+extern crate rust_embed;
+extern crate libc;
+
+use std::{env, fs, process, thread};
+use std::collections::BinaryHeap;
+use std::cmp::Reverse;
+use std::net::UdpSocket;
+use std::path::PathBuf;
+use std::sync::{Arc, Mutex, Condvar};
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::time::{Duration, Instant};
+use rust_embed::{BackendOptions, TextBuffer, FFIData, start_backend_with, rust_text_input, rust_try_sync_text, rust_send_cursor};
+
+const DELETE_KEY: u8 = 127;
+const POLL_INTERVAL_US: u64 = 200;
+const WARMUP_SECONDS: u64 = 60;
+const SETTLE_SECONDS: u64 = 2;
+
+#[derive(Debug, Clone)]
+struct Options
+{
+    peers: usize,
+    rounds: usize,
+    concurrency: usize, //peers that edit at the same time in a round
+    workload: String,
+    loss: f64,
+    reorder: f64,
+    delay_ms: u64,
+    jitter_ms: u64,
+    timeout: Duration,
+    base_port: u16,
+    seed: u64
+}
+
+fn parse_value<T: std::str::FromStr> (name: &str, value: &str) -> Result<T, String>
+{
+    value.parse().map_err(|_| format!("invalid value for {}: {}", name, value))
+}
+
+impl Options
+{
+    fn parse (arguments: &[String]) -> Result<Options, String>
+    {
+        let mut options = Options
+        {
+            peers: 3,
+            rounds: 200,
+            concurrency: 1,
+            workload: "mixed".to_string(),
+            loss: 0.0,
+            reorder: 0.0,
+            delay_ms: 0,
+            jitter_ms: 0,
+            timeout: Duration::from_secs(30),
+            base_port: 4100,
+            seed: 1
+        };
+
+        let mut arguments = arguments.iter();
+        while let Some(name) = arguments.next()
+        {
+            let value = arguments.next().ok_or(format!("{} needs a value", name))?;
+            match &name[..]
+            {
+                "--peers" => options.peers = parse_value(name, value)?,
+                "--rounds" => options.rounds = parse_value(name, value)?,
+                "--concurrency" => options.concurrency = parse_value(name, value)?,
+                "--workload" => options.workload = value.clone(),
+                "--loss" => options.loss = parse_value(name, value)?,
+                "--reorder" => options.reorder = parse_value(name, value)?,
+                "--delay" => options.delay_ms = parse_value(name, value)?,
+                "--jitter" => options.jitter_ms = parse_value(name, value)?,
+                "--timeout" => options.timeout = Duration::from_secs(parse_value(name, value)?),
+                "--base-port" => options.base_port = parse_value(name, value)?,
+                "--seed" => options.seed = parse_value(name, value)?,
+                _ => return Err(format!("unknown option {}", name))
+            }
+        }
+
+        if options.peers < 2
+        {
+            return Err("there have to be at least 2 peers".to_string());
+        }
+        if !["typing", "paste", "delete", "mixed"].contains(&&options.workload[..])
+        {
+            return Err(format!("unknown workload {}", options.workload));
+        }
+        options.concurrency = std::cmp::min(std::cmp::max(options.concurrency, 1), options.peers);
+        return Ok(options);
+    }
+
+    fn own_port (&self, peer: usize) -> u16
+    {
+        self.base_port + (peer*(self.peers + 1) + peer) as u16
+    }
+
+    ///Q(peer, other): where the proxy receives what peer sends to other, and sends what other sends to peer.
+    fn proxy_port (&self, peer: usize, other: usize) -> u16
+    {
+        self.base_port + (peer*(self.peers + 1) + other + if other > peer { 1 } else { 0 }) as u16
+    }
+}
+
+///xorshift64*, good enough for picking edits and dropping packets
+struct Random (u64);
+
+impl Random
+{
+    fn new (seed: u64) -> Random
+    {
+        Random(seed.wrapping_mul(0x9e3779b97f4a7c15) | 1)
+    }
+
+    fn next (&mut self) -> u64
+    {
+        self.0 ^= self.0 >> 12;
+        self.0 ^= self.0 << 25;
+        self.0 ^= self.0 >> 27;
+        self.0.wrapping_mul(0x2545f4914f6cdd1d)
+    }
+
+    fn below (&mut self, limit: usize) -> usize
+    {
+        (self.next() % std::cmp::max(limit, 1) as u64) as usize
+    }
+
+    fn chance (&mut self, probability: f64) -> bool
+    {
+        ((self.next() >> 11) as f64 / (1u64 << 53) as f64) < probability
+    }
+}
+
+
+#[derive(Default)]
+struct Traffic
+{
+    packets: AtomicUsize,
+    bytes: AtomicUsize,
+    dropped: AtomicUsize
+}
+
+struct Proxy
+{
+    queue: Mutex<BinaryHeap<Reverse<(Instant, u64, usize, u16, Vec<u8>)>>>, //due, sequence number, socket to send from, port, datagram
+    wakeup: Condvar,
+    traffic: Traffic,
+    sequence: AtomicUsize
+}
+
+///Binds the proxy sockets and starts a thread per socket that receives and schedules, and one that sends what is due.
+fn start_proxy (options: &Options) -> Arc<Proxy>
+{
+    let proxy = Arc::new(Proxy { queue: Mutex::new(BinaryHeap::new()), wakeup: Condvar::new(), traffic: Traffic::default(), sequence: AtomicUsize::new(0) });
+    let peers = options.peers;
+    let mut sockets = Vec::new(); //sockets[peer*peers + other] is Q(peer, other)
+    for peer in 0..peers
+    {
+        for other in 0..peers
+        {
+            sockets.push(if other == peer { None } else
+            {
+                Some(UdpSocket::bind(("127.0.0.1", options.proxy_port(peer, other))).unwrap_or_else(|error|
+                {
+                    eprintln!("Can't bind proxy port {}: {}", options.proxy_port(peer, other), error);
+                    process::exit(1);
+                }))
+            });
+        }
+    }
+
+    for peer in 0..peers
+    {
+        for other in (0..peers).filter(|&other| other != peer)
+        {
+            let socket = sockets[peer*peers + other].as_ref().unwrap().try_clone().expect("Can't share a proxy socket.");
+            let (proxy, options) = (proxy.clone(), options.clone());
+            let mut random = Random::new(options.seed ^ ((peer*peers + other) as u64) << 32);
+            thread::spawn(move ||
+            {
+                let mut buffer = [0u8; 65536];
+                while let Ok(length) = socket.recv(&mut buffer)
+                {
+                    if random.chance(options.loss)
+                    {
+                        proxy.traffic.dropped.fetch_add(1, Ordering::Relaxed);
+                        continue;
+                    }
+
+                    let mut delay = options.delay_ms*1000 + random.below(options.jitter_ms as usize*1000 + 1) as u64;
+                    if random.chance(options.reorder)
+                    {
+                        delay += options.delay_ms*1000 + options.jitter_ms*1000 + 2000; //arrives after at least the next one
+                    }
+
+                    let sequence = proxy.sequence.fetch_add(1, Ordering::Relaxed) as u64;
+                    let due = Instant::now() + Duration::from_micros(delay);
+                    proxy.queue.lock().unwrap().push(Reverse((due, sequence, other*peers + peer, options.own_port(other), buffer[..length].to_vec())));
+                    proxy.wakeup.notify_one();
+                }
+            });
+        }
+    }
+
+    let forwarder = proxy.clone();
+    thread::spawn(move ||
+    {
+        let mut queue = forwarder.queue.lock().unwrap();
+        loop
+        {
+            let now = Instant::now();
+            let next_due = queue.peek().map(|&Reverse((due, ..))| due);
+            match next_due
+            {
+                Some(due) if due <= now =>
+                {
+                    let Reverse((_, _, socket, port, datagram)) = queue.pop().unwrap();
+                    if sockets[socket].as_ref().unwrap().send_to(&datagram[..], ("127.0.0.1", port)).is_ok()
+                    {
+                        forwarder.traffic.packets.fetch_add(1, Ordering::Relaxed);
+                        forwarder.traffic.bytes.fetch_add(datagram.len(), Ordering::Relaxed);
+                    }
+                },
+                Some(due) => queue = forwarder.wakeup.wait_timeout(queue, due - now).unwrap().0,
+                None => queue = forwarder.wakeup.wait(queue).unwrap()
+            }
+        }
+    });
+
+    return proxy;
+}
+
+
+fn thread_IDs () -> Vec<u32>
+{
+    match fs::read_dir("/proc/self/task")
+    {
+        Ok(entries) => entries.filter_map(|entry| entry.ok().and_then(|entry| entry.file_name().to_str().and_then(|name| name.parse().ok()))).collect(),
+        Err(_) => Vec::new()
+    }
+}
+
+///User and system time of the threads, from /proc (so only on Linux).
+fn cpu_seconds (threads: &[u32]) -> f64
+{
+    let ticks_per_second = unsafe { libc::sysconf(libc::_SC_CLK_TCK) } as f64;
+    let mut ticks = 0;
+    for thread in threads.iter()
+    {
+        if let Ok(stat) = fs::read_to_string(format!("/proc/self/task/{}/stat", thread))
+        {
+            //the fields after the command name, which may contain spaces, start with the state
+            let fields: Vec<&str> = stat[stat.rfind(')').unwrap_or(0)+1..].split_whitespace().collect();
+            ticks += fields.get(11).and_then(|field| field.parse::<u64>().ok()).unwrap_or(0);
+            ticks += fields.get(12).and_then(|field| field.parse::<u64>().ok()).unwrap_or(0);
+        }
+    }
+    ticks as f64 / ticks_per_second
+}
+
+struct Instance
+{
+    ffi: *mut FFIData,
+    buffer: *mut TextBuffer,
+    threads: Vec<u32> //the backend's, to measure its CPU time
+}
+
+impl Instance
+{
+    fn start (options: &Options, peer: usize) -> Instance
+    {
+        let others: Vec<u16> = (0..options.peers).filter(|&other| other != peer).map(|other| options.proxy_port(peer, other)).collect();
+        let mut backend_options = BackendOptions::from_environment(options.own_port(peer), others[0]);
+        backend_options.peer_ports = others;
+        backend_options.pad_ID = 0;
+        backend_options.trace = backend_options.trace.map(|path| PathBuf::from(format!("{}.{}", path.display(), peer))); //one trace per peer
+
+        let before = thread_IDs();
+        let buffer = Box::into_raw(Box::new(TextBuffer::new()));
+        let ffi = start_backend_with(backend_options, buffer);
+        let threads = thread_IDs().into_iter().filter(|thread| !before.contains(thread)).collect();
+        Instance { ffi: ffi, buffer: buffer, threads: threads }
+    }
+
+    fn sync (&self)
+    {
+        unsafe { rust_try_sync_text(self.ffi) };
+    }
+
+    fn text (&self) -> Vec<char>
+    {
+        unsafe { (*self.buffer).text() }
+    }
+
+    fn move_cursor (&self, position: usize)
+    {
+        unsafe { rust_send_cursor(position as u32, self.ffi) };
+    }
+
+    fn press_key (&self, key: u8)
+    {
+        unsafe { rust_text_input(&key, 1, self.ffi) };
+    }
+
+    ///Like keypresses: one call per character.
+    fn type_text (&self, text: &str)
+    {
+        for byte in text.bytes()
+        {
+            self.press_key(byte);
+        }
+    }
+
+    fn paste (&self, text: &str)
+    {
+        unsafe { rust_text_input(text.as_ptr(), text.len() as i32, self.ffi) };
+    }
+}
+
+fn random_word (random: &mut Random, length: usize) -> String
+{
+    (0..length).map(|_| (b'a' + random.below(26) as u8) as char).collect()
+}
+
+///Performs one scripted edit on the instance. Returns the number of characters inserted or deleted.
+fn edit (instance: &Instance, workload: &str, random: &mut Random) -> usize
+{
+    let text_length = instance.text().len();
+    let kind = match workload
+    {
+        "mixed" => match random.below(100) { 0..=59 => "typing", 60..=74 => "paste", _ => "delete" },
+        _ => workload
+    };
+
+    match kind
+    {
+        "delete" if text_length > 0 =>
+        {
+            let position = 1 + random.below(text_length);
+            let count = 1 + random.below(std::cmp::min(position, 5));
+            instance.move_cursor(position);
+            for _ in 0..count
+            {
+                instance.press_key(DELETE_KEY);
+            }
+            count
+        },
+        "paste" =>
+        {
+            let length = 40 + random.below(160);
+            let text = random_word(random, length);
+            instance.move_cursor(random.below(text_length + 1));
+            instance.paste(&text);
+            text.len()
+        },
+        _ =>
+        {
+            let length = 1 + random.below(8);
+            let word = random_word(random, length) + " ";
+            instance.move_cursor(random.below(text_length + 1));
+            instance.type_text(&word);
+            word.len()
+        }
+    }
+}
+
+fn sync_all (instances: &[Instance]) -> Vec<Vec<char>>
+{
+    instances.iter().map(|instance| { instance.sync(); instance.text() }).collect()
+}
+
+///Waits until all peers show the same text, different from the given one. Returns false on timeout.
+fn wait_for_convergence (instances: &[Instance], previous: &[char], timeout: Duration) -> bool
+{
+    let start = Instant::now();
+    loop
+    {
+        let texts = sync_all(instances);
+        if texts.iter().all(|text| *text == texts[0]) && (&texts[0][..] != previous)
+        {
+            return true;
+        }
+        if start.elapsed() >= timeout
+        {
+            return false;
+        }
+        thread::sleep(Duration::from_micros(POLL_INTERVAL_US));
+    }
+}
+
+///Waits until every backend has been assigned an ID range, by having each of them type a character until it shows up.
+fn warm_up (instances: &[Instance]) -> bool
+{
+    let start = Instant::now();
+    for (index, instance) in instances.iter().enumerate()
+    {
+        loop
+        {
+            let before = sync_all(instances)[index].len();
+            instance.move_cursor(0);
+            instance.type_text("x");
+            let sent = Instant::now();
+            while (sent.elapsed() < Duration::from_millis(500)) && (instance.text().len() == before)
+            {
+                sync_all(instances);
+                thread::sleep(Duration::from_micros(POLL_INTERVAL_US));
+            }
+            if instance.text().len() > before
+            {
+                break;
+            }
+            if start.elapsed() >= Duration::from_secs(WARMUP_SECONDS)
+            {
+                return false;
+            }
+        }
+    }
+
+    //retried keypresses may still be on their way, so wait until the text has been the same everywhere for a while
+    let start = Instant::now();
+    let mut stable_since = (Instant::now(), Vec::new());
+    loop
+    {
+        let texts = sync_all(instances);
+        if !texts.iter().all(|text| *text == texts[0]) || (texts[0] != stable_since.1)
+        {
+            stable_since = (Instant::now(), texts[0].clone());
+        }
+        else if stable_since.0.elapsed() >= Duration::from_secs(SETTLE_SECONDS)
+        {
+            return true;
+        }
+        if start.elapsed() >= Duration::from_secs(WARMUP_SECONDS)
+        {
+            return false;
+        }
+        thread::sleep(Duration::from_micros(POLL_INTERVAL_US));
+    }
+}
+
+fn percentile (sorted: &[f64], fraction: f64) -> f64
+{
+    if sorted.is_empty()
+    {
+        return 0.0;
+    }
+    sorted[((sorted.len() - 1) as f64 * fraction).round() as usize]
+}
+
+fn main ()
+{
+    let arguments: Vec<String> = env::args().collect();
+    let options = match Options::parse(&arguments[1..])
+    {
+        Ok(options) => options,
+        Err(message) =>
+        {
+            eprintln!("{}", message);
+            eprintln!("Usage: {} [--peers N] [--rounds N] [--concurrency N] [--workload typing|paste|delete|mixed] [--loss P] [--reorder P] [--delay MS] [--jitter MS] [--timeout S] [--base-port PORT] [--seed N]", arguments[0]);
+            process::exit(2);
+        }
+    };
+
+    let proxy = start_proxy(&options);
+    let instances: Vec<Instance> = (0..options.peers).map(|peer| Instance::start(&options, peer)).collect();
+    if !warm_up(&instances)
+    {
+        eprintln!("The peers didn't finish the init exchange within {} s.", WARMUP_SECONDS);
+        rust_embed::flush_log();
+        process::exit(1);
+    }
+
+    let traffic_start = (proxy.traffic.packets.load(Ordering::Relaxed), proxy.traffic.bytes.load(Ordering::Relaxed), proxy.traffic.dropped.load(Ordering::Relaxed));
+    let cpu_start: Vec<f64> = instances.iter().map(|instance| cpu_seconds(&instance.threads)).collect();
+    let mut random = Random::new(options.seed);
+    let mut latencies = Vec::with_capacity(options.rounds);
+    let mut edits = 0;
+    let mut characters = 0;
+    let mut timed_out = 0;
+
+    for _ in 0..options.rounds
+    {
+        let previous = sync_all(&instances).swap_remove(0);
+        let start = Instant::now();
+
+        let mut editors: Vec<usize> = (0..options.peers).collect();
+        for _ in 0..options.concurrency
+        {
+            let editor = editors.swap_remove(random.below(editors.len()));
+            characters += edit(&instances[editor], &options.workload, &mut random);
+            edits += 1;
+        }
+
+        if wait_for_convergence(&instances, &previous[..], options.timeout)
+        {
+            latencies.push(start.elapsed().as_secs() as f64 * 1000.0 + start.elapsed().subsec_nanos() as f64 / 1e6);
+        }
+        else
+        {
+            timed_out += 1;
+            for (index, text) in sync_all(&instances).iter().enumerate()
+            {
+                eprintln!("peer {}: {:?}", index, text.iter().collect::<String>());
+            }
+            break; //the peers have diverged, later rounds wouldn't tell anything
+        }
+    }
+
+    let packets = proxy.traffic.packets.load(Ordering::Relaxed) - traffic_start.0;
+    let bytes = proxy.traffic.bytes.load(Ordering::Relaxed) - traffic_start.1;
+    let dropped = proxy.traffic.dropped.load(Ordering::Relaxed) - traffic_start.2;
+    latencies.sort_by(|a, b| a.partial_cmp(b).unwrap());
+    let per_edit = |total: usize| total as f64 / std::cmp::max(edits, 1) as f64;
+
+    eprintln!("{} peers, {} rounds of {} ({} at a time), loss {:.3}, reorder {:.3}, delay {} ms +- {} ms",
+        options.peers, options.rounds, options.workload, options.concurrency, options.loss, options.reorder, options.delay_ms, options.jitter_ms);
+    eprintln!("converged rounds: {}, edits: {} ({} characters), timed out: {}", latencies.len(), edits, characters, timed_out);
+    eprintln!("convergence latency (ms): p50 {:.2}  p90 {:.2}  p99 {:.2}  max {:.2}",
+        percentile(&latencies, 0.5), percentile(&latencies, 0.9), percentile(&latencies, 0.99), percentile(&latencies, 1.0));
+    eprintln!("traffic per edit: {:.2} packets, {:.1} bytes ({} packets dropped)", per_edit(packets), per_edit(bytes), dropped);
+    eprintln!("cpu per peer (s): {}", instances.iter().zip(cpu_start.iter()).map(|(instance, start)| format!("{:.2}", cpu_seconds(&instance.threads) - start)).collect::<Vec<String>>().join(" "));
+
+    rust_embed::flush_log();
+    process::exit(if timed_out > 0 { 1 } else { 0 });
+}
@@ -0,0 +1,38 @@
+//Replays a session recorded with DECAPAD_TRACE=<file> into a fresh backend and reports where the time went.
+//usage: decapad-replay <trace file> [repetitions]
+
+extern crate rust_embed;
+
+use std::{env, process};
+use std::path::Path;
+
+fn main ()
+{
+    let arguments: Vec<String> = env::args().collect();
+    if arguments.len() < 2
+    {
+        eprintln!("usage: {} <trace file> [repetitions]", arguments[0]);
+        process::exit(2);
+    }
+
+    let trace = match rust_embed::Trace::read(Path::new(&arguments[1]))
+    {
+        Ok(trace) => trace,
+        Err(error) =>
+        {
+            eprintln!("Can't read {}: {}", arguments[1], error);
+            process::exit(1);
+        }
+    };
+
+    let repetitions = arguments.get(2).and_then(|value| value.parse().ok()).unwrap_or(1);
+    for repetition in 0..repetitions
+    {
+        if repetitions > 1
+        {
+            println!("run {}:", repetition + 1);
+        }
+        println!("{}", rust_embed::replay_trace(&trace));
+    }
+    rust_embed::flush_log();
+}
@@ -0,0 +1,527 @@
+//Shared storage for the contents of all inserts of a pad.
+//Every insert owns a slot in one append-only byte arena that holds its characters as UTF-8, so the content never needs re-encoding before
+//it is sent. Deleted characters are not overwritten in place (that would change the byte length of multi-byte characters), but marked in a
+//per-slot tombstone bitmap. A slot that has to grow beyond its capacity while it isn't at the end of the arena gets moved to the end,
+//leaving garbage behind.
+//Both the garbage and the bytes of deleted characters are only freed by rebuilding the arena (see ContentArena::adopt). A slot whose
+//tombstones have been dropped that way remembers which positions have no bytes anymore in a second bitmap, so the character positions
+//(which other inserts use to reference their parent) never change.
+
+use std::{fmt, str};
+use std::cmp::{min, max};
+
+const DELETED_CHARACTER: char = 127 as char;
+const MINIMUM_SLOT_CAPACITY: u32 = 16;
+
+#[derive(Debug, Clone)]
+pub struct ContentSlot
+{
+    offset: u32,
+    byte_length: u32,
+    byte_capacity: u32,
+    length: u32, //in characters
+    deleted: Vec<u64>, //tombstone bitmap, stays empty (and unallocated) until the first deletion
+    deleted_count: u32,
+    removed: Vec<u64>, //deleted characters whose bytes have been dropped from the arena
+    removed_count: u32,
+    all_deleted: bool //compact form for inserts that have been deleted completely: no bytes and no bitmaps
+}
+
+fn bit_is_set (bitmap: &Vec<u64>, position: usize) -> bool
+{
+    match bitmap.get(position/64)
+    {
+        Some(word) => (word >> (position%64)) & 1 == 1,
+        None => false
+    }
+}
+
+fn set_bit (bitmap: &mut Vec<u64>, position: usize)
+{
+    while bitmap.len() <= position/64
+    {
+        bitmap.push(0);
+    }
+    bitmap[position/64] |= 1 << (position%64);
+}
+
+impl ContentSlot
+{
+    ///Number of characters in the slot, including deleted ones.
+    pub fn len (&self) -> usize
+    {
+        self.length as usize
+    }
+
+    pub fn byte_len (&self) -> usize
+    {
+        self.byte_length as usize
+    }
+
+    pub fn is_deleted (&self, position: usize) -> bool
+    {
+        self.all_deleted | bit_is_set(&self.deleted, position)
+    }
+
+    fn is_removed (&self, position: usize) -> bool
+    {
+        self.all_deleted | bit_is_set(&self.removed, position)
+    }
+
+    pub fn is_all_deleted (&self) -> bool
+    {
+        self.all_deleted
+    }
+
+    ///Marks a character as deleted. Returns false if it already was.
+    pub fn delete (&mut self, position: usize) -> bool
+    {
+        assert!(position < self.len(), "ContentSlot::delete was called with a position that is out of bounds.");
+
+        if self.is_deleted(position)
+        {
+            return false;
+        }
+
+        set_bit(&mut self.deleted, position);
+        self.deleted_count += 1;
+        return true;
+    }
+
+    pub fn deleted_count (&self) -> usize
+    {
+        self.deleted_count as usize
+    }
+
+    ///Number of deleted characters that still take up space in the arena.
+    pub fn tombstone_count (&self) -> usize
+    {
+        (self.deleted_count - self.removed_count) as usize
+    }
+
+    ///Turns the compact form of a completely deleted slot back into the bitmap form, so characters can be appended.
+    fn expand (&mut self)
+    {
+        if self.all_deleted
+        {
+            self.all_deleted = false;
+            for position in 0..self.len()
+            {
+                set_bit(&mut self.deleted, position);
+                set_bit(&mut self.removed, position);
+            }
+        }
+    }
+}
+
+///Iterates over all character positions of a slot, yielding None for deleted characters.
+pub struct SlotCharacters<'a>
+{
+    chars: str::Chars<'a>,
+    slot: &'a ContentSlot,
+    position: usize
+}
+
+impl<'a> Iterator for SlotCharacters<'a>
+{
+    type Item = Option<char>;
+
+    fn next (&mut self) -> Option<Option<char>>
+    {
+        if self.position >= self.slot.len()
+        {
+            return None;
+        }
+
+        let position = self.position;
+        self.position += 1;
+
+        if self.slot.is_removed(position)
+        {
+            return Some(None);
+        }
+
+        let character = self.chars.next();
+        if self.slot.is_deleted(position)
+        {
+            return Some(None);
+        }
+        return Some(character);
+    }
+}
+
+pub struct ContentArena
+{
+    bytes: Vec<u8>,
+    garbage: usize //bytes that belong to slots which have been moved
+}
+
+impl fmt::Debug for ContentArena
+{
+    fn fmt (&self, formatter: &mut fmt::Formatter) -> fmt::Result
+    {
+        write!(formatter, "ContentArena {{ {} bytes, {} of them garbage }}", self.bytes.len(), self.garbage)
+    }
+}
+
+impl ContentArena
+{
+    pub fn new () -> ContentArena
+    {
+        ContentArena { bytes: Vec::new(), garbage: 0 }
+    }
+
+    pub fn with_capacity (capacity: usize) -> ContentArena
+    {
+        ContentArena { bytes: Vec::with_capacity(capacity), garbage: 0 }
+    }
+
+    pub fn len (&self) -> usize
+    {
+        self.bytes.len()
+    }
+
+    pub fn garbage (&self) -> usize
+    {
+        self.garbage
+    }
+
+    fn empty_slot (&self) -> ContentSlot
+    {
+        ContentSlot
+        {
+            offset: self.bytes.len() as u32,
+            byte_length: 0,
+            byte_capacity: 0,
+            length: 0,
+            deleted: Vec::new(),
+            deleted_count: 0,
+            removed: Vec::new(),
+            removed_count: 0,
+            all_deleted: false
+        }
+    }
+
+    ///Makes a new slot with the given content. Characters equal to 127 (DEL) are marked as deleted.
+    pub fn allocate (&mut self, content: &str, reserve: usize) -> ContentSlot
+    {
+        let mut slot = self.empty_slot();
+
+        self.bytes.reserve(content.len() + reserve);
+        self.bytes.extend_from_slice(content.as_bytes());
+        self.bytes.resize(slot.offset as usize + content.len() + reserve, 0);
+        slot.byte_capacity = (content.len() + reserve) as u32;
+        slot.byte_length = content.len() as u32;
+        self.count_characters(&mut slot, content);
+
+        return slot;
+    }
+
+    fn count_characters (&mut self, slot: &mut ContentSlot, new_content: &str)
+    {
+        for character in new_content.chars()
+        {
+            slot.length += 1;
+            if character == DELETED_CHARACTER
+            {
+                let position = slot.len() - 1;
+                slot.delete(position);
+            }
+        }
+    }
+
+    fn make_room (&mut self, slot: &mut ContentSlot, additional_bytes: usize)
+    {
+        let needed = slot.byte_length as usize + additional_bytes;
+        if needed <= slot.byte_capacity as usize
+        {
+            return;
+        }
+
+        let new_capacity = max(MINIMUM_SLOT_CAPACITY, 2*needed as u32);
+        let slot_end = (slot.offset + slot.byte_capacity) as usize;
+
+        if slot_end == self.bytes.len() //last slot in the arena, can grow in place
+        {
+            self.bytes.resize(slot.offset as usize + new_capacity as usize, 0);
+        }
+        else
+        {
+            let new_offset = self.bytes.len();
+            self.bytes.reserve(new_capacity as usize);
+            for i in 0..slot.byte_length as usize
+            {
+                let byte = self.bytes[slot.offset as usize + i];
+                self.bytes.push(byte);
+            }
+            self.bytes.resize(new_offset + new_capacity as usize, 0);
+
+            self.garbage += slot.byte_capacity as usize;
+            slot.offset = new_offset as u32;
+        }
+
+        slot.byte_capacity = new_capacity;
+    }
+
+    ///Appends UTF-8 encoded characters to a slot. Characters equal to 127 (DEL) are marked as deleted.
+    pub fn append_str (&mut self, slot: &mut ContentSlot, content: &str)
+    {
+        slot.expand();
+        self.make_room(slot, content.len());
+        let start = (slot.offset + slot.byte_length) as usize;
+        self.bytes[start .. start+content.len()].copy_from_slice(content.as_bytes());
+        slot.byte_length += content.len() as u32;
+        self.count_characters(slot, content);
+    }
+
+    pub fn push (&mut self, slot: &mut ContentSlot, character: char)
+    {
+        let mut encoded = [0u8; 4];
+        let encoded = character.encode_utf8(&mut encoded);
+        self.append_str(slot, encoded);
+    }
+
+    ///The raw UTF-8 content of a slot. Deleted characters are contained in it unless they have been dropped by a compaction.
+    pub fn as_str (&self, slot: &ContentSlot) -> &str
+    {
+        let start = slot.offset as usize;
+        unsafe { str::from_utf8_unchecked(&self.bytes[start .. start + slot.byte_length as usize]) } //only valid UTF-8 is ever written into a slot
+    }
+
+    pub fn characters<'a> (&'a self, slot: &'a ContentSlot) -> SlotCharacters<'a>
+    {
+        SlotCharacters { chars: self.as_str(slot).chars(), slot: slot, position: 0 }
+    }
+
+    ///Byte offset of the character at the given position inside the slot's content. Only meaningful for slots without dropped characters.
+    pub fn byte_offset (&self, slot: &ContentSlot, position: usize) -> usize
+    {
+        if slot.byte_length == slot.length //ASCII
+        {
+            return min(position, slot.byte_len());
+        }
+
+        match self.as_str(slot).char_indices().nth(position)
+        {
+            Some((offset, _)) => offset,
+            None => slot.byte_len()
+        }
+    }
+
+    ///Writes the content starting at the character position `from` to the buffer in the wire format, i.e. as UTF-8 with deleted characters
+    ///replaced by DEL. As long as there are no deletions in the slot, this is a plain copy out of the arena.
+    pub fn serialize (&self, slot: &ContentSlot, from: usize, buffer: &mut Vec<u8>)
+    {
+        self.serialize_range(slot, from, slot.len(), buffer);
+    }
+
+    ///Like serialize, but only up to the character position `to` (exclusive).
+    pub fn serialize_range (&self, slot: &ContentSlot, from: usize, to: usize, buffer: &mut Vec<u8>)
+    {
+        let to = min(to, slot.len());
+        if from >= to
+        {
+            return;
+        }
+
+        if slot.deleted_count == 0
+        {
+            let start = self.byte_offset(slot, from);
+            let content = &self.as_str(slot)[start..];
+            let end = if slot.byte_length == slot.length { to - from } else { content.char_indices().nth(to - from).map_or(content.len(), |(offset, _)| offset) };
+            buffer.extend_from_slice(&content.as_bytes()[..end]);
+        }
+        else if slot.all_deleted
+        {
+            for _ in from..to
+            {
+                buffer.push(DELETED_CHARACTER as u8);
+            }
+        }
+        else
+        {
+            for character in self.characters(slot).skip(from).take(to - from)
+            {
+                match character
+                {
+                    Some(character) =>
+                    {
+                        let mut encoded = [0u8; 4];
+                        buffer.extend_from_slice(character.encode_utf8(&mut encoded).as_bytes());
+                    },
+                    None => buffer.push(DELETED_CHARACTER as u8)
+                }
+            }
+        }
+    }
+
+    ///Bytes of the deleted characters that are still stored in the slot, i.e. what adopt with drop_tombstones would leave behind.
+    pub fn tombstone_bytes (&self, slot: &ContentSlot) -> usize
+    {
+        if slot.byte_length == slot.length - slot.removed_count //ASCII
+        {
+            return slot.tombstone_count();
+        }
+
+        let mut bytes = 0;
+        let mut characters = self.as_str(slot).chars();
+        for position in 0..slot.len()
+        {
+            if slot.is_removed(position)
+            {
+                continue;
+            }
+            let character = characters.next().unwrap_or(DELETED_CHARACTER);
+            if slot.is_deleted(position)
+            {
+                bytes += character.len_utf8();
+            }
+        }
+        return bytes;
+    }
+
+    ///Copies a slot from another arena into this one (this is how an arena is compacted). With drop_tombstones set, the bytes of deleted
+    ///characters are left behind, and a slot that only contains deleted characters is turned into its compact form. With keep_spare set,
+    ///the slot keeps its spare capacity, so the insert that is being typed into doesn't have to move again right away.
+    pub fn adopt (&mut self, old_arena: &ContentArena, slot: &mut ContentSlot, drop_tombstones: bool, keep_spare: bool)
+    {
+        let mut new_slot = self.empty_slot();
+        new_slot.length = slot.length;
+
+        if drop_tombstones & (slot.deleted_count == slot.length) & (slot.length > 0)
+        {
+            new_slot.all_deleted = true;
+            new_slot.deleted_count = slot.length;
+            new_slot.removed_count = slot.length;
+        }
+
+        else if drop_tombstones & (slot.tombstone_count() > 0)
+        {
+            for character in old_arena.characters(slot)
+            {
+                if let Some(character) = character
+                {
+                    let mut encoded = [0u8; 4];
+                    self.bytes.extend_from_slice(character.encode_utf8(&mut encoded).as_bytes());
+                }
+            }
+
+            new_slot.deleted = slot.deleted.clone();
+            new_slot.deleted_count = slot.deleted_count;
+            new_slot.removed = slot.deleted.clone();
+            new_slot.removed_count = slot.deleted_count;
+        }
+
+        else
+        {
+            self.bytes.extend_from_slice(old_arena.as_str(slot).as_bytes());
+            new_slot.deleted = slot.deleted.clone();
+            new_slot.deleted_count = slot.deleted_count;
+            new_slot.removed = slot.removed.clone();
+            new_slot.removed_count = slot.removed_count;
+            new_slot.all_deleted = slot.all_deleted;
+        }
+
+        new_slot.byte_length = (self.bytes.len() - new_slot.offset as usize) as u32;
+        new_slot.byte_capacity = new_slot.byte_length + if keep_spare { slot.byte_capacity - slot.byte_length } else { 0 };
+        let end = (new_slot.offset + new_slot.byte_capacity) as usize;
+        self.bytes.resize(end, 0);
+        *slot = new_slot;
+    }
+}
+
+
+#[test]
+fn test_content_arena ()
+{
+    let mut arena = ContentArena::new();
+    let mut first = arena.allocate("Hello", 0);
+    let second = arena.allocate("W\u{7f}rld", 0);
+
+    assert_eq!(first.len(), 5);
+    assert_eq!(second.len(), 5);
+    assert!(second.is_deleted(1));
+    assert_eq!(second.deleted_count(), 1);
+
+    arena.push(&mut first, 'ö'); //has to move the first slot behind the second one
+    assert_eq!(arena.as_str(&first), "Helloö");
+    assert_eq!(arena.as_str(&second), "W\u{7f}rld");
+    assert_eq!(arena.garbage(), 5);
+
+    arena.append_str(&mut first, "!!"); //enough capacity left now
+    assert_eq!(arena.garbage(), 5);
+    assert_eq!(arena.characters(&first).count(), 8);
+
+    assert!(first.delete(5));
+    assert!(!first.delete(5));
+    let mut serialized = Vec::new();
+    arena.serialize(&first, 4, &mut serialized);
+    assert_eq!(&serialized[..], "o\u{7f}!!".as_bytes());
+
+    serialized.clear();
+    arena.serialize(&second, 0, &mut serialized);
+    assert_eq!(&serialized[..], "W\u{7f}rld".as_bytes());
+
+    //parts of the content, as long inserts are sent in several records
+    let third = arena.allocate("aöbcü", 0);
+    let ascii = arena.allocate("abcdef", 0);
+    for &(slot, from, to, expected) in [(&first, 3, 6, "lo\u{7f}"), (&third, 1, 4, "öbc"), (&third, 4, 9, "ü"), (&ascii, 2, 4, "cd"), (&ascii, 4, 4, "")].iter()
+    {
+        serialized.clear();
+        arena.serialize_range(slot, from, to, &mut serialized);
+        assert_eq!(&serialized[..], expected.as_bytes());
+    }
+}
+
+#[test]
+fn test_content_arena_compaction ()
+{
+    let mut arena = ContentArena::new();
+    let mut partly_deleted = arena.allocate("abcdef", 0);
+    let mut fully_deleted = arena.allocate("xyz", 0);
+    let mut untouched = arena.allocate("ü", 4);
+    arena.push(&mut partly_deleted, 'g');
+
+    partly_deleted.delete(1);
+    partly_deleted.delete(2);
+    for position in 0..3
+    {
+        fully_deleted.delete(position);
+    }
+
+    let mut multi_byte = arena.allocate("aüb", 0);
+    multi_byte.delete(1);
+    assert_eq!((arena.tombstone_bytes(&partly_deleted), arena.tombstone_bytes(&fully_deleted), arena.tombstone_bytes(&multi_byte)), (2, 3, 2));
+
+    let mut compacted = ContentArena::new();
+    compacted.adopt(&arena, &mut partly_deleted, true, true);
+    compacted.adopt(&arena, &mut fully_deleted, true, false);
+    compacted.adopt(&arena, &mut untouched, true, false);
+
+    assert_eq!(compacted.len(), (5 + 9) + 0 + 2); //only partly_deleted (being typed into) keeps the spare capacity it got when it moved
+    assert_eq!(compacted.garbage(), 0);
+    assert!(fully_deleted.is_all_deleted());
+    assert_eq!(fully_deleted.len(), 3);
+
+    let rendered: Vec<Option<char>> = compacted.characters(&partly_deleted).collect();
+    assert_eq!(rendered, vec![Some('a'), None, None, Some('d'), Some('e'), Some('f'), Some('g')]);
+
+    //the wire format does not change through compaction
+    let mut serialized = Vec::new();
+    compacted.serialize(&partly_deleted, 0, &mut serialized);
+    assert_eq!(&serialized[..], "a\u{7f}\u{7f}defg".as_bytes());
+
+    serialized.clear();
+    compacted.serialize(&fully_deleted, 1, &mut serialized);
+    assert_eq!(&serialized[..], "\u{7f}\u{7f}".as_bytes());
+
+    //compacted slots can still grow and get deleted from, the one with spare capacity in place
+    compacted.append_str(&mut partly_deleted, "hi");
+    assert_eq!(compacted.garbage(), 0);
+    compacted.append_str(&mut fully_deleted, "!");
+    assert_eq!(compacted.characters(&fully_deleted).collect::<Vec<Option<char>>>(), vec![None, None, None, Some('!')]);
+    partly_deleted.delete(6);
+    serialized.clear();
+    compacted.serialize(&partly_deleted, 0, &mut serialized);
+    assert_eq!(&serialized[..], "a\u{7f}\u{7f}def\u{7f}hi".as_bytes());
+}
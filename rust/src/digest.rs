@@ -0,0 +1,297 @@
+//Summaries of the insert set that peers exchange from time to time, to find out cheaply whether they agree and, if not, which inserts
+//have to be transferred.
+//A digest contains a version vector (the number of inserts and the highest insert ID per author) and a hash for every bucket of
+//BUCKET_SIZE consecutive insert IDs. The hash of a bucket is the sum of the hashes of its inserts, so it doesn't depend on their order.
+//For the buckets that differ, the peers then exchange the states (ID, length, number of deleted characters) of their inserts, and each
+//side sends the inserts the other one is missing or has an older state of.
+
+use std::collections::BTreeMap;
+use tnetstring::{self, Value};
+
+pub const BUCKET_SIZE: u32 = 64;
+pub const BUCKETS_PER_MESSAGE: usize = 256; //keeps digest messages well below the receive buffer size
+pub const STATE_BUCKETS_PER_MESSAGE: usize = 2;
+
+pub fn bucket_of (ID: u32) -> u32
+{
+    ID / BUCKET_SIZE
+}
+
+///FNV-1a over everything that identifies the state of an insert, cut down to 31 bits so it fits into a tnetstring integer everywhere.
+pub fn insert_hash (ID: u32, parent: u32, author: u32, charPos: u16, length: usize, deleted: usize) -> u32
+{
+    let mut hash: u64 = 0xcbf29ce484222325;
+    for &value in [ID, parent, author, charPos as u32, length as u32, deleted as u32].iter()
+    {
+        for shift in [24, 16, 8, 0].iter()
+        {
+            hash ^= ((value >> shift) & 0xff) as u64;
+            hash = hash.wrapping_mul(0x100000001b3);
+        }
+    }
+
+    ((hash ^ (hash >> 32)) as u32) & 0x7fffffff
+}
+
+#[derive(Debug, Default, PartialEq)]
+pub struct Digest
+{
+    pub authors: BTreeMap<u32, (u32, u32)>, //number of inserts and highest ID
+    pub buckets: BTreeMap<u32, u32>
+}
+
+fn integer (value: Value) -> Option<u32>
+{
+    match value
+    {
+        Value::Integer(value) if (value >= 0) & (value as u64 <= u32::max_value() as u64) => Some(value as u32),
+        _ => None
+    }
+}
+
+///Reads a list of exactly values.len() integers into values.
+fn integers (value: Value, values: &mut [u32]) -> Option<()>
+{
+    let mut items = value.as_list()?;
+    for slot in values.iter_mut()
+    {
+        *slot = integer(items.next()?)?;
+    }
+    match items.next()
+    {
+        None => Some(()),
+        Some(_) => None
+    }
+}
+
+fn write_integers_into (values: &[u32], list: &mut Vec<u8>)
+{
+    for &value in values.iter()
+    {
+        tnetstring::write_integer(value as isize, list);
+    }
+}
+
+fn write_integers (values: &[u32], result: &mut Vec<u8>)
+{
+    tnetstring::write_list(result, |list| write_integers_into(values, list));
+}
+
+impl Digest
+{
+    pub fn new () -> Digest
+    {
+        Digest::default()
+    }
+
+    pub fn add (&mut self, ID: u32, author: u32, hash: u32)
+    {
+        let entry = self.authors.entry(author).or_insert((0, 0));
+        entry.0 += 1;
+        entry.1 = ::std::cmp::max(entry.1, ID);
+
+        let bucket = self.buckets.entry(bucket_of(ID)).or_insert(0);
+        *bucket = (bucket.wrapping_add(hash)) & 0x7fffffff;
+    }
+
+    ///The encoded digest messages, each covering up to BUCKETS_PER_MESSAGE buckets. The version vector is only in the first one.
+    pub fn messages (&self) -> Vec<Vec<u8>>
+    {
+        let buckets: Vec<(u32, u32)> = self.buckets.iter().map(|(&index, &hash)| (index, hash)).collect();
+        let mut messages = Vec::new();
+
+        for (number, part) in buckets.chunks(BUCKETS_PER_MESSAGE).enumerate()
+        {
+            let first = if number == 0 { 0 } else { part[0].0 };
+            let last = if (number+1)*BUCKETS_PER_MESSAGE >= buckets.len() { u32::max_value() } else { part[part.len()-1].0 };
+            messages.push(self.message(first, last, part, number == 0));
+        }
+
+        if messages.is_empty() //still tell the peer that there is nothing
+        {
+            messages.push(self.message(0, u32::max_value(), &[], true));
+        }
+
+        return messages;
+    }
+
+    fn message (&self, first: u32, last: u32, buckets: &[(u32, u32)], with_authors: bool) -> Vec<u8>
+    {
+        let mut message = Vec::new();
+        tnetstring::write_dict(&mut message, |dict|
+        {
+            dict.string("type", "Digest");
+            dict.integer("first_bucket", first as isize);
+            dict.integer("last_bucket", last as isize);
+            dict.list("buckets", |list|
+            {
+                for &(index, hash) in buckets.iter()
+                {
+                    write_integers(&[index, hash], list);
+                }
+            });
+
+            if with_authors
+            {
+                dict.list("authors", |list|
+                {
+                    for (&author, &(count, highest)) in self.authors.iter()
+                    {
+                        write_integers(&[author, count, highest], list);
+                    }
+                });
+            }
+        });
+        return message;
+    }
+
+    ///Reads a digest message. Returns the digest and the range of buckets it covers.
+    pub fn from_message (data: &Value) -> Option<(Digest, u32, u32)>
+    {
+        let first = integer(data.field("first_bucket")?)?;
+        let last = integer(data.field("last_bucket")?)?;
+        let mut digest = Digest::new();
+
+        let mut values = [0; 3];
+        for bucket in data.field("buckets")?.as_list()?
+        {
+            integers(bucket, &mut values[..2])?;
+            digest.buckets.insert(values[0], values[1]);
+        }
+
+        if let Some(authors) = data.field("authors").and_then(|authors| authors.as_list())
+        {
+            for author in authors
+            {
+                integers(author, &mut values)?;
+                digest.authors.insert(values[0], (values[1], values[2]));
+            }
+        }
+
+        return Some((digest, first, last));
+    }
+
+    ///The buckets within first..=last that are different (or only present) in one of the two digests.
+    pub fn differing_buckets (&self, other: &Digest, first: u32, last: u32) -> Vec<u32>
+    {
+        let mut differing = Vec::new();
+
+        for (&index, &hash) in self.buckets.range(first..=last)
+        {
+            if other.buckets.get(&index) != Some(&hash)
+            {
+                differing.push(index);
+            }
+        }
+
+        for (&index, _) in other.buckets.range(first..=last)
+        {
+            if !self.buckets.contains_key(&index)
+            {
+                differing.push(index);
+            }
+        }
+
+        differing.sort();
+        return differing;
+    }
+}
+
+///Encodes a bucket states message: the listed buckets and the state of every insert in them.
+pub fn bucket_states_message (buckets: &[u32], states: &[(u32, usize, usize)], reply: bool) -> Vec<u8>
+{
+    let mut message = Vec::new();
+    tnetstring::write_dict(&mut message, |dict|
+    {
+        dict.string("type", "Bucket states");
+        dict.list("buckets", |list| write_integers_into(buckets, list));
+        dict.list("inserts", |list|
+        {
+            for &(ID, length, deleted) in states.iter()
+            {
+                write_integers(&[ID, length as u32, deleted as u32], list);
+            }
+        });
+        dict.bool("reply", reply);
+    });
+    return message;
+}
+
+///Reads a bucket states message into the buckets, the insert states by ID and whether the sender expects the states of our side back.
+pub fn read_bucket_states (data: &Value) -> Option<(Vec<u32>, BTreeMap<u32, (usize, usize)>, bool)>
+{
+    let mut buckets = Vec::new();
+    for index in data.field("buckets")?.as_list()?
+    {
+        buckets.push(integer(index)?);
+    }
+
+    let mut states = BTreeMap::new();
+    let mut values = [0; 3];
+    for state in data.field("inserts")?.as_list()?
+    {
+        integers(state, &mut values)?;
+        states.insert(values[0], (values[1] as usize, values[2] as usize));
+    }
+
+    let reply = data.field("reply") == Some(Value::Bool(true));
+    return Some((buckets, states, reply));
+}
+
+
+#[test]
+fn test_digest ()
+{
+    let mut ours = Digest::new();
+    let mut theirs = Digest::new();
+    for ID in 1..200
+    {
+        ours.add(ID, 1, insert_hash(ID, ID-1, 1, 0, 10, 0));
+        if ID != 70
+        {
+            theirs.add(ID, 1, insert_hash(ID, ID-1, 1, 0, 10, if ID == 150 { 1 } else { 0 }));
+        }
+    }
+    ours.add(1030, 1026, insert_hash(1030, 0, 1026, 0, 3, 0));
+
+    assert_eq!(ours.differing_buckets(&theirs, 0, u32::max_value()), vec![1, 2, bucket_of(1030)]);
+    assert_eq!(ours.differing_buckets(&theirs, 2, 2), vec![2]);
+    assert_eq!(ours.differing_buckets(&ours, 0, u32::max_value()), vec![]);
+
+    let messages = ours.messages();
+    assert_eq!(messages.len(), 1);
+    let message = tnetstring::decode_borrowed(&mut &messages[0][..]).unwrap();
+    assert_eq!(message.field("type"), Some(Value::String("Digest")));
+    let (decoded, first, last) = Digest::from_message(&message).unwrap();
+    assert_eq!((first, last), (0, u32::max_value()));
+    assert_eq!(decoded, ours);
+
+    let encoded = bucket_states_message(&[1, 2], &[(70, 10, 0), (150, 10, 1)], true);
+    let (buckets, states, reply) = read_bucket_states(&tnetstring::decode_borrowed(&mut &encoded[..]).unwrap()).unwrap();
+    assert_eq!(buckets, vec![1, 2]);
+    assert_eq!(states.get(&150), Some(&(10, 1)));
+    assert!(reply);
+}
+
+#[test]
+fn test_large_digest ()
+{
+    let mut digest = Digest::new();
+    for ID in 0..(BUCKETS_PER_MESSAGE as u32 * BUCKET_SIZE * 2 + 5)
+    {
+        digest.add(ID, 1, 1);
+    }
+
+    let messages = digest.messages();
+    assert_eq!(messages.len(), 3);
+    let mut covered = 0;
+    for encoded in messages.iter()
+    {
+        assert!(encoded.len() < 10000);
+        let (part, first, last) = Digest::from_message(&tnetstring::decode_borrowed(&mut &encoded[..]).unwrap()).unwrap();
+        assert!(part.buckets.keys().all(|&index| (first <= index) & (index <= last)));
+        assert_eq!(digest.differing_buckets(&part, first, last), vec![]);
+        covered += part.buckets.len();
+    }
+    assert_eq!(covered, digest.buckets.len());
+}
@@ -0,0 +1,93 @@
+//Edit records encoded during one pass over the send queues of all peers. An edit usually has to go to every peer, so it is encoded for
+//the first one and only copied into the datagrams of the others. With a single peer, records are still serialized in place.
+
+use std::collections::HashMap;
+use framing::Batcher;
+
+///Identifies an encoded record: the insert ID, what part of the insert it carries and the wire version. Long inserts are sent in
+///several records, so inserts and appends are identified by the character range of their content.
+#[derive(Clone, Copy, Debug, PartialEq, Eq, Hash)]
+pub enum RecordKey
+{
+    Insert (u32, u16, u32), //content up to the position
+    Append (u32, u16, u16, u32),
+    Delete (u32, u16, u16, u32)
+}
+
+#[derive(Debug)]
+pub struct EncodedRecords
+{
+    pub shared: bool, //whether there is more than one peer to share the records with
+    data: Vec<u8>,
+    ranges: HashMap<RecordKey, (usize, usize)>
+}
+
+impl EncodedRecords
+{
+    pub fn new () -> EncodedRecords
+    {
+        EncodedRecords { shared: false, data: Vec::new(), ranges: HashMap::new() }
+    }
+
+    ///Forgets all records (the inserts may change before the next pass), keeping the allocations.
+    pub fn clear (&mut self)
+    {
+        self.data.clear();
+        self.ranges.clear();
+    }
+
+    ///Writes a record into the batcher, encoding it only if it hasn't been encoded in this pass yet. Returns its length.
+    pub fn write<F: FnOnce(&mut Vec<u8>)> (&mut self, key: RecordKey, batcher: &mut Batcher, encode: F) -> usize
+    {
+        if !self.shared
+        {
+            let mut length = 0;
+            batcher.write_record(|buffer|
+            {
+                let start = buffer.len();
+                encode(buffer);
+                length = buffer.len() - start;
+            });
+            return length;
+        }
+
+        let (start, end) = match self.ranges.get(&key)
+        {
+            Some(&range) => range,
+            None =>
+            {
+                let start = self.data.len();
+                encode(&mut self.data);
+                self.ranges.insert(key, (start, self.data.len()));
+                (start, self.data.len())
+            }
+        };
+
+        batcher.push(&self.data[start..end]);
+        return end - start;
+    }
+}
+
+
+#[test]
+fn test_encode_once ()
+{
+    let mut encoded = EncodedRecords::new();
+    encoded.shared = true;
+    let mut batchers = [Batcher::new(1400), Batcher::new(1400)];
+    let mut encodings = 0;
+
+    for batcher in batchers.iter_mut()
+    {
+        batcher.enabled = true;
+        assert_eq!(encoded.write(RecordKey::Insert(7, 6, 2), batcher, |buffer| { encodings += 1; buffer.extend_from_slice(b"insert"); }), 6);
+        encoded.write(RecordKey::Delete(7, 0, 1, 2), batcher, |buffer| { encodings += 1; buffer.extend_from_slice(b"delete"); });
+    }
+    assert_eq!(encodings, 2);
+    let first = batchers[0].finish().to_vec();
+    assert_eq!(&first[..], batchers[1].finish());
+
+    encoded.clear();
+    encoded.write(RecordKey::Insert(7, 6, 2), &mut batchers[0], |buffer| { encodings += 1; buffer.extend_from_slice(b"insert2"); });
+    assert_eq!(encodings, 3);
+}
@@ -0,0 +1,289 @@
+//Packs protocol records into datagrams.
+//A batch datagram starts with the usual 4 byte checksum, followed by 'B' and then any number of records, each prefixed with its length as
+//a big endian u16. Peers that haven't announced support for batches get every record in a datagram of its own (checksum and record).
+//Datagrams of any pad but pad 0 have 'P' and the pad ID as a big endian u16 between the checksum and the rest, so a host serving many pads
+//on one socket can tell them apart (see host.rs).
+
+use crc::Checksum;
+
+pub const DEFAULT_MTU: usize = 1400;
+pub const BATCH_TAG: u8 = 'B' as u8;
+pub const PAD_TAG: u8 = 'P' as u8;
+const PAD_PREFIX_LENGTH: usize = 3;
+const BATCH_HEADER_LENGTH: usize = 5;
+const MAXIMUM_SPARE_BUFFERS: usize = 64;
+const OVERFLOW_RESERVE: usize = 2048; //room for the record that overflows a batch before it is moved into the next one
+pub const BATCH_OVERHEAD: usize = BATCH_HEADER_LENGTH + PAD_PREFIX_LENGTH + 2; //a record that is at most this much smaller than the MTU fits into a batch
+
+#[derive(Debug)]
+pub struct Batcher
+{
+    pub enabled: bool,
+    pub checksum: Checksum,
+    pub pad_ID: u16,
+    mtu: usize,
+    current: Vec<u8>, //the batch that is being filled, empty if there is none
+    finished: Vec<Vec<u8>>, //checksummed datagrams that are ready to be sent
+    spare: Vec<Vec<u8>> //buffers of sent datagrams, kept around for reuse
+}
+
+impl Batcher
+{
+    pub fn new (mtu: usize) -> Batcher
+    {
+        Batcher { enabled: false, checksum: Checksum::Koopman, pad_ID: 0, mtu: mtu, current: Vec::new(), finished: Vec::new(), spare: Vec::new() }
+    }
+
+    pub fn mtu (&self) -> usize
+    {
+        self.mtu
+    }
+
+    fn new_buffer (&mut self) -> Vec<u8>
+    {
+        match self.spare.pop()
+        {
+            Some(mut buffer) =>
+            {
+                buffer.clear();
+                buffer
+            },
+            None => Vec::with_capacity(self.mtu + OVERFLOW_RESERVE)
+        }
+    }
+
+    ///Writes the placeholder for the checksum, the pad prefix and, for a batch, its tag. Returns the length of that header.
+    fn start_datagram (&self, datagram: &mut Vec<u8>, batch: bool) -> usize
+    {
+        datagram.extend_from_slice(&[0, 0, 0, 0]);
+        if self.pad_ID != 0
+        {
+            datagram.extend_from_slice(&[PAD_TAG, (self.pad_ID>>8) as u8, self.pad_ID as u8]);
+        }
+        if batch
+        {
+            datagram.push(BATCH_TAG);
+        }
+        datagram.len()
+    }
+
+    fn write_checksum (checksum: Checksum, datagram: &mut Vec<u8>)
+    {
+        let checkvalue = checksum.compute(&datagram[4..]);
+        datagram[0] = (checkvalue>>24) as u8;
+        datagram[1] = (checkvalue>>16) as u8;
+        datagram[2] = (checkvalue>>8) as u8;
+        datagram[3] = checkvalue as u8;
+    }
+
+    ///Checksums the current batch in place, queues it for sending and continues with the given buffer.
+    fn finish_current (&mut self, next: Vec<u8>)
+    {
+        let mut finished = ::std::mem::replace(&mut self.current, next);
+        if finished.len() > 0
+        {
+            Batcher::write_checksum(self.checksum, &mut finished);
+            self.finished.push(finished);
+        }
+        else
+        {
+            self.spare.push(finished);
+        }
+    }
+
+    ///Serializes a record directly into the datagram it is going to be sent in.
+    pub fn write_record<F: FnOnce(&mut Vec<u8>)> (&mut self, write: F)
+    {
+        if !self.enabled
+        {
+            let mut datagram = self.new_buffer();
+            self.start_datagram(&mut datagram, false);
+            write(&mut datagram);
+            Batcher::write_checksum(self.checksum, &mut datagram);
+            self.finished.push(datagram);
+            return;
+        }
+
+        let mut current = ::std::mem::replace(&mut self.current, Vec::new());
+        let header_length = if current.len() == 0 { self.start_datagram(&mut current, true) } else { self.header_length() };
+        self.current = current;
+
+        let start = self.current.len();
+        self.current.extend_from_slice(&[0, 0]);
+        write(&mut self.current);
+        let length = self.current.len() - start - 2;
+        self.current[start] = (length>>8) as u8;
+        self.current[start+1] = length as u8;
+
+        //the record doesn't fit anymore, so it starts the next batch
+        if (self.current.len() > self.mtu) & (start > header_length)
+        {
+            let mut next = self.new_buffer();
+            self.start_datagram(&mut next, true);
+            next.extend_from_slice(&self.current[start..]);
+            self.current.truncate(start);
+            self.finish_current(next);
+        }
+    }
+
+    fn header_length (&self) -> usize
+    {
+        if self.pad_ID != 0 { BATCH_HEADER_LENGTH + PAD_PREFIX_LENGTH } else { BATCH_HEADER_LENGTH }
+    }
+
+    pub fn push (&mut self, record: &[u8])
+    {
+        self.write_record(|buffer| buffer.extend_from_slice(record));
+    }
+
+    ///Closes the current batch and returns all datagrams that are ready to be sent.
+    pub fn finish (&mut self) -> &[Vec<u8>]
+    {
+        if self.current.len() > 0
+        {
+            let next = self.new_buffer();
+            self.finish_current(next);
+        }
+        &self.finished[..]
+    }
+
+    ///Keeps the buffers of the sent datagrams for reuse.
+    pub fn clear (&mut self)
+    {
+        while let Some(buffer) = self.finished.pop()
+        {
+            if self.spare.len() < MAXIMUM_SPARE_BUFFERS
+            {
+                self.spare.push(buffer);
+            }
+        }
+    }
+}
+
+///Iterates over the records of a batch datagram (without the checksum and the 'B'). Stops at the first malformed length.
+pub struct BatchRecords<'a>
+{
+    rest: &'a [u8]
+}
+
+impl<'a> Iterator for BatchRecords<'a>
+{
+    type Item = &'a [u8];
+
+    fn next (&mut self) -> Option<&'a [u8]>
+    {
+        if self.rest.len() < 2
+        {
+            return None;
+        }
+
+        let length = ((self.rest[0] as usize)<<8) + self.rest[1] as usize;
+        if (length == 0) | (self.rest.len() < 2+length)
+        {
+            self.rest = &[];
+            return None;
+        }
+
+        let record = &self.rest[2..2+length];
+        self.rest = &self.rest[2+length..];
+        return Some(record);
+    }
+}
+
+///Splits a checksummed payload (everything after the checksum) into its records.
+pub fn records<'a> (payload: &'a [u8]) -> BatchRecords<'a>
+{
+    if (payload.len() > 0) && (payload[0] == BATCH_TAG)
+    {
+        BatchRecords { rest: &payload[1..] }
+    }
+    else
+    {
+        BatchRecords { rest: &[] }
+    }
+}
+
+pub fn is_batch (payload: &[u8]) -> bool
+{
+    (payload.len() >= BATCH_HEADER_LENGTH - 4) && (payload[0] == BATCH_TAG)
+}
+
+///Splits a checksummed payload into the pad ID and the rest (a batch or a single record).
+pub fn split_pad (payload: &[u8]) -> (u16, &[u8])
+{
+    if (payload.len() >= PAD_PREFIX_LENGTH) && (payload[0] == PAD_TAG)
+    {
+        ((((payload[1] as u16)<<8) + payload[2] as u16), &payload[PAD_PREFIX_LENGTH..])
+    }
+    else
+    {
+        (0, payload)
+    }
+}
+
+
+#[test]
+fn test_batcher ()
+{
+    let mut batcher = Batcher::new(20);
+    batcher.enabled = true;
+    batcher.push(b"first");
+    batcher.push(b"second");
+    batcher.push(b"third record"); //does not fit into the first datagram anymore
+
+    let datagrams = batcher.finish().to_vec();
+    assert_eq!(datagrams.len(), 2);
+    for datagram in datagrams.iter()
+    {
+        assert_eq!(Checksum::Koopman.compute(&datagram[4..]), ((datagram[0] as u32)<<24) + ((datagram[1] as u32)<<16) + ((datagram[2] as u32)<<8) + datagram[3] as u32);
+        assert!(is_batch(&datagram[4..]));
+    }
+
+    assert_eq!(records(&datagrams[0][4..]).collect::<Vec<&[u8]>>(), vec![&b"first"[..], &b"second"[..]]);
+    assert_eq!(records(&datagrams[1][4..]).collect::<Vec<&[u8]>>(), vec![&b"third record"[..]]);
+    batcher.clear();
+
+    batcher.write_record(|buffer| buffer.extend_from_slice(b"written in place"));
+    assert_eq!(records(&batcher.finish()[0][4..]).collect::<Vec<&[u8]>>(), vec![&b"written in place"[..]]);
+    batcher.clear();
+
+    batcher.enabled = false;
+    batcher.push(b"single");
+    let datagrams = batcher.finish().to_vec();
+    assert_eq!(datagrams.len(), 1);
+    assert_eq!(&datagrams[0][4..], b"single");
+    batcher.clear();
+    assert!(batcher.finish().is_empty());
+}
+
+#[test]
+fn test_pad_prefix ()
+{
+    let mut batcher = Batcher::new(24);
+    batcher.pad_ID = 0x1234;
+    batcher.push(b"single");
+    batcher.enabled = true;
+    batcher.push(b"first");
+    batcher.push(b"second");
+    batcher.push(b"third record");
+
+    let datagrams = batcher.finish().to_vec();
+    assert_eq!(datagrams.len(), 3);
+    assert_eq!(split_pad(&datagrams[0][4..]), (0x1234, &b"single"[..]));
+    for datagram in datagrams[1..].iter()
+    {
+        let (pad_ID, payload) = split_pad(&datagram[4..]);
+        assert_eq!(pad_ID, 0x1234);
+        assert!(is_batch(payload));
+    }
+    assert_eq!(records(split_pad(&datagrams[1][4..]).1).collect::<Vec<&[u8]>>(), vec![&b"first"[..], &b"second"[..]]);
+    assert_eq!(records(split_pad(&datagrams[2][4..]).1).collect::<Vec<&[u8]>>(), vec![&b"third record"[..]]);
+    assert_eq!(split_pad(b"Bxyz"), (0, &b"Bxyz"[..]));
+}
+
+#[test]
+fn test_malformed_batch ()
+{
+    assert_eq!(records(b"B\x00\x03abc\x00\x09abc").collect::<Vec<&[u8]>>(), vec![&b"abc"[..]]);
+    assert_eq!(records(b"i\x00\x03abc").count(), 0);
+}
@@ -0,0 +1,762 @@
+//Hosting of many pads in one process on one socket. A dispatcher thread receives all datagrams and hands each one to the worker thread
+//that owns its pad (see framing.rs for the pad prefix). Pads are assigned to workers by consistent hashing of the pad ID, so changing the
+//number of workers only moves the pads of one worker's share. Every worker owns the complete state of its pads (insert set, peers, send
+//queues) and sends from its own clone of the socket; the only things shared are the channels to and from the dispatcher.
+//A hosted pad takes part in the protocol like any other peer: it owns the first ID range, grants ID ranges to the clients that join
+//and sends them a snapshot, but it never creates inserts itself. Edits that are new to it are relayed to the pad's other clients, so in
+//a star topology every client only talks to the host. Pads are saved to a storage directory, if there is one, and dropped from memory
+//once all their clients are gone. A file that can't be loaded is moved aside instead of being overwritten by the next save.
+//A saved pad is "DPAD", a format version byte, the u32 start and end of the pool of IDs the host can still grant, the u32 CRC32C of the
+//stream and the stream of its inserts (see snapshot_stream). Version 1 files have the u32 end of the ID ranges granted so far instead of
+//the pool.
+
+use std::{io, net, thread, fs};
+use std::path::{Path, PathBuf};
+use std::collections::HashMap;
+use std::sync::mpsc;
+use std::io::Write;
+use std::time::{Duration, Instant, SystemTime, UNIX_EPOCH};
+use std::cmp::{min, max};
+
+use framing;
+use wire::{self, read_u32, write_u32};
+use metrics;
+use crc::{crc32c, Checksum};
+use mmsg::{self, DatagramReceiver, DatagramSender};
+use super::{TextInsertSet, ProtocolBackendState, TextBufferInternal, NetworkState, handle_datagram, get_insert_by_ID, send_digest, snapshot_stream,
+            install_stream, has_valid_checksum, IDLE_WAKEUP_MS, ANTI_ENTROPY_INTERVAL_SECONDS, PEER_TIMEOUT_SECONDS};
+
+const VIRTUAL_NODES: u64 = 64; //points on the ring per worker
+const SAVE_INTERVAL_SECONDS: u64 = 5;
+const STORAGE_MAGIC: &'static [u8] = b"DPAD\x02";
+const LEGACY_STORAGE_MAGIC: &'static [u8] = b"DPAD\x01";
+const STORAGE_HEADER_LENGTH: usize = 5+4+4+4;
+const LEGACY_STORAGE_HEADER_LENGTH: usize = 5+4+4;
+
+#[derive(Debug, Clone)]
+pub struct HostOptions
+{
+    pub port: u16,
+    pub workers: usize,
+    pub mtu: usize,
+    pub storage: Option<PathBuf> //directory the pads are saved in
+}
+
+impl HostOptions
+{
+    pub fn new (port: u16) -> HostOptions
+    {
+        HostOptions { port: port, workers: 1, mtu: framing::DEFAULT_MTU, storage: None }
+    }
+}
+
+fn mix (mut value: u64) -> u64 //splitmix64 finalizer
+{
+    value = (value ^ (value >> 30)).wrapping_mul(0xbf58476d1ce4e5b9);
+    value = (value ^ (value >> 27)).wrapping_mul(0x94d049bb133111eb);
+    value ^ (value >> 31)
+}
+
+///Maps pad IDs to workers.
+#[derive(Debug)]
+pub struct ConsistentHash
+{
+    ring: Vec<(u64, usize)> //sorted points and the worker each belongs to
+}
+
+impl ConsistentHash
+{
+    pub fn new (number_of_workers: usize) -> ConsistentHash
+    {
+        let mut ring = Vec::with_capacity(number_of_workers * VIRTUAL_NODES as usize);
+        for worker in 0..number_of_workers
+        {
+            for node in 0..VIRTUAL_NODES
+            {
+                ring.push((mix(((worker as u64) << 32) | node), worker));
+            }
+        }
+        ring.sort();
+        ConsistentHash { ring: ring }
+    }
+
+    ///The worker owning the first point on the ring at or after the pad's hash.
+    pub fn worker_of (&self, pad_ID: u16) -> usize
+    {
+        let hash = mix(0x70616400_00000000 | pad_ID as u64);
+        match self.ring.binary_search(&(hash, 0))
+        {
+            Ok(index) => self.ring[index].1,
+            Err(index) => self.ring[index % self.ring.len()].1
+        }
+    }
+}
+
+struct Datagram
+{
+    data: Vec<u8>, //including the checksum
+    address: net::SocketAddr
+}
+
+#[derive(Debug)]
+struct HostedPad
+{
+    set: TextInsertSet,
+    backend_state: Option<ProtocolBackendState>,
+    text_buffer: TextBufferInternal, //never rendered, only needed by handle_record
+    network: NetworkState,
+    next_due: Instant,
+    last_digest: Instant,
+    dirty: bool, //changed since it was last saved
+    saving: bool, //handed to the storage thread, which hasn't reported back yet
+    storable: bool, //false if its damaged file couldn't be moved aside, which must not be overwritten
+    last_saved: Instant
+}
+
+impl HostedPad
+{
+    fn new (pad_ID: u16, own_port: u16, mtu: usize, now: Instant) -> HostedPad
+    {
+        HostedPad
+        {
+            set: TextInsertSet::new(),
+            backend_state: Some(ProtocolBackendState::founder()),
+            text_buffer: TextBufferInternal::new(),
+            network: NetworkState::new(pad_ID, own_port, mtu),
+            next_due: now,
+            last_digest: now,
+            dirty: false,
+            saving: false,
+            storable: true,
+            last_saved: now
+        }
+    }
+
+    ///The IDs that can still be granted to joining clients.
+    fn pool (&self) -> (u32, u32)
+    {
+        self.backend_state.as_ref().map(|state| (state.pool_start_ID, state.pool_end_ID)).unwrap_or((1, 0))
+    }
+}
+
+fn pad_path (directory: &Path, pad_ID: u16) -> PathBuf
+{
+    directory.join(format!("pad-{}.dpad", pad_ID))
+}
+
+///The content of a pad's file.
+fn pad_file (pad: &HostedPad) -> Vec<u8>
+{
+    let stream = snapshot_stream(&pad.set);
+    let mut data = Vec::with_capacity(STORAGE_HEADER_LENGTH + stream.len());
+    data.extend_from_slice(STORAGE_MAGIC);
+    let (pool_start_ID, pool_end_ID) = pad.pool();
+    write_u32(pool_start_ID, &mut data);
+    write_u32(pool_end_ID, &mut data);
+    write_u32(crc32c(&stream[..]), &mut data);
+    data.extend_from_slice(&stream[..]);
+    return data;
+}
+
+fn write_pad_file (path: &Path, data: &[u8]) -> io::Result<()>
+{
+    //written next to it and synced first, so neither a crash nor a power loss leaves a partially written pad behind
+    let temporary = path.with_extension("tmp");
+    let mut file = fs::File::create(&temporary)?;
+    file.write_all(data)?;
+    file.sync_all()?;
+    fs::rename(&temporary, path)
+}
+
+fn save_pad (directory: &Path, pad_ID: u16, pad: &HostedPad) -> io::Result<()>
+{
+    write_pad_file(&pad_path(directory, pad_ID), &pad_file(pad)[..])
+}
+
+///Renames a pad file that can't be loaded, so that it isn't overwritten by the next save. Returns the new name.
+fn move_aside (directory: &Path, pad_ID: u16) -> io::Result<PathBuf>
+{
+    let seconds = SystemTime::now().duration_since(UNIX_EPOCH).map(|time| time.as_secs()).unwrap_or(0);
+    let aside = pad_path(directory, pad_ID).with_extension(format!("dpad.damaged-{}", seconds));
+    fs::rename(pad_path(directory, pad_ID), &aside)?;
+    return Ok(aside);
+}
+
+///Restores a saved pad, if there is one. Returns the number of inserts.
+fn load_pad (directory: &Path, pad_ID: u16, pad: &mut HostedPad) -> io::Result<usize>
+{
+    let data = match fs::read(pad_path(directory, pad_ID))
+    {
+        Ok(data) => data,
+        Err(ref error) if error.kind() == io::ErrorKind::NotFound => return Ok(0),
+        Err(error) => return Err(error)
+    };
+
+    let legacy = data.starts_with(LEGACY_STORAGE_MAGIC);
+    let header_length = if legacy { LEGACY_STORAGE_HEADER_LENGTH } else { STORAGE_HEADER_LENGTH };
+    if (data.len() < header_length) || (!legacy & !data.starts_with(STORAGE_MAGIC)) ||
+        (crc32c(&data[header_length..]) != read_u32(&data[header_length-4..header_length]))
+    {
+        return Err(io::Error::new(io::ErrorKind::InvalidData, "damaged pad file"));
+    }
+
+    let HostedPad { ref mut set, ref mut backend_state, .. } = *pad;
+    if let Some(ref mut state) = *backend_state
+    {
+        //never grant the same IDs again
+        if legacy
+        {
+            state.pool_start_ID = max(state.pool_start_ID, read_u32(&data[5..9]) + 1);
+        }
+        else
+        {
+            state.pool_start_ID = max(state.pool_start_ID, read_u32(&data[5..9]));
+            state.pool_end_ID = min(state.pool_end_ID, read_u32(&data[9..13]));
+        }
+        return Ok(install_stream(set, state, &data[header_length..]));
+    }
+    return Ok(0);
+}
+
+///An edit record of a received datagram and the state (length, deleted characters) of its insert before it was applied.
+#[derive(Debug)]
+enum Edit
+{
+    Insert (u32, Option<(usize, usize)>),
+    Append (u32, Option<(usize, usize)>),
+    Delete (u32, u16, u16, Option<(usize, usize)>)
+}
+
+fn insert_state (set: &TextInsertSet, ID: u32) -> Option<(usize, usize)>
+{
+    get_insert_by_ID(ID, set).map(|insert| (insert.content.len(), insert.content.deleted_count()))
+}
+
+///The edit records of a datagram, with the current state of their inserts.
+fn edits_of (datagram: &[u8], set: &TextInsertSet) -> Vec<Edit>
+{
+    let mut edits = Vec::new();
+    if datagram.len() < 4
+    {
+        return edits;
+    }
+
+    let (_, payload) = framing::split_pad(&datagram[4..]);
+    let mut add = |record: &[u8]|
+    {
+        match wire::decode(record)
+        {
+            Some(wire::Record::Insert(header, _)) => edits.push(Edit::Insert(header.ID, insert_state(set, header.ID))),
+            Some(wire::Record::Append { ID, .. }) => edits.push(Edit::Append(ID, insert_state(set, ID))),
+            Some(wire::Record::Delete { ID, start, end }) => edits.push(Edit::Delete(ID, start, end, insert_state(set, ID))),
+            None => ()
+        }
+    };
+
+    if framing::is_batch(payload)
+    {
+        for record in framing::records(payload)
+        {
+            add(record);
+        }
+    }
+    else
+    {
+        add(payload);
+    }
+    return edits;
+}
+
+///Queues whatever the applied edits changed for all peers but the one they came from. Returns whether anything changed.
+fn relay (edits: &[Edit], set: &TextInsertSet, network: &mut NetworkState, from: usize) -> bool
+{
+    let mut changed = false;
+    for edit in edits.iter()
+    {
+        let others = network.peers.iter_mut().enumerate().filter(|&(index, ref peer)| (index != from) & !peer.refused).map(|(_, peer)| peer);
+        match *edit
+        {
+            Edit::Insert(ID, before) | Edit::Append(ID, before) =>
+            {
+                let after = insert_state(set, ID);
+                if after == before
+                {
+                    continue;
+                }
+                changed = true;
+
+                for peer in others
+                {
+                    match (before, after)
+                    {
+                        (Some((length, deleted)), Some((_, deleted_after))) if deleted == deleted_after => peer.enqueue_append(ID, length as u16),
+                        _ => peer.enqueue_full(ID)
+                    }
+                }
+            },
+
+            Edit::Delete(ID, start, end, before) =>
+            {
+                if insert_state(set, ID) == before
+                {
+                    continue;
+                }
+                changed = true;
+
+                for peer in others
+                {
+                    peer.enqueue_delete(ID, start, end);
+                }
+            }
+        }
+    }
+    return changed;
+}
+
+///The pads of one shard.
+struct Worker
+{
+    pads: HashMap<u16, HostedPad>,
+    socket: net::UdpSocket,
+    sender: DatagramSender,
+    own_port: u16,
+    mtu: usize,
+    storage: Option<PathBuf>,
+    saver: Option<(mpsc::Sender<(u16, PathBuf, Vec<u8>)>, mpsc::Receiver<(u16, io::Result<()>)>)>, //requests to and results from the storage thread
+    earliest_due: Instant, //no pad has to send anything before this, unless it received something
+    touched: Vec<u16> //pads that received datagrams since they were last serviced
+}
+
+impl Worker
+{
+    fn new (socket: net::UdpSocket, mtu: usize, storage: Option<PathBuf>) -> io::Result<Worker>
+    {
+        //writing and syncing the files would hold up the pads, so a thread of its own does it; it stops with the worker
+        let mut saver = None;
+        if storage.is_some()
+        {
+            let (requests, pending) = mpsc::channel::<(u16, PathBuf, Vec<u8>)>();
+            let (done, results) = mpsc::channel();
+            thread::Builder::new().name("Pad storage".to_string()).spawn(move ||
+            {
+                for (pad_ID, path, data) in pending.iter()
+                {
+                    let _ = done.send((pad_ID, write_pad_file(&path, &data[..])));
+                }
+            })?;
+            saver = Some((requests, results));
+        }
+
+        Ok(Worker
+        {
+            pads: HashMap::new(),
+            own_port: socket.local_addr()?.port(),
+            socket: socket,
+            sender: DatagramSender::new(),
+            mtu: mtu,
+            storage: storage,
+            saver: saver,
+            earliest_due: Instant::now(),
+            touched: Vec::new()
+        })
+    }
+
+    ///Applies a datagram to its pad. Senders that aren't known yet become peers of the pad.
+    fn handle_datagram (&mut self, datagram: &[u8], address: net::SocketAddr, now: Instant)
+    {
+        if datagram.len() < 4
+        {
+            return;
+        }
+
+        //a stray datagram must not create pads or peers (or load pads from the storage)
+        let (pad_ID, _) = framing::split_pad(&datagram[4..]);
+        let known = self.pads.get(&pad_ID).map_or(false, |pad| pad.network.peer_index(&address).is_some());
+        if !known && !has_valid_checksum(datagram, Checksum::Castagnoli, true)
+        {
+            metrics::CHECKSUM_FAILURES.increment();
+            return;
+        }
+
+        let (own_port, mtu) = (self.own_port, self.mtu);
+        let storage = &self.storage;
+        let pad = self.pads.entry(pad_ID).or_insert_with(||
+        {
+            let mut pad = HostedPad::new(pad_ID, own_port, mtu, now);
+            if let Some(ref directory) = *storage
+            {
+                match load_pad(directory, pad_ID, &mut pad)
+                {
+                    Ok(0) => (),
+                    Ok(inserts) => info!("Loaded pad {} with {} inserts.", pad_ID, inserts),
+                    Err(error) => match move_aside(directory, pad_ID)
+                    {
+                        Ok(aside) => error!("Failed to load pad {}: {}. Moved the file to {:?}, the pad starts empty.", pad_ID, error, aside),
+                        Err(move_error) =>
+                        {
+                            error!("Failed to load pad {}: {}. Failed to move the file aside ({}), the pad isn't saved.", pad_ID, error, move_error);
+                            pad.storable = false;
+                        }
+                    }
+                }
+            }
+            pad
+        });
+
+        let index = match pad.network.peer_index(&address)
+        {
+            Some(index) => index,
+            None =>
+            {
+                pad.network.add_peer(address);
+                pad.network.peers.len() - 1
+            }
+        };
+
+        let edits = edits_of(datagram, &pad.set);
+        let pool = pad.pool();
+
+        let HostedPad { ref mut set, ref mut backend_state, ref mut text_buffer, ref mut network, ref mut dirty, .. } = *pad;
+        network.peers[index].last_heard = now;
+        if handle_datagram(datagram, pad_ID, set, backend_state, text_buffer, &mut network.peers[index])
+        {
+            let changed = relay(&edits[..], set, network, index);
+            *dirty |= changed | (backend_state.as_ref().map(|state| (state.pool_start_ID, state.pool_end_ID)) != Some(pool));
+            self.touched.push(pad_ID);
+        }
+    }
+
+    fn service_pad (pad: &mut HostedPad, socket: &net::UdpSocket, sender: &mut DatagramSender, now: Instant)
+    {
+        pad.network.resend(&pad.set, now);
+        pad.network.flush(socket, sender);
+        pad.next_due = now + pad.network.time_until_next_send(now);
+    }
+
+    ///Sends what the pads that received something produced, and what is due on the others. Also takes care of the periodic work of all
+    ///pads: digests, saving, and forgetting clients that are gone and pads without clients.
+    fn service (&mut self, now: Instant)
+    {
+        let Worker { ref mut pads, ref socket, ref mut sender, ref mut touched, ref mut earliest_due, ref storage, ref saver, .. } = *self;
+
+        if let Some((_, ref results)) = *saver
+        {
+            while let Ok((pad_ID, result)) = results.try_recv()
+            {
+                if let Some(pad) = pads.get_mut(&pad_ID)
+                {
+                    pad.saving = false;
+                    if let Err(error) = result
+                    {
+                        error!("Failed to save pad {}: {}", pad_ID, error);
+                        pad.dirty = true;
+                    }
+                }
+            }
+        }
+
+        touched.sort();
+        touched.dedup();
+        for pad_ID in touched.drain(..)
+        {
+            if let Some(pad) = pads.get_mut(&pad_ID)
+            {
+                Worker::service_pad(pad, socket, sender, now);
+                *earliest_due = min(*earliest_due, pad.next_due);
+            }
+        }
+
+        if now >= *earliest_due
+        {
+            let mut next = now + Duration::from_millis(IDLE_WAKEUP_MS);
+            let mut unused = Vec::new();
+            for (&pad_ID, pad) in pads.iter_mut()
+            {
+                pad.network.remove_idle_peers(now, Duration::from_secs(PEER_TIMEOUT_SECONDS));
+
+                if now.duration_since(pad.last_digest) >= Duration::from_secs(ANTI_ENTROPY_INTERVAL_SECONDS)
+                {
+                    pad.last_digest = now;
+                    let HostedPad { ref set, ref mut network, ref mut next_due, .. } = *pad;
+                    for peer in network.peers.iter_mut().filter(|peer| peer.anti_entropy)
+                    {
+                        send_digest(set, peer);
+                        *next_due = now;
+                    }
+                }
+
+                if pad.next_due <= now
+                {
+                    Worker::service_pad(pad, socket, sender, now);
+                }
+                next = min(next, pad.next_due);
+
+                //the file is written by the storage thread, the worker only serializes the pad
+                if let (Some(ref directory), Some((ref requests, _))) = (storage.as_ref(), saver.as_ref())
+                {
+                    if pad.dirty & pad.storable & !pad.saving && (now.duration_since(pad.last_saved) >= Duration::from_secs(SAVE_INTERVAL_SECONDS))
+                    {
+                        pad.last_saved = now;
+                        if requests.send((pad_ID, pad_path(directory, pad_ID), pad_file(pad))).is_ok()
+                        {
+                            pad.dirty = false;
+                            pad.saving = true;
+                        }
+                        else
+                        {
+                            error!("Failed to save pad {}: the storage thread has stopped", pad_ID);
+                        }
+                    }
+                }
+
+                //a saved pad is loaded again when a client comes back, one that can't be saved is kept
+                if pad.network.peers.is_empty() & (storage.is_none() || (pad.storable & !pad.dirty & !pad.saving))
+                {
+                    unused.push(pad_ID);
+                }
+            }
+
+            for pad_ID in unused
+            {
+                pads.remove(&pad_ID);
+            }
+            *earliest_due = next;
+        }
+    }
+
+    fn run (mut self, incoming: mpsc::Receiver<Datagram>, spare: mpsc::Sender<Vec<u8>>)
+    {
+        loop
+        {
+            let now = Instant::now();
+            let timeout = max(if self.earliest_due > now { self.earliest_due - now } else { Duration::from_millis(0) }, Duration::from_millis(1));
+
+            match incoming.recv_timeout(timeout)
+            {
+                Ok(datagram) =>
+                {
+                    let now = Instant::now();
+                    self.handle_datagram(&datagram.data[..], datagram.address, now);
+                    let _ = spare.send(datagram.data);
+
+                    while let Ok(datagram) = incoming.try_recv() //everything that has queued up, before sending
+                    {
+                        self.handle_datagram(&datagram.data[..], datagram.address, now);
+                        let _ = spare.send(datagram.data);
+                    }
+                },
+                Err(mpsc::RecvTimeoutError::Timeout) => (),
+                Err(mpsc::RecvTimeoutError::Disconnected) => return
+            }
+
+            self.service(Instant::now());
+        }
+    }
+}
+
+///Serves any number of pads on one port. Only returns if the socket fails.
+pub fn host_pads (options: HostOptions) -> io::Result<()>
+{
+    let socket = net::UdpSocket::bind(("127.0.0.1", options.port))?;
+    metrics::start_exporter();
+    let number_of_workers = max(options.workers, 1);
+    let mtu = options.mtu;
+    if let Some(ref directory) = options.storage
+    {
+        fs::create_dir_all(directory)?;
+    }
+
+    let ring = ConsistentHash::new(number_of_workers);
+
+    let (spare_sender, spare_receiver) = mpsc::channel::<Vec<u8>>(); //buffers handed back by the workers for reuse
+    let mut workers = Vec::with_capacity(number_of_workers);
+    for number in 0..number_of_workers
+    {
+        let (datagram_sender, datagram_receiver) = mpsc::channel();
+        let (worker_socket, spare_sender, storage) = (socket.try_clone()?, spare_sender.clone(), options.storage.clone());
+        thread::Builder::new().name(format!("Pad worker {}", number)).spawn(move || //the worker is made in its thread, as the sender isn't Send
+        {
+            let worker = Worker::new(worker_socket, mtu, storage).expect("The socket of a pad worker has no address.");
+            worker.run(datagram_receiver, spare_sender);
+        })?;
+        workers.push(datagram_sender);
+    }
+
+    let mut receiver = DatagramReceiver::new(mmsg::RECEIVE_BATCH, mmsg::RECEIVE_BUFFER_LENGTH);
+    loop
+    {
+        match receiver.receive(&socket, true)
+        {
+            Ok(count) =>
+            {
+                for index in 0..count
+                {
+                    let (data, address) = receiver.datagram(index);
+                    let address = match address
+                    {
+                        Some(address) if data.len() >= 4 => address,
+                        _ => continue
+                    };
+
+                    let (pad_ID, _) = framing::split_pad(&data[4..]);
+                    let mut buffer = spare_receiver.try_recv().unwrap_or_else(|_| Vec::with_capacity(data.len()));
+                    buffer.clear();
+                    buffer.extend_from_slice(data);
+                    if workers[ring.worker_of(pad_ID)].send(Datagram { data: buffer, address: address }).is_err()
+                    {
+                        return Err(io::Error::new(io::ErrorKind::Other, "a pad worker has stopped"));
+                    }
+                }
+            },
+            Err(ref error) if (error.kind() == io::ErrorKind::WouldBlock) | (error.kind() == io::ErrorKind::TimedOut) | (error.kind() == io::ErrorKind::Interrupted) => (),
+            Err(error) => return Err(error)
+        }
+    }
+}
+
+
+#[test]
+fn test_consistent_hash ()
+{
+    let ring = ConsistentHash::new(8);
+    let mut counts = [0usize; 8];
+    for pad_ID in 0..=u16::max_value()
+    {
+        counts[ring.worker_of(pad_ID)] += 1;
+    }
+    for &count in counts.iter()
+    {
+        assert!((count > 65536/8 * 6/10) & (count < 65536/8 * 14/10), "{:?}", counts);
+    }
+
+    //with another worker, pads only move to the new one
+    let larger = ConsistentHash::new(9);
+    let mut moved = 0;
+    for pad_ID in 0..=u16::max_value()
+    {
+        let (before, after) = (ring.worker_of(pad_ID), larger.worker_of(pad_ID));
+        if before != after
+        {
+            assert_eq!(after, 8);
+            moved += 1;
+        }
+    }
+    assert!(moved < 65536/9 * 14/10);
+}
+
+#[test]
+fn test_hosted_pad ()
+{
+    use super::{Peer, init_request};
+
+    let client_socket = net::UdpSocket::bind("127.0.0.1:0").unwrap();
+    client_socket.set_read_timeout(Some(Duration::from_secs(5))).unwrap();
+    let mut worker = Worker::new(net::UdpSocket::bind("127.0.0.1:0").unwrap(), framing::DEFAULT_MTU, None).unwrap();
+
+    //a client joins pad 7
+    let mut client = Peer::new(worker.socket.local_addr().unwrap(), framing::DEFAULT_MTU);
+    client.batcher.pad_ID = 7;
+    client.send_cheap(&init_request(false)[..]);
+    client.resend(&TextInsertSet::new(), &mut ::encoded::EncodedRecords::new(), Instant::now());
+    let datagram = client.batcher.finish()[0].clone();
+
+    worker.handle_datagram(&datagram[..], client_socket.local_addr().unwrap(), Instant::now());
+    worker.handle_datagram(&datagram[..3], client_socket.local_addr().unwrap(), Instant::now());
+    let mut forged = datagram.clone();
+    forged[6] = 8; //another pad, without a matching checksum
+    worker.handle_datagram(&forged[..], "127.0.0.1:9".parse().unwrap(), Instant::now());
+    assert_eq!(worker.pads.len(), 1);
+    assert_eq!(worker.pads[&7].network.peers.len(), 1);
+    worker.service(Instant::now());
+
+    //it is granted the second ID range (after the acknowledgement of its request, which is sent before the features are known)
+    let mut buffer = [0u8; 2000];
+    let mut answer = String::new();
+    while !answer.contains("4:type,4:Init")
+    {
+        let (length, _) = client_socket.recv_from(&mut buffer).unwrap();
+        let (pad_ID, payload) = framing::split_pad(&buffer[4..length]);
+        assert_eq!(pad_ID, 7);
+        answer = String::from_utf8_lossy(payload).into_owned();
+    }
+    assert!(answer.contains("8:start_ID,4:1026#"), "{}", answer);
+
+    //without storage, a pad is forgotten once its clients are gone
+    worker.service(Instant::now() + Duration::from_secs(PEER_TIMEOUT_SECONDS + 1));
+    assert!(worker.pads.is_empty());
+}
+
+#[test]
+fn test_relay_and_storage ()
+{
+    use super::{Peer, TextInsert};
+    use encoded::EncodedRecords;
+
+    let now = Instant::now();
+    let (first, second) = (net::UdpSocket::bind("127.0.0.1:0").unwrap(), net::UdpSocket::bind("127.0.0.1:0").unwrap());
+    second.set_read_timeout(Some(Duration::from_secs(5))).unwrap();
+    let directory = ::std::env::temp_dir().join(format!("decapad-test-{}", ::std::process::id()));
+    fs::create_dir_all(&directory).unwrap();
+    let mut worker = Worker::new(net::UdpSocket::bind("127.0.0.1:0").unwrap(), framing::DEFAULT_MTU, Some(directory.clone())).unwrap();
+    let mut pad = HostedPad::new(7, worker.own_port, worker.mtu, now);
+    pad.network.add_peer(second.local_addr().unwrap());
+    worker.pads.insert(7, pad);
+
+    //the first client sends an insert
+    let mut set = TextInsertSet::new();
+    let content = set.arena.allocate("abc", 0);
+    set.push( TextInsert { ID: 1026, parent: 0, author: 1026, charPos: 0, content: content } );
+    let mut client = Peer::new(worker.socket.local_addr().unwrap(), framing::DEFAULT_MTU);
+    client.batcher.pad_ID = 7;
+    client.enqueue_full(1026);
+    client.resend(&set, &mut EncodedRecords::new(), now);
+    let datagram = client.batcher.finish()[0].clone();
+    worker.handle_datagram(&datagram[..], first.local_addr().unwrap(), now);
+    worker.handle_datagram(&datagram[..], first.local_addr().unwrap(), now); //a duplicate isn't relayed again
+    assert!(worker.pads[&7].dirty);
+    assert_eq!(worker.pads[&7].network.peers.len(), 2);
+    worker.service(now);
+
+    //and the second one receives it from the host
+    let mut buffer = [0u8; 2000];
+    let (length, _) = second.recv_from(&mut buffer).unwrap();
+    let (pad_ID, payload) = framing::split_pad(&buffer[4..length]);
+    assert_eq!(pad_ID, 7);
+    let records: Vec<&[u8]> = if framing::is_batch(payload) { framing::records(payload).collect() } else { vec![payload] }; //batching isn't negotiated yet
+    let relayed: Vec<u32> = records.into_iter().filter_map(|record| match wire::decode(record) { Some(wire::Record::Insert(header, _)) => Some(header.ID), _ => None }).collect();
+    assert_eq!(relayed, vec![1026]);
+
+    //a damaged file isn't overwritten, but kept next to the pad that starts empty
+    fs::write(pad_path(&directory, 8), b"DPAD\x02garbage").unwrap();
+    let mut payload = datagram[4..].to_vec();
+    payload[2] = 8;
+    let mut other_pad = Vec::new();
+    write_u32(crc32c(&payload[..]), &mut other_pad);
+    other_pad.extend_from_slice(&payload[..]);
+    worker.handle_datagram(&other_pad[..], first.local_addr().unwrap(), now);
+    assert_eq!(worker.pads[&8].set.inserts.len(), 1);
+    assert!(!pad_path(&directory, 8).exists());
+    let damaged: Vec<PathBuf> = fs::read_dir(&directory).unwrap().map(|entry| entry.unwrap().path()).filter(|path| path.to_string_lossy().contains("damaged")).collect();
+    assert_eq!(fs::read(&damaged[0]).unwrap(), b"DPAD\x02garbage");
+
+    //the pad survives a restart of the host
+    save_pad(&directory, 7, &worker.pads[&7]).unwrap();
+    let mut restored = HostedPad::new(7, worker.own_port, worker.mtu, now);
+    assert_eq!(load_pad(&directory, 7, &mut restored).unwrap(), 1);
+    assert_eq!(get_insert_by_ID(1026, &restored.set).map(|insert| insert.content.len()), Some(3));
+    assert_eq!(restored.pool(), worker.pads[&7].pool());
+
+    //the worker saves dirty pads through its storage thread
+    fs::remove_file(pad_path(&directory, 7)).unwrap();
+    worker.pads.get_mut(&7).unwrap().dirty = true;
+    let later = now + Duration::from_secs(SAVE_INTERVAL_SECONDS);
+    worker.service(later);
+    assert!(worker.pads[&7].saving & !worker.pads[&7].dirty);
+    while worker.pads[&7].saving
+    {
+        thread::sleep(Duration::from_millis(1));
+        worker.service(later);
+    }
+    assert!(pad_path(&directory, 7).exists());
+    fs::remove_dir_all(&directory).unwrap();
+}
@@ -0,0 +1,144 @@
+//A queue that can also be accessed by key: lookup, update and removal take constant time, while the entries can still be iterated and
+//rotated in the order they were queued in.
+//Removal only takes the entry out of the hash map. Its place in the order is left behind as a stale marker which is skipped (and dropped)
+//when it is encountered, and the whole order is cleaned up once the stale markers start to outnumber the live entries.
+
+use std::collections::HashMap;
+use std::collections::vec_deque::VecDeque;
+use std::hash::Hash;
+
+#[derive(Debug)]
+pub struct IndexedQueue<K: Copy + Hash + Eq, V>
+{
+    entries: HashMap<K, (V, u64)>, //the u64 is the sequence number of the entry's place in the order
+    order: VecDeque<(K, u64)>,
+    next_sequence: u64
+}
+
+impl<K: Copy + Hash + Eq, V> IndexedQueue<K, V>
+{
+    pub fn new () -> IndexedQueue<K, V>
+    {
+        IndexedQueue { entries: HashMap::new(), order: VecDeque::new(), next_sequence: 0 }
+    }
+
+    pub fn len (&self) -> usize
+    {
+        self.entries.len()
+    }
+
+    pub fn is_empty (&self) -> bool
+    {
+        self.entries.is_empty()
+    }
+
+    pub fn contains_key (&self, key: &K) -> bool
+    {
+        self.entries.contains_key(key)
+    }
+
+    pub fn get (&self, key: &K) -> Option<&V>
+    {
+        self.entries.get(key).map(|&(ref value, _)| value)
+    }
+
+    pub fn get_mut (&mut self, key: &K) -> Option<&mut V>
+    {
+        self.entries.get_mut(key).map(|&mut (ref mut value, _)| value)
+    }
+
+    ///Queues a new entry at the back. If there already is an entry with that key, its value is replaced and it keeps its place.
+    pub fn push_back (&mut self, key: K, value: V)
+    {
+        if let Some(entry) = self.entries.get_mut(&key)
+        {
+            entry.0 = value;
+            return;
+        }
+
+        let sequence = self.next_sequence;
+        self.next_sequence += 1;
+        self.entries.insert(key, (value, sequence));
+        self.order.push_back((key, sequence));
+    }
+
+    pub fn remove (&mut self, key: &K) -> Option<V>
+    {
+        let removed = self.entries.remove(key).map(|(value, _)| value);
+
+        if self.order.len() > 2*self.entries.len() + 16
+        {
+            let entries = &self.entries;
+            self.order.retain(|&(ref key, sequence)| is_current(entries, key, sequence));
+        }
+
+        return removed;
+    }
+
+    ///Moves the first entry to the back of the queue and returns it.
+    pub fn rotate (&mut self) -> Option<(K, &mut V)>
+    {
+        while let Some((key, sequence)) = self.order.pop_front()
+        {
+            if is_current(&self.entries, &key, sequence)
+            {
+                self.order.push_back((key, sequence));
+                return Some((key, &mut self.entries.get_mut(&key).unwrap().0));
+            }
+        }
+
+        return None;
+    }
+
+    ///Iterates over the entries in queue order.
+    pub fn iter<'a> (&'a self) -> Box<dyn Iterator<Item=(K, &'a V)> + 'a>
+    {
+        let entries = &self.entries;
+        Box::new(self.order.iter()
+                           .filter(move |&&(ref key, sequence)| is_current(entries, key, sequence))
+                           .map(move |&(key, _)| (key, &entries[&key].0)))
+    }
+}
+
+fn is_current<K: Hash + Eq, V> (entries: &HashMap<K, (V, u64)>, key: &K, sequence: u64) -> bool
+{
+    match entries.get(key)
+    {
+        Some(&(_, current_sequence)) => current_sequence == sequence,
+        None => false
+    }
+}
+
+
+#[test]
+fn test_indexed_queue ()
+{
+    let mut queue: IndexedQueue<u32, &str> = IndexedQueue::new();
+    queue.push_back(3, "three");
+    queue.push_back(1, "one");
+    queue.push_back(2, "two");
+    queue.push_back(1, "uno"); //updates in place
+
+    assert_eq!(queue.len(), 3);
+    assert_eq!(queue.get(&1), Some(&"uno"));
+    assert_eq!(queue.iter().map(|(key, _)| key).collect::<Vec<u32>>(), vec![3, 1, 2]);
+
+    assert_eq!(queue.rotate().map(|(key, _)| key), Some(3));
+    assert_eq!(queue.iter().map(|(key, _)| key).collect::<Vec<u32>>(), vec![1, 2, 3]);
+
+    assert_eq!(queue.remove(&1), Some("uno"));
+    assert_eq!(queue.remove(&1), None);
+    queue.push_back(1, "one again"); //goes to the back, the stale place in the order must not count
+    *queue.get_mut(&2).unwrap() = "dos";
+
+    assert_eq!(queue.rotate().map(|(key, _)| key), Some(2));
+    assert_eq!(queue.iter().map(|(key, value)| (key, *value)).collect::<Vec<(u32, &str)>>(), vec![(3, "three"), (1, "one again"), (2, "dos")]);
+
+    for key in 100..1000
+    {
+        queue.push_back(key, "filler");
+        queue.remove(&key);
+    }
+    assert!(queue.order.len() <= 2*queue.len() + 16);
+    assert_eq!(queue.iter().count(), 3);
+}
@@ -3,6 +3,9 @@
 //#![allow(unused_variables)]
 #![allow(unused_imports)]
 
+#[macro_use]
+mod log;
+
 mod sync;
 use sync::OneThreadTent;
 use sync::spsc_255::{self, Producer, Consumer};
@@ -10,24 +13,75 @@ use sync::spsc_255::{self, Producer, Consumer};
 mod tnetstring;
 
 mod crc;
-use crc::crc;
+use crc::Checksum;
 
 mod utf8;
 
-use std::{mem, net, str, char, thread, process};
+mod content_arena;
+use content_arena::{ContentArena, ContentSlot};
+
+mod indexed_queue;
+use indexed_queue::IndexedQueue;
+
+mod retransmit;
+use retransmit::{RttEstimator, TransmitState, TokenBucket};
+
+mod framing;
+use framing::Batcher;
+
+mod acks;
+use acks::{AckAggregator, AckFrame, PositionSet};
+
+mod wire;
+use wire::{read_u32, write_u32};
+
+mod mmsg;
+use mmsg::{DatagramSender, DatagramReceiver};
+
+mod snapshot;
+use snapshot::{SnapshotSender, SnapshotReceiver};
+
+mod position_table;
+use position_table::PositionTable;
+
+mod digest;
+use digest::Digest;
+
+mod encoded;
+use encoded::{EncodedRecords, RecordKey};
+
+mod host;
+pub use host::{host_pads, HostOptions};
+
+mod trace;
+use trace::TraceWriter;
+pub use trace::{Trace, ReplayReport};
+pub use trace::replay as replay_trace;
+pub use log::flush as flush_log;
+
+mod metrics;
+
+mod bench;
+pub use bench::{run_benchmarks, BenchResult};
+pub use bench::to_json as benchmarks_to_json;
+
+use std::{mem, net, str, char, thread, process, env, ptr, slice, io};
+use std::path::PathBuf;
 
 use std::os::raw::{c_int, c_long, c_ulong};
 use std::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
 
 use std::vec::Vec;
 use std::collections::vec_deque::VecDeque;
+use std::collections::{HashMap, BTreeMap, BTreeSet, BinaryHeap};
+use std::cmp::Reverse;
 use std::rc::Rc;
 use std::sync::{Arc, Condvar, Mutex};
 use std::cell::{Cell, RefCell, Ref, RefMut};
 
 use std::ops::Deref;
 use std::sync::mpsc;
-use std::time::Duration;
+use std::time::{Duration, Instant};
 use std::cmp::{min, max};
 
 extern crate libc;
@@ -36,37 +90,19 @@ fn deserialize_u16 (buffer: &[u8]) -> u16
 {
     if buffer.len() < 2
     {
-        panic!("deserialize_u32 needs a slice that is at least 2 bytes long, but it got only {}.", buffer.len());
+        panic!("read_u32 needs a slice that is at least 2 bytes long, but it got only {}.", buffer.len());
     }
 
     let result = ((buffer[0] as u16)<<8) + (buffer[1] as u16);
     return result;
 }
 
-fn deserialize_u32 (buffer: &[u8]) -> u32
-{
-    if buffer.len() < 4
-    {
-        panic!("deserialize_u32 needs a slice that is at least 4 bytes long, but it got only {}.", buffer.len());
-    }
-
-    let result = ((buffer[0] as u32)<<24) + ((buffer[1] as u32)<<16) + ((buffer[2] as u32)<<8) + (buffer[3] as u32);
-    return result;
-}
-
 fn serialize_u16 (number: u16, buffer: &mut Vec<u8>)
 {
     buffer.push((number>>8) as u8);
     buffer.push(number as u8);
 }
 
-fn serialize_u32 (number: u32, buffer: &mut Vec<u8>)
-{
-    buffer.push((number>>24) as u8);
-    buffer.push((number>>16) as u8);
-    buffer.push((number>>8) as u8);
-    buffer.push(number as u8);
-}
 
 
 enum KeyEvent
@@ -82,8 +118,8 @@ struct TextInsert
     ID: u32,
     parent: u32,
     author: u32,
-    charPos: u8,
-    content: Vec<char>
+    charPos: u16,
+    content: ContentSlot //characters are stored in the arena of the TextInsertSet
 }
 
 impl TextInsert
@@ -95,7 +131,7 @@ impl TextInsert
             Some(&TextInsert { parent, ..}) if parent == self.ID => true,
             Some(&TextInsert { parent, ..}) if parent == 0 => false,
             Some(&TextInsert { parent, ..}) => self.is_ancestor_of_ID(parent, &*set),
-            None => {println!("TextInsert.is_ancestor_of could not find the insert {}", other_ID); false}
+            None => {warn!("TextInsert.is_ancestor_of could not find the insert {}", other_ID); false}
         }
     }
 
@@ -117,81 +153,40 @@ impl TextInsert
             }
             else
             {
-                println!("TextInsert.is_ancestor_of could not find the ancestor of {}, which is {}.", other.ID, other.parent);
+                warn!("TextInsert.is_ancestor_of could not find the ancestor of {}, which is {}.", other.ID, other.parent);
                 false
             }
         }
     }
 
-    fn get_number_of_deleted_chars (&self) -> u8
+    fn get_number_of_deleted_chars (&self) -> u16
     {
-        let mut number = 0;
-        for character in self.content.iter()
-        {
-            if *character == 127 as char
-            {
-                number += 1;
-            }
-        }
-
-        return number;
+        self.content.deleted_count() as u16
     }
 
-    fn serialize (&self, buffer: &mut Vec<u8>)
+    fn header (&self) -> wire::InsertHeader
     {
-        let mut content_string = String::with_capacity(self.content.len()); //convert to UTF-8
-        for character in self.content.iter()
-        {
-            content_string.push(*character);
-        }
-
-        serialize_u32(self.ID, buffer);
-        serialize_u32(self.parent, buffer);
-        serialize_u32(self.author, buffer);
-        buffer.push(self.charPos);
-        buffer.extend_from_slice(content_string.as_bytes());
+        wire::InsertHeader { ID: self.ID, parent: self.parent, author: self.author, charPos: self.charPos }
     }
 
-    fn send(&self, network: &mut NetworkState)
+    fn serialize (&self, arena: &ContentArena, version: u32, buffer: &mut Vec<u8>)
     {
-        let mut buffer: Vec<u8> = Vec::with_capacity(20+self.content.len());
-        buffer.push('i' as u8);
-        serialize_u16(0, &mut buffer); //pad ID placeholder
-        self.serialize(&mut buffer);
-        network.send(&buffer[..]);
+        wire::encode_insert_header(version, &self.header(), buffer);
+        arena.serialize(&self.content, 0, buffer);
     }
 
-    fn deserialize (buffer: &[u8], set: &mut TextInsertSet, backend_state: &ProtocolBackendState) -> Option<(usize, bool)>
+    fn deserialize (header: &wire::InsertHeader, content: &[u8], set: &mut TextInsertSet, backend_state: &ProtocolBackendState) -> Option<(usize, bool)>
     {
-        if buffer.len() < 13
-        {
-            println!("TextInsert::deserialize says: given buffer is too short, cannot read header.");
-            return None;
-        }
-
         let mut new_insert_created = false;
         let mut insert_index = 0;
 
-        let ID = deserialize_u32(&buffer[0..4]);
-        let parent = deserialize_u32(&buffer[4..8]);
-        let author = deserialize_u32(&buffer[8..12]);
-
-        let charPos = buffer[12];
+        let wire::InsertHeader { ID, parent, author, charPos } = *header;
 
-        let mut raw_content: Vec<u8> = Vec::with_capacity(buffer.len()-13);
-        raw_content.extend_from_slice(&buffer[13..]);
-        match String::from_utf8(raw_content)
+        match str::from_utf8(content)
         {
-            Ok(content_string) => 
+            Ok(content) => 
             {
-                let mut content: Vec<char> = Vec::with_capacity(254);
-                for character in content_string.chars()
-                {
-                    content.push(character);
-                }
-                content.shrink_to_fit();
-
-                if content.len() > 255
+                if content.chars().count() > MAXIMUM_INSERT_LENGTH
                 {
                     return None;
                 }
@@ -201,24 +196,21 @@ impl TextInsert
                     Some(index) =>
                     {
                         insert_index = index;
-                        let mut old_insert = &mut set[index];
+                        let TextInsertSet { ref mut inserts, ref mut arena, .. } = *set;
+                        let old_insert = &mut inserts[index];
 
-                        if content.len() >= old_insert.content.len() //TODO: assume this is an update for now, actually we would need authenticity checking (and copying over 127s?)
-                        {
-                            //old_insert.ID = ID;
-                            //old_insert.parent = parent;
-                            //old_insert.author = author;
-                            //old_insert.charPos = charPos;
-                            old_insert.content = content;
-                        }
-                        else
+                        //TODO: assume this is an update for now, actually we would need authenticity checking
+                        let old_length = old_insert.content.len();
+                        for (position, (byte_offset, character)) in content.char_indices().enumerate()
                         {
-                            for (old_character, new_character) in old_insert.content.iter_mut().zip(content.iter())
+                            if position == old_length
                             {
-                                if *new_character == 127 as char
-                                {
-                                    *old_character = 127 as char
-                                }
+                                arena.append_str(&mut old_insert.content, &content[byte_offset..]);
+                                break;
+                            }
+                            else if character == 127 as char
+                            {
+                                old_insert.content.delete(position);
                             }
                         }
                     },
@@ -227,14 +219,15 @@ impl TextInsert
                     {
                         if (ID >= backend_state.start_ID) & (ID <= backend_state.end_ID)
                         {
-                            println!("Insert unserialization failed due to invalid insert ID: The insert would be newly created, but its ID lies within our ID range.");
+                            warn!("Insert unserialization failed due to invalid insert ID: The insert would be newly created, but its ID lies within our ID range.");
                             return None;
                         }
                         else
                         {
                             new_insert_created = true;
 
-                            insert_index = set.len();
+                            insert_index = set.inserts.len();
+                            let content = set.arena.allocate(content, 0);
                             set.push(
                                 TextInsert
                                 {
@@ -254,7 +247,7 @@ impl TextInsert
 
             Err(_) =>
             {
-                println!("TextInsert::deserialize got invalid UTF-8.");
+                warn!("TextInsert::deserialize got invalid UTF-8.");
                 return None;
             }
         }
@@ -263,430 +256,2109 @@ impl TextInsert
 }
 
 
-type TextInsertSet = Vec<TextInsert>;
+const COMPACTION_INTERVAL_SECONDS: u64 = 30;
+const MINIMUM_COMPACTABLE_BYTES: usize = 4096;
+const MAXIMUM_INSERT_LENGTH: usize = 65535; //characters, charPos and the positions on the wire are u16
+const LEGACY_INSERT_LENGTH: usize = wire::LEGACY_MAXIMUM_POSITION as usize; //while some peer doesn't understand wide positions
+
+#[derive(Debug)]
+struct TextInsertSet
+{
+    inserts: Vec<TextInsert>,
+    arena: ContentArena, //holds the content of all inserts
+    index: HashMap<u32, usize> //maps insert IDs to their index in inserts
+}
+
+impl TextInsertSet
+{
+    fn new () -> TextInsertSet
+    {
+        TextInsertSet { inserts: Vec::new(), arena: ContentArena::new(), index: HashMap::new() }
+    }
+
+    fn push (&mut self, insert: TextInsert)
+    {
+        self.index.insert(insert.ID, self.inserts.len());
+        self.inserts.push(insert);
+    }
+
+    fn push_str (&mut self, index: usize, text: &str)
+    {
+        let TextInsertSet { ref mut inserts, ref mut arena, .. } = *self;
+        arena.append_str(&mut inserts[index].content, text);
+    }
+
+    ///Bytes that a compaction could free: moved slots plus the content of deleted characters in settled inserts (see compact).
+    fn compactable_bytes<F> (&self, is_settled: &F) -> usize where F: Fn(&TextInsert) -> bool
+    {
+        let mut bytes = self.arena.garbage();
+        for insert in self.inserts.iter().filter(|insert| is_settled(insert))
+        {
+            bytes += self.arena.tombstone_bytes(&insert.content);
+        }
+        return bytes;
+    }
+
+    ///Rebuilds the arena without garbage. The bytes of deleted characters are only dropped for inserts whose deletions all known peers have
+    ///acknowledged (is_settled), fully deleted inserts keep just their length, so the IDs and charPos their children reference stay valid.
+    ///Only the active insert (the one being typed into) keeps spare capacity.
+    fn compact<F> (&mut self, is_settled: F, active_insert: Option<u32>) where F: Fn(&TextInsert) -> bool
+    {
+        let mut new_arena = ContentArena::with_capacity(self.arena.len() - self.compactable_bytes(&is_settled));
+        for insert in self.inserts.iter_mut()
+        {
+            let settled = is_settled(insert);
+            new_arena.adopt(&self.arena, &mut insert.content, settled, Some(insert.ID) == active_insert);
+        }
+        self.arena = new_arena;
+    }
+}
 
 
 #[derive(Debug)]
 struct TextBufferInternal
 {
     text: Vec<char>,
-    ID_table: Vec<u32>,
-    author_table: Vec<u32>,
-    charPos_table: Vec<u8>,
+    positions: PositionTable, //run-length encoded insert ID, author and charPos for every character in text
     cursor_ID: Option<u32>, //ID of the insert where the parent is
-    cursor_charPos: Option<u8>, //character position of the cursor inside the insert
+    cursor_charPos: Option<u16>, //character position of the cursor inside the insert
     cursor_globalPos: usize, //position of the cursor in the buffer
     active_insert: Option<u32>,
     needs_updating: bool
 }
 
+impl TextBufferInternal
+{
+    fn new () -> TextBufferInternal
+    {
+        TextBufferInternal { text: Vec::new(), positions: PositionTable::new(), cursor_ID: None, cursor_charPos: None, cursor_globalPos: 0, active_insert: None, needs_updating: false }
+    }
+}
+
 #[derive(Debug)]
 struct ProtocolBackendState
 {
     start_ID: u32,
     end_ID: u32,
-    author_ID: u32
+    author_ID: u32,
+    pool_start_ID: u32, //the IDs we can still grant to joining peers, empty if pool_start_ID > pool_end_ID
+    pool_end_ID: u32
 }
 
-#[derive(Clone, Copy, Debug)]
-enum SendType
+///The IDs granted to a joining peer in the init exchange: the range it creates its inserts with and the pool it grants to the peers that
+///join through it. Both are split off the granter's pool, so no two peers ever hand out the same IDs.
+#[derive(Clone, Copy, Debug, PartialEq)]
+struct IDGrant
 {
-    Full,
-    Append { position: u8 },
-    Delete { start_pos: u8, end_pos: u8 }
+    start_ID: u32,
+    end_ID: u32,
+    pool_start_ID: u32,
+    pool_end_ID: u32
+}
+
+impl ProtocolBackendState
+{
+    ///The state of a peer that got the IDs from start_ID to end_ID and nothing to grant to others.
+    fn new (start_ID: u32, end_ID: u32) -> ProtocolBackendState
+    {
+        ProtocolBackendState { start_ID: start_ID, end_ID: end_ID, author_ID: start_ID, pool_start_ID: 1, pool_end_ID: 0 }
+    }
+
+    ///The state of the peer that starts the pad: the first range and all other IDs as its pool.
+    fn founder () -> ProtocolBackendState
+    {
+        ProtocolBackendState { pool_start_ID: GRANTED_IDS + 1, pool_end_ID: FOUNDER_END_ID, ..ProtocolBackendState::new(1, GRANTED_IDS) }
+    }
+
+    fn granted (grant: &IDGrant) -> ProtocolBackendState
+    {
+        ProtocolBackendState { pool_start_ID: grant.pool_start_ID, pool_end_ID: grant.pool_end_ID, ..ProtocolBackendState::new(grant.start_ID, grant.end_ID) }
+    }
+
+    ///Splits the IDs for a joining peer off our pool: its range from the bottom, its own pool (at most half of the rest) from the top.
+    ///None once the pool is used up.
+    fn grant (&mut self) -> Option<IDGrant>
+    {
+        let unused = if self.pool_start_ID <= self.pool_end_ID { self.pool_end_ID - self.pool_start_ID + 1 } else { 0 };
+        if unused < GRANTED_IDS
+        {
+            return None;
+        }
+
+        let pool_size = min(GRANTED_POOL_IDS, (unused - GRANTED_IDS)/2);
+        let grant = IDGrant
+        {
+            start_ID: self.pool_start_ID,
+            end_ID: self.pool_start_ID + GRANTED_IDS - 1,
+            pool_start_ID: self.pool_end_ID - pool_size + 1,
+            pool_end_ID: self.pool_end_ID
+        };
+        self.pool_start_ID += GRANTED_IDS;
+        self.pool_end_ID -= pool_size;
+        return Some(grant);
+    }
 }
 
-#[derive(Clone, Copy, Debug)]
+///What still has to be sent (and acknowledged) for one insert.
+#[derive(Clone, Debug)]
 struct SendQueueEntry
 {
-    ID: u32,
-    kind: SendType
+    full: bool, //the whole insert, supersedes the other two
+    append_position: Option<u16>, //all characters starting at this position
+    deletions: PositionSet, //deleted characters whose deletion hasn't been acknowledged yet
+    transmit: TransmitState
 }
 
+impl SendQueueEntry
+{
+    fn is_done (&self) -> bool
+    {
+        !self.full & self.append_position.is_none() & self.deletions.is_empty()
+    }
+}
 
 #[derive(Debug)]
-struct NetworkState
+struct CheapMessage
 {
-    socket: net::UdpSocket,
-    other_address: net::SocketAddr,
-    send_queue: VecDeque<SendQueueEntry>,
-    cheap_queue: VecDeque<(u32, Vec<u8>)>,
-    cheap_counter: u32
+    data: Vec<u8>,
+    transmit: TransmitState
 }
 
-impl NetworkState
+///Identifies an entry in one of the two send queues for the retransmission timers.
+#[derive(Clone, Copy, Debug, PartialEq, Eq, PartialOrd, Ord)]
+enum QueueKey
 {
-    fn send(&self, data: &[u8])
-    {
-        let checkvalue = crc(data);
-        let mut checked_buffer = Vec::with_capacity(4+data.len());
-        serialize_u32(checkvalue, &mut checked_buffer);
-        checked_buffer.extend_from_slice(data);
+    Insert(u32),
+    Cheap(u32)
+}
+
+const PACING_RATE: f64 = 4000000.0; //bytes per second
+const PACING_BURST: f64 = 65536.0;
+const IDLE_WAKEUP_MS: u64 = 100;
+const INIT_RETRY_MS: u64 = 300;
+const MAXIMUM_RECEIVE_ROUNDS: usize = 16; //receive calls per loop iteration, so that input and retransmissions still get their turn
+const ANTI_ENTROPY_INTERVAL_SECONDS: u64 = 10;
+const PEER_TIMEOUT_SECONDS: u64 = 300; //a peer that hasn't been heard of for this long gets nothing sent and no longer holds compaction back
+const GRANTED_IDS: u32 = 1025; //size of the ID range a joining peer creates its inserts with
+const GRANTED_POOL_IDS: u32 = 1 << 20; //IDs a joining peer gets to grant to others at most
+const FOUNDER_END_ID: u32 = 0x7fffffff;
 
-        match self.socket.send_to(&checked_buffer[..], &self.other_address)
+
+///Everything we keep per other process editing the pad: what still has to be sent to it and acknowledged, and what it understands.
+#[derive(Debug)]
+struct Peer
+{
+    address: net::SocketAddr,
+    introduced: bool, //whether we have received its Init request or Init message, i.e. know its features
+    checksum_agreed: bool, //whether it has sent us a datagram with the checksum it announced since it was introduced
+    refused: bool, //whether we turned down its Init request, in which case nothing is queued for it
+    host: bool, //whether it hosts the pad, so we introduce ourselves regardless of the ports
+    founder: bool, //whether an Init request from it while neither side is initialized starts the pad (see NetworkState::add_peer)
+    init_request: Option<(Instant, u32)>, //when we last sent it an Init request and the message ID
+    ID_range: Option<IDGrant>, //the IDs we granted it in the init exchange
+    last_heard: Instant, //when we last received a datagram from it
+    send_queue: IndexedQueue<u32, SendQueueEntry>, //keyed by insert ID
+    cheap_queue: IndexedQueue<u32, CheapMessage>, //keyed by message ID
+    cheap_counter: u32,
+    batcher: Batcher, //collects the records sent during one iteration of the backend loop
+    cumulative_acks: bool, //whether the peer understands 'K' records
+    wire_version: u32, //format of the edit and 'K' records sent to the peer
+    pending_acks: AckAggregator,
+    snapshot_out: Option<SnapshotSender>, //the snapshot that is being sent to the peer
+    snapshot_in: Option<SnapshotReceiver>,
+    snapshot_counter: u32,
+    anti_entropy: bool, //whether the peer understands digest messages
+    digests_in: Vec<(Digest, u32, u32)>, //received digest messages with their bucket ranges, answered by answer_digests
+    rtt: RttEstimator,
+    pacing: TokenBucket,
+    unsent: VecDeque<QueueKey>, //entries whose current content has not been sent yet, in the order they changed
+    timers: BinaryHeap<Reverse<(Instant, QueueKey)>> //retransmission deadlines, possibly outdated (checked against TransmitState.due)
+}
+
+impl Peer
+{
+    fn new (address: net::SocketAddr, mtu: usize) -> Peer
+    {
+        Peer
         {
-            Err(error) => println!("Failed to send data: {:?}", error),
-            _ => ()
+            address: address,
+            introduced: false,
+            checksum_agreed: false,
+            refused: false,
+            host: false,
+            founder: false,
+            init_request: None,
+            ID_range: None,
+            last_heard: Instant::now(),
+            send_queue: IndexedQueue::new(),
+            cheap_queue: IndexedQueue::new(),
+            cheap_counter: 0,
+            batcher: Batcher::new(mtu),
+            cumulative_acks: false,
+            wire_version: wire::LEGACY_VERSION,
+            pending_acks: AckAggregator::new(),
+            snapshot_out: None,
+            snapshot_in: None,
+            snapshot_counter: 0,
+            anti_entropy: false,
+            digests_in: Vec::new(),
+            rtt: RttEstimator::new(),
+            pacing: TokenBucket::new(PACING_RATE, PACING_BURST, Instant::now()),
+            unsent: VecDeque::new(),
+            timers: BinaryHeap::new()
         }
     }
 
-    fn send_cheap (&mut self, data: &[u8])
+    ///Queues a record for sending with the next flush.
+    fn send(&mut self, data: &[u8])
     {
-        let message_id = self.cheap_counter;
-        self.cheap_counter += 1;
-
-        let mut augmented_message = Vec::with_capacity(data.len()+1);
-        augmented_message.push('m' as u8);
-        serialize_u32(message_id, &mut augmented_message);
-        augmented_message.extend_from_slice(data);
-        self.cheap_queue.push_back((message_id, augmented_message));
+        self.batcher.push(data);
     }
 
-    fn send_acka (&self, ID: u32, length: u8)
+    ///Queues a record that is serialized directly into the outgoing datagram.
+    fn write_record<F: FnOnce(&mut Vec<u8>)> (&mut self, write: F)
     {
-        let mut ack_buffer = Vec::new();
-        ack_buffer.push('A' as u8);
-        serialize_u16(0, &mut ack_buffer);
-        serialize_u32(ID, &mut ack_buffer);
-        ack_buffer.push(length);
-        self.send(&ack_buffer[..]);
+        self.batcher.write_record(write);
     }
 
-    fn get_queue_entry (&self, ID: u32) -> Option<usize>
+    ///Queues the pending acknowledgements and packs everything queued since the last flush into datagrams.
+    fn finish (&mut self) -> &[Vec<u8>]
     {
-        for (index, entry) in self.send_queue.iter().enumerate()
+        if !self.pending_acks.is_empty()
         {
-            if entry.ID == ID
-            {
-                return Some(index);
-            }
+            let max_length = self.batcher.mtu().saturating_sub(framing::BATCH_OVERHEAD);
+            self.pending_acks.write_frames(max_length, wire::has_wide_positions(self.wire_version), &mut self.batcher);
         }
-        return None;
-    }
 
-    fn enqueue_full (&mut self, ID: u32)
-    {
-        if let Some(index) = self.get_queue_entry(ID)
+        if let Some(ref mut receiver) = self.snapshot_in
         {
-            let entry = &mut self.send_queue[index];
-            match entry.kind
-            {
-                SendType::Full => (),
-                SendType::Append {..} | SendType::Delete {..} => entry.kind = SendType::Full
-            }
+            receiver.write_ack(&mut self.batcher);
         }
 
-        else
-        {
-            self.send_queue.push_back( SendQueueEntry { ID: ID, kind: SendType::Full });
-        }
+        self.batcher.finish()
     }
 
-    fn enqueue_append (&mut self, ID: u32, position: u8)
+    ///Sends all records queued since the last flush, packed into as few datagrams as possible.
+    fn flush (&mut self, socket: &net::UdpSocket, sender: &mut DatagramSender)
     {
-        if let Some(index) = self.get_queue_entry(ID)
+        self.finish();
+        let Peer { ref address, ref mut batcher, .. } = *self;
+        let datagrams = batcher.finish();
+        if datagrams.len() > 0
         {
-            let entry = self.send_queue[index];
-            match entry.kind
+            let sent = match sender.send_all(socket, address, datagrams)
+            {
+                Err(error) =>
+                {
+                    warn!("Failed to send data: {:?}", error);
+                    0
+                },
+                Ok(sent) if sent < datagrams.len() =>
+                {
+                    warn!("Failed to send {} of {} datagrams.", datagrams.len()-sent, datagrams.len());
+                    sent
+                },
+                Ok(sent) => sent
+            };
+
+            metrics::SEND_FAILURES.add((datagrams.len() - sent) as u64);
+            metrics::DATAGRAMS_SENT.add(sent as u64);
+            for datagram in datagrams[..sent].iter()
             {
-                SendType::Full => (),
-                SendType::Delete {..} => self.send_queue.push_back( SendQueueEntry { ID: ID, kind: SendType::Append { position: position } }),
-                SendType::Append {..} => ()
+                metrics::DATAGRAM_BYTES_SENT.add(datagram.len() as u64);
+                metrics::SENT_RECORDS.datagram(&datagram[..]);
             }
         }
+        batcher.clear();
+    }
 
-        else
-        {
-            self.send_queue.push_back( SendQueueEntry { ID: ID, kind: SendType::Append { position: position } });
-        }
+    fn send_cheap (&mut self, data: &[u8]) -> u32
+    {
+        let message_id = self.cheap_counter;
+        self.cheap_counter += 1;
+
+        let mut augmented_message = Vec::with_capacity(data.len()+1);
+        augmented_message.push('m' as u8);
+        write_u32(message_id, &mut augmented_message);
+        augmented_message.extend_from_slice(data);
+        self.cheap_queue.push_back(message_id, CheapMessage { data: augmented_message, transmit: TransmitState::new() });
+        self.unsent.push_back(QueueKey::Cheap(message_id));
+        return message_id;
     }
 
-    fn enqueue_delete (&mut self, ID: u32, start: u8, end: u8)
+    ///Acknowledges the current state of an insert, after receiving it or an append to it. The single 'I', 'A' and 'D' acks only go to
+    ///peers without cumulative acks, which predate wide positions, so their inserts are never longer than 255 characters.
+    fn ack_insert (&mut self, ID: u32, length: u16, deleted: u16, appended: bool)
     {
-        let mut append_new = false;
+        if self.cumulative_acks
+        {
+            self.pending_acks.insert_state(ID, length, deleted);
+            return;
+        }
 
-        if let Some(index) = self.get_queue_entry(ID)
+        self.write_record(|ack_buffer|
         {
-            let entry = &mut self.send_queue[index];
-            match entry.kind
+            ack_buffer.push(if appended { 'A' as u8 } else { 'I' as u8 });
+            serialize_u16(0, ack_buffer);
+            write_u32(ID, ack_buffer);
+            ack_buffer.push(length as u8);
+            if !appended
             {
-                SendType::Full => (),
-                SendType::Delete { ref mut start_pos, ref mut end_pos } =>
-                {
-                    *start_pos = min(*start_pos, start);
-                    *end_pos = max(*end_pos, end);
-                },
-                SendType::Append {..} => append_new = true
+                ack_buffer.push(deleted as u8);
             }
-        }
-        
-        else
+        });
+    }
+
+    fn ack_delete (&mut self, ID: u32, start: u16, end: u16)
+    {
+        if self.cumulative_acks
         {
-            append_new = true;
+            self.pending_acks.deletion(ID, start, end);
+            return;
         }
 
-        if append_new
+        self.write_record(|ack_buffer|
+        {
+            ack_buffer.push('D' as u8);
+            serialize_u16(0, ack_buffer);
+            write_u32(ID, ack_buffer);
+            ack_buffer.push(start as u8);
+            ack_buffer.push(end as u8);
+        });
+    }
+
+    fn ack_message (&mut self, message_id: u32)
+    {
+        if self.cumulative_acks
         {
-            self.send_queue.push_back( SendQueueEntry { ID: ID, kind: SendType::Delete { start_pos: start, end_pos: end }});
+            self.pending_acks.message(message_id);
+            return;
         }
+
+        self.write_record(|ack_buffer|
+        {
+            ack_buffer.push('M' as u8);
+            write_u32(message_id, ack_buffer);
+        });
     }
 
-    fn resend(&mut self, set: &TextInsertSet)
+    ///Applies the peer's acknowledgement of the state of an insert: it has all characters up to length and knows of that many deletions.
+    fn insert_acknowledged (&mut self, ID: u32, length: u16, deleted: Option<u16>, set: &TextInsertSet)
     {
-        if let Some(entry) = self.send_queue.pop_front()
+        if let Some(insert) = get_insert_by_ID(ID, set)
         {
-            if let Some(insert) = get_insert_by_ID(entry.ID, set)
+            if !self.send_queue.contains_key(&ID)
             {
-                self.send_queue.push_back(entry);
+                return;
+            }
 
-                match entry.kind
+            self.acknowledged(QueueKey::Insert(ID), Instant::now());
+            let entry = self.send_queue.get_mut(&ID).unwrap();
+            let complete = length as usize >= insert.content.len();
+
+            if entry.full
+            {
+                if let Some(deleted) = deleted
                 {
-                    SendType::Full => insert.send(self),
-                    SendType::Append { position } =>
+                    if (length > 0) & (deleted >= insert.get_number_of_deleted_chars())
                     {
-                        if position < insert.content.len() as u8
+                        entry.full = false;
+                        if !complete //the peer got the first records of a long insert, only the rest has to be sent again
                         {
-                            let mut buffer = Vec::new();
-                            buffer.push('a' as u8);
-                            serialize_u16(0, &mut buffer);
-                            serialize_u32(insert.ID, &mut buffer);
-                            buffer.push(position);
-
-                            let mut utf8_content = String::new();
-                            for character in &insert.content[position as usize..]
-                            {
-                                utf8_content.push(*character);
-                            }
-
-                            buffer.extend_from_slice(utf8_content.as_bytes());
-
-                            self.send(&buffer[..]);
+                            entry.append_position = Some(length);
                         }
-                    },
-                    SendType::Delete { start_pos, end_pos } =>
-                    {
-                        let mut buffer = Vec::new();
-                        buffer.push('d' as u8);
-                        serialize_u16(0, &mut buffer);
-                        serialize_u32(insert.ID, &mut buffer);
-                        buffer.push(start_pos);
-                        buffer.push(end_pos);
-
-                        self.send(&buffer[..]);
                     }
                 }
             }
-            else
+
+            if let Some(position) = entry.append_position
             {
-                println!("Warning: the insert send queue contained an unknown insert ID.");
+                if complete
+                {
+                    entry.append_position = None;
+                }
+                else if position < length
+                {
+                    entry.append_position = Some(length);
+                }
             }
         }
 
-        if let Some((msg_id, msg)) = self.cheap_queue.pop_front()
+        self.remove_if_done(ID);
+    }
+
+    ///Any acknowledged range clears the pending deletions it covers, even if they were sent in different records.
+    fn delete_acknowledged (&mut self, ID: u32, start: u16, end: u16)
+    {
+        self.acknowledged(QueueKey::Insert(ID), Instant::now());
+        if let Some(entry) = self.send_queue.get_mut(&ID)
         {
-            self.send(&msg[..]);
-            self.cheap_queue.push_back((msg_id, msg));
+            entry.deletions.remove_range(start, end);
         }
+        self.remove_if_done(ID);
     }
-}
-
-#[repr(C)]
-pub struct DynamicArray_ulong
-{
-    array: *mut c_ulong,
-    length: c_long,
-    allocated_length: c_long
-}
-
-#[repr(C)]
-pub struct DynamicArray_uint32
-{
-    array: *mut u32,
-    length: c_long,
-    allocated_length: c_long
-}
-
-#[repr(C)]
-pub struct TextBuffer
-{
-    cursor: c_int,
-    ahead_cursor: c_int,
-    x: c_int,
-    line_y: c_int,
-    y_padding: c_int,
-    line: c_int,
-    text: DynamicArray_uint32,
-    author_table: DynamicArray_uint32,
-}
-
-pub struct ThreadPointerWrapper
-{
-    text_buffer: *mut TextBuffer,
-}
-
-unsafe impl Send for ThreadPointerWrapper {}
 
-pub struct FFIData
-{
-    sender: Producer,
-    receiver: Consumer,
-    sync_ready: Arc<AtomicBool>,
-    buffer_locked: Arc<AtomicBool>,
-    buffer_synced: Arc<AtomicBool>
-}
-
-
-fn render_text(set: &TextInsertSet, text_buffer: &mut TextBufferInternal)
-{
-    let mut ID_stack: Vec<u32> = Vec::new();
+    fn message_acknowledged (&mut self, message_id: u32)
+    {
+        self.acknowledged(QueueKey::Cheap(message_id), Instant::now());
+        self.cheap_queue.remove(&message_id);
+    }
 
-    let mut temp_cursor_ID = false;
-    if text_buffer.cursor_ID.is_none()
+    ///Reads the optional protocol features announced by the peer in its Init request or Init message.
+    fn negotiate (&mut self, data: &tnetstring::Value)
     {
-        let cursor = text_buffer.cursor_globalPos;
-        if cursor > 0
+        if data.field("batching") == Some(tnetstring::Value::Bool(true))
         {
-            text_buffer.cursor_ID = Some(text_buffer.ID_table[cursor-1]);
-            text_buffer.cursor_charPos = Some(text_buffer.charPos_table[cursor-1] +1);
+            self.batcher.enabled = true;
         }
-        else
+
+        if data.field("cumulative_acks") == Some(tnetstring::Value::Bool(true))
         {
-            text_buffer.cursor_ID = Some(0);
-            text_buffer.cursor_charPos = Some(0);
+            self.cumulative_acks = true;
         }
-        temp_cursor_ID = true;
-    }
 
+        if let Some(name) = data.field("checksum").and_then(|name| name.as_str())
+        {
+            if let Some(checksum) = Checksum::from_name(name)
+            {
+                self.batcher.checksum = checksum;
+            }
+        }
 
-    text_buffer.text.clear();
-    text_buffer.ID_table.clear();
-    text_buffer.author_table.clear();
-    text_buffer.charPos_table.clear();
+        if data.field("anti_entropy") == Some(tnetstring::Value::Bool(true))
+        {
+            self.anti_entropy = true;
+        }
 
-    render_text_internal(&set, 0, 0, &mut *text_buffer, &mut ID_stack);
+        if let Some(version) = data.field("wire_version").and_then(|version| version.as_integer())
+        {
+            if version >= wire::LEGACY_VERSION as isize
+            {
+                self.wire_version = min(version as u32, wire::CURRENT_VERSION);
+            }
+        }
+    }
 
-    if text_buffer.cursor_ID.unwrap() == 0 //edge case
+    ///Returns the queue entry of an insert (creating it if necessary) and marks it for sending as soon as possible, as its content changed.
+    fn changed_queue_entry (&mut self, ID: u32) -> &mut SendQueueEntry
     {
-        text_buffer.cursor_globalPos = 0;
+        let unsent = match self.send_queue.get_mut(&ID)
+        {
+            Some(entry) =>
+            {
+                let unsent = entry.transmit.is_unsent();
+                entry.transmit.reset();
+                unsent
+            },
+            None => false
+        };
+        if !self.send_queue.contains_key(&ID)
+        {
+            self.send_queue.push_back(ID, SendQueueEntry { full: false, append_position: None, deletions: PositionSet::new(), transmit: TransmitState::new() });
+        }
+
+        if !unsent //otherwise it's already waiting in the unsent queue
+        {
+            self.unsent.push_back(QueueKey::Insert(ID));
+        }
+
+        self.send_queue.get_mut(&ID).unwrap()
     }
 
-    if temp_cursor_ID
+    ///Removes the queue entry of an insert if nothing is left to send for it.
+    fn remove_if_done (&mut self, ID: u32)
     {
-        text_buffer.cursor_ID = None;
-        text_buffer.cursor_charPos = None;
+        let done = match self.send_queue.get(&ID)
+        {
+            Some(entry) => entry.is_done(),
+            None => false
+        };
+
+        if done
+        {
+            self.send_queue.remove(&ID);
+        }
     }
 
-}
+    ///Feeds the round trip time of an acknowledged message into the estimator.
+    fn acknowledged (&mut self, key: QueueKey, now: Instant)
+    {
+        let transmit = match key
+        {
+            QueueKey::Insert(ID) => self.send_queue.get(&ID).map(|entry| entry.transmit),
+            QueueKey::Cheap(message_id) => self.cheap_queue.get(&message_id).map(|message| message.transmit)
+        };
 
-fn render_text_internal(set: &TextInsertSet, parentID: u32, charPos: u8, text_buffer: &mut TextBufferInternal, ID_stack: &mut Vec<u32>)
-{
-    let mut inserts: Vec<&TextInsert> = Vec::new();
-    for i in 0..set.len()
+        if let Some(rtt) = transmit.and_then(|transmit| transmit.rtt_sample(now))
+        {
+            self.rtt.sample(rtt);
+        }
+    }
+
+    fn enqueue_full (&mut self, ID: u32)
+    {
+        let entry = self.changed_queue_entry(ID);
+        entry.full = true;
+        entry.append_position = None;
+        entry.deletions = PositionSet::new();
+    }
+
+    fn enqueue_append (&mut self, ID: u32, position: u16)
+    {
+        let entry = self.changed_queue_entry(ID);
+        if !entry.full & entry.append_position.is_none()
+        {
+            entry.append_position = Some(position);
+        }
+    }
+
+    fn enqueue_delete (&mut self, ID: u32, start: u16, end: u16)
+    {
+        let entry = self.changed_queue_entry(ID);
+        if !entry.full
+        {
+            entry.deletions.insert_range(start, end);
+        }
+    }
+
+    fn is_idle (&self, now: Instant) -> bool
     {
-        let insert = &set[i];
-        if (insert.parent == parentID) & (insert.charPos == charPos)
+        now.duration_since(self.last_heard) >= Duration::from_secs(PEER_TIMEOUT_SECONDS)
+    }
+
+    ///Turns the peer away because its wire version can't carry the inserts of the pad: it gets an Init refused message and no more
+    ///inserts.
+    fn refuse (&mut self)
+    {
+        if !self.refused
+        {
+            warn!("Refused {}, its wire version {} can't carry the inserts of the pad.", self.address, self.wire_version);
+        }
+        self.refused = true;
+        self.send_queue = IndexedQueue::new(); //the stale unsent keys and timers find no entries anymore
+        self.send_cheap(&init_refusal("wire_version")[..]);
+    }
+
+    ///Characters per insert or append record, so that even a record of four byte characters fits into a datagram.
+    fn record_characters (&self) -> usize
+    {
+        max(1, self.batcher.mtu().saturating_sub(framing::BATCH_OVERHEAD + wire::MAXIMUM_HEADER_LENGTH) / 4)
+    }
+
+    ///Whether the peer's wire version can carry the positions of the insert.
+    fn can_receive (&self, insert: &TextInsert) -> bool
+    {
+        wire::has_wide_positions(self.wire_version) || fits_legacy_positions(insert)
+    }
+
+    ///Sends whatever is pending for an insert and returns the number of bytes sent. Content that doesn't fit into one record follows in
+    ///append records.
+    fn send_entry (&mut self, ID: u32, entry: &SendQueueEntry, set: &TextInsertSet, encoded: &mut EncodedRecords) -> usize
+    {
+        let mut bytes = 0;
+        let version = self.wire_version;
+        let record_characters = self.record_characters();
+
+        if let Some(insert) = get_insert_by_ID(ID, set)
         {
-            if ID_stack.contains(&insert.ID)
+            let length = insert.content.len();
+            let mut append_position = entry.append_position.map(|position| position as usize);
+
+            if entry.full
             {
-                println!("render_text has detected a cyclic dependency between inserts. This should never happen, as it does not conform to the protocol specification.");
+                let end = min(length, record_characters);
+                bytes += encoded.write(RecordKey::Insert(ID, end as u16, version), &mut self.batcher, |buffer|
+                {
+                    wire::encode_insert_header(version, &insert.header(), buffer);
+                    set.arena.serialize_range(&insert.content, 0, end, buffer);
+                });
+                append_position = Some(end);
             }
-            else
+
+            if let Some(mut position) = append_position
+            {
+                while position < length
+                {
+                    let end = min(length, position + record_characters);
+                    bytes += encoded.write(RecordKey::Append(ID, position as u16, end as u16, version), &mut self.batcher, |buffer|
+                    {
+                        wire::encode_append_header(version, insert.ID, position as u16, buffer);
+                        set.arena.serialize_range(&insert.content, position, end, buffer);
+                    });
+                    position = end;
+                }
+            }
+
+            for (start_pos, end_pos) in entry.deletions.ranges()
             {
-                inserts.push(insert);
+                bytes += encoded.write(RecordKey::Delete(ID, start_pos, end_pos, version), &mut self.batcher, |buffer|
+                {
+                    wire::encode_delete(version, insert.ID, start_pos, end_pos, buffer);
+                });
             }
         }
+        else
+        {
+            warn!("The insert send queue contained an unknown insert ID.");
+        }
+
+        return bytes;
     }
-    inserts.sort_by(|a, b| a.ID.cmp(&b.ID));
 
-    for insert in inserts
+    ///Sends a queued message if it is still in its queue and, for retransmissions, actually due. Returns false if there was nothing to send.
+    fn transmit (&mut self, key: QueueKey, due: Option<Instant>, set: &TextInsertSet, encoded: &mut EncodedRecords, now: Instant) -> bool
     {
-        ID_stack.push(insert.ID);
+        let rto = self.rtt.rto();
 
-        for (position, character) in insert.content.iter().enumerate()
+        let (bytes, next_due) = match key
         {
-            if (Some(insert.ID) == text_buffer.cursor_ID) & (Some(position as u8) == text_buffer.cursor_charPos) //NOTE: maybe keep information on where the cursor is attached. would only be necessary for deleting to the right, normal backspace and insertion should be attached to the left.
+            QueueKey::Insert(ID) =>
             {
-                text_buffer.cursor_globalPos = text_buffer.text.len();
+                let entry = match self.send_queue.get(&ID)
+                {
+                    Some(entry) if entry.transmit.due == due => entry.clone(),
+                    _ => return false
+                };
+
+                //a peer that is gone for good would hold the entry forever, anti-entropy repairs what it missed if it comes back
+                if self.is_idle(now)
+                {
+                    self.send_queue.remove(&ID);
+                    return false;
+                }
+
+                //a host relays the inserts of wide clients to legacy clients that joined before the pad held wide inserts, they are
+                //turned away now rather than left to miss the insert; before the peer is introduced, its version isn't known yet
+                let receivable = get_insert_by_ID(ID, set).map_or(true, |insert| self.can_receive(insert));
+                if !receivable & self.introduced
+                {
+                    self.refuse();
+                    return false;
+                }
+
+                let bytes = if receivable { self.send_entry(ID, &entry, set, encoded) } else { 0 };
+                (bytes, self.send_queue.get_mut(&ID).unwrap().transmit.sent(now, rto))
+            },
+
+            QueueKey::Cheap(message_id) =>
+            {
+                match self.cheap_queue.get_mut(&message_id)
+                {
+                    Some(message) =>
+                    {
+                        if message.transmit.due != due
+                        {
+                            return false;
+                        }
+                        self.batcher.push(&message.data[..]);
+                        (message.data.len() + 4, message.transmit.sent(now, rto))
+                    },
+                    None => return false
+                }
+            }
+        };
+
+        if due.is_some()
+        {
+            metrics::RETRANSMISSIONS.increment();
+        }
+        self.pacing.consume(bytes);
+        self.timers.push(Reverse((next_due, key)));
+        return true;
+    }
+
+    ///Sends new and changed entries right away and retransmits entries that haven't been acknowledged in time, as far as the pacing allows.
+    fn resend(&mut self, set: &TextInsertSet, encoded: &mut EncodedRecords, now: Instant)
+    {
+        self.pacing.refill(now);
+
+        while self.pacing.can_send()
+        {
+            match self.unsent.pop_front()
+            {
+                Some(key) => { self.transmit(key, None, set, encoded, now); },
+                None => break
             }
+        }
 
-            render_text_internal(set, insert.ID, position as u8, &mut *text_buffer, ID_stack);
-            if *character != 127 as char
+        while self.pacing.can_send()
+        {
+            match self.timers.peek()
             {
-                text_buffer.text.push(*character);
-                text_buffer.ID_table.push(insert.ID);
-                text_buffer.author_table.push(insert.author);
-                text_buffer.charPos_table.push(position as u8);
+                Some(&Reverse((due, _))) if due <= now => (),
+                _ => break
             }
+
+            let Reverse((due, key)) = self.timers.pop().unwrap();
+            self.transmit(key, Some(due), set, encoded, now);
+        }
+
+        let rto = self.rtt.rto();
+        let Peer { ref mut snapshot_out, ref mut batcher, ref mut pacing, .. } = *self;
+        let done = match *snapshot_out
+        {
+            Some(ref mut sender) =>
+            {
+                sender.send(batcher, pacing, now, rto);
+                sender.is_done()
+            },
+            None => false
+        };
+        if done
+        {
+            *snapshot_out = None;
         }
+    }
 
-        if (Some(insert.ID) == text_buffer.cursor_ID) & (Some(insert.content.len() as u8) == text_buffer.cursor_charPos)
+    ///Starts sending the whole insert set to the peer.
+    fn start_snapshot (&mut self, set: &TextInsertSet)
+    {
+        let chunk_size = self.batcher.mtu().saturating_sub(framing::BATCH_OVERHEAD + snapshot::CHUNK_HEADER_LENGTH);
+        self.snapshot_counter += 1;
+        let stream = snapshot_stream(set);
+        if stream.len() > snapshot::MAXIMUM_LENGTH
         {
-            text_buffer.cursor_globalPos = text_buffer.text.len();
+            warn!("The snapshot for {} has {} bytes, more than peers accept.", self.address, stream.len());
         }
+        self.snapshot_out = Some(SnapshotSender::new(self.snapshot_counter, stream, chunk_size));
+    }
 
-        render_text_internal(set, insert.ID, insert.content.len() as u8, &mut *text_buffer, ID_stack);
+    ///How long the backend loop may wait for incoming data before something has to be sent.
+    fn time_until_next_send (&self, now: Instant) -> Duration
+    {
+        let mut wait = Duration::from_millis(IDLE_WAKEUP_MS);
 
-        ID_stack.pop();
+        if !self.unsent.is_empty()
+        {
+            wait = min(wait, self.pacing.time_until_available());
+        }
+
+        if let Some(&Reverse((due, _))) = self.timers.peek()
+        {
+            let until_due = if due > now { due.duration_since(now) } else { Duration::from_secs(0) };
+            wait = min(wait, max(until_due, self.pacing.time_until_available()));
+        }
+
+        if let Some(until_due) = self.snapshot_out.as_ref().and_then(|sender| sender.time_until_next_send(now, self.rtt.rto()))
+        {
+            wait = min(wait, max(until_due, self.pacing.time_until_available()));
+        }
+
+        return wait;
     }
+}
 
+///All peers of a pad. Local edits are queued for every peer, records received from a peer are answered to that peer. The socket is
+///passed in for sending, as a host shares one socket between many pads.
+#[derive(Debug)]
+struct NetworkState
+{
+    pad_ID: u16,
+    own_port: u16,
+    peers: Vec<Peer>,
+    encoded: EncodedRecords, //edit records shared between the peers during one resend pass
+    mtu: usize,
+    trace: Option<TraceWriter>,
+    queue_depths: metrics::QueueDepths
 }
 
-unsafe fn expandDynamicArray_uint32 (array: &mut DynamicArray_uint32, new_length: usize) -> i8
+impl NetworkState
 {
-    if new_length > array.allocated_length as usize
+    fn new (pad_ID: u16, own_port: u16, mtu: usize) -> NetworkState
     {
-        let new_pointer: *mut u32 = libc::realloc(array.array as *mut libc::c_void, new_length*std::mem::size_of::<u32>()) as *mut u32;
-        if new_pointer.is_null()
+        NetworkState { pad_ID: pad_ID, own_port: own_port, peers: Vec::new(), encoded: EncodedRecords::new(), mtu: mtu, trace: None,
+                       queue_depths: metrics::QueueDepths::default() }
+    }
+
+    ///Peers with a lower port than ours send us Init requests. When nobody is initialized yet, only the peer with the second lowest port
+    ///starts the pad, on the request of the one with the lowest port, so two peers never take the same ID range.
+    fn add_peer (&mut self, address: net::SocketAddr)
+    {
+        if self.peer_index(&address).is_none()
         {
-            return -1;
+            let mut peer = Peer::new(address, self.mtu);
+            peer.batcher.pad_ID = self.pad_ID;
+            self.peers.push(peer);
+            self.encoded.shared = self.peers.len() > 1;
         }
-        else
+
+        let own_port = self.own_port;
+        let lower_ports: Vec<u16> = self.peers.iter().map(|peer| peer.address.port()).filter(|&port| port < own_port).collect();
+        for peer in self.peers.iter_mut()
         {
-            array.array = new_pointer;
-            array.allocated_length = new_length as c_long;
-            return 0;
+            peer.founder = (lower_ports.len() == 1) && (lower_ports[0] == peer.address.port());
         }
     }
-    return 0;
+
+    fn peer_index (&self, address: &net::SocketAddr) -> Option<usize>
+    {
+        self.peers.iter().position(|peer| peer.address == *address)
+    }
+
+    ///Forgets the peers that haven't been heard of for the given time, together with everything still queued for them.
+    fn remove_idle_peers (&mut self, now: Instant, timeout: Duration)
+    {
+        self.peers.retain(|peer| now.duration_since(peer.last_heard) < timeout);
+        self.encoded.shared = self.peers.len() > 1;
+    }
+
+    fn enqueue_full (&mut self, ID: u32)
+    {
+        for peer in self.peers.iter_mut().filter(|peer| !peer.refused)
+        {
+            peer.enqueue_full(ID);
+        }
+    }
+
+    fn enqueue_append (&mut self, ID: u32, position: u16)
+    {
+        for peer in self.peers.iter_mut().filter(|peer| !peer.refused)
+        {
+            peer.enqueue_append(ID, position);
+        }
+    }
+
+    fn enqueue_delete (&mut self, ID: u32, start: u16, end: u16)
+    {
+        for peer in self.peers.iter_mut().filter(|peer| !peer.refused)
+        {
+            peer.enqueue_delete(ID, start, end);
+        }
+    }
+
+    ///How long our inserts may grow: beyond 255 characters only once every peer we send to understands wide positions.
+    fn maximum_insert_length (&self) -> usize
+    {
+        if self.peers.iter().all(|peer| peer.refused || wire::has_wide_positions(peer.wire_version)) { MAXIMUM_INSERT_LENGTH } else { LEGACY_INSERT_LENGTH }
+    }
+
+    ///Whether no peer is waiting for anything of the insert anymore, not counting the ones that have been idle for too long.
+    fn is_settled (&self, ID: u32, now: Instant) -> bool
+    {
+        self.peers.iter().all(|peer| peer.is_idle(now) || !peer.send_queue.contains_key(&ID))
+    }
+
+    fn resend (&mut self, set: &TextInsertSet, now: Instant)
+    {
+        let NetworkState { ref mut peers, ref mut encoded, .. } = *self;
+        answer_digests(set, &mut peers[..]);
+        encoded.clear();
+        for peer in peers.iter_mut()
+        {
+            peer.resend(set, encoded, now);
+        }
+    }
+
+    fn flush (&mut self, socket: &net::UdpSocket, sender: &mut DatagramSender)
+    {
+        self.trace_sent();
+        for peer in self.peers.iter_mut()
+        {
+            peer.flush(socket, sender);
+        }
+
+        let send_queue = self.peers.iter().map(|peer| peer.send_queue.len()).sum();
+        let cheap_queue = self.peers.iter().map(|peer| peer.cheap_queue.len()).sum();
+        self.queue_depths.update(send_queue, cheap_queue);
+    }
+
+    ///Stops recording after a write error rather than failing over and over.
+    fn check_trace (&mut self, result: io::Result<()>)
+    {
+        if let Err(error) = result
+        {
+            error!("Failed to write the trace, stopped recording: {}", error);
+            self.trace = None;
+        }
+    }
+
+    ///Records the datagrams about to be sent and the end of the iteration (finishing the batches early, Peer::flush won't add anything to them).
+    fn trace_sent (&mut self)
+    {
+        let result = match *self
+        {
+            NetworkState { ref mut peers, trace: Some(ref mut trace), .. } =>
+            {
+                let mut result = Ok(());
+                for (index, peer) in peers.iter_mut().enumerate()
+                {
+                    for datagram in peer.finish().iter()
+                    {
+                        result = result.and_then(|_| trace.sent(index, &datagram[..]));
+                    }
+                }
+                result.and_then(|_| trace.iteration_end()).and_then(|_| trace.flush_if_due())
+            },
+            _ => return
+        };
+        self.check_trace(result);
+    }
+
+    fn trace_input (&mut self, bytes: &[u8])
+    {
+        if let Some(result) = self.trace.as_mut().map(|trace| trace.input(bytes))
+        {
+            self.check_trace(result);
+        }
+    }
+
+    fn trace_received (&mut self, peer: usize, datagram: &[u8])
+    {
+        if let Some(result) = self.trace.as_mut().map(|trace| trace.received(peer, datagram))
+        {
+            self.check_trace(result);
+        }
+    }
+
+    fn trace_rendered (&mut self)
+    {
+        if let Some(result) = self.trace.as_mut().map(|trace| trace.rendered())
+        {
+            self.check_trace(result);
+        }
+    }
+
+    fn time_until_next_send (&self, now: Instant) -> Duration
+    {
+        self.peers.iter().map(|peer| peer.time_until_next_send(now)).min().unwrap_or(Duration::from_millis(IDLE_WAKEUP_MS))
+    }
+}
+
+#[repr(C)]
+pub struct DynamicArray_ulong
+{
+    array: *mut c_ulong,
+    length: c_long,
+    allocated_length: c_long
+}
+
+#[repr(C)]
+pub struct DynamicArray_uint32
+{
+    array: *mut u32,
+    length: c_long,
+    allocated_length: c_long
+}
+
+#[repr(C)]
+pub struct TextBuffer
+{
+    cursor: c_int,
+    ahead_cursor: c_int,
+    x: c_int,
+    line_y: c_int,
+    y_padding: c_int,
+    line: c_int,
+    text: DynamicArray_uint32,
+    author_table: DynamicArray_uint32,
+}
+
+impl TextBuffer
+{
+    ///An empty buffer, for frontends that aren't written in C.
+    pub fn new () -> TextBuffer
+    {
+        let empty = || DynamicArray_uint32 { array: ptr::null_mut(), length: 0, allocated_length: 0 };
+        TextBuffer { cursor: 0, ahead_cursor: 0, x: 0, line_y: 0, y_padding: 0, line: 0, text: empty(), author_table: empty() }
+    }
+
+    ///The text as of the last synchronization. Must not be called while the backend may be writing, i.e. during a sync.
+    pub fn text (&self) -> Vec<char>
+    {
+        if self.text.array.is_null()
+        {
+            return Vec::new();
+        }
+        unsafe { slice::from_raw_parts(self.text.array, self.text.length as usize) }.iter().filter_map(|&character| char::from_u32(character)).collect()
+    }
+
+    pub fn cursor (&self) -> usize
+    {
+        self.cursor as usize
+    }
+
+    ///Releases the arrays of a buffer created by new once no backend writes to it anymore.
+    pub fn free (&mut self)
+    {
+        unsafe
+        {
+            libc::free(self.text.array as *mut libc::c_void);
+            libc::free(self.author_table.array as *mut libc::c_void);
+        }
+        *self = TextBuffer::new();
+    }
+}
+
+///How a backend is set up. start_backend takes it from the environment, other frontends can fill it in themselves.
+#[derive(Debug, Clone)]
+pub struct BackendOptions
+{
+    pub own_port: u16,
+    pub peer_ports: Vec<u16>, //the first one is the host if the pad isn't 0
+    pub pad_ID: u16,
+    pub mtu: usize,
+    pub trace: Option<PathBuf> //where to record the session, see trace.rs
+}
+
+impl BackendOptions
+{
+    pub fn from_environment (own_port: u16, other_port: u16) -> BackendOptions
+    {
+        let mut peer_ports = vec![other_port];
+        peer_ports.extend(env::var("DECAPAD_PEERS").unwrap_or(String::new()).split(',').filter_map(|port| port.trim().parse::<u16>().ok())); //further peers
+
+        BackendOptions
+        {
+            own_port: own_port,
+            peer_ports: peer_ports,
+            pad_ID: env::var("DECAPAD_PAD").ok().and_then(|value| value.parse().ok()).unwrap_or(0), //pads other than 0 are served by a host
+            mtu: env::var("DECAPAD_MTU").ok().and_then(|value| value.parse().ok()).unwrap_or(framing::DEFAULT_MTU),
+            trace: env::var_os("DECAPAD_TRACE").map(PathBuf::from)
+        }
+    }
+}
+
+pub struct ThreadPointerWrapper
+{
+    text_buffer: *mut TextBuffer,
+}
+
+unsafe impl Send for ThreadPointerWrapper {}
+
+pub struct FFIData
+{
+    sender: Producer,
+    receiver: Consumer,
+    sync_ready: Arc<AtomicBool>,
+    buffer_locked: Arc<AtomicBool>,
+    buffer_synced: Arc<AtomicBool>
+}
+
+
+#[derive(Debug, Clone, Copy)]
+struct ChildEntry
+{
+    parent: u32,
+    charPos: u16,
+    ID: u32,
+    index: usize
+}
+
+///All inserts of a set sorted by (parent, charPos, ID), so the children of an insert can be found without scanning the whole set.
+struct ChildIndex
+{
+    entries: Vec<ChildEntry>
+}
+
+impl ChildIndex
+{
+    fn new (set: &TextInsertSet) -> ChildIndex
+    {
+        let mut entries = Vec::with_capacity(set.inserts.len());
+        for (index, insert) in set.inserts.iter().enumerate()
+        {
+            entries.push( ChildEntry { parent: insert.parent, charPos: insert.charPos, ID: insert.ID, index: index } );
+        }
+        entries.sort_by(|a, b| (a.parent, a.charPos, a.ID).cmp(&(b.parent, b.charPos, b.ID)));
+
+        ChildIndex { entries: entries }
+    }
+
+    ///All children of an insert, sorted by charPos and then by ID.
+    fn children_of (&self, parent: u32) -> &[ChildEntry]
+    {
+        let start = self.entries.partition_point(|entry| entry.parent < parent);
+        let end = self.entries.partition_point(|entry| entry.parent <= parent);
+        &self.entries[start..end]
+    }
+}
+
+fn render_text(set: &TextInsertSet, text_buffer: &mut TextBufferInternal)
+{
+    let mut ID_stack: Vec<u32> = Vec::new();
+
+    let mut temp_cursor_ID = false;
+    if text_buffer.cursor_ID.is_none()
+    {
+        let cursor = text_buffer.cursor_globalPos;
+        if cursor > 0
+        {
+            let (ID, charPos) = text_buffer.positions.lookup(cursor-1).expect("render_text says: cursor position is out of bounds.");
+            text_buffer.cursor_ID = Some(ID);
+            text_buffer.cursor_charPos = Some(charPos +1);
+        }
+        else
+        {
+            text_buffer.cursor_ID = Some(0);
+            text_buffer.cursor_charPos = Some(0);
+        }
+        temp_cursor_ID = true;
+    }
+
+
+    text_buffer.text.clear();
+    text_buffer.positions.clear();
+
+    let child_index = ChildIndex::new(set);
+    let root_inserts = child_index.children_of(0);
+    let root_inserts_end = root_inserts.iter().take_while(|entry| entry.charPos == 0).count();
+    render_text_internal(&set, &child_index, &root_inserts[..root_inserts_end], &mut *text_buffer, &mut ID_stack);
+
+    if text_buffer.cursor_ID.unwrap() == 0 //edge case
+    {
+        text_buffer.cursor_globalPos = 0;
+    }
+
+    if temp_cursor_ID
+    {
+        text_buffer.cursor_ID = None;
+        text_buffer.cursor_charPos = None;
+    }
+
+}
+
+///Renders a group of inserts that share the same parent and charPos (siblings is sorted by ID).
+fn render_text_internal(set: &TextInsertSet, child_index: &ChildIndex, siblings: &[ChildEntry], text_buffer: &mut TextBufferInternal, ID_stack: &mut Vec<u32>)
+{
+    for sibling in siblings
+    {
+        if ID_stack.contains(&sibling.ID)
+        {
+            error!("render_text has detected a cyclic dependency between inserts. This should never happen, as it does not conform to the protocol specification.");
+            continue;
+        }
+
+        let insert = &set.inserts[sibling.index];
+        let children = child_index.children_of(insert.ID);
+        let mut next_child = 0;
+        let length = insert.content.len();
+
+        ID_stack.push(insert.ID);
+
+        let mut characters = set.arena.characters(&insert.content);
+        let mut position = 0;
+        while position <= length
+        {
+            if insert.content.is_all_deleted() //nothing to render here except for the children, so skip ahead to them
+            {
+                let mut next_position = length;
+                if next_child < children.len()
+                {
+                    next_position = min(next_position, children[next_child].charPos as usize);
+                }
+                if let (Some(cursor_ID), Some(cursor_charPos)) = (text_buffer.cursor_ID, text_buffer.cursor_charPos)
+                {
+                    if (cursor_ID == insert.ID) & (cursor_charPos as usize >= position)
+                    {
+                        next_position = min(next_position, cursor_charPos as usize);
+                    }
+                }
+                position = max(position, next_position);
+            }
+
+            if (Some(insert.ID) == text_buffer.cursor_ID) & (Some(position as u16) == text_buffer.cursor_charPos) //NOTE: maybe keep information on where the cursor is attached. would only be necessary for deleting to the right, normal backspace and insertion should be attached to the left.
+            {
+                text_buffer.cursor_globalPos = text_buffer.text.len();
+            }
+
+            let first_child = next_child;
+            while (next_child < children.len()) && (children[next_child].charPos as usize == position)
+            {
+                next_child += 1;
+            }
+            render_text_internal(set, child_index, &children[first_child..next_child], &mut *text_buffer, ID_stack);
+
+            if position < length
+            {
+                if let Some(Some(character)) = characters.next()
+                {
+                    text_buffer.text.push(character);
+                    text_buffer.positions.push(insert.ID, insert.author, position as u16);
+                }
+            }
+
+            position += 1;
+        }
+
+        ID_stack.pop();
+    }
+
+}
+
+#[test]
+fn test_render_text_after_compaction ()
+{
+    let mut set = TextInsertSet::new();
+    for &(ID, parent, charPos, content) in [(1, 0, 0, "Hello"), (2, 1, 2, "XYZ"), (3, 2, 1, "_"), (4, 1, 5, " World")].iter()
+    {
+        let content = set.arena.allocate(content, 0);
+        set.push( TextInsert { ID: ID, parent: parent, author: 1, charPos: charPos, content: content } );
+    }
+
+    let mut text_buffer = TextBufferInternal::new();
+
+    render_text(&set, &mut text_buffer);
+    assert_eq!(text_buffer.text.iter().cloned().collect::<String>(), "HeX_YZllo World");
+
+    for position in 0..3
+    {
+        set.inserts[1].content.delete(position); //delete XYZ, but keep its child
+    }
+    set.inserts[3].content.delete(0);
+    assert_eq!(set.compactable_bytes(&|insert: &TextInsert| insert.ID != 4), 3); //the deleted space of " World" isn't settled yet
+    set.compact(|insert| insert.ID != 4, None);
+    assert!(set.inserts[1].content.is_all_deleted());
+
+    text_buffer.cursor_ID = Some(2);
+    text_buffer.cursor_charPos = Some(2);
+    render_text(&set, &mut text_buffer);
+    assert_eq!(text_buffer.text.iter().cloned().collect::<String>(), "He_lloWorld");
+    assert_eq!(text_buffer.cursor_globalPos, 3);
+    assert_eq!(text_buffer.positions.lookup(2), Some((3, 0)));
+}
+
+unsafe fn expandDynamicArray_uint32 (array: &mut DynamicArray_uint32, new_length: usize) -> i8
+{
+    if new_length > array.allocated_length as usize
+    {
+        let new_pointer: *mut u32 = libc::realloc(array.array as *mut libc::c_void, new_length*std::mem::size_of::<u32>()) as *mut u32;
+        if new_pointer.is_null()
+        {
+            return -1;
+        }
+        else
+        {
+            array.array = new_pointer;
+            array.allocated_length = new_length as c_long;
+            return 0;
+        }
+    }
+    return 0;
+}
+
+fn synchronize_buffers ( text_buffer: &TextBufferInternal, c_pointers: &ThreadPointerWrapper, is_buffer_locked: &Arc<AtomicBool> )
+{
+    assert!(is_buffer_locked.load(Ordering::Acquire) == true);
+
+    let start = Instant::now();
+    write_text_buffer(text_buffer, unsafe { &mut *c_pointers.text_buffer });
+    metrics::SYNCHRONIZE_BUFFERS.record(start.elapsed());
+
+    is_buffer_locked.store(false, Ordering::Release);
+}
+
+///Copies the rendered text, cursor and authors into the GUI's buffer.
+fn write_text_buffer (text_buffer: &TextBufferInternal, c_text_buffer: &mut TextBuffer)
+{
+    unsafe
+    {
+        c_text_buffer.cursor = text_buffer.cursor_globalPos as c_int;
+        c_text_buffer.ahead_cursor = c_text_buffer.cursor;
+
+        expandDynamicArray_uint32(&mut c_text_buffer.text, text_buffer.text.len());
+        c_text_buffer.text.length = text_buffer.text.len() as c_long;
+        for (offset, character) in text_buffer.text.iter().enumerate()
+        {
+            *c_text_buffer.text.array.offset(offset as isize) = *character as u32;
+        }
+
+        expandDynamicArray_uint32(&mut c_text_buffer.author_table, text_buffer.positions.len());
+        c_text_buffer.author_table.length = text_buffer.positions.len() as c_long;
+        let mut offset = 0;
+        for run in text_buffer.positions.runs()
+        {
+            for _ in 0..run.length
+            {
+                *c_text_buffer.author_table.array.offset(offset as isize) = run.author;
+                offset += 1;
+            }
+        }
+    }
+}
+
+///The optional protocol features this backend announces in the init exchange.
+fn write_protocol_features (dict: &mut tnetstring::DictWriter)
+{
+    dict.bool("batching", true);
+    dict.bool("cumulative_acks", true);
+    dict.integer("wire_version", wire::CURRENT_VERSION as isize);
+    dict.string("checksum", Checksum::Castagnoli.name());
+    dict.bool("snapshot", true);
+    dict.bool("anti_entropy", true);
+}
+
+///An Init request. A peer that is already initialized only introduces itself and doesn't need an ID range or a snapshot.
+fn init_request (initialized: bool) -> Vec<u8>
+{
+    let mut request = Vec::new();
+    tnetstring::write_dict(&mut request, |dict|
+    {
+        dict.string("type", "Init request");
+        dict.bool("initialized", initialized);
+        write_protocol_features(dict);
+    });
+    return request;
+}
+
+///The answer to an Init request, with the IDs granted to the requester if it needs them.
+fn init_message (ID_range: Option<IDGrant>) -> Vec<u8>
+{
+    let mut message = Vec::new();
+    tnetstring::write_dict(&mut message, |dict|
+    {
+        dict.string("type", "Init");
+        if let Some(grant) = ID_range
+        {
+            dict.integer("start_ID", grant.start_ID as isize);
+            dict.integer("end_ID", grant.end_ID as isize);
+            dict.integer("pool_start_ID", grant.pool_start_ID as isize);
+            dict.integer("pool_end_ID", grant.pool_end_ID as isize);
+        }
+        write_protocol_features(dict);
+    });
+    return message;
+}
+
+///The answer to an Init request from a peer that can't join the pad, e.g. because its wire version can't carry the inserts.
+fn init_refusal (reason: &str) -> Vec<u8>
+{
+    let mut message = Vec::new();
+    tnetstring::write_dict(&mut message, |dict|
+    {
+        dict.string("type", "Init refused");
+        dict.string("reason", reason);
+        write_protocol_features(dict);
+    });
+    return message;
+}
+
+///Whether a legacy wire version can carry the positions of the insert.
+fn fits_legacy_positions (insert: &TextInsert) -> bool
+{
+    (insert.content.len() <= LEGACY_INSERT_LENGTH) & (insert.charPos as usize <= LEGACY_INSERT_LENGTH)
+}
+
+fn insert_digest_hash (insert: &TextInsert) -> u32
+{
+    digest::insert_hash(insert.ID, insert.parent, insert.author, insert.charPos, insert.content.len(), insert.content.deleted_count())
+}
+
+fn build_digest (set: &TextInsertSet) -> Digest
+{
+    let mut digest = Digest::new();
+    for insert in set.inserts.iter()
+    {
+        digest.add(insert.ID, insert.author, insert_digest_hash(insert));
+    }
+    return digest;
+}
+
+///Sends the digest of our insert set, so the peer can find inserts that got lost on the way although they were acknowledged (e.g. after
+///a restart of one side).
+fn send_digest (set: &TextInsertSet, peer: &mut Peer)
+{
+    for message in build_digest(set).messages()
+    {
+        peer.send_cheap(&message[..]);
+    }
+}
+
+///Sends the state of our inserts in the given buckets, a few buckets per message.
+fn send_bucket_states (buckets: &[u32], reply: bool, set: &TextInsertSet, peer: &mut Peer)
+{
+    let mut states: BTreeMap<u32, Vec<(u32, usize, usize)>> = buckets.iter().map(|&bucket| (bucket, Vec::new())).collect();
+    for insert in set.inserts.iter()
+    {
+        if let Some(bucket_states) = states.get_mut(&digest::bucket_of(insert.ID))
+        {
+            bucket_states.push((insert.ID, insert.content.len(), insert.content.deleted_count()));
+        }
+    }
+
+    for part in buckets.chunks(digest::STATE_BUCKETS_PER_MESSAGE)
+    {
+        let part_states: Vec<(u32, usize, usize)> = part.iter().flat_map(|bucket| states.remove(bucket).unwrap_or(Vec::new())).collect();
+        peer.send_cheap(&digest::bucket_states_message(part, &part_states[..], reply)[..]);
+    }
+}
+
+///Keeps a digest message of the peer until answer_digests compares it with ours.
+fn handle_digest (data: &tnetstring::Value, peer: &mut Peer)
+{
+    match Digest::from_message(data)
+    {
+        Some(digest) => peer.digests_in.push(digest),
+        None => warn!("Received a malformed digest.")
+    }
+}
+
+///Compares the digest messages received since the last call with our digest, which is built only once for all of them. A complete digest
+///with the same version vector and bucket hashes as ours needs no answer; otherwise the states of the inserts in the differing buckets
+///are sent back.
+fn answer_digests (set: &TextInsertSet, peers: &mut [Peer])
+{
+    if peers.iter().all(|peer| peer.digests_in.is_empty())
+    {
+        return;
+    }
+
+    let ours = build_digest(set);
+    for peer in peers.iter_mut()
+    {
+        for (theirs, first, last) in mem::replace(&mut peer.digests_in, Vec::new())
+        {
+            let complete = (first == 0) & (last == u32::max_value());
+            if complete && (ours.authors == theirs.authors) && (ours.buckets == theirs.buckets)
+            {
+                continue;
+            }
+
+            let differing = ours.differing_buckets(&theirs, first, last);
+            if differing.len() > 0
+            {
+                send_bucket_states(&differing[..], true, set, peer);
+            }
+        }
+    }
+}
+
+///Sends the inserts of the listed buckets that the peer doesn't have or has an older state of, and answers with our own states if asked.
+fn handle_bucket_states (data: &tnetstring::Value, set: &TextInsertSet, peer: &mut Peer)
+{
+    let (buckets, theirs, reply) = match digest::read_bucket_states(data)
+    {
+        Some(states) => states,
+        None => { warn!("Received malformed bucket states."); return; }
+    };
+
+    let listed: BTreeSet<u32> = buckets.iter().cloned().collect();
+    let mut missing = 0;
+    for insert in set.inserts.iter().filter(|insert| listed.contains(&digest::bucket_of(insert.ID)))
+    {
+        let outdated = match theirs.get(&insert.ID)
+        {
+            Some(&(length, deleted)) => (length < insert.content.len()) | (deleted != insert.content.deleted_count()),
+            None => true
+        };
+
+        if outdated
+        {
+            peer.enqueue_full(insert.ID);
+            missing += 1;
+        }
+    }
+
+    if missing > 0
+    {
+        info!("Anti-entropy: resending {} inserts.", missing);
+    }
+
+    if reply
+    {
+        send_bucket_states(&buckets[..], false, set, peer);
+    }
+}
+
+#[cfg(test)]
+fn deliver (from: &mut Peer, from_set: &TextInsertSet, to: &mut Peer, to_set: &mut TextInsertSet, to_backend_state: &mut Option<ProtocolBackendState>)
+{
+    let mut text_buffer = TextBufferInternal::new();
+    from.resend(from_set, &mut EncodedRecords::new(), Instant::now());
+    for datagram in from.finish().to_vec()
+    {
+        for record in framing::records(&datagram[4..])
+        {
+            handle_record(record, to_set, to_backend_state, &mut text_buffer, to);
+        }
+    }
+    answer_digests(to_set, slice::from_mut(to));
+    from.batcher.clear();
+}
+
+#[test]
+fn test_anti_entropy ()
+{
+    let (mut first_set, mut second_set) = (TextInsertSet::new(), TextInsertSet::new());
+    for ID in 1..101
+    {
+        let content = first_set.arena.allocate("abc", 0);
+        first_set.push( TextInsert { ID: ID, parent: ID-1, author: 1, charPos: if ID == 1 { 0 } else { 3 }, content: content } );
+        if ID != 70 //lost on the way to the second peer
+        {
+            let content = second_set.arena.allocate("abc", 0);
+            second_set.push( TextInsert { ID: ID, parent: ID-1, author: 1, charPos: if ID == 1 { 0 } else { 3 }, content: content } );
+        }
+    }
+    first_set.inserts[9].content.delete(1); //a deletion the second peer missed
+    let content = second_set.arena.allocate("xyz", 0);
+    second_set.push( TextInsert { ID: 1030, parent: 5, author: 1026, charPos: 1, content: content } ); //an insert the first peer missed
+
+    let address = "127.0.0.1:2001".parse().unwrap();
+    let mut first = Peer::new(address, framing::DEFAULT_MTU);
+    let mut second = Peer::new(address, framing::DEFAULT_MTU);
+    first.batcher.enabled = true;
+    second.batcher.enabled = true;
+    let mut first_backend_state = Some(ProtocolBackendState::new(1, 1025));
+    let mut second_backend_state = Some(ProtocolBackendState::new(1026, 2050));
+    assert!(build_digest(&first_set) != build_digest(&second_set));
+
+    send_digest(&first_set, &mut first);
+    deliver(&mut first, &first_set, &mut second, &mut second_set, &mut second_backend_state); //digest
+    deliver(&mut second, &second_set, &mut first, &mut first_set, &mut first_backend_state); //states of the differing buckets
+    deliver(&mut first, &first_set, &mut second, &mut second_set, &mut second_backend_state); //missing inserts and our states
+    deliver(&mut second, &second_set, &mut first, &mut first_set, &mut first_backend_state); //missing inserts
+
+    assert_eq!(first_set.inserts.len(), 101);
+    assert_eq!(second_set.inserts.len(), 101);
+    assert_eq!(build_digest(&first_set), build_digest(&second_set));
+}
+
+///Serializes all inserts for a snapshot: each one as an insert record of the current version (which has the layout of version 2), prefixed
+///with its length as a varint.
+fn snapshot_stream (set: &TextInsertSet) -> Vec<u8>
+{
+    let mut stream = Vec::with_capacity(set.arena.len() + 16*set.inserts.len());
+    let mut record = Vec::new();
+
+    for insert in set.inserts.iter()
+    {
+        record.clear();
+        insert.serialize(&set.arena, wire::CURRENT_VERSION, &mut record);
+        wire::write_varint(record.len() as u64, &mut stream);
+        stream.extend_from_slice(&record[..]);
+    }
+
+    return stream;
+}
+
+///Merges a completely received snapshot into the insert set, once the backend is initialized.
+fn install_snapshot_if_complete (set: &mut TextInsertSet, backend_state: &Option<ProtocolBackendState>, text_buffer: &mut TextBufferInternal, peer: &mut Peer)
+{
+    let backend_state = match *backend_state
+    {
+        Some(ref backend_state) => backend_state,
+        None => return
+    };
+
+    let stream = match peer.snapshot_in
+    {
+        Some(ref mut receiver) if !receiver.installed && receiver.is_complete() => receiver.assemble(),
+        _ => None
+    };
+
+    if let Some(stream) = stream
+    {
+        let installed = install_stream(set, backend_state, &stream[..]);
+        info!("Installed a snapshot with {} inserts.", installed);
+        text_buffer.needs_updating = true;
+    }
+}
+
+///Merges the inserts of a stream written by snapshot_stream into the insert set. Returns how many were accepted.
+fn install_stream (set: &mut TextInsertSet, backend_state: &ProtocolBackendState, stream: &[u8]) -> usize
+{
+    let mut rest = stream;
+    let mut installed = 0;
+    while rest.len() > 0
+    {
+        let length = match wire::read_varint(&mut rest)
+        {
+            Some(length) if length as usize <= rest.len() => length as usize,
+            _ => break
+        };
+
+        if let Some(wire::Record::Insert(header, content)) = wire::decode(&rest[..length])
+        {
+            if TextInsert::deserialize(&header, content, set, backend_state).is_some()
+            {
+                installed += 1;
+            }
+        }
+        rest = &rest[length..];
+    }
+    return installed;
+}
+
+#[test]
+fn test_snapshot_install ()
+{
+    let mut set = TextInsertSet::new();
+    for ID in 1..301
+    {
+        let content: String = (0..200).map(|i| char::from_u32('a' as u32 + (ID + i)%26).unwrap()).collect();
+        let content = set.arena.allocate(&content[..], 0);
+        set.push( TextInsert { ID: ID, parent: ID-1, author: 1, charPos: if ID == 1 { 0 } else { 200 }, content: content } );
+    }
+    set.inserts[5].content.delete(3);
+
+    let address = "127.0.0.1:2001".parse().unwrap();
+    let mut sending = Peer::new(address, framing::DEFAULT_MTU);
+    let mut receiving = Peer::new(address, framing::DEFAULT_MTU);
+    let mut older = Peer::new(address, framing::DEFAULT_MTU);
+    for peer in vec![&mut sending, &mut older]
+    {
+        peer.batcher.enabled = true;
+        peer.start_snapshot(&set);
+        peer.resend(&set, &mut EncodedRecords::new(), Instant::now());
+    }
+    sending.start_snapshot(&set); //the second one replaces the first, which is never sent
+    sending.batcher.clear();
+    sending.resend(&set, &mut EncodedRecords::new(), Instant::now());
+
+    //a delayed chunk of an older snapshot arrives in between, it doesn't throw away what has been received of the current one
+    let mut records: Vec<Vec<u8>> = sending.batcher.finish().iter().flat_map(|datagram| framing::records(&datagram[4..]).map(|record| record.to_vec()).collect::<Vec<Vec<u8>>>()).collect();
+    let stale = framing::records(&older.batcher.finish()[0][4..]).next().unwrap().to_vec();
+    let middle = records.len()/2;
+    records.insert(middle, stale);
+
+    let mut joined_set = TextInsertSet::new();
+    let mut joined_backend_state = Some(ProtocolBackendState::new(1026, 2050));
+    let mut text_buffer = TextBufferInternal::new();
+    for record in records.iter()
+    {
+        handle_record(&record[..], &mut joined_set, &mut joined_backend_state, &mut text_buffer, &mut receiving);
+    }
+
+    assert_eq!(joined_set.inserts.len(), 300);
+    let mut expected_text = TextBufferInternal::new();
+    render_text(&set, &mut expected_text);
+    render_text(&joined_set, &mut text_buffer);
+    assert_eq!(text_buffer.text, expected_text.text);
+}
+
+///Handles a single protocol record (a datagram without its checksum, or one record out of a batch).
+fn handle_record (record: &[u8], set: &mut TextInsertSet, backend_state: &mut Option<ProtocolBackendState>, text_buffer: &mut TextBufferInternal, peer: &mut Peer)
+{
+    if record.len() == 0
+    {
+        return;
+    }
+
+    if wire::is_edit_record(record[0])
+    {
+        match (wire::decode(record), backend_state.as_ref())
+        {
+            (Some(_), None) => debug!("Received data without being initialized first."),
+
+            (Some(wire::Record::Insert(header, content)), Some(backend_state_unpacked)) =>
+            {
+                match TextInsert::deserialize(&header, content, set, backend_state_unpacked)
+                {
+                    Some((insert_index, new_insert_created)) =>
+                    {
+                        let insert = &set.inserts[insert_index];
+                        text_buffer.needs_updating = true;
+                        peer.ack_insert(insert.ID, insert.content.len() as u16, insert.get_number_of_deleted_chars(), false);
+                        trace!("Deserialized insert.");
+                    },
+                    None => ()
+                }
+            },
+
+            (Some(wire::Record::Append { ID: insert_ID, start, content }), Some(_)) =>
+            {
+                trace!("Received apnd.");
+                if let Some(insert_index) = get_insert_by_ID_index(insert_ID, set)
+                {
+                    let TextInsertSet { ref mut inserts, ref mut arena, .. } = *set;
+                    let insert = &mut inserts[insert_index];
+                    let append_start = start as usize;
+
+                    if let Ok(utf8_data) = str::from_utf8(content)
+                    {
+                        let data_length = utf8_data.chars().count();
+                        let old_length = insert.content.len();
+
+                        if data_length+append_start > MAXIMUM_INSERT_LENGTH
+                        {
+                            warn!("Received append beyond the maximum insert length.");
+                        }
+
+                        else if append_start <= old_length
+                        {
+                            //the characters we already have only carry deletions (when the rest of a long insert is sent again)
+                            for (position, (byte_offset, character)) in utf8_data.char_indices().enumerate().map(|(index, indexed)| (append_start+index, indexed))
+                            {
+                                if position == old_length
+                                {
+                                    arena.append_str(&mut insert.content, &utf8_data[byte_offset..]);
+                                    text_buffer.needs_updating = true;
+                                    break;
+                                }
+                                else if (character == 127 as char) && insert.content.delete(position)
+                                {
+                                    text_buffer.needs_updating = true;
+                                }
+                            }
+                        }
+
+                        else
+                        {
+                            warn!("Received append that was too far ahead"); //TODO: change this when resend insert requests are there
+                        }
+                    }
+
+                    peer.ack_insert(insert.ID, insert.content.len() as u16, insert.get_number_of_deleted_chars(), true);
+                    trace!("Sent ack apnd");
+                }
+            },
+
+            (Some(wire::Record::Delete { ID: insert_ID, start: start_pos, end: end_pos }), Some(_)) =>
+            {
+                if let Some(mut insert) = get_insert_by_ID_mut(insert_ID, set)
+                {
+                    if (start_pos <= end_pos) & (end_pos as usize <= insert.content.len())
+                    {
+                        for i in start_pos as usize ..end_pos as usize
+                        {
+                            insert.content.delete(i);
+                            text_buffer.needs_updating = true;
+                        }
+
+                        peer.ack_delete(insert.ID, start_pos, end_pos);
+                    }
+                }
+            },
+
+            (None, _) => warn!("Received a malformed edit record.")
+        }
+    }
+
+    else if 'I' as u8 == record[0]
+    {
+        if record.len() == 1+2+4+1+1
+        {
+            let ack_ID = read_u32(&record[3..7]);
+            peer.insert_acknowledged(ack_ID, record[7] as u16, Some(record[8] as u16), set);
+        }
+    }
+
+    else if 'A' as u8 == record[0]
+    {
+        if record.len() == 1+2+4+1
+        {
+            let insert_ID = read_u32(&record[3..7]);
+            peer.insert_acknowledged(insert_ID, record[7] as u16, None, set);
+        }
+    }
+
+    else if 'D' as u8 == record[0]
+    {
+        if record.len() == 1+2+4+1+1
+        {
+            let insert_ID = read_u32(&record[3..7]);
+            peer.delete_acknowledged(insert_ID, record[7] as u16, record[8] as u16);
+        }
+    }
+
+    else if snapshot::CHUNK_TAG == record[0]
+    {
+        //the sender numbers its snapshots, a delayed chunk of an older one must not throw away the progress of the current one
+        let current = peer.snapshot_in.as_ref().map(|receiver| receiver.ID);
+        if SnapshotReceiver::snapshot_ID(record) > current
+        {
+            peer.snapshot_in = SnapshotReceiver::new(record);
+        }
+
+        if let Some(ref mut receiver) = peer.snapshot_in
+        {
+            receiver.handle_chunk(record);
+        }
+        install_snapshot_if_complete(set, backend_state, text_buffer, peer);
+    }
+
+    else if snapshot::ACK_TAG == record[0]
+    {
+        if let Some(ref mut sender) = peer.snapshot_out
+        {
+            sender.handle_ack(record);
+        }
+    }
+
+    else if acks::is_ack_record(record[0])
+    {
+        match AckFrame::decode(record)
+        {
+            Some(frame) =>
+            {
+                for &(insert_ID, length, deleted) in frame.inserts.iter()
+                {
+                    peer.insert_acknowledged(insert_ID, length, Some(deleted), set);
+                }
+
+                for &(insert_ID, start_pos, end_pos) in frame.deletions.iter()
+                {
+                    peer.delete_acknowledged(insert_ID, start_pos, end_pos);
+                }
+
+                for &(first, last) in frame.messages.iter()
+                {
+                    let acknowledged_messages: Vec<u32> = peer.cheap_queue.iter()
+                                                                             .map(|(message_id, _)| message_id)
+                                                                             .filter(|&message_id| (first <= message_id) & (message_id <= last))
+                                                                             .collect();
+                    for message_id in acknowledged_messages
+                    {
+                        peer.message_acknowledged(message_id);
+                    }
+                }
+            },
+            None => warn!("Received a malformed ack record.")
+        }
+    }
+
+    else if (record[0] == 'm' as u8) & (record.len() >= 1+4)
+    {
+        let message_id = read_u32(&record[1..5]);
+        peer.ack_message(message_id);
+
+        trace!("Message: {}", std::str::from_utf8(&record[5..]).unwrap_or("<can't decode>"));
+
+        if let Ok(data) = tnetstring::decode_borrowed(&mut &record[5..])
+        {
+            if let Some(message_type) = data.field("type").and_then(|message_type| message_type.as_str())
+            {
+                //both sides of the init exchange announce the optional features they understand
+                if (message_type == "Init request") | (message_type == "Init")
+                {
+                    peer.negotiate(&data);
+                }
+
+                //once the pad holds inserts beyond 255 characters, a legacy peer would miss them and diverge for good
+                if (message_type == "Init request") && !wire::has_wide_positions(peer.wire_version) && backend_state.is_some() &&
+                    !set.inserts.iter().all(|insert| fits_legacy_positions(insert))
+                {
+                    peer.introduced = true;
+                    peer.refuse();
+                }
+
+                else if message_type == "Init request"
+                {
+                    peer.introduced = true;
+                    peer.refused = false; //e.g. restarted with a newer version
+                    let requester_initialized = data.field("initialized") == Some(tnetstring::Value::Bool(true));
+
+                    match *backend_state
+                    {
+                        None if !requester_initialized & peer.founder => *backend_state = Some(ProtocolBackendState::founder()), //TODO: find a better scheme for deciding initialization
+
+                        None if !requester_initialized => (), //its requests tell us once it has been initialized by someone else
+
+                        None =>
+                        {
+                            //the requester is part of a running pad, so we ask it for an ID range in turn
+                            peer.send_cheap(&init_message(None)[..]);
+                            peer.send_cheap(&init_request(false)[..]);
+                        },
+
+                        Some(ref mut state) =>
+                        {
+                            let mut granted = None;
+                            if !requester_initialized
+                            {
+                                //a retried request gets the same range again
+                                granted = peer.ID_range.or_else(|| state.grant());
+                                if granted.is_none()
+                                {
+                                    warn!("No IDs left to grant to {}.", peer.address);
+                                    peer.send_cheap(&init_refusal("ID_range")[..]);
+                                    return;
+                                }
+                                peer.ID_range = granted;
+                            }
+
+                            peer.send_cheap(&init_message(granted)[..]);
+
+                            //instead of sending the inserts one by one, the joining peer gets all of them at once
+                            if !requester_initialized & (data.field("snapshot") == Some(tnetstring::Value::Bool(true))) & peer.snapshot_out.is_none()
+                            {
+                                peer.start_snapshot(set);
+                            }
+                        }
+                    }
+                }
+
+                else if message_type == "Digest"
+                {
+                    handle_digest(&data, peer);
+                }
+
+                else if message_type == "Bucket states"
+                {
+                    handle_bucket_states(&data, set, peer);
+                }
+
+                else if message_type == "Init refused"
+                {
+                    error!("{} refused to let us join the pad: {}", peer.address, data.field("reason").and_then(|reason| reason.as_str()).unwrap_or("no reason given"));
+                }
+
+                else if message_type == "Init"
+                {
+                    peer.introduced = true;
+                    match *backend_state
+                    {
+                        None =>
+                        {
+                            let ID_field = |name: &str| data.field(name).and_then(|ID| ID.as_integer()).map(|ID| ID as u32);
+                            if let (Some(start_ID), Some(end_ID)) = (ID_field("start_ID"), ID_field("end_ID"))
+                            {
+                                //a granter without pools leaves us nothing to grant
+                                let (pool_start_ID, pool_end_ID) = (ID_field("pool_start_ID").unwrap_or(1), ID_field("pool_end_ID").unwrap_or(0));
+                                *backend_state = Some(ProtocolBackendState::granted(&IDGrant { start_ID: start_ID, end_ID: end_ID, pool_start_ID: pool_start_ID, pool_end_ID: pool_end_ID }));
+                                install_snapshot_if_complete(set, backend_state, text_buffer, peer); //in case it arrived first
+                            }
+                        },
+                        _ => ()
+                    }
+                }
+            }
+        }
+    }
+
+    else if (record[0] == 'M' as u8) & (record.len() >= 1+4)
+    {
+        let acknowledged_message_id = read_u32(&record[1..5]);
+        peer.message_acknowledged(acknowledged_message_id);
+    }
+}
+
+///Whether the checkvalue in front of a datagram (of at least 4 bytes) matches its content, optionally also with the other checksum.
+fn has_valid_checksum (datagram: &[u8], checksum: Checksum, accept_other: bool) -> bool
+{
+    let checkvalue = read_u32(&datagram[0..4]);
+    (checksum.compute(&datagram[4..]) == checkvalue) || (accept_other && (checksum.other().compute(&datagram[4..]) == checkvalue))
+}
+
+///Whether the payload of a datagram contains an Init request.
+fn holds_init_request (payload: &[u8]) -> bool
+{
+    let is_init_request = |record: &[u8]|
+    {
+        (record.len() >= 1+4) && (record[0] == 'm' as u8) &&
+        tnetstring::decode_borrowed(&mut &record[5..]).ok().map_or(false, |data| data.field("type").and_then(|message_type| message_type.as_str()) == Some("Init request"))
+    };
+
+    if framing::is_batch(payload)
+    {
+        return framing::records(payload).any(is_init_request);
+    }
+    return is_init_request(payload);
 }
 
-fn synchronize_buffers ( text_buffer: &TextBufferInternal, c_pointers: &ThreadPointerWrapper, is_buffer_locked: &Arc<AtomicBool> )
+///Checks the checksum and the pad of a received datagram and hands its records to handle_record. Returns false if it was dropped.
+fn handle_datagram (datagram: &[u8], pad_ID: u16, set: &mut TextInsertSet, backend_state: &mut Option<ProtocolBackendState>, text_buffer: &mut TextBufferInternal, peer: &mut Peer) -> bool
 {
-    assert!(is_buffer_locked.load(Ordering::Acquire) == true);
+    if datagram.len() < 4
+    {
+        return false;
+    }
 
-    unsafe
+    trace!("Received data: {:?}", &datagram[4..]);
+
+    metrics::DATAGRAMS_RECEIVED.increment();
+    metrics::DATAGRAM_BYTES_RECEIVED.add(datagram.len() as u64);
+
+    //the peer uses the original checksum until it has our side of the init exchange, after that only a restarted one does so for its Init request
+    let (datagram_pad_ID, payload) = framing::split_pad(&datagram[4..]);
+    let announced = has_valid_checksum(datagram, peer.batcher.checksum, false);
+    if !announced && !(has_valid_checksum(datagram, peer.batcher.checksum, true) && (!peer.checksum_agreed || holds_init_request(payload)))
     {
+        metrics::CHECKSUM_FAILURES.increment();
+        return false;
+    }
+    peer.checksum_agreed = announced & (peer.checksum_agreed | peer.introduced);
 
-        let mut c_text_buffer = &mut *c_pointers.text_buffer;
-        c_text_buffer.cursor = text_buffer.cursor_globalPos as c_int;
-        c_text_buffer.ahead_cursor = c_text_buffer.cursor;
+    if datagram_pad_ID != pad_ID
+    {
+        return false;
+    }
 
-        expandDynamicArray_uint32(&mut c_text_buffer.text, text_buffer.text.len());
-        c_text_buffer.text.length = text_buffer.text.len() as c_long;
-        for (offset, character) in text_buffer.text.iter().enumerate()
+    if framing::is_batch(payload)
+    {
+        for record in framing::records(payload)
         {
-            *c_text_buffer.text.array.offset(offset as isize) = *character as u32;
+            metrics::RECEIVED_RECORDS.record(record);
+            handle_record(record, set, backend_state, text_buffer, peer);
         }
+    }
+    else
+    {
+        metrics::RECEIVED_RECORDS.record(payload);
+        handle_record(payload, set, backend_state, text_buffer, peer);
+    }
+    return true;
+}
 
-        expandDynamicArray_uint32(&mut c_text_buffer.author_table, text_buffer.author_table.len());
-        c_text_buffer.author_table.length = text_buffer.author_table.len() as c_long;
-        for (offset, author_ID) in text_buffer.author_table.iter().enumerate()
+#[test]
+fn test_short_records ()
+{
+    //records are exact-length slices of the datagram, a truncated record of any type must be dropped without reading past its end
+    let mut set = TextInsertSet::new();
+    let mut backend_state = Some(ProtocolBackendState::new(1, 1025));
+    let mut text_buffer = TextBufferInternal::new();
+    let mut peer = Peer::new("127.0.0.1:2001".parse().unwrap(), framing::DEFAULT_MTU);
+    let mut sender = Batcher::new(framing::DEFAULT_MTU);
+
+    for tag in 0..256
+    {
+        for length in 1..9
         {
-            *c_text_buffer.author_table.array.offset(offset as isize) = *author_ID;
+            let record: Vec<u8> = (0..length).map(|index| if index == 0 { tag as u8 } else { index as u8 }).collect();
+            sender.push(&record[..]);
+            for datagram in sender.finish().to_vec()
+            {
+                handle_datagram(&datagram[..], 0, &mut set, &mut backend_state, &mut text_buffer, &mut peer);
+            }
+            sender.clear();
         }
     }
+}
 
-    is_buffer_locked.store(false, Ordering::Release);
+#[test]
+fn test_checksum_switch ()
+{
+    let mut set = TextInsertSet::new();
+    let mut backend_state = Some(ProtocolBackendState::new(1, 1025));
+    let mut text_buffer = TextBufferInternal::new();
+    let mut peer = Peer::new("127.0.0.1:2001".parse().unwrap(), framing::DEFAULT_MTU);
+    peer.batcher.checksum = Checksum::Castagnoli;
+
+    let mut request = b"m\0\0\0\x01".to_vec();
+    request.extend_from_slice(&init_request(true)[..]);
+    let datagram = |checksum: Checksum, record: &[u8]|
+    {
+        let mut sender = Batcher::new(framing::DEFAULT_MTU);
+        sender.checksum = checksum;
+        sender.push(record);
+        return sender.finish()[0].clone();
+    };
+    let (original, announced) = (datagram(Checksum::Koopman, b"M\0\0\0\x01"), datagram(Checksum::Castagnoli, b"M\0\0\0\x01"));
+
+    //either one is accepted until the peer has used the announced one after the introduction
+    assert!(handle_datagram(&original[..], 0, &mut set, &mut backend_state, &mut text_buffer, &mut peer));
+    assert!(handle_datagram(&announced[..], 0, &mut set, &mut backend_state, &mut text_buffer, &mut peer));
+    peer.introduced = true;
+    assert!(handle_datagram(&original[..], 0, &mut set, &mut backend_state, &mut text_buffer, &mut peer));
+    assert!(handle_datagram(&announced[..], 0, &mut set, &mut backend_state, &mut text_buffer, &mut peer));
+    assert!(!handle_datagram(&original[..], 0, &mut set, &mut backend_state, &mut text_buffer, &mut peer));
+
+    //except for the Init request of a restarted peer, which starts the agreement over
+    assert!(handle_datagram(&datagram(Checksum::Koopman, &request[..])[..], 0, &mut set, &mut backend_state, &mut text_buffer, &mut peer));
+    assert!(handle_datagram(&original[..], 0, &mut set, &mut backend_state, &mut text_buffer, &mut peer));
 }
 
 #[no_mangle]
 pub unsafe extern fn start_backend (own_port: u16, other_port: u16, textbuffer_ptr: *mut TextBuffer) -> *mut FFIData
 {
-    start_backend_safe(own_port, other_port, textbuffer_ptr)
+    start_backend_with(BackendOptions::from_environment(own_port, other_port), textbuffer_ptr)
 }
 
-fn start_backend_safe (own_port: u16, other_port: u16, c_text_buffer_ptr: *mut TextBuffer) -> *mut FFIData
+pub fn start_backend_with (options: BackendOptions, c_text_buffer_ptr: *mut TextBuffer) -> *mut FFIData
 {
+    let (own_port, pad_ID) = (options.own_port, options.pad_ID);
+    metrics::start_exporter();
+
 	
 	let (input_sender, input_receiver): (Producer, Consumer) = spsc_255::new();
 
@@ -706,22 +2378,9 @@ fn start_backend_safe (own_port: u16, other_port: u16, c_text_buffer_ptr: *mut T
 	thread::Builder::new().name("Rust".to_string()).spawn(move ||
 	{
         //set up data structures
-        let mut set: TextInsertSet = Vec::new();
+        let mut set = TextInsertSet::new();
         let mut backend_state: Option<ProtocolBackendState> = None;
-        let mut text_buffer =
-            TextBufferInternal
-            {
-                text: Vec::new(),
-                ID_table: Vec::new(),
-                author_table: Vec::new(),
-                charPos_table: Vec::new(),
-                cursor_ID: None,
-                cursor_charPos: None,
-                cursor_globalPos: 0,
-                active_insert: None,
-                needs_updating: false
-            }
-        ;
+        let mut text_buffer = TextBufferInternal::new();
 
         //stream converter for the GUI threads character stream
         let mut converter = utf8::Utf8StreamConverter::new();
@@ -729,408 +2388,161 @@ fn start_backend_safe (own_port: u16, other_port: u16, c_text_buffer_ptr: *mut T
         //network
 		let mut own_socket = net::UdpSocket::bind(("127.0.0.1", own_port)).expect("Socket fail!");
         //own_socket.set_nonblocking(true);
-        own_socket.set_read_timeout(Some(Duration::from_millis(100)));
-        let mut network =
-            NetworkState
+        if let Err(error) = own_socket.set_read_timeout(Some(Duration::from_millis(100)))
+        {
+            warn!("Failed to set the read timeout: {}", error);
+        }
+        let mut network = NetworkState::new(pad_ID, own_port, options.mtu);
+        let mut sender = DatagramSender::new();
+        for &port in options.peer_ports.iter()
+        {
+            network.add_peer(net::SocketAddr::V4(net::SocketAddrV4::new(net::Ipv4Addr::new(127, 0, 0, 1), port)));
+        }
+        if let Some(peer) = network.peers.first_mut()
+        {
+            peer.host = pad_ID != 0;
+        }
+        if let Some(ref path) = options.trace
+        {
+            match TraceWriter::create(path, own_port, pad_ID, &options.peer_ports[..])
             {
-                socket: own_socket,
-                other_address: net::SocketAddr::V4(net::SocketAddrV4::new(net::Ipv4Addr::new(127, 0, 0, 1), other_port)),
-                send_queue: VecDeque::new(),
-                cheap_queue: VecDeque::new(),
-                cheap_counter: 0
+                Ok(trace) => network.trace = Some(trace),
+                Err(error) => error!("Failed to create the trace {:?}: {}", path, error)
             }
-        ;
+        }
+        let mut read_timeout = Duration::from_millis(IDLE_WAKEUP_MS);
 		
-		const BUFFER_LENGTH: usize = 10000;
-		let mut buffer = [0u8; BUFFER_LENGTH];
+        let mut receiver = DatagramReceiver::new(mmsg::RECEIVE_BATCH, mmsg::RECEIVE_BUFFER_LENGTH);
 
-        let mut resend_timer = 0;
+        let mut last_compaction = Instant::now();
+        let mut last_digest = Instant::now();
 
 		loop
 		{
-			//check network
-			match network.socket.recv_from(&mut buffer) //TODO: use mio to check both the socket and the pipe
+			//check network: wait for the first datagrams, then drain whatever else has arrived, so that a burst of packets is applied
+			//completely before the text is rendered and handed to the GUI once
+			for round in 0..MAXIMUM_RECEIVE_ROUNDS
 			{
-				Ok((bytes, address)) => 
-                {
-                    if address.port() == other_port //TODO: check IP address
-                    {
-                        println!("Received data.\n | {:?}", &buffer[4..bytes]);
-
-                        let checkvalue = deserialize_u32(&buffer[0..4]);
-                        if crc(&buffer[4..bytes]) == checkvalue
-                        {
-                            if 'i' as u8 == buffer[4]
-                            {
-                                if bytes >= 20
-                                {
-                                    match backend_state
-                                    {
-                                        Some(ref backend_state_unpacked) =>
-                                        {
-                                            match TextInsert::deserialize(&buffer[7..bytes], &mut set, &backend_state_unpacked) //start at 7 to ignore pad ID for now
-                                            {
-                                                Some((insert_index, new_insert_created)) =>
-                                                {
-                                                    let insert = &set[insert_index];
-                                                    text_buffer.needs_updating = true;
-                                                    let mut ack_buffer = Vec::with_capacity(8);
-                                                    ack_buffer.push('I' as u8);
-                                                    serialize_u16(0, &mut ack_buffer);
-                                                    serialize_u32(insert.ID, &mut ack_buffer);
-                                                    ack_buffer.push(insert.content.len() as u8);
-                                                    ack_buffer.push(insert.get_number_of_deleted_chars());
-                                                    network.send(&ack_buffer[..]);
-                                                    println!("Deserialized insert.");
-                                                },
-                                                None => ()
-                                            }
-                                        },
-                                        None => println!("Received data without being initialized first.")
-                                    }
-                                }
-                            }
-
-                            else if 'I' as u8 == buffer[4]
-                            {
-                                if bytes == 4+1+2+4+1+1
-                                {
-                                    let ack_ID = deserialize_u32(&buffer[7..11]);
-                                    let ack_content_length = buffer[11];
-                                    let ack_deleted_chars = buffer[12];
-                                    if let Some(index) = network.send_queue.iter().position(|&x| x.ID == ack_ID)
-                                    {
-                                        if let Some(insert) = get_insert_by_ID(ack_ID, &set)
-                                        {
-                                            if (ack_content_length >= insert.content.len() as u8) & (ack_deleted_chars >= insert.get_number_of_deleted_chars())
-                                            {
-                                                network.send_queue.remove(index);
-                                            }
-                                        }
-                                    }
-                                }
-                            }
-
-                            else if 'a' as u8 == buffer[4]
-                            {
-                                println!("Received apnd.");
-                                if bytes >= 4+1+2+4+1
-                                {
-                                    if backend_state.is_some()
-                                    {
-                                        let insert_ID = deserialize_u32(&buffer[7..11]);
-
-                                        if let Some(mut insert) = get_insert_by_ID_mut(insert_ID, &mut set)
-                                        {
-                                            let data_length = bytes-4-1-2-4-1;
-                                            let append_start = buffer[11] as usize;
-
-                                            if data_length+append_start <= insert.content.len()
-                                            {
-                                                //no new data
-                                            }
-
-                                            else
-                                            {
-                                                let mut data;
-                                                if append_start < insert.content.len()
-                                                {
-                                                    data = Some(&buffer[insert.content.len()-append_start +12 .. bytes]);
-                                                }
-                                                else if append_start == insert.content.len()
-                                                {
-                                                    data = Some(&buffer[12..bytes]);
-                                                }
-                                                else
-                                                {
-                                                    println!("Warning: received append that was too far ahead"); //TODO: change this when resend insert requests are there
-                                                    data = None;
-                                                }
-
-                                                if let Some(data) = data
-                                                {
-                                                    if let Ok(utf8_data) = str::from_utf8(data)
-                                                    {
-                                                        for character in utf8_data.chars()
-                                                        {
-                                                            insert.content.push(character);
-                                                        }
-                                                    }
-                                                    text_buffer.needs_updating = true;
-                                                }
-                                            }
-
-                                            network.send_acka(insert.ID, insert.content.len() as u8);
-                                            println!("Sent ack apnd");
-                                        }
-                                    }
-                                }
-                            }
-
-                            else if 'A' as u8 == buffer[4]
-                            {
-                                if bytes == 4+1+2+4+1
-                                {
-                                    let insert_ID = deserialize_u32(&buffer[7..11]);
-                                    let acknowledged_position = buffer[11];
-
-                                    if let Some(entry_index) = network.get_queue_entry(insert_ID)
-                                    {
-                                        if let Some(insert) = get_insert_by_ID(insert_ID, &set)
-                                        {
-                                            {
-                                                let entry = &mut network.send_queue[entry_index];
-                                                match entry.kind
-                                                {
-                                                    SendType::Append { ref mut position } =>
-                                                    {
-                                                        if *position < acknowledged_position
-                                                        {
-                                                            *position = acknowledged_position;
-
-                                                            if *position > insert.content.len() as u8
-                                                            {
-                                                                *position = insert.content.len() as u8;
-                                                                println!("Received an acka with append position out of bounds.");
-                                                            }
-                                                        }
-                                                    },
-                                                    _ => ()
-                                                }
-                                            }
-
-                                            if insert.content.len() == acknowledged_position as usize
-                                            {
-                                                network.send_queue.remove(entry_index);
-                                            }
-                                        }
-                                    }
-                                }
-                            }
-
-                            else if 'd' as u8 == buffer[4]
-                            {
-                                if bytes == 4+1+2+4+1+1
-                                {
-                                    if backend_state.is_some()
-                                    {
-                                        let insert_ID = deserialize_u32(&buffer[7..11]);
-                                        let start_pos = buffer[11];
-                                        let end_pos = buffer[12];
-
-                                        if let Some(mut insert) = get_insert_by_ID_mut(insert_ID, &mut set)
-                                        {
-                                            if (start_pos <= end_pos) & (end_pos <= insert.content.len() as u8)
-                                            {
-                                                for i in start_pos as usize ..end_pos as usize
-                                                {
-                                                    insert.content[i] = 127 as char;
-                                                    text_buffer.needs_updating = true;
-                                                }
-
-                                                let mut ack_buffer = Vec::new();
-                                                ack_buffer.push('D' as u8);
-                                                serialize_u16(0, &mut ack_buffer);
-                                                serialize_u32(insert.ID, &mut ack_buffer);
-                                                ack_buffer.push(start_pos);
-                                                ack_buffer.push(end_pos);
-                                                network.send(&ack_buffer[..]);
-                                            }
-                                        }
-                                    }
-                                }
-                            }
-
-                            else if 'D' as u8 == buffer[4]
-                            {
-                                if bytes == 4+1+2+4+1+1
-                                {
-                                    let insert_ID = deserialize_u32(&buffer[7..11]);
-                                    let start_pos = buffer[11];
-                                    let end_pos = buffer[12];
-
-                                    if let Some(index) = network.get_queue_entry(insert_ID)
-                                    {
-                                        let entry = network.send_queue[index];
-                                        match entry.kind
-                                        {
-                                            SendType::Delete { start_pos: stored_start_pos, end_pos: stored_end_pos } =>
-                                            {
-                                                if (stored_start_pos == start_pos) & (stored_end_pos == end_pos)
-                                                {
-                                                    network.send_queue.remove(index);
-                                                }
-                                            },
-                                            _ => ()
-                                        }
-                                    }
-                                }
-                            }
+				match receiver.receive(&own_socket, round == 0) //TODO: use mio to check both the socket and the pipe
+				{
+					Ok(count) =>
+					{
+						for index in 0..count
+						{
+							let (datagram, address) = receiver.datagram(index);
+							let peer = match address.and_then(|address| network.peer_index(&address))
+							{
+								Some(peer) => peer,
+								None => continue
+							};
+
+							network.trace_received(peer, datagram);
+							network.peers[peer].last_heard = Instant::now();
+							handle_datagram(datagram, pad_ID, &mut set, &mut backend_state, &mut text_buffer, &mut network.peers[peer]);
+						}
+
+						if count < receiver.capacity()
+						{
+							break;
+						}
+					},
+					Err(_) => break
+				}
+			}
 
-                            else if buffer[4] == 'm' as u8
-                            {
-                                let message_id = deserialize_u32(&buffer[5..9]);
-                                let mut ack = Vec::with_capacity(5);
-                                ack.push('M' as u8);
-                                serialize_u32(message_id, &mut ack);
+            //send new and resend un-ACKed inserts
+            let now = Instant::now();
+            for peer in network.peers.iter_mut().filter(|peer| !peer.introduced & ((own_port < peer.address.port()) | peer.host))
+            {
+                let retry = match peer.init_request
+                {
+                    Some((time, _)) => now.duration_since(time) >= Duration::from_millis(INIT_RETRY_MS),
+                    None => true
+                };
 
-                                network.send(&ack[..]);
+                if retry
+                {
+                    //an older request that is still being retransmitted might not tell whether we are initialized anymore
+                    if let Some((_, message_id)) = peer.init_request
+                    {
+                        peer.cheap_queue.remove(&message_id);
+                    }
+                    let message_id = peer.send_cheap(&init_request(backend_state.is_some())[..]); //retry init
+                    peer.init_request = Some((now, message_id));
+                }
+            }
 
-                                println!(" | Message: {}", std::str::from_utf8(&buffer[9..bytes]).unwrap_or("<can't decode>"));
+            network.resend(&set, now);
 
-                                if let Ok(data) = tnetstring::decode(&mut &buffer[9..bytes])
-                                {
-                                    if let Some(&tnetstring::Data::String(ref message_type)) = tnetstring::get_field("type", &data)
-                                    {
-                                        let message_type = &message_type[..];
-
-                                        if message_type == "Init request"
-                                        {
-                                            match backend_state
-                                            {
-                                                None => backend_state = Some(ProtocolBackendState { start_ID: 1, end_ID: 1025, author_ID: 1 }), //TODO: find a better scheme for deciding initialization
-                                                Some(ProtocolBackendState { end_ID, .. }) =>
-                                                {
-                                                    let mut answer = Vec::new();
-                                                    tnetstring::encode_string_dict( vec![
-                                                                                        ("type", tnetstring::Data::String("Init".to_string())),
-                                                                                        ("start_ID", tnetstring::Data::Integer(end_ID as isize+1)),
-                                                                                        ("end_ID", tnetstring::Data::Integer(end_ID as isize+1025))
-                                                                                        ], &mut answer);
-
-                                                    network.send_cheap(&answer[..]);
-                                                }
-                                            }
-                                        }
-
-                                        else if message_type == "Init"
-                                        {
-                                            match backend_state
-                                            {
-                                                None =>
-                                                {
-                                                    if let (Some(&tnetstring::Data::Integer(start_ID)), Some(&tnetstring::Data::Integer(end_ID))) = (tnetstring::get_field("start_ID", &data), tnetstring::get_field("end_ID", &data))
-                                                    {
-                                                        backend_state = Some (ProtocolBackendState { start_ID: start_ID as u32, end_ID: end_ID as u32, author_ID: start_ID as u32 });
-                                                    }
-                                                },
-                                                _ => ()
-                                            }
-                                        }
-                                    }
-                                }
-                            }
+            let next_timeout = max(network.time_until_next_send(now), Duration::from_millis(1));
+            if next_timeout != read_timeout
+            {
+                read_timeout = next_timeout;
+                if let Err(error) = own_socket.set_read_timeout(Some(read_timeout))
+                {
+                    warn!("Failed to set the read timeout: {}", error);
+                }
+            }
 
-                            else if buffer[4] == 'M' as u8
-                            {
-                                let acknowledged_message_id = deserialize_u32(&buffer[5..9]);
-                                let mut delete_index = None;
-                                for i in 0..network.cheap_queue.len()
-                                {
-                                    if network.cheap_queue[i].0 == acknowledged_message_id
-                                    {
-                                        delete_index = Some(i);
-                                    }
-                                }
+            //drop deleted content once all peers know about the deletions
+            if now.duration_since(last_compaction) >= Duration::from_secs(COMPACTION_INTERVAL_SECONDS)
+            {
+                last_compaction = now;
 
-                                if let Some(index) = delete_index
-                                {
-                                    network.cheap_queue.remove(index);
-                                }
-                            }
-                        }
-                    }
-                },
-				Err(_) => ()
-			}
+                let network = &network;
+                let is_settled = |insert: &TextInsert| network.is_settled(insert.ID, now);
+                let compactable_bytes = set.compactable_bytes(&is_settled);
+                if (compactable_bytes >= MINIMUM_COMPACTABLE_BYTES) & (compactable_bytes*4 >= set.arena.len())
+                {
+                    set.compact(is_settled, text_buffer.active_insert);
+                }
+            }
 
-            //resend un-ACKed inserts
-            if resend_timer == 0
+            //anti-entropy: compare digests with the peers to repair divergence that acknowledgements didn't catch
+            if backend_state.is_some() && (now.duration_since(last_digest) >= Duration::from_secs(ANTI_ENTROPY_INTERVAL_SECONDS))
             {
-                network.resend(&set);
-
-                if backend_state.is_none() & (own_port < other_port)
+                last_digest = now;
+                for peer in network.peers.iter_mut().filter(|peer| peer.anti_entropy)
                 {
-                    network.send_cheap("23:4:type,12:Init request,}".as_bytes()); //retry init
+                    send_digest(&set, peer);
                 }
             }
-            resend_timer = (resend_timer+1)%3;
 			
 			//check input queue
 			{
-                while let Some(byte) = input_receiver.pop()
+                let input = &input_receiver;
+                let mut consumed = Vec::new();
                 {
-                    if let Some(character) = converter.input(byte)
+                    let mut next_byte = |wait: bool|
                     {
-                        if character == 127 as char
-                        {
-                            if text_buffer.needs_updating
-                            {
-                                render_text(&set, &mut text_buffer); //make sure we get the correct cursor position for deleting...
-                                text_buffer.needs_updating = false; //TODO: revisit whats going on with the cursor position here
-                            }
-
-                            if text_buffer.cursor_globalPos > 0
-                            {
-                                text_buffer.cursor_globalPos -= 1;
-                                delete_character(text_buffer.cursor_globalPos, &mut set, &mut network, &mut text_buffer);
-                                text_buffer.needs_updating = true;
-
-                                text_buffer.active_insert = None;
-
-                                text_buffer.needs_updating = true;
-                            }
-                        }
-
-                        else if character == 31 as char //ASCII unit separator: sent to indicate that the previous stream of text is terminated and cursor position must be updated
-                        {
-                            let mut new_cursor_pos: usize = 0;
-
-                            new_cursor_pos = input_receiver.blocking_pop() as usize;
-                            new_cursor_pos += (input_receiver.blocking_pop() as usize)<<8;
-                            new_cursor_pos += (input_receiver.blocking_pop() as usize)<<16;
-                            new_cursor_pos += (input_receiver.blocking_pop() as usize)<<32;
-
-                            if new_cursor_pos > text_buffer.text.len()
-                            {
-                                new_cursor_pos = text_buffer.text.len();
-                            }
-
-                            println!("new cursor position: {}", new_cursor_pos);
-                            text_buffer.cursor_globalPos = new_cursor_pos;
-
-                            text_buffer.active_insert = None;
-                            text_buffer.cursor_ID = None;
-                            text_buffer.cursor_charPos = None;
-                        }
+                        let byte = if wait { Some(input.blocking_pop()) } else { input.pop() };
+                        consumed.extend(byte);
+                        byte
+                    };
+                    handle_input(&mut next_byte, &mut converter, &mut set, &mut backend_state, &mut text_buffer, &mut network);
+                }
 
-                        else
-                        {
-                            match backend_state
-                            {
-                                None => println!("Got some keypresses, but weren't initialized."), //TODO: find better solution
-                                
-                                Some(ref mut inner_backend_state) =>
-                                {
-                                    insert_character(&mut set, character, &mut network, &mut text_buffer, inner_backend_state);
-                                    text_buffer.needs_updating = true;
-                                }
-                            }
-                        }
-                    }
+                if consumed.len() > 0
+                {
+                    network.trace_input(&consumed[..]);
                 }
 			}
 
             if text_buffer.needs_updating
             {
+                network.trace_rendered();
+                let start = Instant::now();
                 render_text(&set, &mut text_buffer);//TODO: initialize with correct cursor position
+                metrics::RENDER_TEXT.record(start.elapsed());
                 text_buffer.needs_updating = false;
 
-                println!("Newly rendered text: {:?}", &text_buffer.text);
-                println!("Data: {:?}", &set);
+                trace!("Newly rendered text: {:?}", &text_buffer.text);
+                trace!("Data: {:?}", &set);
 
                 sync_ready.store(true, Ordering::Relaxed);
+                let start = Instant::now();
                 while !buffer_locked.load(Ordering::Acquire) {}
+                metrics::GUI_WAIT.record(start.elapsed());
                 synchronize_buffers(&text_buffer, &c_pointers, &buffer_locked);
                 buffer_synced.store(true, Ordering::Relaxed);
             }
@@ -1150,6 +2562,8 @@ fn start_backend_safe (own_port: u16, other_port: u16, c_text_buffer_ptr: *mut T
                     }
                 }
             }
+
+            network.flush(&own_socket, &mut sender); //everything produced in this iteration leaves in as few datagrams as possible
 		}
 	}).expect("Could not start the backend thread. Good bye.");
 	
@@ -1166,156 +2580,469 @@ fn start_backend_safe (own_port: u16, other_port: u16, c_text_buffer_ptr: *mut T
 
 fn get_insert_by_ID (ID: u32, set: &TextInsertSet) -> Option<&TextInsert>
 {
-    for insert in set
+    match set.index.get(&ID)
     {
-        if insert.ID == ID
-        {
-            return Some(insert);
-        }
+        Some(&index) => Some(&set.inserts[index]),
+        None => None
     }
-
-    return None;
 }
 
 fn get_insert_by_ID_mut (ID: u32, set: &mut TextInsertSet) -> Option<&mut TextInsert>
 {
-    for insert in set
+    match set.index.get(&ID)
+    {
+        Some(&index) => Some(&mut set.inserts[index]),
+        None => None
+    }
+}
+
+fn get_insert_by_ID_index (ID: u32, set: &TextInsertSet) -> Option<usize>
+{
+    set.index.get(&ID).cloned()
+}
+        
+
+///Applies the keypresses and commands of the GUI. next_byte returns the next byte of the input stream or None if there is none; if asked
+///to wait, it blocks until there is one. Typed text is collected into runs that are inserted at once, up to the next command or the end
+///of the available input.
+fn handle_input<F: FnMut(bool) -> Option<u8>> (next_byte: &mut F, converter: &mut utf8::Utf8StreamConverter, set: &mut TextInsertSet, backend_state: &mut Option<ProtocolBackendState>,
+                                               text_buffer: &mut TextBufferInternal, network: &mut NetworkState)
+{
+    let mut run = String::new();
+    while let Some(byte) = next_byte(false)
     {
-        if insert.ID == ID
+        if let Some(character) = converter.input(byte)
         {
-            return Some(insert);
+            if (character != 127 as char) & (character != 31 as char)
+            {
+                run.push(character);
+                continue;
+            }
+
+            insert_run(&mut run, set, backend_state, text_buffer, network);
+
+            if character == 127 as char
+            {
+                if text_buffer.needs_updating
+                {
+                    render_text(set, text_buffer); //make sure we get the correct cursor position for deleting...
+                    //TODO: revisit whats going on with the cursor position here
+                    //needs_updating stays set: the changes rendered here still have to be handed to the GUI
+                }
+
+                if text_buffer.cursor_globalPos > 0
+                {
+                    text_buffer.cursor_globalPos -= 1;
+                    delete_character(text_buffer.cursor_globalPos, set, network, text_buffer);
+                    text_buffer.needs_updating = true;
+
+                    text_buffer.active_insert = None;
+
+                    text_buffer.needs_updating = true;
+                }
+            }
+
+            else //ASCII unit separator: sent to indicate that the previous stream of text is terminated and cursor position must be updated
+            {
+                let mut new_cursor_pos: usize = 0;
+
+                new_cursor_pos = next_byte(true).unwrap_or(0) as usize;
+                new_cursor_pos += (next_byte(true).unwrap_or(0) as usize)<<8;
+                new_cursor_pos += (next_byte(true).unwrap_or(0) as usize)<<16;
+                new_cursor_pos += (next_byte(true).unwrap_or(0) as usize)<<32;
+
+                if new_cursor_pos > text_buffer.text.len()
+                {
+                    new_cursor_pos = text_buffer.text.len();
+                }
+
+                debug!("new cursor position: {}", new_cursor_pos);
+                text_buffer.cursor_globalPos = new_cursor_pos;
+
+                text_buffer.active_insert = None;
+                text_buffer.cursor_ID = None;
+                text_buffer.cursor_charPos = None;
+            }
         }
     }
 
-    return None;
+    insert_run(&mut run, set, backend_state, text_buffer, network);
 }
 
-fn get_insert_by_ID_index (ID: u32, set: &TextInsertSet) -> Option<usize>
+///Inserts the collected run of typed text (if any) and empties it.
+fn insert_run (run: &mut String, set: &mut TextInsertSet, backend_state: &mut Option<ProtocolBackendState>, text_buffer: &mut TextBufferInternal, network: &mut NetworkState)
 {
-    for (index, insert) in set.iter().enumerate()
+    if run.len() == 0
+    {
+        return;
+    }
+
+    match *backend_state
     {
-        if insert.ID == ID
+        None => warn!("Got some keypresses, but weren't initialized."), //TODO: find better solution
+
+        Some(ref mut inner_backend_state) =>
         {
-            return Some(index);
+            insert_text(set, &run[..], network, text_buffer, inner_backend_state);
+            text_buffer.needs_updating = true;
         }
     }
-    return None;
+    run.clear();
 }
-        
 
-fn insert_character<'a> (set: &mut TextInsertSet, character: char, network: &mut NetworkState, text_buffer: &mut TextBufferInternal, state: &mut ProtocolBackendState)
+///Splits text after the given number of characters (or at its end).
+fn split_at_character (text: &str, characters: usize) -> (&str, &str)
 {
-    let mut make_new_insert = false;
-    if let Some(active_insert_ID) = text_buffer.active_insert
+    let byte_offset = text.char_indices().nth(characters).map_or(text.len(), |(byte_offset, _)| byte_offset);
+    text.split_at(byte_offset)
+}
+
+///Inserts text at the cursor. It is appended to the active insert as far as that has room, the rest goes into new inserts of up to
+///MAXIMUM_INSERT_LENGTH characters (LEGACY_INSERT_LENGTH while a peer doesn't understand wide positions); each insert is queued for
+///sending once, however long the text is.
+fn insert_text (set: &mut TextInsertSet, text: &str, network: &mut NetworkState, text_buffer: &mut TextBufferInternal, state: &mut ProtocolBackendState)
+{
+    let maximum_length = network.maximum_insert_length();
+    let mut rest = text;
+    while rest.len() > 0
     {
-        if let Some(active_insert) = get_insert_by_ID_mut(active_insert_ID, &mut *set)
+        let active_index = match text_buffer.active_insert
         {
-            if active_insert.content.len() < 255
-            {
-                network.enqueue_append(active_insert.ID, active_insert.content.len() as u8);
-                active_insert.content.push(character);
-                text_buffer.cursor_ID = Some(active_insert.ID);
-                text_buffer.cursor_charPos = Some(active_insert.content.len() as u8);
-            }
-            else
+            Some(active_insert_ID) =>
             {
-                make_new_insert = true;
-            }
+                let index = get_insert_by_ID_index(active_insert_ID, &*set);
+                if index.is_none()
+                {
+                    warn!("insert_text says: active_insert was not found in insert set (ID: {})", active_insert_ID);
+                    text_buffer.active_insert = None;
+                }
+                index.filter(|&index| set.inserts[index].content.len() < maximum_length)
+            },
+            None => None
+        };
+
+        if let Some(index) = active_index
+        {
+            let ID = set.inserts[index].ID;
+            let length = set.inserts[index].content.len();
+            let (appended, remainder) = split_at_character(rest, maximum_length - length);
+
+            network.enqueue_append(ID, length as u16);
+            set.push_str(index, appended);
+            text_buffer.cursor_ID = Some(ID);
+            text_buffer.cursor_charPos = Some(set.inserts[index].content.len() as u16);
+            rest = remainder;
         }
+
         else
         {
-            println!("insert_character says: active_insert was not found in insert set (ID: {})", active_insert_ID);
-            make_new_insert = false;
+            let (content, remainder) = split_at_character(rest, maximum_length);
+            let new_insert = new_insert_at_cursor(set, content, text_buffer, state);
+
+            text_buffer.cursor_ID = Some(new_insert.ID);
+            text_buffer.cursor_charPos = Some(new_insert.content.len() as u16);
+
+            text_buffer.active_insert = Some(new_insert.ID);
+            network.enqueue_full(new_insert.ID);
+
+            set.push(new_insert);
+            //TODO: send_now?
+            rest = remainder;
         }
     }
+}
 
-    else
+///Creates an insert with our next ID for content typed at the cursor, as the child of the character left of it (or, if that is an
+///ancestor of the character right of it, of that one).
+fn new_insert_at_cursor (set: &mut TextInsertSet, content: &str, text_buffer: &TextBufferInternal, state: &mut ProtocolBackendState) -> TextInsert
+{
+    let position = text_buffer.cursor_globalPos;
+
+    let (parent, parent_charPos): (u32, u16) =
+    if let (Some(ID), Some(charPos)) = (text_buffer.cursor_ID, text_buffer.cursor_charPos)
     {
-        make_new_insert = true;
+        (ID, charPos)
     }
 
-    if make_new_insert
+    else
     {
-        let position = text_buffer.cursor_globalPos;
-
-        let (parent, parent_charPos): (u32, u8) =
-        if let (Some(ID), Some(charPos)) = (text_buffer.cursor_ID, text_buffer.cursor_charPos)
+        if position == 0
         {
-            (ID, charPos)
+            match text_buffer.positions.lookup(position)
+            {
+                Some(ID_and_charPos) => ID_and_charPos,
+                None => (0, 0)
+            }
         }
-
         else
         {
-            if position == 0
+            let (left_ID, left_charPos) = text_buffer.positions.lookup(position-1).expect("insert_text says: cursor position is out of bounds.");
+
+            if position == text_buffer.positions.len()
             {
-                if text_buffer.ID_table.len() == 0
-                {
-                    (0, 0)
-                }
-                else
-                {
-                    (text_buffer.ID_table[position], text_buffer.charPos_table[position])
-                }
+                (left_ID, left_charPos + 1)
             }
             else
             {
-                if position == text_buffer.ID_table.len()
+                let (right_ID, right_charPos) = text_buffer.positions.lookup(position).unwrap();
+
+                let left_insert = get_insert_by_ID(left_ID, &*set).expect("insert_text says: the position table contains at least one ID that is does not belong to any insert currently in the insert set.");
+
+                let right_insert = get_insert_by_ID(right_ID, &*set).expect("insert_text says: the position table contains at least one ID that is does not belong to any insert currently in the insert set.");
+
+
+                if left_insert.is_ancestor_of(right_insert, &*set)
                 {
-                    (text_buffer.ID_table[position-1], text_buffer.charPos_table[position-1] + 1)
+                    (right_insert.ID, right_charPos)
                 }
                 else
                 {
-                    let left_insert = get_insert_by_ID(text_buffer.ID_table[position-1], &*set).expect("insert_character says: ID_table contains at least one ID that is does not belong to any insert currently in the insert set.");
-
-                    let right_insert = get_insert_by_ID(text_buffer.ID_table[position], &*set).expect("insert_character says: ID_table contains at least one ID that is does not belong to any insert currently in the insert set.");
-
-
-                    if left_insert.is_ancestor_of(right_insert, &*set)
-                    {
-                        (right_insert.ID, text_buffer.charPos_table[position])
-                    }
-                    else
-                    {
-                        (left_insert.ID, text_buffer.charPos_table[position-1] +1)
-                    }
+                    (left_insert.ID, left_charPos +1)
                 }
             }
+        }
+    };
+
+    let new_insert =
+        TextInsert
+        {
+            ID: state.start_ID,
+            parent: parent,
+            author: state.author_ID,
+            charPos: parent_charPos,
+            content: set.arena.allocate(content, 0)
         };
 
-        let new_insert = 
-            TextInsert
-            {
-                ID: state.start_ID,
-                parent: parent,
-                author: state.author_ID,
-                charPos: parent_charPos,
-                content: vec![character]
-            };
-        
+    state.start_ID += 1;
+    return new_insert;
+}
+
+#[test]
+fn test_insert_text ()
+{
+    let mut set = TextInsertSet::new();
+    let mut backend_state = Some(ProtocolBackendState::new(1, 1025));
+    let mut text_buffer = TextBufferInternal::new();
+    let mut network = NetworkState::new(0, 2001, framing::DEFAULT_MTU);
+    network.add_peer("127.0.0.1:2002".parse().unwrap());
+    let mut converter = utf8::Utf8StreamConverter::new();
+
+    //a paste of 600 characters fills up two inserts and starts a third one, each of them is queued once
+    let paste: String = (0..600).map(|i| if i%7 == 0 { 'ü' } else { char::from_u32('a' as u32 + i%26).unwrap() }).collect();
+    let mut bytes = paste.bytes();
+    handle_input(&mut |_| bytes.next(), &mut converter, &mut set, &mut backend_state, &mut text_buffer, &mut network);
+    let lengths: Vec<usize> = set.inserts.iter().map(|insert| insert.content.len()).collect();
+    assert_eq!(lengths, vec![255, 255, 90]);
+    assert_eq!((set.inserts[1].parent, set.inserts[1].charPos), (1, 255));
+    let contents: String = set.inserts.iter().map(|insert| set.arena.as_str(&insert.content)).collect();
+    assert_eq!(contents, paste);
+    assert_eq!(network.peers[0].send_queue.len(), 3);
+    assert_eq!((text_buffer.cursor_ID, text_buffer.cursor_charPos), (Some(3), Some(90)));
+
+    //typing on continues the last insert, a deletion ends the run
+    let mut bytes = "xyz\x7f!".bytes();
+    render_text(&set, &mut text_buffer);
+    text_buffer.cursor_globalPos = 600;
+    handle_input(&mut |_| bytes.next(), &mut converter, &mut set, &mut backend_state, &mut text_buffer, &mut network);
+    assert_eq!(set.inserts[2].content.len(), 93);
+    assert_eq!(set.inserts.len(), 4);
+    assert_eq!(set.arena.as_str(&set.inserts[3].content), "!");
+    assert_eq!(network.peers[0].send_queue.len(), 4);
+}
+
+#[test]
+fn test_long_inserts ()
+{
+    //once every peer understands wide positions, a pasted document takes a single insert instead of 236
+    let paste: String = (0..60000).map(|i| if i%7 == 0 { 'ü' } else { char::from_u32('a' as u32 + i%26).unwrap() }).collect();
+    let mut insert_counts = Vec::new();
+    for &version in [wire::VARINT_VERSION, wire::CURRENT_VERSION].iter()
+    {
+        let mut set = TextInsertSet::new();
+        let mut backend_state = Some(ProtocolBackendState::new(1, 1025));
+        let mut text_buffer = TextBufferInternal::new();
+        let mut network = NetworkState::new(0, 2001, framing::DEFAULT_MTU);
+        network.add_peer("127.0.0.1:2002".parse().unwrap());
+        network.peers[0].wire_version = version;
+        let mut bytes = paste.bytes();
+        handle_input(&mut |_| bytes.next(), &mut utf8::Utf8StreamConverter::new(), &mut set, &mut backend_state, &mut text_buffer, &mut network);
+        insert_counts.push(set.inserts.len());
+    }
+    assert_eq!(insert_counts, vec![236, 1]);
+
+    let mut set = TextInsertSet::new();
+    let content = set.arena.allocate(&paste[..], 0);
+    set.push( TextInsert { ID: 1, parent: 0, author: 1, charPos: 0, content: content } );
+    set.inserts[0].content.delete(100);
+    let mut backend_state = Some(ProtocolBackendState { start_ID: 2, ..ProtocolBackendState::founder() });
+
+    let address = "127.0.0.1:2001".parse().unwrap();
+    let (mut sending, mut receiving) = (Peer::new(address, framing::DEFAULT_MTU), Peer::new(address, framing::DEFAULT_MTU));
+    for peer in vec![&mut sending, &mut receiving]
+    {
+        peer.introduced = true;
+        peer.batcher.enabled = true;
+        peer.cumulative_acks = true;
+        peer.wire_version = wire::CURRENT_VERSION;
+    }
+    sending.enqueue_full(1);
+
+    //the content is split into records that fit into datagrams, all but the last one arrive
+    let mut received_set = TextInsertSet::new();
+    let mut received_backend_state = Some(ProtocolBackendState::new(1026, 2050));
+    let mut text_buffer = TextBufferInternal::new();
+    sending.resend(&set, &mut EncodedRecords::new(), Instant::now());
+    let datagrams = sending.batcher.finish().to_vec();
+    sending.batcher.clear();
+    assert!(datagrams.iter().all(|datagram| datagram.len() <= framing::DEFAULT_MTU));
+    let records: Vec<Vec<u8>> = datagrams.iter().flat_map(|datagram| framing::records(&datagram[4..]).map(|record| record.to_vec()).collect::<Vec<Vec<u8>>>()).collect();
+    for record in records[..records.len()-1].iter()
+    {
+        handle_record(&record[..], &mut received_set, &mut received_backend_state, &mut text_buffer, &mut receiving);
+    }
+    let received = received_set.inserts[0].content.len();
+    assert!((received > 255) & (received < 60000));
+
+    //after the acknowledgement, only the rest is sent again
+    deliver(&mut receiving, &received_set, &mut sending, &mut set, &mut backend_state);
+    let entry = sending.send_queue.get(&1).unwrap().clone();
+    assert_eq!((entry.full, entry.append_position), (false, Some(received as u16)));
+    assert!(sending.send_entry(1, &entry, &set, &mut EncodedRecords::new()) < framing::DEFAULT_MTU);
+    deliver(&mut sending, &set, &mut receiving, &mut received_set, &mut received_backend_state);
+    deliver(&mut receiving, &received_set, &mut sending, &mut set, &mut backend_state);
+    assert_eq!(sending.send_queue.len(), 0);
+
+    let mut expected_text = TextBufferInternal::new();
+    render_text(&set, &mut expected_text);
+    render_text(&received_set, &mut text_buffer);
+    assert_eq!(text_buffer.text.len(), 59999);
+    assert_eq!(text_buffer.text, expected_text.text);
+
+    //a peer that only knows positions up to 255 can't get the insert at all, so it isn't let in
+    for &version in [wire::VARINT_VERSION, wire::CURRENT_VERSION].iter()
+    {
+        let mut request = vec!['m' as u8];
+        write_u32(1, &mut request);
+        tnetstring::write_dict(&mut request, |dict|
+        {
+            dict.string("type", "Init request");
+            dict.bool("initialized", false);
+            dict.bool("snapshot", true);
+            dict.integer("wire_version", version as isize);
+        });
+        let mut joining = Peer::new(address, framing::DEFAULT_MTU);
+        handle_record(&request[..], &mut set, &mut backend_state, &mut text_buffer, &mut joining);
+
+        let refused = joining.cheap_queue.iter().any(|(_, message)| message.data.windows(12).any(|window| window == b"Init refused"));
+        assert_eq!((joining.refused, refused), (version == wire::VARINT_VERSION, version == wire::VARINT_VERSION));
+        assert_eq!((joining.ID_range.is_some(), joining.snapshot_out.is_some()), (!refused, !refused));
+    }
 
-        state.start_ID += 1;
+    //a legacy client that joined a host before the insert grew (relayed from a wide client) is turned away when the insert is due
+    let mut legacy = Peer::new(address, framing::DEFAULT_MTU);
+    legacy.introduced = true;
+    legacy.wire_version = wire::VARINT_VERSION;
+    legacy.enqueue_full(1);
+    legacy.resend(&set, &mut EncodedRecords::new(), Instant::now());
+    assert!(legacy.refused & legacy.send_queue.is_empty());
+    let datagrams = legacy.batcher.finish().to_vec(); //unbatched, one record each
+    assert_eq!(datagrams.len(), 1);
+    assert!(datagrams[0].windows(12).any(|window| window == b"Init refused"));
+
+    //the refused peer comes back with a current version on the same address and is let in again
+    let mut request = vec!['m' as u8];
+    write_u32(2, &mut request);
+    request.extend_from_slice(&init_request(false)[..]);
+    handle_record(&request[..], &mut set, &mut backend_state, &mut text_buffer, &mut legacy);
+    assert!(!legacy.refused & legacy.ID_range.is_some() & legacy.snapshot_out.is_some());
+    let mut network = NetworkState::new(0, 2001, framing::DEFAULT_MTU);
+    network.peers.push(legacy);
+    network.enqueue_full(1);
+    assert_eq!(network.peers[0].send_queue.len(), 1);
+
+    //a refused peer gets nothing queued and doesn't hold our inserts back to 255 characters
+    network = NetworkState::new(0, 2001, framing::DEFAULT_MTU);
+    network.add_peer("127.0.0.1:2002".parse().unwrap());
+    network.peers[0].wire_version = wire::VARINT_VERSION;
+    assert_eq!(network.maximum_insert_length(), LEGACY_INSERT_LENGTH);
+    network.peers[0].refused = true;
+    network.enqueue_full(1);
+    assert_eq!(network.peers[0].send_queue.len(), 0);
+    assert_eq!(network.maximum_insert_length(), MAXIMUM_INSERT_LENGTH);
+}
 
-        text_buffer.cursor_ID = Some(new_insert.ID);
-        text_buffer.cursor_charPos = Some(1);
+#[test]
+fn test_ID_grants ()
+{
+    //the founder grants to B, then both grant to a joiner of their own: all four must create inserts with different IDs
+    fn join (granter: &mut Option<ProtocolBackendState>) -> IDGrant
+    {
+        let mut request = vec!['m' as u8];
+        write_u32(1, &mut request);
+        request.extend_from_slice(&init_request(false)[..]);
+        let mut joining = Peer::new("127.0.0.1:2002".parse().unwrap(), framing::DEFAULT_MTU);
+        handle_record(&request[..], &mut TextInsertSet::new(), granter, &mut TextBufferInternal::new(), &mut joining);
+        handle_record(&request[..], &mut TextInsertSet::new(), granter, &mut TextBufferInternal::new(), &mut joining); //a retry
+        assert_eq!(joining.cheap_queue.len(), 2);
+        return joining.ID_range.unwrap();
+    }
 
-        text_buffer.active_insert = Some(new_insert.ID);
-        network.send_queue.push_back(SendQueueEntry { ID: new_insert.ID, kind: SendType::Full });
+    let mut founder = Some(ProtocolBackendState::founder());
+    let mut second = Some(ProtocolBackendState::granted(&join(&mut founder)));
+    let (third, fourth) = (join(&mut founder), join(&mut second));
 
-        set.push(new_insert);
-        //TODO: send_now?
+    let mut ranges = Vec::new();
+    for state in [founder.as_ref().unwrap(), second.as_ref().unwrap()].iter()
+    {
+        ranges.push((state.start_ID, state.end_ID));
+        ranges.push((state.pool_start_ID, state.pool_end_ID));
     }
-                
+    for grant in [third, fourth].iter()
+    {
+        ranges.push((grant.start_ID, grant.end_ID));
+        ranges.push((grant.pool_start_ID, grant.pool_end_ID));
+    }
+    ranges.sort();
+    assert!(ranges.iter().all(|&(start, end)| start <= end));
+    assert!(ranges.windows(2).all(|pair| pair[0].1 < pair[1].0), "{:?}", ranges);
+    assert_eq!(((third.start_ID, third.end_ID), fourth.end_ID - fourth.start_ID + 1), ((2*GRANTED_IDS + 1, 3*GRANTED_IDS), GRANTED_IDS));
+
+    //a granter whose pool is used up refuses instead of handing out IDs that are taken
+    let mut exhausted = Some(ProtocolBackendState::new(1, GRANTED_IDS));
+    let mut request = vec!['m' as u8];
+    write_u32(1, &mut request);
+    request.extend_from_slice(&init_request(false)[..]);
+    let mut joining = Peer::new("127.0.0.1:2002".parse().unwrap(), framing::DEFAULT_MTU);
+    handle_record(&request[..], &mut TextInsertSet::new(), &mut exhausted, &mut TextBufferInternal::new(), &mut joining);
+    assert!(joining.ID_range.is_none() & joining.snapshot_out.is_none());
+}
 
+#[test]
+fn test_idle_peers ()
+{
+    //a peer that has been gone for a long time doesn't keep inserts from settling, nor is it sent anything
+    let now = Instant::now();
+    let mut set = TextInsertSet::new();
+    let content = set.arena.allocate("abc", 0);
+    set.push( TextInsert { ID: 1, parent: 0, author: 1, charPos: 0, content: content } );
+    let mut network = NetworkState::new(0, 2001, framing::DEFAULT_MTU);
+    network.add_peer("127.0.0.1:2002".parse().unwrap());
+    network.enqueue_full(1);
+    assert!(!network.is_settled(1, now));
+
+    let later = network.peers[0].last_heard + Duration::from_secs(PEER_TIMEOUT_SECONDS);
+    assert!(network.is_settled(1, later));
+    network.resend(&set, later);
+    assert!(network.peers[0].send_queue.is_empty() & network.peers[0].batcher.finish().is_empty());
 }
 
 fn delete_character (position: usize, set: &mut TextInsertSet, network: &mut NetworkState, text_buffer: &mut TextBufferInternal)
 {
-    if position < text_buffer.ID_table.len()
+    if let Some((ID, position_in_insert)) = text_buffer.positions.lookup(position)
     {
-        let mut insert = get_insert_by_ID_mut(text_buffer.ID_table[position], &mut *set).expect("delete_character says: ID_table contains at least one ID that is not associated to any insert in our vector. This should not happen.");
+        let mut insert = get_insert_by_ID_mut(ID, &mut *set).expect("delete_character says: the position table contains at least one ID that is not associated to any insert in our vector. This should not happen.");
 
-        let position_in_insert = text_buffer.charPos_table[position];
-        insert.content[position_in_insert as usize] = 127 as char;
+        insert.content.delete(position_in_insert as usize);
         text_buffer.cursor_ID = Some(insert.ID);
         text_buffer.cursor_charPos = Some(position_in_insert);
 
@@ -1337,12 +3064,19 @@ pub unsafe extern fn rust_text_input (text: *const u8, length: i32, box_ptr: *mu
     {
         while ffi.sender.push(*text.offset(i)) == false
         {
-            println!("rust_text_input says: keypress buffer has run full");
+            warn!("rust_text_input says: keypress buffer has run full");
         }
     }
 	mem::forget(ffi);
 }
 
+///Writes out the queued log records, for the GUI to call before it exits.
+#[no_mangle]
+pub extern fn rust_flush_log ()
+{
+    log::flush();
+}
+
 #[no_mangle]
 pub unsafe extern fn rust_try_sync_text (ffi_data: *mut FFIData)
 {
@@ -0,0 +1,392 @@
+//Leveled logging that stays off the hot paths: error!, warn!, info!, debug! and trace! take format arguments like println!.
+//Levels above MAX_LEVEL are compiled out, it is chosen with the max_level_* features (cargo build --features max_level_info). At run time,
+//DECAPAD_LOG sets the level, by default and per module, e.g. DECAPAD_LOG=info,host=debug,rust_embed=trace (modules are named without the
+//crate, except the crate root itself); without it, only warnings and errors are logged.
+//Enabled records are formatted by the thread that logs them and put into a lock-free ring, from which a writer thread writes them to stderr,
+//so a slow terminal never blocks the backend. When the ring is full, records are dropped and counted rather than waited for. The writer
+//sleeps until a record is pushed; whatever it hasn't written yet when the process exits is lost unless flush is called first.
+
+use std::{env, fmt, io, thread};
+use std::thread::Thread;
+use std::cell::UnsafeCell;
+use std::io::Write;
+use std::sync::OnceLock;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::time::Instant;
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord)]
+pub enum Level
+{
+    Off,
+    Error,
+    Warn,
+    Info,
+    Debug,
+    Trace
+}
+
+pub const MAX_LEVEL: Level = if cfg!(feature = "max_level_off") { Level::Off }
+                             else if cfg!(feature = "max_level_error") { Level::Error }
+                             else if cfg!(feature = "max_level_warn") { Level::Warn }
+                             else if cfg!(feature = "max_level_info") { Level::Info }
+                             else if cfg!(feature = "max_level_debug") { Level::Debug }
+                             else { Level::Trace };
+
+const DEFAULT_LEVEL: Level = Level::Warn;
+const RING_CAPACITY: usize = 1024; //a power of two
+
+macro_rules! log
+{
+    ($level:expr, $($argument:tt)+) =>
+    {{
+        let level = $level;
+        if (level <= $crate::log::MAX_LEVEL) && $crate::log::enabled(level, module_path!())
+        {
+            $crate::log::write(level, module_path!(), format_args!($($argument)+));
+        }
+    }}
+}
+
+macro_rules! error { ($($argument:tt)+) => { log!($crate::log::Level::Error, $($argument)+) } }
+macro_rules! warn { ($($argument:tt)+) => { log!($crate::log::Level::Warn, $($argument)+) } }
+macro_rules! info { ($($argument:tt)+) => { log!($crate::log::Level::Info, $($argument)+) } }
+macro_rules! debug { ($($argument:tt)+) => { log!($crate::log::Level::Debug, $($argument)+) } }
+macro_rules! trace { ($($argument:tt)+) => { log!($crate::log::Level::Trace, $($argument)+) } }
+
+impl Level
+{
+    fn from_name (name: &str) -> Option<Level>
+    {
+        let level = match &name.trim().to_lowercase()[..]
+        {
+            "off" => Level::Off,
+            "error" => Level::Error,
+            "warn" | "warning" => Level::Warn,
+            "info" => Level::Info,
+            "debug" => Level::Debug,
+            "trace" => Level::Trace,
+            _ => return None
+        };
+        Some(level)
+    }
+
+    fn name (self) -> &'static str
+    {
+        match self
+        {
+            Level::Off => "OFF",
+            Level::Error => "ERROR",
+            Level::Warn => "WARN",
+            Level::Info => "INFO",
+            Level::Debug => "DEBUG",
+            Level::Trace => "TRACE"
+        }
+    }
+}
+
+#[derive(Debug)]
+struct Filter
+{
+    default: Level,
+    modules: Vec<(String, Level)>,
+    maximum: Level //of all of the above, to turn most disabled records away without looking at their module
+}
+
+impl Filter
+{
+    fn parse (specification: &str) -> Filter
+    {
+        let mut filter = Filter { default: DEFAULT_LEVEL, modules: Vec::new(), maximum: DEFAULT_LEVEL };
+        for directive in specification.split(',').map(|directive| directive.trim()).filter(|directive| directive.len() > 0)
+        {
+            let mut parts = directive.splitn(2, '=');
+            match (parts.next(), parts.next().map(Level::from_name))
+            {
+                (Some(module), Some(Some(level))) => filter.modules.push((module.trim().to_string(), level)),
+                (Some(level), None) => filter.default = Level::from_name(level).unwrap_or(filter.default),
+                _ => ()
+            }
+        }
+        filter.maximum = filter.modules.iter().map(|&(_, level)| level).fold(filter.default, ::std::cmp::max);
+        return filter;
+    }
+
+    ///The level of the most specific directive for the module (a directive for "host" covers "host" and "host::something").
+    fn level (&self, module_path: &str) -> Level
+    {
+        let module = module_path.splitn(2, "::").nth(1).unwrap_or(module_path);
+        let mut best: Option<(usize, Level)> = None;
+        for &(ref name, level) in self.modules.iter()
+        {
+            let matches = (module == &name[..]) || (module.starts_with(&name[..]) && module[name.len()..].starts_with("::"));
+            if matches && best.map_or(true, |(length, _)| name.len() > length)
+            {
+                best = Some((name.len(), level));
+            }
+        }
+        best.map_or(self.default, |(_, level)| level)
+    }
+}
+
+static FILTER: OnceLock<Filter> = OnceLock::new();
+
+fn filter () -> &'static Filter
+{
+    FILTER.get_or_init(|| Filter::parse(&env::var("DECAPAD_LOG").unwrap_or(String::new())))
+}
+
+pub fn enabled (level: Level, module_path: &str) -> bool
+{
+    let filter = filter();
+    (level != Level::Off) && (level <= filter.maximum) && (level <= filter.level(module_path))
+}
+
+
+///A bounded queue for any number of producers and consumers (Dmitry Vyukov's design): every slot carries a sequence number that tells
+///whose turn it is, so pushing and popping each take one compare-and-swap of a position and no lock.
+struct Ring
+{
+    slots: Box<[Slot]>,
+    push_position: AtomicUsize,
+    pop_position: AtomicUsize
+}
+
+struct Slot
+{
+    sequence: AtomicUsize,
+    record: UnsafeCell<Option<String>>
+}
+
+unsafe impl Sync for Ring {} //a slot's record is only touched by the thread that won its position
+
+impl Ring
+{
+    fn new (capacity: usize) -> Ring
+    {
+        assert!(capacity.is_power_of_two());
+        let slots: Vec<Slot> = (0..capacity).map(|index| Slot { sequence: AtomicUsize::new(index), record: UnsafeCell::new(None) }).collect();
+        Ring { slots: slots.into_boxed_slice(), push_position: AtomicUsize::new(0), pop_position: AtomicUsize::new(0) }
+    }
+
+    ///Gives the record back if the ring is full.
+    fn push (&self, record: String) -> Result<(), String>
+    {
+        let mut position = self.push_position.load(Ordering::Relaxed);
+        loop
+        {
+            let slot = &self.slots[position & (self.slots.len() - 1)];
+            let sequence = slot.sequence.load(Ordering::Acquire);
+            if sequence == position
+            {
+                match self.push_position.compare_exchange_weak(position, position + 1, Ordering::Relaxed, Ordering::Relaxed)
+                {
+                    Ok(_) =>
+                    {
+                        unsafe { *slot.record.get() = Some(record); }
+                        slot.sequence.store(position + 1, Ordering::Release);
+                        return Ok(());
+                    },
+                    Err(current) => position = current
+                }
+            }
+            else if sequence < position //the slot still holds the record from one lap ago
+            {
+                return Err(record);
+            }
+            else
+            {
+                position = self.push_position.load(Ordering::Relaxed);
+            }
+        }
+    }
+
+    fn pop (&self) -> Option<String>
+    {
+        let mut position = self.pop_position.load(Ordering::Relaxed);
+        loop
+        {
+            let slot = &self.slots[position & (self.slots.len() - 1)];
+            let sequence = slot.sequence.load(Ordering::Acquire);
+            if sequence == position + 1
+            {
+                match self.pop_position.compare_exchange_weak(position, position + 1, Ordering::Relaxed, Ordering::Relaxed)
+                {
+                    Ok(_) =>
+                    {
+                        let record = unsafe { (*slot.record.get()).take() };
+                        slot.sequence.store(position + self.slots.len(), Ordering::Release);
+                        return record;
+                    },
+                    Err(current) => position = current
+                }
+            }
+            else if sequence < position + 1 //empty
+            {
+                return None;
+            }
+            else
+            {
+                position = self.pop_position.load(Ordering::Relaxed);
+            }
+        }
+    }
+}
+
+struct Logger
+{
+    ring: Ring,
+    start: Instant,
+    dropped: AtomicUsize,
+    writer: Option<Thread> //if there is none, the logging threads write
+}
+
+static LOGGER: OnceLock<Logger> = OnceLock::new();
+
+fn logger () -> &'static Logger
+{
+    LOGGER.get_or_init(||
+    {
+        let spawned = thread::Builder::new().name("Log".to_string()).spawn(||
+        {
+            loop
+            {
+                if !drain()
+                {
+                    thread::park(); //a push in between leaves the token behind, so it returns right away
+                }
+            }
+        });
+        if let Err(ref error) = spawned
+        {
+            eprintln!("Failed to start the log writer, logging from the calling threads: {}", error);
+        }
+        Logger { ring: Ring::new(RING_CAPACITY), start: Instant::now(), dropped: AtomicUsize::new(0), writer: spawned.ok().map(|writer| writer.thread().clone()) }
+    })
+}
+
+///Writes out the queued records. Returns whether there were any.
+fn drain () -> bool
+{
+    let logger = logger();
+    let stderr = io::stderr();
+    let mut output = stderr.lock();
+    let mut written = false;
+
+    let dropped = logger.dropped.swap(0, Ordering::Relaxed);
+    if dropped > 0
+    {
+        let _ = write!(output, "{} log records were dropped, the log writer couldn't keep up\n", dropped);
+        written = true;
+    }
+
+    while let Some(record) = logger.ring.pop()
+    {
+        let _ = output.write_all(record.as_bytes());
+        written = true;
+    }
+    let _ = output.flush();
+    return written;
+}
+
+pub fn write (level: Level, module_path: &str, arguments: fmt::Arguments)
+{
+    let logger = logger();
+    let elapsed = logger.start.elapsed();
+    let record = format!("{:5}.{:06} {:5} {}: {}\n", elapsed.as_secs(), elapsed.subsec_micros(), level.name(), module_path, arguments);
+    if logger.ring.push(record).is_err()
+    {
+        logger.dropped.fetch_add(1, Ordering::Relaxed);
+    }
+    match logger.writer
+    {
+        Some(ref writer) => writer.unpark(),
+        None => { drain(); }
+    }
+}
+
+///Writes out everything logged so far from the calling thread, e.g. before the process exits.
+pub fn flush ()
+{
+    if LOGGER.get().is_some()
+    {
+        drain();
+    }
+}
+
+
+#[test]
+fn test_filter ()
+{
+    let filter = Filter::parse("info, host=debug,host::storage=off,rust_embed=trace,bogus=loud");
+    assert_eq!(filter.default, Level::Info);
+    assert_eq!(filter.maximum, Level::Trace);
+    assert_eq!(filter.level("rust_embed"), Level::Trace);
+    assert_eq!(filter.level("rust_embed::host"), Level::Debug);
+    assert_eq!(filter.level("rust_embed::host::storage"), Level::Off);
+    assert_eq!(filter.level("rust_embed::hosted"), Level::Info);
+    assert_eq!(filter.level("rust_embed::snapshot"), Level::Info);
+
+    let filter = Filter::parse("");
+    assert_eq!((filter.default, filter.maximum), (DEFAULT_LEVEL, DEFAULT_LEVEL));
+}
+
+#[test]
+fn test_ring ()
+{
+    let ring = Ring::new(4);
+    assert_eq!(ring.pop(), None);
+    for round in 0..3
+    {
+        for index in 0..4
+        {
+            assert!(ring.push(format!("{} {}", round, index)).is_ok());
+        }
+        assert_eq!(ring.push("overflow".to_string()), Err("overflow".to_string()));
+        for index in 0..4
+        {
+            assert_eq!(ring.pop(), Some(format!("{} {}", round, index)));
+        }
+        assert_eq!(ring.pop(), None);
+    }
+
+    //producers on several threads, every record arrives exactly once
+    let ring = ::std::sync::Arc::new(Ring::new(64));
+    let producers: Vec<_> = (0..4).map(|producer|
+    {
+        let ring = ring.clone();
+        thread::spawn(move ||
+        {
+            for index in 0..1000
+            {
+                let mut record = format!("{}", producer * 1000 + index);
+                while let Err(returned) = ring.push(record)
+                {
+                    record = returned;
+                    thread::yield_now();
+                }
+            }
+        })
+    }).collect();
+
+    let mut seen = vec![false; 4000];
+    let mut count = 0;
+    while count < 4000
+    {
+        match ring.pop()
+        {
+            Some(record) =>
+            {
+                let number: usize = record.parse().unwrap();
+                assert!(!seen[number]);
+                seen[number] = true;
+                count += 1;
+            },
+            None => thread::yield_now()
+        }
+    }
+    for producer in producers
+    {
+        producer.join().unwrap();
+    }
+    assert_eq!(ring.pop(), None);
+}
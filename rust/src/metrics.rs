@@ -0,0 +1,465 @@
+//Process wide metrics: counters, gauges and latency histograms, kept in statics of atomics so that every thread (the backend, the workers
+//of a host) updates them without taking a lock. With DECAPAD_METRICS set, a thread exports a snapshot in the Prometheus text format:
+//  DECAPAD_METRICS=<file>        the file is rewritten every EXPORT_INTERVAL_SECONDS (through a temporary file, so readers never see half
+//                                of a snapshot)
+//  DECAPAD_METRICS=unix:<path>   a Unix domain socket at the path answers every connection with the current snapshot (only on Unix)
+//Histograms are HDR style: values are sorted into 16 linear sub-buckets per power of two, which bounds the error of a quantile to 1/16
+//of its value over the whole range.
+
+use std::{env, fs, thread};
+use std::fmt::Write as FmtWrite;
+use std::io::Write;
+#[cfg(unix)]
+use std::os::unix::net::UnixListener;
+use std::path::PathBuf;
+use std::sync::Once;
+use std::sync::atomic::{AtomicU64, AtomicI64, Ordering};
+use std::time::Duration;
+
+use framing;
+use wire;
+
+const EXPORT_INTERVAL_SECONDS: u64 = 5;
+const SUB_BUCKET_BITS: u32 = 4;
+const SUB_BUCKETS: usize = 1<<SUB_BUCKET_BITS;
+const BUCKETS: usize = (64 - SUB_BUCKET_BITS as usize + 1) * SUB_BUCKETS;
+const QUANTILES: [f64; 4] = [0.5, 0.9, 0.99, 0.999];
+
+pub struct Counter (AtomicU64);
+
+impl Counter
+{
+    pub const fn new () -> Counter
+    {
+        Counter(AtomicU64::new(0))
+    }
+
+    pub fn add (&self, value: u64)
+    {
+        self.0.fetch_add(value, Ordering::Relaxed);
+    }
+
+    pub fn increment (&self)
+    {
+        self.add(1);
+    }
+
+    pub fn get (&self) -> u64
+    {
+        self.0.load(Ordering::Relaxed)
+    }
+}
+
+///A level that several owners contribute to, each adding its changes (see QueueDepths).
+pub struct Gauge (AtomicI64);
+
+impl Gauge
+{
+    pub const fn new () -> Gauge
+    {
+        Gauge(AtomicI64::new(0))
+    }
+
+    pub fn add (&self, value: i64)
+    {
+        self.0.fetch_add(value, Ordering::Relaxed);
+    }
+
+    pub fn get (&self) -> i64
+    {
+        self.0.load(Ordering::Relaxed)
+    }
+}
+
+///Durations in nanoseconds.
+pub struct Histogram
+{
+    buckets: [AtomicU64; BUCKETS],
+    count: AtomicU64,
+    sum: AtomicU64
+}
+
+const ZERO: AtomicU64 = AtomicU64::new(0);
+
+fn bucket_index (value: u64) -> usize
+{
+    if value < SUB_BUCKETS as u64
+    {
+        return value as usize;
+    }
+    let exponent = 63 - value.leading_zeros(); //at least SUB_BUCKET_BITS
+    let sub_bucket = (value >> (exponent - SUB_BUCKET_BITS)) as usize & (SUB_BUCKETS - 1);
+    (exponent - SUB_BUCKET_BITS + 1) as usize * SUB_BUCKETS + sub_bucket
+}
+
+///The largest value that is sorted into the bucket.
+fn bucket_limit (index: usize) -> u64
+{
+    if index < SUB_BUCKETS
+    {
+        return index as u64;
+    }
+    let exponent = (index / SUB_BUCKETS) as u32 + SUB_BUCKET_BITS - 1;
+    let lowest = ((SUB_BUCKETS + index % SUB_BUCKETS) as u64) << (exponent - SUB_BUCKET_BITS);
+    lowest + ((1u64 << (exponent - SUB_BUCKET_BITS)) - 1)
+}
+
+impl Histogram
+{
+    pub const fn new () -> Histogram
+    {
+        Histogram { buckets: [ZERO; BUCKETS], count: AtomicU64::new(0), sum: AtomicU64::new(0) }
+    }
+
+    pub fn record (&self, duration: Duration)
+    {
+        let nanoseconds = duration.as_secs().saturating_mul(1_000_000_000).saturating_add(duration.subsec_nanos() as u64);
+        self.buckets[bucket_index(nanoseconds)].fetch_add(1, Ordering::Relaxed);
+        self.count.fetch_add(1, Ordering::Relaxed);
+        self.sum.fetch_add(nanoseconds, Ordering::Relaxed);
+    }
+
+    pub fn count (&self) -> u64
+    {
+        self.count.load(Ordering::Relaxed)
+    }
+
+    ///The upper bound of the bucket the quantile falls into, in nanoseconds. The buckets are read one by one while other threads may be
+    ///recording, so this is exact only for a histogram nobody writes to.
+    pub fn quantile (&self, quantile: f64) -> u64
+    {
+        let counts: Vec<u64> = self.buckets.iter().map(|bucket| bucket.load(Ordering::Relaxed)).collect();
+        let total: u64 = counts.iter().sum();
+        let rank = ((quantile * total as f64).ceil() as u64).max(1);
+        let mut seen = 0;
+        for (index, &count) in counts.iter().enumerate()
+        {
+            seen += count;
+            if seen >= rank
+            {
+                return bucket_limit(index);
+            }
+        }
+        return 0;
+    }
+}
+
+///Records and their bytes by type, the type being the first byte of a record.
+pub struct RecordCounters
+{
+    records: [Counter; 256],
+    bytes: [Counter; 256]
+}
+
+const NO_RECORDS: Counter = Counter::new();
+
+impl RecordCounters
+{
+    pub const fn new () -> RecordCounters
+    {
+        RecordCounters { records: [NO_RECORDS; 256], bytes: [NO_RECORDS; 256] }
+    }
+
+    pub fn record (&self, record: &[u8])
+    {
+        if let Some(&tag) = record.first()
+        {
+            self.records[tag as usize].increment();
+            self.bytes[tag as usize].add(record.len() as u64);
+        }
+    }
+
+    ///Counts the records of a datagram, including its checksum.
+    pub fn datagram (&self, datagram: &[u8])
+    {
+        if datagram.len() < 4
+        {
+            return;
+        }
+        let (_, payload) = framing::split_pad(&datagram[4..]);
+        if framing::is_batch(payload)
+        {
+            for record in framing::records(payload)
+            {
+                self.record(record);
+            }
+        }
+        else
+        {
+            self.record(payload);
+        }
+    }
+}
+
+pub static DATAGRAMS_RECEIVED: Counter = Counter::new();
+pub static DATAGRAM_BYTES_RECEIVED: Counter = Counter::new();
+pub static DATAGRAMS_SENT: Counter = Counter::new();
+pub static DATAGRAM_BYTES_SENT: Counter = Counter::new();
+pub static SEND_FAILURES: Counter = Counter::new();
+pub static CHECKSUM_FAILURES: Counter = Counter::new();
+pub static RETRANSMISSIONS: Counter = Counter::new();
+pub static RECEIVED_RECORDS: RecordCounters = RecordCounters::new();
+pub static SENT_RECORDS: RecordCounters = RecordCounters::new();
+pub static SEND_QUEUE_DEPTH: Gauge = Gauge::new();
+pub static CHEAP_QUEUE_DEPTH: Gauge = Gauge::new();
+pub static RENDER_TEXT: Histogram = Histogram::new();
+pub static SYNCHRONIZE_BUFFERS: Histogram = Histogram::new();
+pub static GUI_WAIT: Histogram = Histogram::new(); //how long the backend spins until the GUI locks its buffer for a sync
+
+///The share of one NetworkState in the queue depth gauges, taken back when it is dropped.
+#[derive(Debug, Default)]
+pub struct QueueDepths
+{
+    send_queue: i64,
+    cheap_queue: i64
+}
+
+impl QueueDepths
+{
+    pub fn update (&mut self, send_queue: usize, cheap_queue: usize)
+    {
+        SEND_QUEUE_DEPTH.add(send_queue as i64 - self.send_queue);
+        CHEAP_QUEUE_DEPTH.add(cheap_queue as i64 - self.cheap_queue);
+        self.send_queue = send_queue as i64;
+        self.cheap_queue = cheap_queue as i64;
+    }
+}
+
+impl Drop for QueueDepths
+{
+    fn drop (&mut self)
+    {
+        self.update(0, 0);
+    }
+}
+
+fn record_type_name (tag: u8) -> Option<&'static str>
+{
+    let name = match tag
+    {
+        b'i' => "insert",
+        b'a' => "append",
+        b'd' => "delete",
+        tag if tag == b'i' | wire::V2_TAG_BIT => "insert_v2",
+        tag if tag == b'a' | wire::V2_TAG_BIT => "append_v2",
+        tag if tag == b'd' | wire::V2_TAG_BIT => "delete_v2",
+        b'I' => "insert_ack",
+        b'A' => "append_ack",
+        b'D' => "delete_ack",
+        b'K' => "cumulative_ack",
+        tag if tag == b'K' | wire::V2_TAG_BIT => "cumulative_ack_wide",
+        b'm' => "message",
+        b'M' => "message_ack",
+        b'S' => "snapshot_chunk",
+        b'T' => "snapshot_ack",
+        _ => return None
+    };
+    Some(name)
+}
+
+fn write_header (output: &mut String, name: &str, kind: &str, help: &str)
+{
+    let _ = write!(output, "# HELP decapad_{} {}\n# TYPE decapad_{} {}\n", name, help, name, kind);
+}
+
+fn write_counter (output: &mut String, name: &str, help: &str, counter: &Counter)
+{
+    write_header(output, name, "counter", help);
+    let _ = write!(output, "decapad_{} {}\n", name, counter.get());
+}
+
+fn write_gauge (output: &mut String, name: &str, help: &str, gauge: &Gauge)
+{
+    write_header(output, name, "gauge", help);
+    let _ = write!(output, "decapad_{} {}\n", name, gauge.get());
+}
+
+fn write_records (output: &mut String, direction: &str, counters: &RecordCounters)
+{
+    let name = format!("records_{}_total", direction);
+    write_header(output, &name, "counter", &format!("Protocol records {} by type.", direction));
+    let mut other = 0;
+    for tag in 0..256
+    {
+        let count = counters.records[tag].get();
+        match record_type_name(tag as u8)
+        {
+            Some(type_name) => { let _ = write!(output, "decapad_{}{{type=\"{}\"}} {}\n", name, type_name, count); },
+            None => other += count
+        }
+    }
+    let _ = write!(output, "decapad_{}{{type=\"other\"}} {}\n", name, other);
+
+    let name = format!("record_bytes_{}_total", direction);
+    write_header(output, &name, "counter", &format!("Bytes of the protocol records {} by type, without framing.", direction));
+    let mut other = 0;
+    for tag in 0..256
+    {
+        let bytes = counters.bytes[tag].get();
+        match record_type_name(tag as u8)
+        {
+            Some(type_name) => { let _ = write!(output, "decapad_{}{{type=\"{}\"}} {}\n", name, type_name, bytes); },
+            None => other += bytes
+        }
+    }
+    let _ = write!(output, "decapad_{}{{type=\"other\"}} {}\n", name, other);
+}
+
+fn write_histogram (output: &mut String, name: &str, help: &str, histogram: &Histogram)
+{
+    write_header(output, name, "summary", help);
+    for &quantile in QUANTILES.iter()
+    {
+        let _ = write!(output, "decapad_{}{{quantile=\"{}\"}} {:.9}\n", name, quantile, histogram.quantile(quantile) as f64 / 1e9);
+    }
+    let _ = write!(output, "decapad_{}_sum {:.9}\ndecapad_{}_count {}\n", name, histogram.sum.load(Ordering::Relaxed) as f64 / 1e9, name,
+                   histogram.count());
+}
+
+///A snapshot of all metrics in the Prometheus text exposition format.
+pub fn exposition () -> String
+{
+    let mut output = String::with_capacity(8192);
+    write_counter(&mut output, "datagrams_received_total", "Datagrams received from peers.", &DATAGRAMS_RECEIVED);
+    write_counter(&mut output, "datagram_bytes_received_total", "Bytes of the datagrams received from peers.", &DATAGRAM_BYTES_RECEIVED);
+    write_counter(&mut output, "datagrams_sent_total", "Datagrams sent to peers.", &DATAGRAMS_SENT);
+    write_counter(&mut output, "datagram_bytes_sent_total", "Bytes of the datagrams sent to peers.", &DATAGRAM_BYTES_SENT);
+    write_counter(&mut output, "send_failures_total", "Datagrams that the socket didn't take.", &SEND_FAILURES);
+    write_counter(&mut output, "checksum_failures_total", "Received datagrams dropped for a wrong checksum.", &CHECKSUM_FAILURES);
+    write_counter(&mut output, "retransmissions_total", "Records sent again because they weren't acknowledged in time.", &RETRANSMISSIONS);
+    write_records(&mut output, "received", &RECEIVED_RECORDS);
+    write_records(&mut output, "sent", &SENT_RECORDS);
+    write_gauge(&mut output, "send_queue_depth", "Inserts waiting for acknowledgement, summed over all peers.", &SEND_QUEUE_DEPTH);
+    write_gauge(&mut output, "cheap_queue_depth", "Messages waiting for acknowledgement, summed over all peers.", &CHEAP_QUEUE_DEPTH);
+    write_histogram(&mut output, "render_text_seconds", "Time spent in render_text.", &RENDER_TEXT);
+    write_histogram(&mut output, "synchronize_buffers_seconds", "Time spent copying the text into the GUI's buffer.", &SYNCHRONIZE_BUFFERS);
+    write_histogram(&mut output, "gui_wait_seconds", "Time spent waiting for the GUI to lock its buffer for a sync.", &GUI_WAIT);
+    return output;
+}
+
+fn export_to_file (path: PathBuf)
+{
+    let mut temporary = path.clone().into_os_string();
+    temporary.push(".tmp");
+    loop
+    {
+        let result = fs::File::create(&temporary).and_then(|mut file| file.write_all(exposition().as_bytes())).and_then(|_| fs::rename(&temporary, &path));
+        if let Err(error) = result
+        {
+            error!("Failed to export the metrics to {:?}: {}", path, error);
+        }
+        thread::sleep(Duration::from_secs(EXPORT_INTERVAL_SECONDS));
+    }
+}
+
+#[cfg(unix)]
+fn export_to_socket (path: PathBuf)
+{
+    let _ = fs::remove_file(&path); //left over by an earlier process
+    let listener = match UnixListener::bind(&path)
+    {
+        Ok(listener) => listener,
+        Err(error) =>
+        {
+            error!("Failed to export the metrics on {:?}: {}", path, error);
+            return;
+        }
+    };
+
+    for connection in listener.incoming()
+    {
+        if let Ok(mut connection) = connection
+        {
+            let _ = connection.set_write_timeout(Some(Duration::from_secs(1))); //a stuck reader mustn't stop the exporter
+            let _ = connection.write_all(exposition().as_bytes());
+        }
+    }
+}
+
+#[cfg(not(unix))]
+fn export_to_socket (path: PathBuf)
+{
+    error!("Failed to export the metrics on {:?}: Unix domain sockets are not available on this platform", path);
+}
+
+static EXPORTER: Once = Once::new();
+
+///Starts exporting if DECAPAD_METRICS asks for it, once per process however many backends or hosts there are.
+pub fn start_exporter ()
+{
+    EXPORTER.call_once(||
+    {
+        let target = match env::var("DECAPAD_METRICS")
+        {
+            Ok(target) => target,
+            Err(_) => return
+        };
+
+        let spawned = if target.starts_with("unix:")
+        {
+            let path = PathBuf::from(&target["unix:".len()..]);
+            thread::Builder::new().name("Metrics".to_string()).spawn(move || export_to_socket(path))
+        }
+        else
+        {
+            let path = PathBuf::from(target);
+            thread::Builder::new().name("Metrics".to_string()).spawn(move || export_to_file(path))
+        };
+        if let Err(error) = spawned
+        {
+            error!("Failed to start the metrics exporter: {}", error);
+        }
+    });
+}
+
+
+#[test]
+fn test_histogram ()
+{
+    for &value in [0, 1, 15, 16, 17, 31, 32, 1000, 123456789, u64::max_value()].iter()
+    {
+        let index = bucket_index(value);
+        assert!(index < BUCKETS);
+        assert!(value <= bucket_limit(index));
+        assert!((index == 0) || (value > bucket_limit(index - 1)));
+        assert!(bucket_limit(index) - value <= value / SUB_BUCKETS as u64);
+    }
+
+    let histogram = Histogram::new();
+    for microseconds in 1..1001
+    {
+        histogram.record(Duration::from_micros(microseconds));
+    }
+    assert_eq!(histogram.count(), 1000);
+    for &(quantile, expected) in [(0.5, 500_000), (0.99, 990_000), (1.0, 1_000_000)].iter()
+    {
+        let value = histogram.quantile(quantile);
+        assert!((value >= expected) && (value - expected <= expected / SUB_BUCKETS as u64), "{} {}", quantile, value);
+    }
+}
+
+#[test]
+fn test_exposition ()
+{
+    let counters = RecordCounters::new();
+    let mut datagram = vec![0, 0, 0, 0, framing::BATCH_TAG, 0, 2, b'K', 1, 0, 3, b'm', 1, 2];
+    counters.datagram(&datagram[..]);
+    datagram.truncate(4);
+    datagram.extend_from_slice(&[b'i' | wire::V2_TAG_BIT, 1, 2, 3]);
+    counters.datagram(&datagram[..]);
+    assert_eq!((counters.records[b'K' as usize].get(), counters.bytes[b'm' as usize].get()), (1, 3));
+    assert_eq!(counters.records[(b'i' | wire::V2_TAG_BIT) as usize].get(), 1);
+
+    let mut output = String::new();
+    write_records(&mut output, "received", &counters);
+    assert!(output.contains("# TYPE decapad_records_received_total counter\n"));
+    assert!(output.contains("decapad_records_received_total{type=\"cumulative_ack\"} 1\n"));
+    assert!(output.contains("decapad_record_bytes_received_total{type=\"insert_v2\"} 4\n"));
+
+    {
+        let mut depths = QueueDepths::default();
+        depths.update(3, 1);
+        depths.update(2, 1);
+        assert!(exposition().contains("# TYPE decapad_render_text_seconds summary\n"));
+    }
+}
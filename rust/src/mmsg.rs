@@ -0,0 +1,300 @@
+//Sends and receives several datagrams with one system call (sendmmsg/recvmmsg on Linux, one send_to/recv_from per datagram elsewhere).
+//The header arrays and buffers are kept between calls, so neither direction allocates once they have grown to the usual number of datagrams.
+
+use std::{io, net, mem, ptr};
+
+#[cfg(target_os = "linux")]
+use std::os::unix::io::AsRawFd;
+
+const MAXIMUM_MESSAGES_PER_CALL: usize = 1024; //UIO_MAXIOV
+pub const RECEIVE_BUFFER_LENGTH: usize = 10000;
+pub const RECEIVE_BATCH: usize = 64;
+
+pub struct DatagramSender
+{
+    #[cfg(target_os = "linux")]
+    headers: Vec<::libc::mmsghdr>,
+    #[cfg(target_os = "linux")]
+    iovecs: Vec<::libc::iovec>
+}
+
+impl ::std::fmt::Debug for DatagramSender
+{
+    fn fmt (&self, formatter: &mut ::std::fmt::Formatter) -> ::std::fmt::Result
+    {
+        write!(formatter, "DatagramSender")
+    }
+}
+
+impl DatagramSender
+{
+    #[cfg(target_os = "linux")]
+    pub fn new () -> DatagramSender
+    {
+        DatagramSender { headers: Vec::new(), iovecs: Vec::new() }
+    }
+
+    #[cfg(not(target_os = "linux"))]
+    pub fn new () -> DatagramSender
+    {
+        DatagramSender {}
+    }
+
+    ///Returns the number of datagrams that have been sent, which is less than given only if there was an error.
+    #[cfg(target_os = "linux")]
+    pub fn send_all (&mut self, socket: &net::UdpSocket, address: &net::SocketAddr, datagrams: &[Vec<u8>]) -> io::Result<usize>
+    {
+        let mut address_storage: ::libc::sockaddr_in = unsafe { mem::zeroed() };
+        match *address
+        {
+            net::SocketAddr::V4(ref address) =>
+            {
+                address_storage.sin_family = ::libc::AF_INET as ::libc::sa_family_t;
+                address_storage.sin_port = address.port().to_be();
+                address_storage.sin_addr = ::libc::in_addr { s_addr: u32::from_ne_bytes(address.ip().octets()) };
+            },
+            net::SocketAddr::V6(_) => return send_one_by_one(socket, address, datagrams)
+        }
+
+        let mut sent = 0;
+        while sent < datagrams.len()
+        {
+            let count = ::std::cmp::min(datagrams.len() - sent, MAXIMUM_MESSAGES_PER_CALL);
+
+            self.iovecs.clear();
+            for datagram in datagrams[sent..sent+count].iter()
+            {
+                self.iovecs.push(::libc::iovec { iov_base: datagram.as_ptr() as *mut ::libc::c_void, iov_len: datagram.len() });
+            }
+
+            self.headers.clear();
+            for iovec in self.iovecs.iter_mut()
+            {
+                let mut header: ::libc::mmsghdr = unsafe { mem::zeroed() };
+                header.msg_hdr.msg_name = &mut address_storage as *mut ::libc::sockaddr_in as *mut ::libc::c_void;
+                header.msg_hdr.msg_namelen = mem::size_of::<::libc::sockaddr_in>() as ::libc::socklen_t;
+                header.msg_hdr.msg_iov = iovec as *mut ::libc::iovec;
+                header.msg_hdr.msg_iovlen = 1;
+                header.msg_hdr.msg_control = ptr::null_mut();
+                self.headers.push(header);
+            }
+
+            let result = unsafe { ::libc::sendmmsg(socket.as_raw_fd(), self.headers.as_mut_ptr(), count as _, 0 as _) };
+            if result < 0
+            {
+                let error = io::Error::last_os_error();
+                if error.kind() == io::ErrorKind::Interrupted
+                {
+                    continue;
+                }
+                return if sent > 0 { Ok(sent) } else { Err(error) };
+            }
+
+            sent += result as usize;
+        }
+
+        return Ok(sent);
+    }
+
+    #[cfg(not(target_os = "linux"))]
+    pub fn send_all (&mut self, socket: &net::UdpSocket, address: &net::SocketAddr, datagrams: &[Vec<u8>]) -> io::Result<usize>
+    {
+        send_one_by_one(socket, address, datagrams)
+    }
+}
+
+fn send_one_by_one (socket: &net::UdpSocket, address: &net::SocketAddr, datagrams: &[Vec<u8>]) -> io::Result<usize>
+{
+    for (index, datagram) in datagrams.iter().enumerate()
+    {
+        if let Err(error) = socket.send_to(&datagram[..], address)
+        {
+            return if index > 0 { Ok(index) } else { Err(error) };
+        }
+    }
+
+    return Ok(datagrams.len());
+}
+
+
+///A ring of receive buffers that is filled by one call. Only the datagrams of the latest call are available.
+pub struct DatagramReceiver
+{
+    buffers: Vec<Vec<u8>>,
+    lengths: Vec<usize>,
+    addresses: Vec<Option<net::SocketAddr>>,
+    count: usize,
+    #[cfg(target_os = "linux")]
+    headers: Vec<::libc::mmsghdr>,
+    #[cfg(target_os = "linux")]
+    iovecs: Vec<::libc::iovec>,
+    #[cfg(target_os = "linux")]
+    names: Vec<::libc::sockaddr_storage>
+}
+
+impl ::std::fmt::Debug for DatagramReceiver
+{
+    fn fmt (&self, formatter: &mut ::std::fmt::Formatter) -> ::std::fmt::Result
+    {
+        write!(formatter, "DatagramReceiver {{ count: {} }}", self.count)
+    }
+}
+
+impl DatagramReceiver
+{
+    pub fn new (batch: usize, buffer_length: usize) -> DatagramReceiver
+    {
+        DatagramReceiver
+        {
+            buffers: (0..batch).map(|_| vec![0u8; buffer_length]).collect(),
+            lengths: vec![0; batch],
+            addresses: vec![None; batch],
+            count: 0,
+            #[cfg(target_os = "linux")]
+            headers: Vec::with_capacity(batch),
+            #[cfg(target_os = "linux")]
+            iovecs: Vec::with_capacity(batch),
+            #[cfg(target_os = "linux")]
+            names: vec![unsafe { mem::zeroed() }; batch]
+        }
+    }
+
+    pub fn capacity (&self) -> usize
+    {
+        self.buffers.len()
+    }
+
+    pub fn len (&self) -> usize
+    {
+        self.count
+    }
+
+    pub fn datagram (&self, index: usize) -> (&[u8], Option<net::SocketAddr>)
+    {
+        (&self.buffers[index][..self.lengths[index]], self.addresses[index])
+    }
+
+    ///Receives as many datagrams as are available, up to the capacity. With wait set, it blocks (within the socket's read timeout) until
+    ///the first one arrives, otherwise it returns an error of kind WouldBlock if there is none.
+    #[cfg(target_os = "linux")]
+    pub fn receive (&mut self, socket: &net::UdpSocket, wait: bool) -> io::Result<usize>
+    {
+        self.count = 0;
+
+        self.iovecs.clear();
+        for buffer in self.buffers.iter_mut()
+        {
+            self.iovecs.push(::libc::iovec { iov_base: buffer.as_mut_ptr() as *mut ::libc::c_void, iov_len: buffer.len() });
+        }
+
+        self.headers.clear();
+        for (iovec, name) in self.iovecs.iter_mut().zip(self.names.iter_mut())
+        {
+            let mut header: ::libc::mmsghdr = unsafe { mem::zeroed() };
+            header.msg_hdr.msg_name = name as *mut ::libc::sockaddr_storage as *mut ::libc::c_void;
+            header.msg_hdr.msg_namelen = mem::size_of::<::libc::sockaddr_storage>() as ::libc::socklen_t;
+            header.msg_hdr.msg_iov = iovec as *mut ::libc::iovec;
+            header.msg_hdr.msg_iovlen = 1;
+            header.msg_hdr.msg_control = ptr::null_mut();
+            self.headers.push(header);
+        }
+
+        let flags = if wait { ::libc::MSG_WAITFORONE } else { ::libc::MSG_DONTWAIT };
+        let result = unsafe { ::libc::recvmmsg(socket.as_raw_fd(), self.headers.as_mut_ptr(), self.headers.len() as _, flags as _, ptr::null_mut()) };
+        if result < 0
+        {
+            return Err(io::Error::last_os_error());
+        }
+
+        self.count = result as usize;
+        for index in 0..self.count
+        {
+            self.lengths[index] = self.headers[index].msg_len as usize;
+            self.addresses[index] = socket_address(&self.names[index]);
+        }
+
+        return Ok(self.count);
+    }
+
+    #[cfg(not(target_os = "linux"))]
+    pub fn receive (&mut self, socket: &net::UdpSocket, wait: bool) -> io::Result<usize>
+    {
+        self.count = 0;
+        socket.set_nonblocking(!wait)?;
+        let result = socket.recv_from(&mut self.buffers[0]);
+        socket.set_nonblocking(false)?;
+
+        let (length, address) = result?;
+        self.lengths[0] = length;
+        self.addresses[0] = Some(address);
+        self.count = 1;
+        return Ok(1);
+    }
+}
+
+#[cfg(target_os = "linux")]
+fn socket_address (storage: &::libc::sockaddr_storage) -> Option<net::SocketAddr>
+{
+    match storage.ss_family as ::libc::c_int
+    {
+        ::libc::AF_INET =>
+        {
+            let address = unsafe { &*(storage as *const ::libc::sockaddr_storage as *const ::libc::sockaddr_in) };
+            let ip = net::Ipv4Addr::from(address.sin_addr.s_addr.to_ne_bytes());
+            Some(net::SocketAddr::V4(net::SocketAddrV4::new(ip, u16::from_be(address.sin_port))))
+        },
+        ::libc::AF_INET6 =>
+        {
+            let address = unsafe { &*(storage as *const ::libc::sockaddr_storage as *const ::libc::sockaddr_in6) };
+            let ip = net::Ipv6Addr::from(address.sin6_addr.s6_addr);
+            Some(net::SocketAddr::V6(net::SocketAddrV6::new(ip, u16::from_be(address.sin6_port), address.sin6_flowinfo, address.sin6_scope_id)))
+        },
+        _ => None
+    }
+}
+
+#[test]
+fn test_send_all ()
+{
+    let receiver = net::UdpSocket::bind("127.0.0.1:0").unwrap();
+    let sender = net::UdpSocket::bind("127.0.0.1:0").unwrap();
+    receiver.set_read_timeout(Some(::std::time::Duration::from_secs(5))).unwrap();
+
+    let datagrams: Vec<Vec<u8>> = (0..5u8).map(|i| vec![i; 10 + i as usize]).collect();
+    let mut datagram_sender = DatagramSender::new();
+    assert_eq!(datagram_sender.send_all(&sender, &receiver.local_addr().unwrap(), &datagrams[..]).unwrap(), 5);
+
+    let mut buffer = [0u8; 100];
+    for datagram in datagrams.iter()
+    {
+        let (length, _) = receiver.recv_from(&mut buffer).unwrap();
+        assert_eq!(&buffer[..length], &datagram[..]);
+    }
+}
+
+#[test]
+fn test_receive_batch ()
+{
+    let receiver = net::UdpSocket::bind("127.0.0.1:0").unwrap();
+    let sender = net::UdpSocket::bind("127.0.0.1:0").unwrap();
+    receiver.set_read_timeout(Some(::std::time::Duration::from_secs(5))).unwrap();
+
+    let datagrams: Vec<Vec<u8>> = (0..5u8).map(|i| vec![i; 10 + i as usize]).collect();
+    DatagramSender::new().send_all(&sender, &receiver.local_addr().unwrap(), &datagrams[..]).unwrap();
+
+    let mut datagram_receiver = DatagramReceiver::new(4, 100);
+    let mut received = Vec::new();
+    while received.len() < datagrams.len()
+    {
+        datagram_receiver.receive(&receiver, true).unwrap();
+        for index in 0..datagram_receiver.len()
+        {
+            let (data, address) = datagram_receiver.datagram(index);
+            assert_eq!(address, Some(sender.local_addr().unwrap()));
+            received.push(data.to_vec());
+        }
+    }
+    assert_eq!(received, datagrams);
+
+    assert_eq!(datagram_receiver.receive(&receiver, false).unwrap_err().kind(), io::ErrorKind::WouldBlock);
+}
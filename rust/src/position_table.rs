@@ -0,0 +1,159 @@
+//Maps positions in the rendered text back to the inserts the characters came from.
+//Consecutive characters almost always come from the same insert with increasing charPos, so instead of storing ID, author and charPos
+//for every single character, we store runs of them, together with the prefix sums of the run lengths for random access.
+
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct TextRun
+{
+    pub ID: u32,
+    pub author: u32,
+    pub start_charPos: u16,
+    pub length: u32
+}
+
+#[derive(Debug)]
+pub struct PositionTable
+{
+    runs: Vec<TextRun>,
+    run_ends: Vec<usize> //run_ends[i] is the global position directly behind the last character of runs[i]
+}
+
+impl PositionTable
+{
+    pub fn new () -> PositionTable
+    {
+        PositionTable { runs: Vec::new(), run_ends: Vec::new() }
+    }
+
+    pub fn clear (&mut self)
+    {
+        self.runs.clear();
+        self.run_ends.clear();
+    }
+
+    ///Number of characters (not runs) in the table.
+    pub fn len (&self) -> usize
+    {
+        match self.run_ends.last()
+        {
+            Some(&end) => end,
+            None => 0
+        }
+    }
+
+    pub fn number_of_runs (&self) -> usize
+    {
+        self.runs.len()
+    }
+
+    ///Appends one character at the end of the table, extending the last run if possible.
+    pub fn push (&mut self, ID: u32, author: u32, charPos: u16)
+    {
+        if let Some(last_run) = self.runs.last_mut()
+        {
+            if (last_run.ID == ID) & (last_run.start_charPos as u32 + last_run.length == charPos as u32)
+            {
+                last_run.length += 1;
+                *self.run_ends.last_mut().unwrap() += 1;
+                return;
+            }
+        }
+
+        let end = self.len() + 1;
+        self.runs.push( TextRun { ID: ID, author: author, start_charPos: charPos, length: 1 } );
+        self.run_ends.push(end);
+    }
+
+    fn run_index (&self, position: usize) -> Option<usize>
+    {
+        if position >= self.len()
+        {
+            return None;
+        }
+
+        //binary search for the first run that ends behind the position
+        let mut low = 0;
+        let mut high = self.run_ends.len() - 1;
+        while low < high
+        {
+            let middle = (low + high) / 2;
+            if self.run_ends[middle] > position
+            {
+                high = middle;
+            }
+            else
+            {
+                low = middle + 1;
+            }
+        }
+
+        return Some(low);
+    }
+
+    ///Returns the insert ID and the character position inside that insert for a global position.
+    pub fn lookup (&self, position: usize) -> Option<(u32, u16)>
+    {
+        match self.run_index(position)
+        {
+            Some(index) =>
+            {
+                let run = &self.runs[index];
+                let run_start = self.run_ends[index] - run.length as usize;
+                Some((run.ID, run.start_charPos + (position - run_start) as u16))
+            },
+            None => None
+        }
+    }
+
+    pub fn ID_at (&self, position: usize) -> u32
+    {
+        self.lookup(position).expect("PositionTable::ID_at was called with a position that is out of bounds.").0
+    }
+
+    pub fn charPos_at (&self, position: usize) -> u16
+    {
+        self.lookup(position).expect("PositionTable::charPos_at was called with a position that is out of bounds.").1
+    }
+
+    pub fn author_at (&self, position: usize) -> u32
+    {
+        let index = self.run_index(position).expect("PositionTable::author_at was called with a position that is out of bounds.");
+        self.runs[index].author
+    }
+
+    pub fn runs (&self) -> &[TextRun]
+    {
+        &self.runs[..]
+    }
+}
+
+
+#[test]
+fn test_position_table_runs ()
+{
+    let mut table = PositionTable::new();
+    for charPos in 0..10
+    {
+        table.push(5, 1, charPos);
+    }
+    table.push(7, 2, 0);
+    table.push(7, 2, 1);
+    table.push(5, 1, 10); //same insert, but not adjacent to its previous run anymore
+    table.push(5, 1, 12); //gap left by a deleted character
+
+    assert_eq!(table.len(), 14);
+    assert_eq!(table.number_of_runs(), 4);
+
+    assert_eq!(table.lookup(0), Some((5, 0)));
+    assert_eq!(table.lookup(9), Some((5, 9)));
+    assert_eq!(table.lookup(10), Some((7, 0)));
+    assert_eq!(table.lookup(11), Some((7, 1)));
+    assert_eq!(table.lookup(12), Some((5, 10)));
+    assert_eq!(table.lookup(13), Some((5, 12)));
+    assert_eq!(table.lookup(14), None);
+    assert_eq!(table.author_at(11), 2);
+
+    table.clear();
+    assert_eq!(table.len(), 0);
+    assert_eq!(table.lookup(0), None);
+}
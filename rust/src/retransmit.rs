@@ -0,0 +1,247 @@
+//Building blocks for deciding when queued messages are (re)sent: a round trip time estimator that derives the retransmission timeout
+//(as described in RFC 6298), the per-message transmission state with exponential backoff, and a token bucket that paces the sending rate.
+
+use std::time::{Duration, Instant};
+use std::cmp::{min, max};
+
+const INITIAL_RTO_MS: u64 = 300;
+const MINIMUM_RTO_MS: u64 = 30;
+const MAXIMUM_RTO_MS: u64 = 10000;
+const MAXIMUM_BACKOFF_SHIFT: u32 = 6;
+
+fn duration_to_us (duration: Duration) -> u64
+{
+    duration.as_secs()*1000000 + duration.subsec_nanos() as u64/1000
+}
+
+#[derive(Debug)]
+pub struct RttEstimator
+{
+    srtt_us: Option<u64>,
+    rttvar_us: u64,
+    rto_us: u64
+}
+
+impl RttEstimator
+{
+    pub fn new () -> RttEstimator
+    {
+        RttEstimator { srtt_us: None, rttvar_us: 0, rto_us: INITIAL_RTO_MS*1000 }
+    }
+
+    pub fn sample (&mut self, rtt: Duration)
+    {
+        let rtt_us = duration_to_us(rtt);
+        match self.srtt_us
+        {
+            None =>
+            {
+                self.srtt_us = Some(rtt_us);
+                self.rttvar_us = rtt_us/2;
+            },
+            Some(srtt_us) =>
+            {
+                let difference = if srtt_us > rtt_us { srtt_us - rtt_us } else { rtt_us - srtt_us };
+                self.rttvar_us = (3*self.rttvar_us + difference)/4;
+                self.srtt_us = Some((7*srtt_us + rtt_us)/8);
+            }
+        }
+
+        let rto_us = self.srtt_us.unwrap() + max(1000, 4*self.rttvar_us);
+        self.rto_us = min(max(rto_us, MINIMUM_RTO_MS*1000), MAXIMUM_RTO_MS*1000);
+    }
+
+    pub fn srtt (&self) -> Option<Duration>
+    {
+        self.srtt_us.map(Duration::from_micros)
+    }
+
+    pub fn rto (&self) -> Duration
+    {
+        Duration::from_micros(self.rto_us)
+    }
+}
+
+///When a queued message has been sent and how often it has been retransmitted since.
+#[derive(Debug, Clone, Copy)]
+pub struct TransmitState
+{
+    pub sent_at: Option<Instant>, //None if the current content has never been sent
+    pub retransmissions: u32,
+    pub due: Option<Instant>, //when the message has to be retransmitted if it isn't acknowledged until then
+    pub superseded: bool //whether earlier content has been sent, whose acknowledgement can't be told apart from the current one's
+}
+
+impl TransmitState
+{
+    pub fn new () -> TransmitState
+    {
+        TransmitState { sent_at: None, retransmissions: 0, due: None, superseded: false }
+    }
+
+    pub fn is_unsent (&self) -> bool
+    {
+        self.sent_at.is_none()
+    }
+
+    ///Records a transmission and returns the time it is due for retransmission (with exponential backoff, up to MAXIMUM_RTO_MS).
+    pub fn sent (&mut self, now: Instant, rto: Duration) -> Instant
+    {
+        if self.sent_at.is_some()
+        {
+            self.retransmissions += 1;
+        }
+        self.sent_at = Some(now);
+
+        let due = now + min(rto * (1 << min(self.retransmissions, MAXIMUM_BACKOFF_SHIFT)), Duration::from_millis(MAXIMUM_RTO_MS));
+        self.due = Some(due);
+        return due;
+    }
+
+    ///Round trip time for an acknowledgement received now. Following Karn's algorithm, there is none if the message has been retransmitted,
+    ///as the acknowledgement could belong to any of the transmissions.
+    pub fn rtt_sample (&self, now: Instant) -> Option<Duration>
+    {
+        match self.sent_at
+        {
+            Some(sent_at) if (self.retransmissions == 0) & !self.superseded => Some(now.duration_since(sent_at)),
+            _ => None
+        }
+    }
+
+    ///The content has changed, so it should be sent again right away. The backoff stays, and once anything has been sent, the message
+    ///yields no more round trip times.
+    pub fn reset (&mut self)
+    {
+        self.superseded |= self.sent_at.is_some();
+        self.sent_at = None;
+        self.due = None;
+    }
+}
+
+///Paces sending to a rate of bytes per second, while allowing bursts up to a given size.
+#[derive(Debug)]
+pub struct TokenBucket
+{
+    tokens: f64,
+    capacity: f64,
+    rate: f64,
+    last_refill: Instant
+}
+
+impl TokenBucket
+{
+    pub fn new (rate: f64, capacity: f64, now: Instant) -> TokenBucket
+    {
+        TokenBucket { tokens: capacity, capacity: capacity, rate: rate, last_refill: now }
+    }
+
+    pub fn refill (&mut self, now: Instant)
+    {
+        if now > self.last_refill
+        {
+            let elapsed = now.duration_since(self.last_refill);
+            let elapsed_seconds = elapsed.as_secs() as f64 + elapsed.subsec_nanos() as f64 * 1e-9;
+            self.tokens = (self.tokens + elapsed_seconds*self.rate).min(self.capacity);
+            self.last_refill = now;
+        }
+    }
+
+    ///Sending is allowed as long as there are any tokens left. The size of the message is only known afterwards, so the bucket can go
+    ///into debt, which delays the following messages.
+    pub fn can_send (&self) -> bool
+    {
+        self.tokens > 0.0
+    }
+
+    pub fn consume (&mut self, bytes: usize)
+    {
+        self.tokens -= bytes as f64;
+    }
+
+    ///How long it takes until sending is allowed again.
+    pub fn time_until_available (&self) -> Duration
+    {
+        if self.tokens > 0.0
+        {
+            Duration::from_secs(0)
+        }
+        else
+        {
+            Duration::from_micros(((-self.tokens + 1.0) / self.rate * 1e6) as u64)
+        }
+    }
+}
+
+
+#[test]
+fn test_rtt_estimator ()
+{
+    let mut estimator = RttEstimator::new();
+    assert_eq!(estimator.rto(), Duration::from_millis(INITIAL_RTO_MS));
+
+    estimator.sample(Duration::from_millis(100));
+    assert_eq!(estimator.srtt(), Some(Duration::from_millis(100)));
+    assert_eq!(estimator.rto(), Duration::from_millis(300)); //srtt + 4*rttvar with rttvar = rtt/2
+
+    for _ in 0..50
+    {
+        estimator.sample(Duration::from_millis(10));
+    }
+    assert!(estimator.srtt().unwrap() < Duration::from_millis(11));
+    assert_eq!(estimator.rto(), Duration::from_millis(MINIMUM_RTO_MS));
+}
+
+#[test]
+fn test_transmit_state_backoff ()
+{
+    let start = Instant::now();
+    let rto = Duration::from_millis(100);
+    let mut state = TransmitState::new();
+    assert!(state.is_unsent());
+
+    assert_eq!(state.sent(start, rto), start + rto);
+    assert!(state.rtt_sample(start + Duration::from_millis(20)).is_some());
+
+    assert_eq!(state.sent(start, rto), start + rto*2);
+    assert_eq!(state.sent(start, rto), start + rto*4);
+    assert!(state.rtt_sample(start + Duration::from_millis(20)).is_none());
+
+    for _ in 0..20
+    {
+        state.sent(start, rto);
+    }
+    assert_eq!(state.due, Some(start + rto*(1 << MAXIMUM_BACKOFF_SHIFT)));
+
+    //a long round trip time doesn't back off beyond the maximum
+    let mut state = TransmitState::new();
+    let rto = Duration::from_millis(MAXIMUM_RTO_MS/2);
+    assert_eq!(state.sent(start, rto), start + rto);
+    assert_eq!(state.sent(start, rto), start + rto*2);
+    assert_eq!(state.sent(start, rto), start + Duration::from_millis(MAXIMUM_RTO_MS));
+
+    //changed content is sent right away, but an acknowledgement may still belong to the earlier transmissions
+    let mut state = TransmitState::new();
+    state.sent(start, rto);
+    state.reset();
+    assert!(state.is_unsent());
+    assert_eq!(state.sent(start, rto), start + rto);
+    assert!(state.rtt_sample(start + Duration::from_millis(20)).is_none());
+}
+
+#[test]
+fn test_token_bucket ()
+{
+    let start = Instant::now();
+    let mut bucket = TokenBucket::new(1000.0, 500.0, start);
+    assert!(bucket.can_send());
+    bucket.consume(600);
+    assert!(!bucket.can_send());
+    assert_eq!(bucket.time_until_available(), Duration::from_millis(101));
+
+    bucket.refill(start + Duration::from_millis(200));
+    assert!(bucket.can_send());
+    bucket.refill(start + Duration::from_secs(10));
+    bucket.consume(500);
+    assert!(!bucket.can_send()); //the burst is limited to the capacity
+}
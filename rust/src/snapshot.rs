@@ -0,0 +1,379 @@
+//Bulk transfer of the whole insert set to a peer that has just joined, instead of sending every insert through the send queue.
+//The snapshot is one byte stream (see snapshot_stream in lib.rs), split into numbered chunks that are sent in 'S' records:
+//  'S', u32 snapshot ID, u32 sequence number, u32 number of chunks, u32 length of the stream, u32 CRC32C of the stream, data
+//The receiver acknowledges with 'T' records:
+//  'T', u32 snapshot ID, u32 number of the first missing chunk, u64 bitmap of the chunks received after it
+//The sender keeps at most a window of chunks in flight and resends a chunk when it hasn't been acknowledged within the retransmission
+//timeout. The receiver only installs the snapshot once all chunks have arrived and the checksum of the whole stream matches.
+//Chunk records are accepted from anyone, so the receiver rejects headers beyond MAXIMUM_LENGTH and MAXIMUM_CHUNKS and only keeps the chunks
+//that actually arrived.
+
+use std::time::{Duration, Instant};
+use std::cmp::min;
+use std::collections::BTreeMap;
+
+use crc::crc32c;
+use framing::Batcher;
+use wire::{read_u32, write_u32};
+use retransmit::TokenBucket;
+
+pub const CHUNK_TAG: u8 = 'S' as u8;
+pub const ACK_TAG: u8 = 'T' as u8;
+pub const CHUNK_HEADER_LENGTH: usize = 1+4+4+4+4+4;
+const ACK_LENGTH: usize = 1+4+4+8;
+const WINDOW: usize = 256; //chunks
+const SELECTIVE_ACK_CHUNKS: usize = 64;
+pub const MAXIMUM_LENGTH: usize = 64 << 20; //bytes of the stream
+pub const MAXIMUM_CHUNKS: usize = 1 << 17; //enough for MAXIMUM_LENGTH in chunks of 512 bytes
+
+#[derive(Debug)]
+pub struct SnapshotSender
+{
+    pub ID: u32,
+    stream: Vec<u8>,
+    checksum: u32,
+    chunk_size: usize,
+    number_of_chunks: usize,
+    acknowledged: Vec<bool>,
+    sent_at: Vec<Option<Instant>>,
+    first_unacknowledged: usize
+}
+
+impl SnapshotSender
+{
+    pub fn new (ID: u32, stream: Vec<u8>, chunk_size: usize) -> SnapshotSender
+    {
+        let chunk_size = ::std::cmp::max(chunk_size, 1);
+        let number_of_chunks = ::std::cmp::max((stream.len() + chunk_size - 1) / chunk_size, 1); //an empty snapshot still has one chunk
+
+        SnapshotSender
+        {
+            ID: ID,
+            checksum: crc32c(&stream[..]),
+            stream: stream,
+            chunk_size: chunk_size,
+            number_of_chunks: number_of_chunks,
+            acknowledged: vec![false; number_of_chunks],
+            sent_at: vec![None; number_of_chunks],
+            first_unacknowledged: 0
+        }
+    }
+
+    pub fn is_done (&self) -> bool
+    {
+        self.first_unacknowledged == self.number_of_chunks
+    }
+
+    fn window_end (&self) -> usize
+    {
+        min(self.first_unacknowledged + WINDOW, self.number_of_chunks)
+    }
+
+    fn is_due (&self, sequence: usize, now: Instant, rto: Duration) -> bool
+    {
+        !self.acknowledged[sequence] && match self.sent_at[sequence]
+        {
+            Some(sent_at) => now.duration_since(sent_at) >= rto,
+            None => true
+        }
+    }
+
+    ///Sends the chunks within the window that haven't been sent yet or are due for retransmission, as far as the pacing allows.
+    pub fn send (&mut self, batcher: &mut Batcher, pacing: &mut TokenBucket, now: Instant, rto: Duration)
+    {
+        for sequence in self.first_unacknowledged..self.window_end()
+        {
+            if !pacing.can_send()
+            {
+                break;
+            }
+
+            if self.is_due(sequence, now, rto)
+            {
+                let start = sequence*self.chunk_size;
+                let end = min(start + self.chunk_size, self.stream.len());
+                let (ID, number_of_chunks, length, checksum) = (self.ID, self.number_of_chunks, self.stream.len(), self.checksum);
+                let data = &self.stream[start..end];
+
+                batcher.write_record(|buffer|
+                {
+                    buffer.push(CHUNK_TAG);
+                    write_u32(ID, buffer);
+                    write_u32(sequence as u32, buffer);
+                    write_u32(number_of_chunks as u32, buffer);
+                    write_u32(length as u32, buffer);
+                    write_u32(checksum, buffer);
+                    buffer.extend_from_slice(data);
+                });
+
+                pacing.consume(CHUNK_HEADER_LENGTH + data.len());
+                self.sent_at[sequence] = Some(now);
+            }
+        }
+    }
+
+    pub fn handle_ack (&mut self, record: &[u8])
+    {
+        if (record.len() != ACK_LENGTH) || (read_u32(&record[1..]) != self.ID)
+        {
+            return;
+        }
+
+        let first_missing = min(read_u32(&record[5..]) as usize, self.number_of_chunks);
+        let bitmap = ((read_u32(&record[9..]) as u64)<<32) + read_u32(&record[13..]) as u64;
+
+        for sequence in self.first_unacknowledged..first_missing
+        {
+            self.acknowledged[sequence] = true;
+        }
+        for bit in 0..SELECTIVE_ACK_CHUNKS
+        {
+            if (bitmap >> bit)&1 == 1
+            {
+                if let Some(acknowledged) = self.acknowledged.get_mut(first_missing + 1 + bit)
+                {
+                    *acknowledged = true;
+                }
+            }
+        }
+
+        while (self.first_unacknowledged < self.number_of_chunks) && self.acknowledged[self.first_unacknowledged]
+        {
+            self.first_unacknowledged += 1;
+        }
+    }
+
+    ///How long until a chunk has to be (re)sent.
+    pub fn time_until_next_send (&self, now: Instant, rto: Duration) -> Option<Duration>
+    {
+        let mut wait = None;
+        for sequence in self.first_unacknowledged..self.window_end()
+        {
+            if self.acknowledged[sequence]
+            {
+                continue;
+            }
+
+            let until_due = match self.sent_at[sequence]
+            {
+                Some(sent_at) if now.duration_since(sent_at) < rto => rto - now.duration_since(sent_at),
+                _ => return Some(Duration::from_secs(0))
+            };
+            wait = Some(match wait { Some(wait) => min(wait, until_due), None => until_due });
+        }
+        return wait;
+    }
+}
+
+#[derive(Debug)]
+pub struct SnapshotReceiver
+{
+    pub ID: u32,
+    length: usize,
+    checksum: u32,
+    number_of_chunks: usize,
+    chunks: BTreeMap<usize, Vec<u8>>, //by sequence number, dropped once the snapshot is installed
+    received_bytes: usize,
+    pub installed: bool,
+    ack_pending: bool
+}
+
+impl SnapshotReceiver
+{
+    ///Starts receiving the snapshot a chunk record belongs to. Returns None if the record is malformed.
+    pub fn new (record: &[u8]) -> Option<SnapshotReceiver>
+    {
+        if (record.len() < CHUNK_HEADER_LENGTH) || (record[0] != CHUNK_TAG)
+        {
+            return None;
+        }
+
+        let number_of_chunks = read_u32(&record[9..]) as usize;
+        let length = read_u32(&record[13..]) as usize;
+        if (number_of_chunks == 0) | (number_of_chunks > length + 1) | (number_of_chunks > MAXIMUM_CHUNKS) | (length > MAXIMUM_LENGTH)
+        {
+            return None;
+        }
+
+        Some(SnapshotReceiver
+        {
+            ID: read_u32(&record[1..]),
+            length: length,
+            checksum: read_u32(&record[17..]),
+            number_of_chunks: number_of_chunks,
+            chunks: BTreeMap::new(),
+            received_bytes: 0,
+            installed: false,
+            ack_pending: false
+        })
+    }
+
+    pub fn snapshot_ID (record: &[u8]) -> Option<u32>
+    {
+        if record.len() >= CHUNK_HEADER_LENGTH { Some(read_u32(&record[1..])) } else { None }
+    }
+
+    pub fn handle_chunk (&mut self, record: &[u8])
+    {
+        if (record.len() < CHUNK_HEADER_LENGTH) || (read_u32(&record[1..]) != self.ID)
+        {
+            return;
+        }
+
+        self.ack_pending = true;
+        let sequence = read_u32(&record[5..]) as usize;
+        let data = &record[CHUNK_HEADER_LENGTH..];
+        if !self.installed && (sequence < self.number_of_chunks) && !self.chunks.contains_key(&sequence) && (self.received_bytes + data.len() <= self.length)
+        {
+            self.chunks.insert(sequence, data.to_vec());
+            self.received_bytes += data.len();
+        }
+    }
+
+    pub fn is_complete (&self) -> bool
+    {
+        self.installed || (self.chunks.len() == self.number_of_chunks)
+    }
+
+    ///Puts the chunks together. Returns None (and starts over) if the stream doesn't match its checksum.
+    pub fn assemble (&mut self) -> Option<Vec<u8>>
+    {
+        let mut stream = Vec::with_capacity(self.length);
+        for chunk in self.chunks.values()
+        {
+            stream.extend_from_slice(&chunk[..]);
+        }
+
+        if (stream.len() != self.length) || (crc32c(&stream[..]) != self.checksum)
+        {
+            warn!("Received a snapshot that doesn't match its checksum.");
+            self.chunks.clear();
+            self.received_bytes = 0;
+            return None;
+        }
+
+        self.installed = true;
+        self.chunks = BTreeMap::new();
+        return Some(stream);
+    }
+
+    ///Acknowledges the chunks received since the last call, if there are any.
+    pub fn write_ack (&mut self, batcher: &mut Batcher)
+    {
+        if !self.ack_pending
+        {
+            return;
+        }
+        self.ack_pending = false;
+
+        let first_missing = if self.installed { self.number_of_chunks } else { (0..self.number_of_chunks).find(|sequence| !self.chunks.contains_key(sequence)).unwrap_or(self.number_of_chunks) };
+        let mut bitmap = 0u64;
+        if !self.installed
+        {
+            for bit in 0..SELECTIVE_ACK_CHUNKS
+            {
+                if self.chunks.contains_key(&(first_missing + 1 + bit))
+                {
+                    bitmap |= 1 << bit;
+                }
+            }
+        }
+
+        let ID = self.ID;
+        batcher.write_record(|buffer|
+        {
+            buffer.push(ACK_TAG);
+            write_u32(ID, buffer);
+            write_u32(first_missing as u32, buffer);
+            write_u32((bitmap>>32) as u32, buffer);
+            write_u32(bitmap as u32, buffer);
+        });
+    }
+}
+
+
+#[test]
+fn test_snapshot_transfer ()
+{
+    let stream: Vec<u8> = (0..10000u32).map(|i| (i*31 + i/7) as u8).collect();
+    let mut sender = SnapshotSender::new(7, stream.clone(), 1000);
+    let now = Instant::now();
+    let rto = Duration::from_millis(100);
+    let mut pacing = TokenBucket::new(1e9, 1e9, now);
+    let mut batcher = Batcher::new(1400);
+    batcher.enabled = true;
+
+    sender.send(&mut batcher, &mut pacing, now, rto);
+    let datagrams = batcher.finish().to_vec();
+    batcher.clear();
+    let records: Vec<Vec<u8>> = datagrams.iter().flat_map(|datagram| ::framing::records(&datagram[4..]).map(|record| record.to_vec()).collect::<Vec<Vec<u8>>>()).collect();
+    assert_eq!(records.len(), 10);
+    assert_eq!(sender.time_until_next_send(now, rto), Some(rto));
+
+    //lose the third chunk
+    let mut receiver = SnapshotReceiver::new(&records[0][..]).unwrap();
+    for (index, record) in records.iter().enumerate()
+    {
+        if index != 2
+        {
+            receiver.handle_chunk(&record[..]);
+        }
+    }
+    assert!(!receiver.is_complete());
+
+    receiver.write_ack(&mut batcher);
+    let ack = batcher.finish()[0][4..].to_vec();
+    batcher.clear();
+    sender.handle_ack(::framing::records(&ack[..]).next().unwrap());
+    assert!(!sender.is_done());
+
+    //only the lost chunk is resent
+    sender.send(&mut batcher, &mut pacing, now + rto, rto);
+    let resent: Vec<Vec<u8>> = batcher.finish().iter().flat_map(|datagram| ::framing::records(&datagram[4..]).map(|record| record.to_vec()).collect::<Vec<Vec<u8>>>()).collect();
+    batcher.clear();
+    assert_eq!(resent, vec![records[2].clone()]);
+
+    receiver.handle_chunk(&resent[0][..]);
+    assert!(receiver.is_complete());
+    assert_eq!(receiver.assemble(), Some(stream));
+
+    receiver.write_ack(&mut batcher);
+    let ack = batcher.finish()[0][4..].to_vec();
+    batcher.clear();
+    sender.handle_ack(::framing::records(&ack[..]).next().unwrap());
+    assert!(sender.is_done());
+}
+
+#[test]
+fn test_snapshot_limits ()
+{
+    let header = |number_of_chunks: u32, length: u32| -> Vec<u8>
+    {
+        let mut record = vec![CHUNK_TAG];
+        for &value in [7, 0, number_of_chunks, length, 0].iter()
+        {
+            write_u32(value, &mut record);
+        }
+        record
+    };
+
+    assert!(SnapshotReceiver::new(&header(0xfffffff0, 0xffffffff)[..]).is_none());
+    assert!(SnapshotReceiver::new(&header(MAXIMUM_CHUNKS as u32 + 1, MAXIMUM_LENGTH as u32)[..]).is_none());
+    assert!(SnapshotReceiver::new(&header(2, MAXIMUM_LENGTH as u32 + 1)[..]).is_none());
+
+    //chunks are only kept as they arrive, and not beyond the announced length
+    let mut receiver = SnapshotReceiver::new(&header(MAXIMUM_CHUNKS as u32, MAXIMUM_LENGTH as u32)[..]).unwrap();
+    let mut chunk = header(MAXIMUM_CHUNKS as u32, MAXIMUM_LENGTH as u32);
+    chunk[5..9].copy_from_slice(&[0, 1, 0, 0]); //a sequence number far ahead
+    chunk.extend_from_slice(b"abcdef");
+    receiver.handle_chunk(&chunk[..]);
+    assert_eq!((receiver.chunks.len(), receiver.received_bytes), (1, 6));
+
+    let mut receiver = SnapshotReceiver::new(&header(4, 8)[..]).unwrap();
+    let mut chunk = header(4, 8);
+    chunk.extend_from_slice(b"abcdef");
+    receiver.handle_chunk(&chunk[..]);
+    chunk[8] = 1;
+    receiver.handle_chunk(&chunk[..]); //would exceed the length
+    assert_eq!((receiver.chunks.len(), receiver.received_bytes), (1, 6));
+}
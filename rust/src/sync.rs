@@ -175,7 +175,7 @@ impl OneThreadTent
         
         else
         {
-            println!("OneThreadTent.sleep (called from thread {:?}) says: Can't go to sleep, there's already someone in the tent!", thread::current().name());
+            warn!("OneThreadTent.sleep (called from thread {:?}) says: Can't go to sleep, there's already someone in the tent!", thread::current().name());
             return false;
         }
     }
@@ -193,7 +193,7 @@ impl OneThreadTent
 
         else
         {
-            println!("OneThreadTent.wake_up (called from thread {:?})says: The tent is empty, there is no one to wake up!", thread::current().name());
+            warn!("OneThreadTent.wake_up (called from thread {:?})says: The tent is empty, there is no one to wake up!", thread::current().name());
             return false;
         }
     }
@@ -225,7 +225,7 @@ impl Drop for OneThreadTent
         }
         else
         {
-            println!("Warning: a tent was dropped while it was occupied. This may result in the other thread sleeping indefinitely.");
+            warn!("A tent was dropped while it was occupied. This may result in the other thread sleeping indefinitely.");
         }
     }
 }
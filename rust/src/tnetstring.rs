@@ -10,86 +10,143 @@ pub enum Data
     Dict (Vec<(Data, Data)>),
 }
 
-fn int_to_string (mut value: isize) -> Vec<u8>
+///Puts the decimal digits of a number at the end of digits and returns where they start, so numbers are written without allocating.
+fn format_decimal (mut value: usize, digits: &mut [u8; 21]) -> usize
 {
-    let mut value_string: Vec<u8> = Vec::new();
+    let mut start = digits.len();
+    loop
+    {
+        start -= 1;
+        digits[start] = b'0' + (value % 10) as u8;
+        value /= 10;
+        if value == 0
+        {
+            return start;
+        }
+    }
+}
+
+fn write_length (length: usize, result: &mut Vec<u8>)
+{
+    let mut digits = [0u8; 21];
+    let start = format_decimal(length, &mut digits);
+    result.extend_from_slice(&digits[start..]);
+    result.push(':' as u8);
+}
+
+pub fn write_bool (value: bool, result: &mut Vec<u8>)
+{
+    result.extend_from_slice(if value { "4:true!".as_bytes() } else { "5:false!".as_bytes() });
+}
+
+pub fn write_integer (value: isize, result: &mut Vec<u8>)
+{
+    let mut digits = [0u8; 21];
+    let mut start = format_decimal(value.unsigned_abs(), &mut digits);
     if value < 0
     {
-        value_string.push('-' as u8);
-        value = -value;
+        start -= 1;
+        digits[start] = '-' as u8;
+    }
+
+    write_length(digits.len() - start, result);
+    result.extend_from_slice(&digits[start..]);
+    result.push('#' as u8);
+}
+
+pub fn write_string (value: &str, result: &mut Vec<u8>)
+{
+    write_length(value.len(), result);
+    result.extend_from_slice(value.as_bytes());
+    result.push(',' as u8);
+}
+
+///Writes the items of a list or dict straight into result and puts the length in front of them afterwards, so nested containers don't
+///need buffers of their own.
+fn write_container<F: FnOnce(&mut Vec<u8>)> (tag: u8, result: &mut Vec<u8>, content: F)
+{
+    let start = result.len();
+    content(result);
+    let length = result.len() - start;
+
+    let mut digits = [0u8; 21];
+    let digits_start = format_decimal(length, &mut digits);
+    let digits = &digits[digits_start..];
+
+    result.resize(start + digits.len() + 1 + length, 0);
+    result.copy_within(start..start+length, start+digits.len()+1);
+    result[start..start+digits.len()].copy_from_slice(digits);
+    result[start+digits.len()] = ':' as u8;
+    result.push(tag);
+}
+
+pub fn write_list<F: FnOnce(&mut Vec<u8>)> (result: &mut Vec<u8>, items: F)
+{
+    write_container(']' as u8, result, items);
+}
+
+///Writes a dict with string keys, e.g. write_dict(&mut message, |dict| { dict.string("type", "Init"); dict.integer("start_ID", 1026); });
+pub fn write_dict<F: FnOnce(&mut DictWriter)> (result: &mut Vec<u8>, fields: F)
+{
+    write_container('}' as u8, result, |result| fields(&mut DictWriter { result: result }));
+}
+
+pub struct DictWriter<'a>
+{
+    result: &'a mut Vec<u8>
+}
+
+impl<'a> DictWriter<'a>
+{
+    pub fn bool (&mut self, key: &str, value: bool)
+    {
+        write_string(key, self.result);
+        write_bool(value, self.result);
     }
 
-    else if value == 0
+    pub fn integer (&mut self, key: &str, value: isize)
     {
-        value_string.push('0' as u8);
+        write_string(key, self.result);
+        write_integer(value, self.result);
     }
 
-    while value > 0
+    pub fn string (&mut self, key: &str, value: &str)
     {
-        let digit = value%10;
-        let digit_ascii_value = digit + 48;
-        value_string.insert(0, digit_ascii_value as u8);
-        value /= 10;
+        write_string(key, self.result);
+        write_string(value, self.result);
     }
 
-    return value_string;
+    pub fn list<F: FnOnce(&mut Vec<u8>)> (&mut self, key: &str, items: F)
+    {
+        write_string(key, self.result);
+        write_list(self.result, items);
+    }
 }
 
 pub fn encode (data: &Data, result: &mut Vec<u8>)
 {
     match *data
     {
-        Data::Bool (true) => result.extend_from_slice("4:true!".as_bytes()),
-        Data::Bool (false) => result.extend_from_slice("5:false!".as_bytes()),
-        Data::Integer (value) =>
-        {
-            let value_string = int_to_string(value);
-            let length = int_to_string(value_string.len() as isize);
-            result.extend_from_slice(&length[..]);
-            result.push(':' as u8);
-            result.extend_from_slice(&value_string[..]);
-            result.push('#' as u8);
-        },
+        Data::Bool (value) => write_bool(value, result),
+        Data::Integer (value) => write_integer(value, result),
+        Data::String (ref value) => write_string(value, result),
 
-        Data::String (ref value) =>
+        Data::List (ref list) => write_list(result, |result|
         {
-            let length = int_to_string(value.as_bytes().len() as isize);
-            result.extend_from_slice(&length[..]);
-            result.push(':' as u8);
-            result.extend_from_slice(value.as_bytes());
-            result.push(',' as u8);
-        },
-
-        Data::List (ref list) =>
-        {
-            let mut list_string: Vec<u8> = Vec::new();
             for item in list.iter()
             {
-                encode(item, &mut list_string);
+                encode(item, result);
             }
+        }),
 
-            let length = int_to_string(list_string.len() as isize);
-            result.extend_from_slice(&length[..]);
-            result.push(':' as u8);
-            result.extend_from_slice(&list_string[..]);
-            result.push(']' as u8);
-        },
-
-        Data::Dict (ref dict) =>
+        Data::Dict (ref dict) => write_container('}' as u8, result, |result|
         {
-            let mut dict_string: Vec<u8> = Vec::new();
             for &(ref key, ref value) in dict.iter()
             {
-                encode(key, &mut dict_string);
-                encode(value, &mut dict_string);
+                encode(key, result);
+                encode(value, result);
             }
-
-            let length = int_to_string(dict_string.len() as isize);
-            result.extend_from_slice(&length[..]);
-            result.push(':' as u8);
-            result.extend_from_slice(&dict_string[..]);
-            result.push('}' as u8);
-        },
+        }),
     }
 }
 
@@ -138,7 +195,11 @@ fn decode_integer (string: &mut &[u8], terminator: u8) -> Result<isize, &'static
         let digit = character as isize - 48;
         if (digit >= 0) & (digit <= 9)
         {
-            result = result*10 + digit as isize;
+            result = match result.checked_mul(10).and_then(|result| result.checked_add(digit))
+            {
+                Some(result) => result,
+                None => return Err("Integer is too large")
+            };
         }
         else
         {
@@ -162,6 +223,15 @@ fn test_decode_integer()
     assert!(*test == "blablafoo".as_bytes());
 }
 
+fn decode_signed_integer (data: &[u8]) -> Result<isize, &'static str>
+{
+    if data.len() > 0 && data[0] == '-' as u8
+    {
+        return decode_integer(&mut &data[1..], 32).map(|value| -value);
+    }
+    return decode_integer(&mut &data[..], 32);
+}
+
 pub fn decode (string: &mut &[u8]) -> Result<Data, &'static str>
 {
     let length: isize;
@@ -177,6 +247,10 @@ pub fn decode (string: &mut &[u8]) -> Result<Data, &'static str>
     }
 
     let length = length as usize;
+    if length >= string.len()
+    {
+        return Err("Length exceeds the data");
+    }
     let mut data = &string[..length];
     let type_char = string[length];
     *string = &string[length+1..];
@@ -201,7 +275,7 @@ pub fn decode (string: &mut &[u8]) -> Result<Data, &'static str>
 
         '#' =>
         {
-            match decode_integer(&mut data, 32)
+            match decode_signed_integer(data)
             {
                 Ok(value) => return Ok(Data::Integer(value)),
                 Err(error) => return Err(error)
@@ -319,3 +393,215 @@ fn test_get_field()
     assert!( get_field("second", &dict_data) == Some(&Data::Integer(2)));
     assert!( get_field("third", &dict_data) == Some(&Data::String("hello".to_string())));
 }
+
+
+///A decoded value that borrows from the buffer it was decoded from. Strings are slices of it, and lists and dicts keep their items
+///encoded until they are iterated over, so looking into a message doesn't allocate.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Value<'a>
+{
+    Bool (bool),
+    Integer (isize),
+    String (&'a str),
+    List (Items<'a>),
+    Dict (Items<'a>), //keys and values alternate
+}
+
+///The encoded items of a list or dict, decoded one at a time. decode_borrowed already checked that they are well-formed.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct Items<'a>
+{
+    rest: &'a [u8]
+}
+
+impl<'a> Iterator for Items<'a>
+{
+    type Item = Value<'a>;
+
+    fn next (&mut self) -> Option<Value<'a>>
+    {
+        if self.rest.len() == 0
+        {
+            return None;
+        }
+        match decode_one_level(&mut self.rest)
+        {
+            Ok(value) => Some(value),
+            Err(_) =>
+            {
+                self.rest = &[];
+                None
+            }
+        }
+    }
+}
+
+impl<'a> Value<'a>
+{
+    ///Looks a field of a dict up by its key. Only the items in front of it are looked at, and nested containers among them are skipped
+    ///without decoding them.
+    pub fn field (&self, name: &str) -> Option<Value<'a>>
+    {
+        if let Value::Dict(mut items) = *self
+        {
+            while let Some(key) = items.next()
+            {
+                let value = items.next()?;
+                if key == Value::String(name)
+                {
+                    return Some(value);
+                }
+            }
+        }
+        return None;
+    }
+
+    pub fn as_bool (&self) -> Option<bool>
+    {
+        match *self { Value::Bool(value) => Some(value), _ => None }
+    }
+
+    pub fn as_integer (&self) -> Option<isize>
+    {
+        match *self { Value::Integer(value) => Some(value), _ => None }
+    }
+
+    pub fn as_str (&self) -> Option<&'a str>
+    {
+        match *self { Value::String(value) => Some(value), _ => None }
+    }
+
+    pub fn as_list (&self) -> Option<Items<'a>>
+    {
+        match *self { Value::List(items) => Some(items), _ => None }
+    }
+}
+
+///Decodes the value at the start of string and moves string past it. Lists and dicts are only split off, not looked into.
+fn decode_one_level<'a> (string: &mut &'a [u8]) -> Result<Value<'a>, &'static str>
+{
+    let length = match decode_integer(string, ':' as u8)
+    {
+        Ok(value) if value >= 0 => value as usize,
+        _ => return Err("Found invalid length")
+    };
+
+    if length >= string.len()
+    {
+        return Err("Length exceeds the data");
+    }
+
+    let data: &'a [u8] = &string[..length];
+    let type_char = string[length];
+    *string = &string[length+1..];
+
+    match type_char as char
+    {
+        '!' if data == "true".as_bytes() => Ok(Value::Bool(true)),
+        '!' if data == "false".as_bytes() => Ok(Value::Bool(false)),
+        '!' => Err("Bool value was neither true nor false"),
+        '#' => decode_signed_integer(data).map(Value::Integer),
+        ',' => str::from_utf8(data).map(Value::String).map_err(|_| "String was not valid utf-8"),
+        ']' => Ok(Value::List(Items { rest: data })),
+        '}' => Ok(Value::Dict(Items { rest: data })),
+        _ => Err("Invalid type tag")
+    }
+}
+
+///Checks that the items of lists and dicts (at any depth) are well-formed, so they can be iterated over without error handling.
+fn check (value: Value) -> Result<(), &'static str>
+{
+    let (mut rest, is_dict) = match value
+    {
+        Value::List(items) => (items.rest, false),
+        Value::Dict(items) => (items.rest, true),
+        _ => return Ok(())
+    };
+
+    let mut count = 0;
+    while rest.len() > 0
+    {
+        check(decode_one_level(&mut rest)?)?;
+        count += 1;
+    }
+
+    if is_dict & (count % 2 != 0)
+    {
+        return Err("Dict has a key without a value");
+    }
+    return Ok(());
+}
+
+///Like decode, but the result borrows from string instead of copying out of it.
+pub fn decode_borrowed<'a> (string: &mut &'a [u8]) -> Result<Value<'a>, &'static str>
+{
+    let value = decode_one_level(string)?;
+    check(value)?;
+    return Ok(value);
+}
+
+#[test]
+fn test_decode_borrowed ()
+{
+    let encoded = "78:43:5:Hello,5:World,7:timeout,2:42#1:0#5:false!}23:tnetstrings are awesome,1:5#]".as_bytes();
+    let mut rest = encoded;
+    let value = decode_borrowed(&mut rest).unwrap();
+    assert_eq!(rest.len(), 0);
+
+    let mut items = value.as_list().unwrap();
+    let dict = items.next().unwrap();
+    assert_eq!(dict.field("Hello"), Some(Value::String("World")));
+    assert_eq!(dict.field("timeout").and_then(|value| value.as_integer()), Some(42));
+    assert_eq!(dict.field("0"), None); //the key is an integer
+    assert_eq!(dict.field("missing"), None);
+    assert_eq!(items.next(), Some(Value::String("tnetstrings are awesome")));
+    assert_eq!(items.next(), Some(Value::Integer(5)));
+    assert_eq!(items.next(), None);
+
+    //strings point into the buffer
+    let text = dict.field("Hello").unwrap().as_str().unwrap();
+    assert!(encoded.as_ptr_range().contains(&text.as_ptr()));
+
+    assert!(decode_borrowed(&mut "12:1:a,1:b,1:c,}".as_bytes()).is_err());
+    assert!(decode_borrowed(&mut "7:3:abc,x]".as_bytes()).is_err());
+    assert!(decode_borrowed(&mut "20:1:a,]".as_bytes()).is_err());
+    assert!(decode_borrowed(&mut "4:true".as_bytes()).is_err());
+    assert!(decode_borrowed(&mut "99999999999999999999999:x,".as_bytes()).is_err());
+    assert!(decode_borrowed(&mut "20:-9223372036854775808#".as_bytes()).is_err());
+    assert!(decode_borrowed(&mut "34:7:timeout,20:99999999999999999999#}".as_bytes()).is_err());
+}
+
+#[test]
+fn test_write ()
+{
+    let mut result = Vec::new();
+    write_dict(&mut result, |dict|
+    {
+        dict.string("type", "Digest");
+        dict.bool("reply", false);
+        dict.integer("first", -12);
+        dict.list("buckets", |list|
+        {
+            for index in 0..2
+            {
+                write_list(list, |pair| { write_integer(index, pair); write_integer(index * 1000, pair); });
+            }
+        });
+    });
+    assert_eq!(str::from_utf8(&result[..]).unwrap(), "86:4:type,6:Digest,5:reply,5:false!5:first,3:-12#7:buckets,26:8:1:0#1:0#]11:1:1#4:1000#]]}");
+
+    let value = decode_borrowed(&mut &result[..]).unwrap();
+    assert_eq!(value.field("first"), Some(Value::Integer(-12)));
+    let pairs: Vec<Vec<Value>> = value.field("buckets").unwrap().as_list().unwrap().map(|pair| pair.as_list().unwrap().collect()).collect();
+    assert_eq!(pairs, vec![vec![Value::Integer(0), Value::Integer(0)], vec![Value::Integer(1), Value::Integer(1000)]]);
+
+    //the owned encoder gives the same bytes
+    let mut dict = Vec::new();
+    dict.push((Data::String("type".to_string()), Data::String("Digest".to_string())));
+    dict.push((Data::String("reply".to_string()), Data::Bool(false)));
+    dict.push((Data::String("first".to_string()), Data::Integer(-12)));
+    dict.push((Data::String("buckets".to_string()), Data::List(vec![Data::List(vec![Data::Integer(0), Data::Integer(0)]), Data::List(vec![Data::Integer(1), Data::Integer(1000)])])));
+    let mut encoded = Vec::new();
+    encode(&Data::Dict(dict), &mut encoded);
+    assert_eq!(encoded, result);
+}
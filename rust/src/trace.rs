@@ -0,0 +1,422 @@
+//Opt-in recording of everything that drives a backend (DECAPAD_TRACE=<file>), so that a slow session can be replayed and profiled offline.
+//A trace is "DTRC", a format version byte, the own port and the pad ID (big endian u16 each), the number of peers (one byte) and their
+//ports, followed by records: a tag, the microseconds since the previous record (varint) and, depending on the tag,
+//  'k' the bytes the backend read from the GUI's input stream (varint length, data)
+//  'r', 's' a datagram received from or sent to a peer (peer index byte, varint length, data)
+//  'x' the backend rendered the text and handed it to the GUI
+//  'i' the backend finished an iteration of its loop, after the datagrams it sent in it
+//Replaying feeds the inputs and received datagrams back into a backend in order, as fast as possible, with a virtual clock that follows
+//the recorded timestamps, and measures where the time goes. What the replayed backend sends is discarded.
+
+use std::{fmt, io, net};
+use std::fs::File;
+use std::io::{Read, Write, BufWriter};
+use std::path::Path;
+use std::time::{Duration, Instant};
+
+use wire;
+use framing;
+use utf8::Utf8StreamConverter;
+use super::{TextInsertSet, ProtocolBackendState, TextBufferInternal, NetworkState, TextBuffer, handle_datagram, handle_input, render_text,
+            write_text_buffer};
+
+const MAGIC: &'static [u8] = b"DTRC";
+const VERSION: u8 = 2;
+const FLUSH_INTERVAL_MS: u64 = 250;
+pub const INPUT_TAG: u8 = 'k' as u8;
+pub const RECEIVED_TAG: u8 = 'r' as u8;
+pub const SENT_TAG: u8 = 's' as u8;
+pub const RENDER_TAG: u8 = 'x' as u8;
+pub const ITERATION_TAG: u8 = 'i' as u8;
+
+#[derive(Debug)]
+pub struct TraceWriter
+{
+    output: BufWriter<File>,
+    last_record: Instant,
+    last_flush: Instant
+}
+
+impl TraceWriter
+{
+    pub fn create (path: &Path, own_port: u16, pad_ID: u16, peer_ports: &[u16]) -> io::Result<TraceWriter>
+    {
+        let mut header = MAGIC.to_vec();
+        header.push(VERSION);
+        header.extend_from_slice(&[(own_port>>8) as u8, own_port as u8, (pad_ID>>8) as u8, pad_ID as u8, peer_ports.len() as u8]);
+        for &port in peer_ports.iter().take(255)
+        {
+            header.extend_from_slice(&[(port>>8) as u8, port as u8]);
+        }
+
+        let mut output = BufWriter::new(File::create(path)?);
+        output.write_all(&header[..])?;
+        let now = Instant::now();
+        Ok(TraceWriter { output: output, last_record: now, last_flush: now })
+    }
+
+    fn record (&mut self, tag: u8, peer: Option<usize>, data: Option<&[u8]>) -> io::Result<()>
+    {
+        let now = Instant::now();
+        let elapsed = now.duration_since(self.last_record);
+        self.last_record = now;
+
+        let mut header = Vec::with_capacity(16);
+        header.push(tag);
+        wire::write_varint(elapsed.as_secs()*1_000_000 + elapsed.subsec_micros() as u64, &mut header);
+        if let Some(peer) = peer
+        {
+            header.push(peer as u8);
+        }
+        if let Some(data) = data
+        {
+            wire::write_varint(data.len() as u64, &mut header);
+        }
+
+        self.output.write_all(&header[..])?;
+        self.output.write_all(data.unwrap_or(&[]))
+    }
+
+    pub fn input (&mut self, bytes: &[u8]) -> io::Result<()>
+    {
+        self.record(INPUT_TAG, None, Some(bytes))
+    }
+
+    pub fn received (&mut self, peer: usize, datagram: &[u8]) -> io::Result<()>
+    {
+        self.record(RECEIVED_TAG, Some(peer), Some(datagram))
+    }
+
+    pub fn sent (&mut self, peer: usize, datagram: &[u8]) -> io::Result<()>
+    {
+        self.record(SENT_TAG, Some(peer), Some(datagram))
+    }
+
+    pub fn rendered (&mut self) -> io::Result<()>
+    {
+        self.record(RENDER_TAG, None, None)
+    }
+
+    pub fn iteration_end (&mut self) -> io::Result<()>
+    {
+        self.record(ITERATION_TAG, None, None)
+    }
+
+    ///Writes out what has been recorded, at most once per FLUSH_INTERVAL_MS, so that the trace is useful even if the process is killed.
+    pub fn flush_if_due (&mut self) -> io::Result<()>
+    {
+        let now = Instant::now();
+        if now.duration_since(self.last_flush) >= Duration::from_millis(FLUSH_INTERVAL_MS)
+        {
+            self.last_flush = now;
+            return self.output.flush();
+        }
+        Ok(())
+    }
+}
+
+#[derive(Debug, PartialEq)]
+pub enum Event<'a>
+{
+    Input (&'a [u8]),
+    Received (usize, &'a [u8]),
+    Sent (usize, &'a [u8]),
+    Rendered,
+    IterationEnd
+}
+
+#[derive(Debug)]
+pub struct Trace
+{
+    pub own_port: u16,
+    pub pad_ID: u16,
+    pub peer_ports: Vec<u16>,
+    data: Vec<u8>,
+    records_start: usize
+}
+
+fn invalid (message: &str) -> io::Error
+{
+    io::Error::new(io::ErrorKind::InvalidData, message)
+}
+
+impl Trace
+{
+    pub fn read (path: &Path) -> io::Result<Trace>
+    {
+        let mut data = Vec::new();
+        File::open(path)?.read_to_end(&mut data)?;
+        Trace::parse(data)
+    }
+
+    pub fn parse (data: Vec<u8>) -> io::Result<Trace>
+    {
+        if (data.len() < 10) || (&data[..4] != MAGIC) || (data[4] != VERSION)
+        {
+            return Err(invalid("not a decapad trace"));
+        }
+
+        let number_of_peers = data[9] as usize;
+        if data.len() < 10 + 2*number_of_peers
+        {
+            return Err(invalid("truncated trace header"));
+        }
+
+        Ok(Trace
+        {
+            own_port: ((data[5] as u16)<<8) + data[6] as u16,
+            pad_ID: ((data[7] as u16)<<8) + data[8] as u16,
+            peer_ports: (0..number_of_peers).map(|peer| ((data[10 + 2*peer] as u16)<<8) + data[11 + 2*peer] as u16).collect(),
+            records_start: 10 + 2*number_of_peers,
+            data: data
+        })
+    }
+
+    ///The records with their time since the start of the trace. A truncated last record (of a trace whose writer was killed) is left out.
+    pub fn events<'a> (&'a self) -> TraceEvents<'a>
+    {
+        TraceEvents { rest: &self.data[self.records_start..], time: Duration::from_secs(0) }
+    }
+}
+
+pub struct TraceEvents<'a>
+{
+    rest: &'a [u8],
+    time: Duration
+}
+
+impl<'a> TraceEvents<'a>
+{
+    fn read_data (&mut self) -> Option<&'a [u8]>
+    {
+        let length = wire::read_varint(&mut self.rest)? as usize;
+        if length > self.rest.len()
+        {
+            return None;
+        }
+        let (data, rest) = self.rest.split_at(length);
+        self.rest = rest;
+        Some(data)
+    }
+
+    fn read_peer (&mut self) -> Option<usize>
+    {
+        let (&peer, rest) = self.rest.split_first()?;
+        self.rest = rest;
+        Some(peer as usize)
+    }
+}
+
+impl<'a> Iterator for TraceEvents<'a>
+{
+    type Item = (Duration, Event<'a>);
+
+    fn next (&mut self) -> Option<(Duration, Event<'a>)>
+    {
+        let (&tag, rest) = self.rest.split_first()?;
+        self.rest = rest;
+        self.time += Duration::from_micros(wire::read_varint(&mut self.rest)?);
+
+        let event = match tag
+        {
+            INPUT_TAG => Event::Input(self.read_data()?),
+            RECEIVED_TAG => { let peer = self.read_peer()?; Event::Received(peer, self.read_data()?) },
+            SENT_TAG => { let peer = self.read_peer()?; Event::Sent(peer, self.read_data()?) },
+            RENDER_TAG => Event::Rendered,
+            ITERATION_TAG => Event::IterationEnd,
+            _ =>
+            {
+                self.rest = &[];
+                return None;
+            }
+        };
+        Some((self.time, event))
+    }
+}
+
+
+#[derive(Debug, Default)]
+pub struct ReplayReport
+{
+    pub duration: Duration, //of the recorded session
+    pub replay_time: Duration,
+    pub inputs: usize,
+    pub input_bytes: usize,
+    pub received: usize,
+    pub received_bytes: usize,
+    pub sent: usize,
+    pub sent_bytes: usize,
+    pub renders: usize,
+    pub iterations: usize,
+    pub input_handling: Duration,
+    pub deserialization: Duration, //handling received datagrams
+    pub resending: Duration,
+    pub rendering: Duration, //render_text
+    pub syncing: Duration //copying the text into the GUI's buffer
+}
+
+impl fmt::Display for ReplayReport
+{
+    fn fmt (&self, formatter: &mut fmt::Formatter) -> fmt::Result
+    {
+        let milliseconds = |duration: Duration| duration.as_secs() as f64 * 1000.0 + duration.subsec_nanos() as f64 / 1e6;
+        writeln!(formatter, "session: {:.1} ms, replayed in {:.1} ms", milliseconds(self.duration), milliseconds(self.replay_time))?;
+        writeln!(formatter, "inputs: {} ({} bytes), received: {} ({} bytes), sent: {} ({} bytes), renders: {}, iterations: {}",
+                 self.inputs, self.input_bytes, self.received, self.received_bytes, self.sent, self.sent_bytes, self.renders, self.iterations)?;
+        writeln!(formatter, "input handling:  {:10.3} ms", milliseconds(self.input_handling))?;
+        writeln!(formatter, "deserialization: {:10.3} ms", milliseconds(self.deserialization))?;
+        writeln!(formatter, "resending:       {:10.3} ms", milliseconds(self.resending))?;
+        writeln!(formatter, "render_text:     {:10.3} ms", milliseconds(self.rendering))?;
+        write!(formatter, "sync:            {:10.3} ms", milliseconds(self.syncing))
+    }
+}
+
+///Replays a trace into a fresh backend, see the top of this file.
+pub fn replay (trace: &Trace) -> ReplayReport
+{
+    let mut set = TextInsertSet::new();
+    let mut backend_state: Option<ProtocolBackendState> = None;
+    let mut text_buffer = TextBufferInternal::new();
+    let mut converter = Utf8StreamConverter::new();
+    let mut gui_buffer = TextBuffer::new();
+
+    let mut network = NetworkState::new(trace.pad_ID, trace.own_port, framing::DEFAULT_MTU);
+    for &port in trace.peer_ports.iter()
+    {
+        network.add_peer(net::SocketAddr::V4(net::SocketAddrV4::new(net::Ipv4Addr::new(127, 0, 0, 1), port)));
+    }
+    if let Some(peer) = network.peers.first_mut()
+    {
+        peer.host = trace.pad_ID != 0;
+    }
+
+    let mut report = ReplayReport::default();
+    let replay_start = Instant::now();
+    for (time, event) in trace.events()
+    {
+        let now = replay_start + time; //the virtual clock
+        report.duration = time;
+
+        let start = Instant::now();
+        match event
+        {
+            Event::Input(bytes) =>
+            {
+                report.inputs += 1;
+                report.input_bytes += bytes.len();
+                let mut bytes = bytes.iter().cloned();
+                handle_input(&mut |_| bytes.next(), &mut converter, &mut set, &mut backend_state, &mut text_buffer, &mut network);
+                report.input_handling += start.elapsed();
+            },
+
+            Event::Received(peer, datagram) =>
+            {
+                report.received += 1;
+                report.received_bytes += datagram.len();
+                if peer < network.peers.len()
+                {
+                    handle_datagram(datagram, trace.pad_ID, &mut set, &mut backend_state, &mut text_buffer, &mut network.peers[peer]);
+                }
+                report.deserialization += start.elapsed();
+            },
+
+            Event::Sent(_, datagram) =>
+            {
+                report.sent += 1;
+                report.sent_bytes += datagram.len();
+            },
+
+            Event::IterationEnd =>
+            {
+                //what the backend would send now is produced and thrown away
+                report.iterations += 1;
+                network.resend(&set, now);
+                for peer in network.peers.iter_mut()
+                {
+                    peer.finish();
+                    peer.batcher.clear();
+                }
+                report.resending += start.elapsed();
+            },
+
+            Event::Rendered =>
+            {
+                report.renders += 1;
+                render_text(&set, &mut text_buffer);
+                text_buffer.needs_updating = false;
+                report.rendering += start.elapsed();
+
+                let start = Instant::now();
+                write_text_buffer(&text_buffer, &mut gui_buffer);
+                report.syncing += start.elapsed();
+            }
+        }
+    }
+
+    gui_buffer.free();
+    report.replay_time = replay_start.elapsed();
+    return report;
+}
+
+
+#[test]
+fn test_trace_round_trip ()
+{
+    let path = ::std::env::temp_dir().join(format!("decapad-trace-test-{}", ::std::process::id()));
+    {
+        let mut writer = TraceWriter::create(&path, 3000, 0, &[3001, 3002]).unwrap();
+        writer.input(b"ab").unwrap();
+        writer.received(1, &[1, 2, 3]).unwrap();
+        writer.rendered().unwrap();
+        writer.sent(0, &[4, 5]).unwrap();
+        writer.iteration_end().unwrap();
+        writer.output.flush().unwrap();
+    }
+
+    let mut data = Vec::new();
+    File::open(&path).unwrap().read_to_end(&mut data).unwrap();
+    ::std::fs::remove_file(&path).unwrap();
+    data.extend_from_slice(&[RECEIVED_TAG, 0, 0, 10, 1]); //cut off by a crash
+
+    let trace = Trace::parse(data).unwrap();
+    assert_eq!((trace.own_port, trace.pad_ID, &trace.peer_ports[..]), (3000, 0, &[3001, 3002][..]));
+    let events: Vec<Event> = trace.events().map(|(_, event)| event).collect();
+    assert_eq!(events, vec![Event::Input(b"ab"), Event::Received(1, &[1, 2, 3]), Event::Rendered, Event::Sent(0, &[4, 5]), Event::IterationEnd]);
+    assert!(trace.events().zip(trace.events().skip(1)).all(|((earlier, _), (later, _))| earlier <= later));
+}
+
+#[test]
+fn test_replay ()
+{
+    use super::init_request;
+
+    //a session in which the peer grants us a range and we type two characters
+    let mut host = super::Peer::new("127.0.0.1:3000".parse().unwrap(), framing::DEFAULT_MTU);
+    let mut host_set = TextInsertSet::new();
+    let mut host_state = Some(ProtocolBackendState::new(1, 1025));
+    let mut host_buffer = TextBufferInternal::new();
+    let mut request = super::Peer::new("127.0.0.1:3001".parse().unwrap(), framing::DEFAULT_MTU);
+    request.send_cheap(&init_request(false)[..]);
+    request.resend(&TextInsertSet::new(), &mut ::encoded::EncodedRecords::new(), Instant::now());
+    for datagram in request.batcher.finish().to_vec()
+    {
+        handle_datagram(&datagram[..], 0, &mut host_set, &mut host_state, &mut host_buffer, &mut host);
+    }
+    host.resend(&host_set, &mut ::encoded::EncodedRecords::new(), Instant::now());
+    host.finish();
+
+    let mut data = MAGIC.to_vec();
+    data.extend_from_slice(&[VERSION, 0x0b, 0xb9, 0, 0, 1, 0x0b, 0xb8]);
+    for datagram in host.batcher.finish().iter()
+    {
+        data.extend_from_slice(&[RECEIVED_TAG, 100, 0]);
+        wire::write_varint(datagram.len() as u64, &mut data);
+        data.extend_from_slice(&datagram[..]);
+    }
+    data.extend_from_slice(&[INPUT_TAG, 100, 2, 'h' as u8, 'i' as u8, RENDER_TAG, 50, SENT_TAG, 0, 0, 1, 0, SENT_TAG, 0, 0, 1, 0, ITERATION_TAG, 0]);
+
+    let report = replay(&Trace::parse(data).unwrap());
+    assert_eq!((report.inputs, report.renders, report.sent, report.iterations), (1, 1, 2, 1));
+    assert!(report.received >= 1);
+    assert_eq!(report.duration, Duration::from_micros(100*report.received as u64 + 150));
+}
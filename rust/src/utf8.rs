@@ -24,7 +24,7 @@ impl Utf8StreamConverter
 
             else if (byte>>6) == 2
             {
-                println!("UTF8-converter says: Un-aligned stream!");
+                warn!("UTF8-converter says: Un-aligned stream!");
                 return None;
             }
 
@@ -73,7 +73,7 @@ impl Utf8StreamConverter
 
             else
             {
-                println!("UTF8-converter says: Invalid number of continuation bytes!");
+                warn!("UTF8-converter says: Invalid number of continuation bytes!");
                 return None;
             }
         }
@@ -0,0 +1,344 @@
+//Encoding and decoding of the records that carry edits: inserts ('i'), appends ('a') and deletes ('d').
+//
+//Version 1 (legacy) uses fixed width fields:
+//  'i', u16 pad ID, u32 ID, u32 parent, u32 author, u8 charPos, content
+//  'a', u16 pad ID, u32 ID, u8 start position, content
+//  'd', u16 pad ID, u32 ID, u8 start, u8 end (exclusive)
+//Version 2 sets the high bit of the tag, drops the pad ID and uses LEB128 varints:
+//  'i'|0x80, u8 flags, author, zigzag(ID-author), [zigzag(parent-ID)], charPos, content
+//  'a'|0x80, ID, start position, content
+//  'd'|0x80, ID, start, end
+//Version 3 has the same layout as version 2, but positions and lengths may go up to 65535 instead of 255, so that long pasted texts fit
+//into one insert. A version 2 decoder rejects the larger values, inserts longer than 255 characters are never sent to such peers.
+//The IDs of an author are allocated from a range starting at its author ID, so an insert's ID is stored as a small delta to the author.
+//The parent is left out for root inserts and for continuations, whose parent is the insert the author created just before.
+//All versions are always accepted, the version used for sending is negotiated in the init exchange.
+
+pub const LEGACY_VERSION: u32 = 1;
+pub const VARINT_VERSION: u32 = 2;
+pub const WIDE_POSITIONS_VERSION: u32 = 3;
+pub const CURRENT_VERSION: u32 = 3;
+pub const V2_TAG_BIT: u8 = 0x80;
+pub const MAXIMUM_HEADER_LENGTH: usize = 1+1+5+5+5+3; //of any record, reached by a version 2 insert with large IDs
+pub const LEGACY_MAXIMUM_POSITION: u16 = 255; //of versions 1 and 2
+
+const ROOT_PARENT: u8 = 1; //the parent is 0
+const CONTINUATION: u8 = 2; //the parent is ID-1
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct InsertHeader
+{
+    pub ID: u32,
+    pub parent: u32,
+    pub author: u32,
+    pub charPos: u16
+}
+
+#[derive(Debug, PartialEq, Eq)]
+pub enum Record<'a>
+{
+    Insert (InsertHeader, &'a [u8]),
+    Append { ID: u32, start: u16, content: &'a [u8] },
+    Delete { ID: u32, start: u16, end: u16 }
+}
+
+pub fn write_varint (mut value: u64, buffer: &mut Vec<u8>)
+{
+    while value >= 0x80
+    {
+        buffer.push((value as u8) | 0x80);
+        value >>= 7;
+    }
+    buffer.push(value as u8);
+}
+
+///Reads a varint from the front of data and advances it. Returns None if data ends within the varint or it is longer than 10 bytes.
+pub fn read_varint (data: &mut &[u8]) -> Option<u64>
+{
+    let mut value = 0u64;
+    for (index, &byte) in data.iter().enumerate().take(10)
+    {
+        value |= ((byte & 0x7f) as u64) << (7*index);
+        if byte & 0x80 == 0
+        {
+            *data = &data[index+1..];
+            return Some(value);
+        }
+    }
+    return None;
+}
+
+fn zigzag (value: i64) -> u64
+{
+    ((value << 1) ^ (value >> 63)) as u64
+}
+
+fn unzigzag (value: u64) -> i64
+{
+    ((value >> 1) as i64) ^ -((value & 1) as i64)
+}
+
+fn read_u32_varint (data: &mut &[u8]) -> Option<u32>
+{
+    match read_varint(data)
+    {
+        Some(value) if value <= u32::max_value() as u64 => Some(value as u32),
+        _ => None
+    }
+}
+
+fn read_u16_varint (data: &mut &[u8]) -> Option<u16>
+{
+    match read_varint(data)
+    {
+        Some(value) if value <= u16::max_value() as u64 => Some(value as u16),
+        _ => None
+    }
+}
+
+fn read_delta (base: u32, data: &mut &[u8]) -> Option<u32>
+{
+    let value = base as i64 + unzigzag(read_varint(data)?);
+    if (value >= 0) & (value <= u32::max_value() as i64)
+    {
+        Some(value as u32)
+    }
+    else
+    {
+        None
+    }
+}
+
+///Big-endian u32, as in all records and the files.
+pub fn read_u32 (data: &[u8]) -> u32
+{
+    ((data[0] as u32)<<24) + ((data[1] as u32)<<16) + ((data[2] as u32)<<8) + data[3] as u32
+}
+
+pub fn write_u32 (value: u32, buffer: &mut Vec<u8>)
+{
+    buffer.push((value>>24) as u8);
+    buffer.push((value>>16) as u8);
+    buffer.push((value>>8) as u8);
+    buffer.push(value as u8);
+}
+
+///Whether a version can carry positions and lengths above 255.
+pub fn has_wide_positions (version: u32) -> bool
+{
+    version >= WIDE_POSITIONS_VERSION
+}
+
+///Whether the record is an insert, append or delete of any version.
+pub fn is_edit_record (tag: u8) -> bool
+{
+    match tag & !V2_TAG_BIT
+    {
+        b'i' | b'a' | b'd' => true,
+        _ => false
+    }
+}
+
+///Writes everything of an insert record up to its content.
+pub fn encode_insert_header (version: u32, header: &InsertHeader, buffer: &mut Vec<u8>)
+{
+    if version == LEGACY_VERSION
+    {
+        buffer.extend_from_slice(&[b'i', 0, 0]); //the zeros are the pad ID placeholder
+        write_u32(header.ID, buffer);
+        write_u32(header.parent, buffer);
+        write_u32(header.author, buffer);
+        buffer.push(header.charPos as u8); //the senders make sure that legacy peers only get positions up to 255
+        return;
+    }
+
+    let flags = if header.parent == 0 { ROOT_PARENT } else if header.parent.wrapping_add(1) == header.ID { CONTINUATION } else { 0 };
+    buffer.push(b'i' | V2_TAG_BIT);
+    buffer.push(flags);
+    write_varint(header.author as u64, buffer);
+    write_varint(zigzag(header.ID as i64 - header.author as i64), buffer);
+    if flags == 0
+    {
+        write_varint(zigzag(header.parent as i64 - header.ID as i64), buffer);
+    }
+    write_varint(header.charPos as u64, buffer);
+}
+
+///Writes everything of an append record up to its content.
+pub fn encode_append_header (version: u32, ID: u32, start: u16, buffer: &mut Vec<u8>)
+{
+    if version == LEGACY_VERSION
+    {
+        buffer.extend_from_slice(&[b'a', 0, 0]);
+        write_u32(ID, buffer);
+        buffer.push(start as u8);
+        return;
+    }
+
+    buffer.push(b'a' | V2_TAG_BIT);
+    write_varint(ID as u64, buffer);
+    write_varint(start as u64, buffer);
+}
+
+pub fn encode_delete (version: u32, ID: u32, start: u16, end: u16, buffer: &mut Vec<u8>)
+{
+    if version == LEGACY_VERSION
+    {
+        buffer.extend_from_slice(&[b'd', 0, 0]);
+        write_u32(ID, buffer);
+        buffer.push(start as u8);
+        buffer.push(end as u8);
+        return;
+    }
+
+    buffer.push(b'd' | V2_TAG_BIT);
+    write_varint(ID as u64, buffer);
+    write_varint(start as u64, buffer);
+    write_varint(end as u64, buffer);
+}
+
+///Decodes an edit record of any version. Returns None for other records and for malformed ones.
+pub fn decode<'a> (record: &'a [u8]) -> Option<Record<'a>>
+{
+    if record.len() == 0
+    {
+        return None;
+    }
+
+    match record[0]
+    {
+        b'i' if record.len() >= 16 =>
+        {
+            let header = InsertHeader { ID: read_u32(&record[3..]), parent: read_u32(&record[7..]), author: read_u32(&record[11..]), charPos: record[15] as u16 };
+            Some(Record::Insert(header, &record[16..]))
+        },
+
+        b'a' if record.len() >= 8 => Some(Record::Append { ID: read_u32(&record[3..]), start: record[7] as u16, content: &record[8..] }),
+
+        b'd' if record.len() == 9 => Some(Record::Delete { ID: read_u32(&record[3..]), start: record[7] as u16, end: record[8] as u16 }),
+
+        tag if tag == b'i' | V2_TAG_BIT =>
+        {
+            if record.len() < 2
+            {
+                return None;
+            }
+            let flags = record[1];
+            let mut rest = &record[2..];
+            let author = read_u32_varint(&mut rest)?;
+            let ID = read_delta(author, &mut rest)?;
+            let parent = match flags
+            {
+                ROOT_PARENT => 0,
+                CONTINUATION => ID.wrapping_sub(1),
+                0 => read_delta(ID, &mut rest)?,
+                _ => return None
+            };
+            let charPos = read_u16_varint(&mut rest)?;
+            Some(Record::Insert(InsertHeader { ID: ID, parent: parent, author: author, charPos: charPos }, rest))
+        },
+
+        tag if tag == b'a' | V2_TAG_BIT =>
+        {
+            let mut rest = &record[1..];
+            let ID = read_u32_varint(&mut rest)?;
+            let start = read_u16_varint(&mut rest)?;
+            Some(Record::Append { ID: ID, start: start, content: rest })
+        },
+
+        tag if tag == b'd' | V2_TAG_BIT =>
+        {
+            let mut rest = &record[1..];
+            let ID = read_u32_varint(&mut rest)?;
+            let start = read_u16_varint(&mut rest)?;
+            let end = read_u16_varint(&mut rest)?;
+            if rest.len() > 0
+            {
+                return None;
+            }
+            Some(Record::Delete { ID: ID, start: start, end: end })
+        },
+
+        _ => None
+    }
+}
+
+
+#[test]
+fn test_varint ()
+{
+    for &value in [0u64, 1, 127, 128, 300, 16383, 16384, u32::max_value() as u64, u64::max_value()].iter()
+    {
+        let mut buffer = Vec::new();
+        write_varint(value, &mut buffer);
+        buffer.push(42);
+        let mut data = &buffer[..];
+        assert_eq!(read_varint(&mut data), Some(value));
+        assert_eq!(data, &[42]);
+    }
+
+    let mut truncated = &[0x80u8, 0x80][..];
+    assert_eq!(read_varint(&mut truncated), None);
+
+    for &value in [0i64, -1, 1, -1000, 1000, i32::min_value() as i64].iter()
+    {
+        assert_eq!(unzigzag(zigzag(value)), value);
+    }
+}
+
+#[test]
+fn test_edit_records ()
+{
+    let headers = [
+        InsertHeader { ID: 1030, parent: 1029, author: 1026, charPos: 255 }, //continuation
+        InsertHeader { ID: 1, parent: 0, author: 1, charPos: 0 }, //root
+        InsertHeader { ID: 1040, parent: 17, author: 1026, charPos: 3 },
+        InsertHeader { ID: 5, parent: 1040, author: 1, charPos: 200 } ];
+
+    for &version in [LEGACY_VERSION, VARINT_VERSION, CURRENT_VERSION].iter()
+    {
+        for header in headers.iter()
+        {
+            let mut buffer = Vec::new();
+            encode_insert_header(version, header, &mut buffer);
+            buffer.extend_from_slice("hä".as_bytes());
+            assert!(is_edit_record(buffer[0]));
+            assert_eq!(decode(&buffer[..]), Some(Record::Insert(*header, "hä".as_bytes())));
+
+            if version != LEGACY_VERSION
+            {
+                assert!(buffer.len() - "hä".len() <= 8); //instead of 16 bytes
+            }
+        }
+
+        let mut buffer = Vec::new();
+        encode_append_header(version, 1030, 7, &mut buffer);
+        buffer.extend_from_slice(b"xyz");
+        assert_eq!(decode(&buffer[..]), Some(Record::Append { ID: 1030, start: 7, content: b"xyz" }));
+
+        let mut buffer = Vec::new();
+        encode_delete(version, 1030, 7, 9, &mut buffer);
+        assert_eq!(decode(&buffer[..]), Some(Record::Delete { ID: 1030, start: 7, end: 9 }));
+        buffer.push(0);
+        assert_eq!(decode(&buffer[..]), None);
+    }
+
+    //positions beyond 255
+    let header = InsertHeader { ID: 1030, parent: 1029, author: 1026, charPos: 40000 };
+    let mut buffer = Vec::new();
+    encode_insert_header(CURRENT_VERSION, &header, &mut buffer);
+    assert_eq!(decode(&buffer[..]), Some(Record::Insert(header, &[][..])));
+
+    let mut buffer = Vec::new();
+    encode_delete(CURRENT_VERSION, 1030, 300, 65535, &mut buffer);
+    assert_eq!(decode(&buffer[..]), Some(Record::Delete { ID: 1030, start: 300, end: 65535 }));
+
+    let mut buffer = Vec::new();
+    encode_append_header(CURRENT_VERSION, 1030, 1000, &mut buffer);
+    buffer.truncate(buffer.len() - 2);
+    write_varint(65536, &mut buffer);
+    assert_eq!(decode(&buffer[..]), None);
+
+    assert_eq!(decode(&[b'i' | V2_TAG_BIT, 0, 0x80][..]), None);
+    assert!(!is_edit_record(b'K'));
+}